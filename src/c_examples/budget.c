@@ -0,0 +1,47 @@
+#include "libapmidg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// share a node GPU power budget among the devices and print where the
+// watts go every second
+
+int main(int argc, char *argv[])
+{
+    int duration = 10;
+    int verbose = 0;
+
+    if (argc < 2) {
+	printf("Usage: %s budget_W [sec]\n", argv[0]);
+	return 1;
+    }
+    if (argc > 2) duration = atoi(argv[2]);
+
+    if(apmidg_init(verbose) != 0) return 1;
+
+    apmidg_budget_config_t cfg;
+    apmidg_budget_defaults(&cfg);
+    cfg.budget_W = atof(argv[1]);
+    if (apmidg_budget_start(&cfg) != 0) {
+	apmidg_finish();
+	return 1;
+    }
+
+    for (int i = 0; i < duration; i++) {
+	sleep(1);
+	apmidg_budget_state_t st;
+	apmidg_budget_getstate(-1, &st);
+	printf("%3d allocated=%6.1lf power=%6.1lf moved=%7.1lf\n", i, st.allocated_W, st.power_W, st.moved_W);
+	for (int di = 0; di < apmidg_getndevs(); di++) {
+	    if (apmidg_budget_getstate(di, &st) != 0) continue;
+	    printf("    dev%-2d limit=%6.1lf power=%6.1lf freq=%6.1lf%s\n",
+		   di, st.limit_W, st.power_W, st.freq_MHz, st.pinned ? " pinned" : "");
+	}
+    }
+
+    apmidg_budget_stop(1); // restore the limits
+
+    apmidg_finish();
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "libapmidg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// hold a power or temperature target with the in-library controller
+// and print the loop state every second
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options] target\n", prog);
+    printf("  -m mode  node, dev (W, default) or temp (C)\n");
+    printf("  -a act   pwrlim (default) or freq\n");
+    printf("  -t sec   run time (default 10)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int mode = APMIDG_CTRL_DEV_POWER;
+    int actuator = APMIDG_CTRL_ACT_PWRLIM;
+    int duration = 10;
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:a:t:h")) != -1) {
+	switch (opt) {
+	case 'm':
+	    if (strcmp(optarg, "node") == 0) mode = APMIDG_CTRL_NODE_POWER;
+	    else if (strcmp(optarg, "temp") == 0) mode = APMIDG_CTRL_DEV_TEMP;
+	    else mode = APMIDG_CTRL_DEV_POWER;
+	    break;
+	case 'a':
+	    actuator = strcmp(optarg, "freq") == 0 ? APMIDG_CTRL_ACT_FREQ : APMIDG_CTRL_ACT_PWRLIM;
+	    break;
+	case 't':
+	    duration = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+    if (optind >= argc) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    if(apmidg_init(verbose) != 0) return 1;
+
+    apmidg_ctrl_config_t cfg;
+    apmidg_ctrl_defaults(mode, actuator, &cfg);
+    cfg.target = atof(argv[optind]);
+    if (apmidg_ctrl_start(&cfg) != 0) {
+	apmidg_finish();
+	return 1;
+    }
+
+    // the node loop is devid -1
+    int first = mode == APMIDG_CTRL_NODE_POWER ? -1 : 0;
+    for (int i = 0; i < duration; i++) {
+	sleep(1);
+	for (int di = first; di < apmidg_getndevs(); di++) {
+	    apmidg_ctrl_state_t st;
+	    if (apmidg_ctrl_getstate(di, &st) != 0) continue;
+	    printf("%3d dev%-2d target=%6.1lf measured=%6.1lf output=%7.1lf%s\n",
+		   i, di, st.target, st.measured, st.output, st.saturated ? " (saturated)" : "");
+	}
+    }
+
+    apmidg_ctrl_stop(1); // restore the limits
+
+    apmidg_finish();
+
+    return 0;
+}
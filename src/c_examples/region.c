@@ -0,0 +1,43 @@
+#include "libapmidg.h"
+#include <stdio.h>
+#include <unistd.h>
+
+// attribute the GPU energy to the phases of a (fake) solver loop. the
+// summary table is printed by apmidg_finish()
+
+static void solve() { usleep(20*1000); }
+static void exchange() { usleep(5*1000); }
+
+int main()
+{
+    int n = 20;
+    int verbose = 0;
+    if(apmidg_init(verbose) != 0) return 1;
+
+    // begin/end are cheap when the sampler keeps the readings current
+    apmidg_sampler_start(1000.0, 0);
+
+    int id_solve = apmidg_region_id("solve");
+    int id_exchange = apmidg_region_id("exchange");
+
+    apmidg_region_begin("iterations");
+    for (int i = 0; i < n; i++) {
+	apmidg_region_begin_id(id_solve);
+	solve();
+	apmidg_region_end_id(id_solve);
+
+	apmidg_region_begin_id(id_exchange);
+	exchange();
+	apmidg_region_end_id(id_exchange);
+    }
+    apmidg_region_end("iterations");
+
+    uint64_t calls;
+    double time_s, energy_J, freq_MHz;
+    if (apmidg_region_getstats("solve", &calls, &time_s, &energy_J, &freq_MHz) == 0)
+	printf("solve: %.3lf J/call\n\n", energy_J / calls);
+
+    apmidg_finish();
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include "libapmidg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// read the telemetry published by apmidgd. no apmidg_init() needed
+int main(int argc, char *argv[])
+{
+    int n = 5;
+    const char *name = argc > 1 ? argv[1] : NULL;
+
+    apmidg_shm_t *shm = apmidg_shm_attach(name);
+    if (!shm) {
+	printf("Failed to attach. Is apmidgd running?\n");
+	return 1;
+    }
+
+    apmidg_snapshot_t snap = {0};
+    apmidg_shm_getsnapshotsize(shm, &snap.npwr, &snap.nfreq, &snap.ntemp);
+    int npwr = snap.npwr, nfreq = snap.nfreq, ntemp = snap.ntemp;
+    snap.pwr_devid = calloc(npwr, sizeof(int));
+    snap.pwr_id = calloc(npwr, sizeof(int));
+    snap.power_W = calloc(npwr, sizeof(double));
+    snap.freq_actual_MHz = calloc(nfreq, sizeof(double));
+    snap.temp_C = calloc(ntemp, sizeof(double));
+
+    printf("ndevs=%d npwr=%d nfreq=%d ntemp=%d\n\n", apmidg_shm_getndevs(shm), npwr, nfreq, ntemp);
+    for (int i = 0; i < n; i++) {
+	uint64_t update_ts_us;
+
+	snap.npwr = npwr; snap.nfreq = nfreq; snap.ntemp = ntemp;
+	if (apmidg_shm_read(shm, &snap, &update_ts_us) == 0) {
+	    printf("update_ts_us=%lu\n", update_ts_us);
+	    for (int j=0; j<snap.npwr; j++)
+		printf("dev%d/pwr%d=%5.1lf W   ", snap.pwr_devid[j], snap.pwr_id[j], snap.power_W[j]);
+	    printf("\n");
+	    for (int j=0; j<snap.nfreq; j++) printf("freq%d=%5.1lf MHz   ", j, snap.freq_actual_MHz[j]);
+	    printf("\n");
+	    for (int j=0; j<snap.ntemp; j++) printf("temp%d=%5.1lf C   ", j, snap.temp_C[j]);
+	    printf("\n\n");
+	} else {
+	    printf("no data yet\n");
+	}
+	sleep(1);
+    }
+
+    apmidg_shm_detach(shm);
+
+    return 0;
+}
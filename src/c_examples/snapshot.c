@@ -0,0 +1,55 @@
+#include "libapmidg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// read all domains of all GPUs with a single call per sample
+static void reportsnapshot(apmidg_snapshot_t *snap)
+{
+    if (apmidg_snapshot(snap) != 0) return;
+
+    for (int i=0; i<snap->npwr; i++)
+	printf("dev%d/pwr%d=%5.1lf W   ", snap->pwr_devid[i], snap->pwr_id[i], snap->power_W[i]);
+    printf("\n");
+    for (int i=0; i<snap->nfreq; i++)
+	printf("dev%d/freq%d=%5.1lf MHz (%.0lf-%.0lf)   ", snap->freq_devid[i], snap->freq_id[i],
+	       snap->freq_actual_MHz[i], snap->freq_min_MHz[i], snap->freq_max_MHz[i]);
+    printf("\n");
+    for (int i=0; i<snap->ntemp; i++)
+	printf("dev%d/temp%d=%5.1lf C   ", snap->temp_devid[i], snap->temp_id[i], snap->temp_C[i]);
+    printf("\n\n");
+}
+
+int main()
+{
+    int n = 5;
+    int verbose = 1;
+    if(apmidg_init(verbose) != 0) return 1;
+
+    // allocate the arrays once
+    apmidg_snapshot_t snap = {0};
+    apmidg_getsnapshotsize(&snap.npwr, &snap.nfreq, &snap.ntemp);
+    snap.pwr_devid = calloc(snap.npwr, sizeof(int));
+    snap.pwr_id = calloc(snap.npwr, sizeof(int));
+    snap.energy_uj = calloc(snap.npwr, sizeof(uint64_t));
+    snap.ts_us = calloc(snap.npwr, sizeof(uint64_t));
+    snap.power_W = calloc(snap.npwr, sizeof(double));
+    snap.freq_devid = calloc(snap.nfreq, sizeof(int));
+    snap.freq_id = calloc(snap.nfreq, sizeof(int));
+    snap.freq_actual_MHz = calloc(snap.nfreq, sizeof(double));
+    snap.freq_min_MHz = calloc(snap.nfreq, sizeof(double));
+    snap.freq_max_MHz = calloc(snap.nfreq, sizeof(double));
+    snap.temp_devid = calloc(snap.ntemp, sizeof(int));
+    snap.temp_id = calloc(snap.ntemp, sizeof(int));
+    snap.temp_C = calloc(snap.ntemp, sizeof(double));
+
+    printf("Read all power, frequency and temperature domains in one call\n\n");
+    for (int i = 0; i < n; i++) {
+	sleep(1);
+	reportsnapshot(&snap);
+    }
+
+    apmidg_finish();
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include "libapmidg.h"
+#include <stdio.h>
+#include <unistd.h>
+
+// print the power of each device over the last 1 and 10 seconds and
+// since start, without storing the samples
+
+int main()
+{
+    int n = 15;
+    int verbose = 0;
+    double windows_s[] = {1.0, 10.0, 0.0};
+    if(apmidg_init(verbose) != 0) return 1;
+
+    apmidg_wstats_start(windows_s, 3);
+    apmidg_sampler_start(1000.0, 0);
+
+    printf("%-6s %-8s %8s %8s %8s %8s %8s %8s\n", "device", "window", "samples", "mean_W", "sd_W", "p50_W", "p99_W", "max_W");
+    for (int i = 0; i < n; i++) {
+	sleep(1);
+	for (int di = 0; di < apmidg_getndevs(); di++) {
+	    for (int w = 0; w < 3; w++) {
+		apmidg_wstats_t st;
+		if (apmidg_wstats_get(di, APMIDG_SAMPLE_POWER, 0, w, &st) != 0) continue;
+		printf("%-6d %-8.0lf %8lu %8.1lf %8.1lf %8.1lf %8.1lf %8.1lf\n", di, st.window_s,
+		       (unsigned long)st.count, st.mean, st.stddev, st.p50, st.p99, st.max);
+	    }
+	}
+	printf("\n");
+    }
+
+    apmidg_finish();
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+  Backend interface between libapmidg and Level Zero
+
+  (setq c-basic-offset 4)
+*/
+
+#ifndef __APMIDG_BACKEND_H_DEFINED__
+#define __APMIDG_BACKEND_H_DEFINED__
+
+// internal use only
+
+#include <level_zero/ze_api.h>
+#include <level_zero/zes_api.h>
+
+// A dispatch table of the Level Zero calls used by libapmidg. The
+// members keep the names and signatures of the Level Zero functions,
+// so a call site reads apmidg_be->zesPowerGetEnergyCounter(...) and a
+// backend only needs to hand out handles that its own functions
+// understand.
+struct apmidg_backend {
+    const char *name;
+
+    ze_result_t (ZE_APICALL *zeInit)(ze_init_flags_t flags);
+    ze_result_t (ZE_APICALL *zeDriverGet)(uint32_t *pCount, ze_driver_handle_t *phDrivers);
+    ze_result_t (ZE_APICALL *zeDriverGetProperties)(ze_driver_handle_t hDriver, ze_driver_properties_t *pProps);
+    ze_result_t (ZE_APICALL *zeDeviceGet)(ze_driver_handle_t hDriver, uint32_t *pCount, ze_device_handle_t *phDevices);
+    ze_result_t (ZE_APICALL *zeDeviceGetProperties)(ze_device_handle_t hDevice, ze_device_properties_t *pProps);
+
+    ze_result_t (ZE_APICALL *zesDeviceEnumPowerDomains)(zes_device_handle_t hDevice, uint32_t *pCount, zes_pwr_handle_t *phPower);
+    ze_result_t (ZE_APICALL *zesDeviceEnumFrequencyDomains)(zes_device_handle_t hDevice, uint32_t *pCount, zes_freq_handle_t *phFrequency);
+    ze_result_t (ZE_APICALL *zesDeviceEnumTemperatureSensors)(zes_device_handle_t hDevice, uint32_t *pCount, zes_temp_handle_t *phTemperature);
+    ze_result_t (ZE_APICALL *zesDevicePciGetProperties)(zes_device_handle_t hDevice, zes_pci_properties_t *pProperties);
+
+    ze_result_t (ZE_APICALL *zesPowerGetProperties)(zes_pwr_handle_t hPower, zes_power_properties_t *pProps);
+    ze_result_t (ZE_APICALL *zesPowerGetEnergyCounter)(zes_pwr_handle_t hPower, zes_power_energy_counter_t *pEnergy);
+    ze_result_t (ZE_APICALL *zesPowerGetLimitsExt)(zes_pwr_handle_t hPower, uint32_t *pCount, zes_power_limit_ext_desc_t *pSustained);
+    ze_result_t (ZE_APICALL *zesPowerSetLimitsExt)(zes_pwr_handle_t hPower, uint32_t *pCount, zes_power_limit_ext_desc_t *pSustained);
+
+    ze_result_t (ZE_APICALL *zesFrequencyGetProperties)(zes_freq_handle_t hFrequency, zes_freq_properties_t *pProperties);
+    ze_result_t (ZE_APICALL *zesFrequencyGetRange)(zes_freq_handle_t hFrequency, zes_freq_range_t *pLimits);
+    ze_result_t (ZE_APICALL *zesFrequencySetRange)(zes_freq_handle_t hFrequency, const zes_freq_range_t *pLimits);
+    ze_result_t (ZE_APICALL *zesFrequencyGetState)(zes_freq_handle_t hFrequency, zes_freq_state_t *pState);
+
+    ze_result_t (ZE_APICALL *zesTemperatureGetProperties)(zes_temp_handle_t hTemperature, zes_temp_properties_t *pProperties);
+    ze_result_t (ZE_APICALL *zesTemperatureGetState)(zes_temp_handle_t hTemperature, double *pTemperature);
+    ze_result_t (ZE_APICALL *zesTemperatureGetConfig)(zes_temp_handle_t hTemperature, zes_temp_config_t *pConfig);
+    ze_result_t (ZE_APICALL *zesTemperatureSetConfig)(zes_temp_handle_t hTemperature, const zes_temp_config_t *pConfig);
+
+    ze_result_t (ZE_APICALL *zesDeviceEventRegister)(zes_device_handle_t hDevice, zes_event_type_flags_t events);
+    ze_result_t (ZE_APICALL *zesDriverEventListen)(ze_driver_handle_t hDriver, uint32_t timeout, uint32_t count, zes_device_handle_t *phDevices, uint32_t *pNumDeviceEvents, zes_event_type_flags_t *pEvents);
+
+    // release the backend's resources. NULL if there is nothing to do
+    void (*fini)();
+};
+
+// the Level Zero loader. the default
+const apmidg_backend *apmidg_backend_l0();
+
+// the simulated GPUs. params is a comma-separated key=value list
+// (e.g., "ndevs=64,util=0.8"). return NULL if params are invalid
+const apmidg_backend *apmidg_backend_sim(const char *params, int verbose);
+
+// the hwmon sysfs files of the i915/xe driver under root (e.g., "/sys")
+// for the card-level energy counter and power limits, and base for
+// everything else. return NULL if base is NULL
+const apmidg_backend *apmidg_backend_hwmon(const apmidg_backend *base, const char *root, int verbose);
+
+// times every call of base for apmidg_stats_get(). it takes the name
+// of base. return NULL if base is NULL
+const apmidg_backend *apmidg_backend_stats(const apmidg_backend *base);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+  The hwmon backend: the card-level energy counter and power limits
+  straight from the hwmon sysfs files of the i915/xe driver
+
+  Level Zero sysman ends up reading the same files, with a lot more
+  work per call. At power domain enumeration, the hwmon directory of
+  the device is looked up once by its PCI address under
+
+    <root>/bus/pci/devices/<domain:bus:dev.fn>/hwmon/hwmonN (name: i915 or xe)
+
+  and the files of its first card-level power domain stay open:
+
+    energy1_input        the energy counter (uJ)
+    power1_max           the sustained limit (uW)
+    power1_max_interval  its averaging window (msec)
+    power1_crit          the peak limit (uW)
+
+  A call reads them with pread() into a stack buffer. Whatever has no
+  file (a subdevice domain, a missing file, a device without hwmon)
+  goes to the base backend, so the mapping is per domain and per file.
+  It is fixed at enumeration: a failed read of an open file is
+  returned as an error rather than served by the base, whose counter
+  and timestamps are unrelated to the file's.
+  root is configurable so that a fake sysfs tree can stand in for
+  /sys, e.g., together with the simulator.
+
+  (setq c-basic-offset 4)
+*/
+
+#include "apmidg_backend.h"
+
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+// a power domain served by hwmon. -1 if the file is missing
+struct HwmonDom {
+    zes_pwr_handle_t h;
+    int energyfd;
+    int maxfd;
+    int intervalfd;
+    int critfd;
+    bool maxrw;       // the files were opened for writing
+    bool intervalrw;
+    bool critrw;
+};
+
+// handle -> HwmonDom. inserts are serialized by hwmon_mtx, lookups
+// are lock-free. a slot is never cleared before fini
+#define HWMON_NSLOTS (1024)
+
+static std::atomic<HwmonDom*> hwmon_slots[HWMON_NSLOTS];
+static std::mutex hwmon_mtx;
+static std::vector<HwmonDom*> hwmon_doms;         // owned, for fini
+static std::vector<zes_device_handle_t> hwmon_devs; // already looked up
+static const apmidg_backend *hwmon_base = NULL;
+static std::string hwmon_root;
+static int hwmon_verbose = 0;
+static apmidg_backend hwmonbackend;
+
+static inline uint32_t slotof(const void *h)
+{
+    uint64_t x = (uint64_t)(uintptr_t)h;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (uint32_t)x & (HWMON_NSLOTS - 1);
+}
+
+static HwmonDom *finddom(zes_pwr_handle_t h)
+{
+    for (uint32_t i = slotof(h), n = 0; n < HWMON_NSLOTS; i = (i + 1) & (HWMON_NSLOTS - 1), n++) {
+	HwmonDom *d = hwmon_slots[i].load(std::memory_order_acquire);
+	if (!d) return NULL;
+	if (d->h == h) return d;
+    }
+    return NULL;
+}
+
+// called with hwmon_mtx held
+static bool insertdom(HwmonDom *d)
+{
+    for (uint32_t i = slotof(d->h), n = 0; n < HWMON_NSLOTS; i = (i + 1) & (HWMON_NSLOTS - 1), n++) {
+	if (!hwmon_slots[i].load(std::memory_order_relaxed)) {
+	    hwmon_slots[i].store(d, std::memory_order_release);
+	    return true;
+	}
+    }
+    return false;
+}
+
+static inline uint64_t gettime_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// read a decimal sysfs value without allocating
+static bool readval(int fd, uint64_t &v)
+{
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return false;
+    buf[n] = 0;
+    char *e;
+    v = strtoull(buf, &e, 10);
+    return e != buf;
+}
+
+static ze_result_t writeval(int fd, bool rw, uint64_t v)
+{
+    char buf[32];
+    if (!rw) return ZE_RESULT_ERROR_INSUFFICIENT_PERMISSIONS;
+    int n = snprintf(buf, sizeof(buf), "%llu\n", (unsigned long long)v);
+    if (pwrite(fd, buf, n, 0) != n)
+	return errno == EACCES || errno == EPERM ? ZE_RESULT_ERROR_INSUFFICIENT_PERMISSIONS : ZE_RESULT_ERROR_UNKNOWN;
+    return ZE_RESULT_SUCCESS;
+}
+
+// open dir/name for writing if possible, otherwise for reading
+static int openfile(const std::string &dir, const char *name, bool *rw)
+{
+    std::string fn = dir + "/" + name;
+    int fd = open(fn.c_str(), O_RDWR | O_CLOEXEC);
+    if (rw) *rw = fd >= 0;
+    if (fd < 0) fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+    return fd;
+}
+
+// the hwmon directory of the device at the PCI address, or "" if none
+static std::string finddir(const zes_pci_address_t &a)
+{
+    char bdf[32];
+    snprintf(bdf, sizeof(bdf), "%04x:%02x:%02x.%x", a.domain, a.bus, a.device, a.function);
+    std::string base = hwmon_root + "/bus/pci/devices/" + bdf + "/hwmon";
+
+    DIR *dp = opendir(base.c_str());
+    if (!dp) return "";
+    std::string found;
+    for (struct dirent *de; (de = readdir(dp)) != NULL; ) {
+	if (strncmp(de->d_name, "hwmon", 5) != 0) continue;
+	std::string dir = base + "/" + de->d_name;
+	char name[16] = {0};
+	FILE *fp = fopen((dir + "/name").c_str(), "r");
+	if (!fp) continue;
+	if (fscanf(fp, "%15s", name) != 1) name[0] = 0;
+	fclose(fp);
+	if (strcmp(name, "i915") == 0 || strcmp(name, "xe") == 0) {
+	    found = dir;
+	    break;
+	}
+    }
+    closedir(dp);
+    return found;
+}
+
+// map the first card-level domain of the device to its hwmon files.
+// the devices may be looked up in parallel (see the library init)
+static void lookupdevice(zes_device_handle_t hDevice, uint32_t count, zes_pwr_handle_t *ph)
+{
+    {
+	std::lock_guard<std::mutex> lock(hwmon_mtx);
+	for (auto d : hwmon_devs) if (d == hDevice) return;
+	hwmon_devs.push_back(hDevice);
+    }
+
+    zes_pci_properties_t pci = {};
+    if (hwmon_base->zesDevicePciGetProperties(hDevice, &pci) != ZE_RESULT_SUCCESS) return;
+    std::string dir = finddir(pci.address);
+    if (dir.empty()) {
+	if (hwmon_verbose >= 1) std::cout << "hwmon: no hwmon directory for bus " << pci.address.bus << ". use " << hwmon_base->name << std::endl;
+	return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+	zes_power_properties_t props = {};
+	if (hwmon_base->zesPowerGetProperties(ph[i], &props) != ZE_RESULT_SUCCESS) continue;
+	if (props.onSubdevice) continue;
+
+	HwmonDom *d = new HwmonDom();
+	d->h = ph[i];
+	d->energyfd = openfile(dir, "energy1_input", NULL);
+	d->maxfd = openfile(dir, "power1_max", &d->maxrw);
+	d->intervalfd = openfile(dir, "power1_max_interval", &d->intervalrw);
+	d->critfd = openfile(dir, "power1_crit", &d->critrw);
+	// the limits need at least the sustained one
+	if (d->maxfd < 0 && d->critfd >= 0) {
+	    close(d->critfd);
+	    d->critfd = -1;
+	}
+	if (d->maxfd < 0 && d->intervalfd >= 0) {
+	    close(d->intervalfd);
+	    d->intervalfd = -1;
+	}
+	if (hwmon_verbose >= 1) {
+	    std::cout << "hwmon: " << dir << ":";
+	    std::cout << " energy=" << (d->energyfd >= 0 ? "hwmon" : hwmon_base->name);
+	    std::cout << " limits=" << (d->maxfd >= 0 ? "hwmon" : hwmon_base->name) << std::endl;
+	}
+	std::lock_guard<std::mutex> lock(hwmon_mtx);
+	hwmon_doms.push_back(d);
+	if (!insertdom(d)) std::cout << "Warning: hwmon: too many power domains" << std::endl;
+	break;
+    }
+}
+
+static ze_result_t ZE_APICALL hwmon_zesDeviceEnumPowerDomains(zes_device_handle_t hDevice, uint32_t *pCount, zes_pwr_handle_t *phPower)
+{
+    ze_result_t res = hwmon_base->zesDeviceEnumPowerDomains(hDevice, pCount, phPower);
+    if (res == ZE_RESULT_SUCCESS && phPower && *pCount > 0) lookupdevice(hDevice, *pCount, phPower);
+    return res;
+}
+
+static ze_result_t ZE_APICALL hwmon_zesPowerGetEnergyCounter(zes_pwr_handle_t hPower, zes_power_energy_counter_t *pEnergy)
+{
+    HwmonDom *d = finddom(hPower);
+    if (!d || d->energyfd < 0) return hwmon_base->zesPowerGetEnergyCounter(hPower, pEnergy);
+    if (!pEnergy) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+
+    uint64_t uj;
+    if (!readval(d->energyfd, uj)) return ZE_RESULT_ERROR_UNKNOWN;
+    pEnergy->energy = uj;
+    pEnergy->timestamp = gettime_us();
+    return ZE_RESULT_SUCCESS;
+}
+
+static void setdesc(zes_power_limit_ext_desc_t *p, zes_power_level_t level, uint64_t uw, bool locked, bool intervallocked, int32_t interval)
+{
+    p->level = level;
+    p->source = ZES_POWER_SOURCE_ANY;
+    p->limitUnit = ZES_LIMIT_UNIT_POWER;
+    p->enabledStateLocked = 1;
+    p->enabled = 1;
+    p->intervalValueLocked = intervallocked;
+    p->interval = interval;
+    p->limitValueLocked = locked;
+    p->limit = (int32_t)(uw / 1000);
+}
+
+// the levels that have a file: sustained, then peak
+static ze_result_t ZE_APICALL hwmon_zesPowerGetLimitsExt(zes_pwr_handle_t hPower, uint32_t *pCount, zes_power_limit_ext_desc_t *pSustained)
+{
+    HwmonDom *d = finddom(hPower);
+    if (!d || d->maxfd < 0) return hwmon_base->zesPowerGetLimitsExt(hPower, pCount, pSustained);
+    if (!pCount) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+
+    uint32_t n = d->critfd >= 0 ? 2 : 1;
+    if (*pCount == 0 || !pSustained) {
+	*pCount = n;
+	return ZE_RESULT_SUCCESS;
+    }
+    if (*pCount > n) *pCount = n;
+
+    uint64_t uw, ms = 0;
+    if (!readval(d->maxfd, uw)) return ZE_RESULT_ERROR_UNKNOWN;
+    bool hasinterval = d->intervalfd >= 0 && readval(d->intervalfd, ms);
+    setdesc(&pSustained[0], ZES_POWER_LEVEL_SUSTAINED, uw, !d->maxrw, !(hasinterval && d->intervalrw), (int32_t)ms);
+    if (*pCount > 1) {
+	if (!readval(d->critfd, uw)) uw = 0;
+	setdesc(&pSustained[1], ZES_POWER_LEVEL_PEAK, uw, !d->critrw, true, 0);
+    }
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL hwmon_zesPowerSetLimitsExt(zes_pwr_handle_t hPower, uint32_t *pCount, zes_power_limit_ext_desc_t *pSustained)
+{
+    HwmonDom *d = finddom(hPower);
+    if (!d || d->maxfd < 0) return hwmon_base->zesPowerSetLimitsExt(hPower, pCount, pSustained);
+    if (!pCount || (*pCount > 0 && !pSustained)) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+
+    for (uint32_t i = 0; i < *pCount; i++) {
+	const zes_power_limit_ext_desc_t *p = &pSustained[i];
+	ze_result_t res = ZE_RESULT_SUCCESS;
+	if (p->limit < 0) continue;
+	if (p->level == ZES_POWER_LEVEL_SUSTAINED) {
+	    uint64_t ms;
+	    if (d->intervalfd >= 0 && p->interval > 0 && readval(d->intervalfd, ms) && ms != (uint64_t)p->interval)
+		res = writeval(d->intervalfd, d->intervalrw, p->interval);
+	    if (res == ZE_RESULT_SUCCESS) res = writeval(d->maxfd, d->maxrw, (uint64_t)p->limit * 1000);
+	} else if (p->level == ZES_POWER_LEVEL_PEAK && d->critfd >= 0) {
+	    res = writeval(d->critfd, d->critrw, (uint64_t)p->limit * 1000);
+	} else {
+	    res = ZE_RESULT_ERROR_UNSUPPORTED_FEATURE;
+	}
+	if (res != ZE_RESULT_SUCCESS) return res;
+    }
+    return ZE_RESULT_SUCCESS;
+}
+
+static void hwmon_fini()
+{
+    {
+	std::lock_guard<std::mutex> lock(hwmon_mtx);
+	for (auto &s : hwmon_slots) s.store(NULL, std::memory_order_relaxed);
+	for (auto d : hwmon_doms) {
+	    for (int fd : {d->energyfd, d->maxfd, d->intervalfd, d->critfd})
+		if (fd >= 0) close(fd);
+	    delete d;
+	}
+	hwmon_doms.clear();
+	hwmon_devs.clear();
+    }
+    if (hwmon_base && hwmon_base->fini) hwmon_base->fini();
+    hwmon_base = NULL;
+}
+
+const apmidg_backend *apmidg_backend_hwmon(const apmidg_backend *base, const char *root, int verbose)
+{
+    if (!base) return NULL;
+
+    hwmon_base = base;
+    hwmon_root = root ? root : "/sys";
+    hwmon_verbose = verbose;
+
+    // everything else goes to the base
+    apmidg_backend *be = &hwmonbackend;
+    *be = *base;
+    be->name = "hwmon";
+    be->zesDeviceEnumPowerDomains = hwmon_zesDeviceEnumPowerDomains;
+    be->zesPowerGetEnergyCounter = hwmon_zesPowerGetEnergyCounter;
+    be->zesPowerGetLimitsExt = hwmon_zesPowerGetLimitsExt;
+    be->zesPowerSetLimitsExt = hwmon_zesPowerSetLimitsExt;
+    be->fini = hwmon_fini;
+
+    if (verbose >= 1) std::cout << "hwmon: root=" << hwmon_root << " base=" << base->name << std::endl;
+
+    return be;
+}
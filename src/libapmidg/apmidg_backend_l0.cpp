@@ -0,0 +1,42 @@
+/*
+  The Level Zero backend: forwards every call to the loader
+
+  (setq c-basic-offset 4)
+*/
+
+#include "apmidg_backend.h"
+
+static apmidg_backend l0backend;
+
+const apmidg_backend *apmidg_backend_l0()
+{
+    apmidg_backend *be = &l0backend;
+
+    be->name = "l0";
+    be->zeInit = zeInit;
+    be->zeDriverGet = zeDriverGet;
+    be->zeDriverGetProperties = zeDriverGetProperties;
+    be->zeDeviceGet = zeDeviceGet;
+    be->zeDeviceGetProperties = zeDeviceGetProperties;
+    be->zesDeviceEnumPowerDomains = zesDeviceEnumPowerDomains;
+    be->zesDeviceEnumFrequencyDomains = zesDeviceEnumFrequencyDomains;
+    be->zesDeviceEnumTemperatureSensors = zesDeviceEnumTemperatureSensors;
+    be->zesDevicePciGetProperties = zesDevicePciGetProperties;
+    be->zesPowerGetProperties = zesPowerGetProperties;
+    be->zesPowerGetEnergyCounter = zesPowerGetEnergyCounter;
+    be->zesPowerGetLimitsExt = zesPowerGetLimitsExt;
+    be->zesPowerSetLimitsExt = zesPowerSetLimitsExt;
+    be->zesFrequencyGetProperties = zesFrequencyGetProperties;
+    be->zesFrequencyGetRange = zesFrequencyGetRange;
+    be->zesFrequencySetRange = zesFrequencySetRange;
+    be->zesFrequencyGetState = zesFrequencyGetState;
+    be->zesTemperatureGetProperties = zesTemperatureGetProperties;
+    be->zesTemperatureGetState = zesTemperatureGetState;
+    be->zesTemperatureGetConfig = zesTemperatureGetConfig;
+    be->zesTemperatureSetConfig = zesTemperatureSetConfig;
+    be->zesDeviceEventRegister = zesDeviceEventRegister;
+    be->zesDriverEventListen = zesDriverEventListen;
+    be->fini = NULL;
+
+    return be;
+}
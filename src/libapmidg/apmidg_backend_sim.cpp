@@ -0,0 +1,788 @@
+/*
+  The simulator backend: deterministic GPUs without Level Zero
+
+  Each simulated device has 'nsubdevs' parts (subdevices, or one part
+  if nsubdevs=0). A part draws
+
+    P = idle/nparts + (tdp-idle)/nparts * util * (f/fmax)^3
+
+  where util comes from a constant or a power trace and f is the
+  requested max frequency. When the sum over the parts exceeds the
+  sustained power limit of the device, a common frequency cap is
+  applied to all parts (found by bisection), which is reported as an
+  average power cap throttle. The energy counters integrate P over
+  time, segment by segment, so the counters only depend on the trace,
+  the control inputs and the clock. With clock=virtual, every energy
+  read advances a shared clock by step_us, which makes a run fully
+  deterministic. latency_us adds a delay to every device call to
+  mimic the cost of a real driver (e.g., to measure the init time).
+  ebits narrows the energy counters to that many bits, so they wrap
+  like a 32-bit hardware counter, and e0 (J) is where they start
+  (e.g., ebits=32,e0=4290 wraps within seconds). The temperature reads
+  of device tempfail fail, and so do the power limit writes of device
+  limfail.
+
+  The topology per device:
+    power domains: the device (controllable) + one per subdevice
+    freq domains:  one per part
+    temp sensors:  GLOBAL + GPU per part, T = tamb + rth * P_part,
+                   with threshold1/2 events (zesTemperatureSetConfig)
+    PCI address:   0000:<devid+1>:00.0
+
+  (setq c-basic-offset 4)
+*/
+
+#include "apmidg_backend.h"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef ZES_FREQ_THROTTLE_REASON_FLAG_AVE_PWR_CAP
+#define ZES_FREQ_THROTTLE_REASON_FLAG_AVE_PWR_CAP (1 << 0)
+#endif
+
+struct SimParams {
+    int ndevs = 2;
+    int nsubdevs = 2;
+    double tdp_W = 600.0;   // the power at fmax and util=1, and the default limit
+    double idle_W = 100.0;
+    double fmin_MHz = 300.0;
+    double fmax_MHz = 1600.0;
+    double util = 1.0;      // used if no trace is given
+    double phase_s = 0.0;   // trace offset of device i is i*phase_s
+    double tamb_C = 30.0;
+    double rth_CperW = 0.15;
+    bool vclock = false;
+    uint64_t step_us = 1000;
+    uint64_t latency_us = 0; // the delay of every device call
+    int ebits = 64;          // the width of the energy counters
+    double e0_J = 0.0;       // the initial energy counter value
+    int tempfail = -1;       // the device whose temperature reads fail
+    int limfail = -1;        // the device whose power limit writes fail
+
+    // the power trace. util[i] holds from t_us[i] to t_us[i+1]. the
+    // last point marks the end of the loop
+    std::vector<uint64_t> trace_t_us;
+    std::vector<double> trace_util;
+};
+
+struct SimDevice;
+
+// the object behind zes_pwr/freq/temp handles
+struct SimDomain {
+    SimDevice *dev;
+    int part;  // -1: the whole device
+    int type;  // temperature sensors only
+    zes_temp_config_t tconfig; // temperature sensors only
+    double lastT; // the temperature at the last threshold check. NAN if none
+};
+
+struct SimDevice {
+    const SimParams *prm;
+    int devid;
+    int nparts;
+    std::mutex mtx;
+
+    uint64_t t0_us;     // when the device was created
+    uint64_t t_us;      // the energy is integrated up to this time
+    std::vector<double> energy_uj;  // per part
+
+    // control inputs
+    int lim_mW;
+    std::vector<double> freqmin_req, freqmax_req;
+
+    // the state derived from util and the control inputs
+    bool dirty;
+    double cur_util;
+    double fcap_MHz;
+    std::vector<double> freq_MHz, power_W;
+
+    std::vector<SimDomain> pwrs, freqs, temps;
+
+    // zesDeviceEventRegister() and the events not listened to yet
+    zes_event_type_flags_t evregistered, evpending;
+
+    SimDevice(const SimParams *_prm, int _devid, uint64_t now_us) : prm(_prm), devid(_devid) {
+	nparts = prm->nsubdevs > 0 ? prm->nsubdevs : 1;
+	t0_us = t_us = now_us;
+	energy_uj.assign(nparts, 0.0);
+	lim_mW = (int)(prm->tdp_W * 1000.0);
+	freqmin_req.assign(nparts, prm->fmin_MHz);
+	freqmax_req.assign(nparts, prm->fmax_MHz);
+	freq_MHz.assign(nparts, prm->fmax_MHz);
+	power_W.assign(nparts, 0.0);
+	dirty = true;
+	cur_util = -1.0;
+	fcap_MHz = prm->fmax_MHz;
+
+	pwrs.push_back({this, -1, 0});
+	if (prm->nsubdevs > 0)
+	    for (int p = 0; p < nparts; p++) pwrs.push_back({this, p, 0});
+	for (int p = 0; p < nparts; p++) freqs.push_back({this, p, 0});
+	temps.push_back({this, -1, ZES_TEMP_SENSORS_GLOBAL});
+	for (int p = 0; p < nparts; p++) temps.push_back({this, p, ZES_TEMP_SENSORS_GPU});
+	for (auto &t : temps) {
+	    t.tconfig = {};
+	    t.tconfig.stype = ZES_STRUCTURE_TYPE_TEMP_CONFIG;
+	    t.lastT = NAN;
+	}
+	evregistered = evpending = 0;
+    }
+
+    double partpower(double util, double f) {
+	double r = f / prm->fmax_MHz;
+	return (prm->idle_W + (prm->tdp_W - prm->idle_W) * util * r * r * r) / nparts;
+    }
+
+    double totalpower(double util, double fcap) {
+	double sum = 0.0;
+	for (int p = 0; p < nparts; p++) sum += partpower(util, std::min(freqmax_req[p], fcap));
+	return sum;
+    }
+
+    void recompute(double util) {
+	double lim_W = lim_mW * 1e-3;
+
+	fcap_MHz = prm->fmax_MHz;
+	if (totalpower(util, fcap_MHz) > lim_W) {
+	    double lo = prm->fmin_MHz, hi = prm->fmax_MHz;
+	    for (int i = 0; i < 32; i++) {
+		double mid = (lo + hi) * 0.5;
+		if (totalpower(util, mid) > lim_W) hi = mid; else lo = mid;
+	    }
+	    fcap_MHz = lo; // the floor is fmin even if the limit is still exceeded
+	}
+	for (int p = 0; p < nparts; p++) {
+	    freq_MHz[p] = std::min(freqmax_req[p], fcap_MHz);
+	    power_W[p] = partpower(util, freq_MHz[p]);
+	}
+	cur_util = util;
+	dirty = false;
+    }
+
+    // return util at t and set tnext to the time it changes
+    double util_at(uint64_t t, uint64_t &tnext) {
+	const std::vector<uint64_t> &tt = prm->trace_t_us;
+	if (tt.size() < 2) {
+	    tnext = UINT64_MAX;
+	    return prm->util;
+	}
+	uint64_t period = tt.back();
+	uint64_t rel = (t - t0_us + (uint64_t)(prm->phase_s * 1e6) * devid) % period;
+	size_t i = std::upper_bound(tt.begin(), tt.end(), rel) - tt.begin() - 1;
+	tnext = t + (tt[i + 1] - rel);
+	return prm->trace_util[i];
+    }
+
+    // integrate the energy up to now. the caller holds mtx
+    void advance(uint64_t now) {
+	uint64_t tnext;
+	while (t_us < now) {
+	    double u = util_at(t_us, tnext);
+	    if (dirty || u != cur_util) recompute(u);
+	    uint64_t tend = std::min(tnext, now);
+	    for (int p = 0; p < nparts; p++) energy_uj[p] += power_W[p] * (tend - t_us); // W*us = uJ
+	    t_us = tend;
+	}
+	if (dirty) recompute(util_at(t_us, tnext));
+    }
+
+    // the caller holds mtx and has advanced the state
+    double temperature(const SimDomain &dom) {
+	double p = 0.0;
+	if (dom.part >= 0) {
+	    p = power_W[dom.part];
+	} else {
+	    for (int i = 0; i < nparts; i++) p = std::max(p, power_W[i]);
+	}
+	return prm->tamb_C + prm->rth_CperW * p;
+    }
+
+    // latch the threshold crossings since the last check into
+    // evpending. the caller holds mtx
+    void checkthresholds(uint64_t now) {
+	advance(now);
+	for (auto &t : temps) {
+	    double T = temperature(t);
+	    const zes_temp_threshold_t *thr[2] = {&t.tconfig.threshold1, &t.tconfig.threshold2};
+	    const zes_event_type_flags_t flag[2] = {ZES_EVENT_TYPE_FLAG_TEMP_THRESHOLD1, ZES_EVENT_TYPE_FLAG_TEMP_THRESHOLD2};
+	    for (int k = 0; k < 2 && !std::isnan(t.lastT); k++) {
+		if (thr[k]->enableLowToHigh && t.lastT < thr[k]->threshold && T >= thr[k]->threshold) evpending |= flag[k];
+		if (thr[k]->enableHighToLow && t.lastT > thr[k]->threshold && T <= thr[k]->threshold) evpending |= flag[k];
+	    }
+	    t.lastT = T;
+	}
+	evpending &= evregistered;
+    }
+};
+
+struct SimDriver {
+    SimParams prm;
+    std::vector<SimDevice*> devs;
+    std::atomic<uint64_t> vclock_us;
+
+    ~SimDriver() {
+	for (auto d : devs) delete d;
+    }
+
+    uint64_t now() {
+	if (prm.vclock) return vclock_us.load(std::memory_order_relaxed);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // energy reads drive the virtual clock
+    uint64_t tick() {
+	if (prm.vclock) return vclock_us.fetch_add(prm.step_us, std::memory_order_relaxed) + prm.step_us;
+	return now();
+    }
+};
+
+static SimDriver *simdrv = NULL;
+static apmidg_backend simbackend;
+
+// the cost of a device call. see latency_us
+static inline void simdelay()
+{
+    if (simdrv->prm.latency_us > 0) usleep(simdrv->prm.latency_us);
+}
+
+#define TODEV(h)  (reinterpret_cast<SimDevice*>(h))
+#define TODOM(h)  (reinterpret_cast<SimDomain*>(h))
+
+// copy up to *pCount handles, or return the count if *pCount is 0
+template <typename H>
+static ze_result_t enumhandles(std::vector<SimDomain> &doms, uint32_t *pCount, H *ph)
+{
+    if (!pCount) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    if (*pCount == 0 || !ph) {
+	*pCount = doms.size();
+	return ZE_RESULT_SUCCESS;
+    }
+    if (*pCount > doms.size()) *pCount = doms.size();
+    for (uint32_t i = 0; i < *pCount; i++) ph[i] = reinterpret_cast<H>(&doms[i]);
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zeInit(ze_init_flags_t flags)
+{
+    return simdrv ? ZE_RESULT_SUCCESS : ZE_RESULT_ERROR_UNINITIALIZED;
+}
+
+static ze_result_t ZE_APICALL sim_zeDriverGet(uint32_t *pCount, ze_driver_handle_t *phDrivers)
+{
+    if (!pCount) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    if (*pCount == 0 || !phDrivers) {
+	*pCount = 1;
+	return ZE_RESULT_SUCCESS;
+    }
+    *pCount = 1;
+    phDrivers[0] = reinterpret_cast<ze_driver_handle_t>(simdrv);
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zeDriverGetProperties(ze_driver_handle_t hDriver, ze_driver_properties_t *pProps)
+{
+    if (!pProps) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    memset(&pProps->uuid, 0, sizeof(pProps->uuid));
+    pProps->driverVersion = 0;
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zeDeviceGet(ze_driver_handle_t hDriver, uint32_t *pCount, ze_device_handle_t *phDevices)
+{
+    if (!pCount) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    uint32_t n = simdrv->devs.size();
+    if (*pCount == 0 || !phDevices) {
+	*pCount = n;
+	return ZE_RESULT_SUCCESS;
+    }
+    if (*pCount > n) *pCount = n;
+    for (uint32_t i = 0; i < *pCount; i++) phDevices[i] = reinterpret_cast<ze_device_handle_t>(simdrv->devs[i]);
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zeDeviceGetProperties(ze_device_handle_t hDevice, ze_device_properties_t *pProps)
+{
+    simdelay();
+    if (!pProps) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDevice *dev = TODEV(hDevice);
+    pProps->type = ZE_DEVICE_TYPE_GPU;
+    pProps->vendorId = 0x8086;
+    pProps->deviceId = 0;
+    pProps->flags = 0;
+    pProps->subdeviceId = 0;
+    pProps->coreClockRate = (uint32_t)dev->prm->fmax_MHz;
+    snprintf(pProps->name, sizeof(pProps->name), "APMIDG simulated GPU %d", dev->devid);
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesDeviceEnumPowerDomains(zes_device_handle_t hDevice, uint32_t *pCount, zes_pwr_handle_t *phPower)
+{
+    simdelay();
+    return enumhandles(TODEV(hDevice)->pwrs, pCount, phPower);
+}
+
+static ze_result_t ZE_APICALL sim_zesDeviceEnumFrequencyDomains(zes_device_handle_t hDevice, uint32_t *pCount, zes_freq_handle_t *phFrequency)
+{
+    simdelay();
+    return enumhandles(TODEV(hDevice)->freqs, pCount, phFrequency);
+}
+
+static ze_result_t ZE_APICALL sim_zesDeviceEnumTemperatureSensors(zes_device_handle_t hDevice, uint32_t *pCount, zes_temp_handle_t *phTemperature)
+{
+    simdelay();
+    return enumhandles(TODEV(hDevice)->temps, pCount, phTemperature);
+}
+
+// device i sits at 0000:<i+1>:00.0
+static ze_result_t ZE_APICALL sim_zesDevicePciGetProperties(zes_device_handle_t hDevice, zes_pci_properties_t *pProperties)
+{
+    simdelay();
+    if (!pProperties) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDevice *dev = TODEV(hDevice);
+    pProperties->address.domain = 0;
+    pProperties->address.bus = dev->devid + 1;
+    pProperties->address.device = 0;
+    pProperties->address.function = 0;
+    pProperties->maxSpeed = {-1, -1, -1};
+    pProperties->haveBandwidthCounters = 0;
+    pProperties->havePacketCounters = 0;
+    pProperties->haveReplayCounters = 0;
+    return ZE_RESULT_SUCCESS;
+}
+
+static void setsustained(zes_power_limit_ext_desc_t *p, int lim_mW)
+{
+    p->level = ZES_POWER_LEVEL_SUSTAINED;
+    p->source = ZES_POWER_SOURCE_ANY;
+    p->limitUnit = ZES_LIMIT_UNIT_POWER;
+    p->enabledStateLocked = 1;
+    p->enabled = 1;
+    p->intervalValueLocked = 0;
+    p->interval = 28;
+    p->limitValueLocked = 0;
+    p->limit = lim_mW;
+}
+
+static ze_result_t ZE_APICALL sim_zesPowerGetProperties(zes_pwr_handle_t hPower, zes_power_properties_t *pProps)
+{
+    simdelay();
+    if (!pProps) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hPower);
+    SimDevice *dev = dom->dev;
+
+    pProps->onSubdevice = dom->part >= 0;
+    pProps->subdeviceId = dom->part >= 0 ? dom->part : 0;
+    pProps->canControl = dom->part < 0;
+    pProps->isEnergyThresholdSupported = 0;
+    pProps->defaultLimit = -1; // deprecated, as the real driver reports
+    pProps->minLimit = -1;
+    pProps->maxLimit = -1;
+
+    for (void *p = pProps->pNext; p; ) {
+	zes_power_ext_properties_t *ext = (zes_power_ext_properties_t *)p;
+	if (ext->stype == ZES_STRUCTURE_TYPE_POWER_EXT_PROPERTIES) {
+	    ext->domain = dom->part < 0 ? ZES_POWER_DOMAIN_CARD : ZES_POWER_DOMAIN_PACKAGE;
+	    if (ext->defaultLimit) setsustained(ext->defaultLimit, dom->part < 0 ? (int)(dev->prm->tdp_W * 1000.0) : -1);
+	}
+	p = ext->pNext;
+    }
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesPowerGetEnergyCounter(zes_pwr_handle_t hPower, zes_power_energy_counter_t *pEnergy)
+{
+    simdelay();
+    if (!pEnergy) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hPower);
+    SimDevice *dev = dom->dev;
+    uint64_t now = simdrv->tick();
+    double e = 0.0;
+
+    std::lock_guard<std::mutex> lock(dev->mtx);
+    dev->advance(now);
+    if (dom->part >= 0) {
+	e = dev->energy_uj[dom->part];
+    } else {
+	for (int p = 0; p < dev->nparts; p++) e += dev->energy_uj[p];
+    }
+    e += simdrv->prm.e0_J * 1e6;
+    pEnergy->energy = (uint64_t)e;
+    if (simdrv->prm.ebits < 64) pEnergy->energy &= (1ULL << simdrv->prm.ebits) - 1;
+    pEnergy->timestamp = dev->t_us;
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesPowerGetLimitsExt(zes_pwr_handle_t hPower, uint32_t *pCount, zes_power_limit_ext_desc_t *pSustained)
+{
+    simdelay();
+    if (!pCount) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hPower);
+    uint32_t n = dom->part < 0 ? 1 : 0;
+
+    if (*pCount == 0 || !pSustained) {
+	*pCount = n;
+	return ZE_RESULT_SUCCESS;
+    }
+    if (*pCount > n) *pCount = n;
+    if (*pCount > 0) {
+	std::lock_guard<std::mutex> lock(dom->dev->mtx);
+	setsustained(&pSustained[0], dom->dev->lim_mW);
+    }
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesPowerSetLimitsExt(zes_pwr_handle_t hPower, uint32_t *pCount, zes_power_limit_ext_desc_t *pSustained)
+{
+    simdelay();
+    if (!pCount || !pSustained) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hPower);
+    SimDevice *dev = dom->dev;
+    if (dom->part >= 0) return ZE_RESULT_ERROR_UNSUPPORTED_FEATURE;
+    if (dev->devid == simdrv->prm.limfail) return ZE_RESULT_ERROR_NOT_AVAILABLE;
+
+    for (uint32_t i = 0; i < *pCount; i++) {
+	if (pSustained[i].level != ZES_POWER_LEVEL_SUSTAINED) continue;
+	if (pSustained[i].limit <= 0) return ZE_RESULT_ERROR_INVALID_ARGUMENT;
+
+	std::lock_guard<std::mutex> lock(dev->mtx);
+	dev->advance(simdrv->now()); // the old limit holds until now
+	dev->lim_mW = pSustained[i].limit;
+	dev->dirty = true;
+    }
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesFrequencyGetProperties(zes_freq_handle_t hFrequency, zes_freq_properties_t *pProperties)
+{
+    simdelay();
+    if (!pProperties) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hFrequency);
+    const SimParams *prm = dom->dev->prm;
+
+    pProperties->type = ZES_FREQ_DOMAIN_GPU;
+    pProperties->onSubdevice = prm->nsubdevs > 0;
+    pProperties->subdeviceId = dom->part;
+    pProperties->canControl = 1;
+    pProperties->isThrottleEventSupported = 0;
+    pProperties->min = prm->fmin_MHz;
+    pProperties->max = prm->fmax_MHz;
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesFrequencyGetRange(zes_freq_handle_t hFrequency, zes_freq_range_t *pLimits)
+{
+    simdelay();
+    if (!pLimits) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hFrequency);
+    SimDevice *dev = dom->dev;
+
+    std::lock_guard<std::mutex> lock(dev->mtx);
+    pLimits->min = dev->freqmin_req[dom->part];
+    pLimits->max = dev->freqmax_req[dom->part];
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesFrequencySetRange(zes_freq_handle_t hFrequency, const zes_freq_range_t *pLimits)
+{
+    simdelay();
+    if (!pLimits) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hFrequency);
+    SimDevice *dev = dom->dev;
+    const SimParams *prm = dev->prm;
+
+    double fmin = std::max(pLimits->min, prm->fmin_MHz);
+    double fmax = std::min(pLimits->max, prm->fmax_MHz);
+    if (fmin > fmax) return ZE_RESULT_ERROR_INVALID_ARGUMENT;
+
+    std::lock_guard<std::mutex> lock(dev->mtx);
+    dev->advance(simdrv->now());
+    dev->freqmin_req[dom->part] = fmin;
+    dev->freqmax_req[dom->part] = fmax;
+    dev->dirty = true;
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesFrequencyGetState(zes_freq_handle_t hFrequency, zes_freq_state_t *pState)
+{
+    simdelay();
+    if (!pState) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hFrequency);
+    SimDevice *dev = dom->dev;
+
+    std::lock_guard<std::mutex> lock(dev->mtx);
+    dev->advance(simdrv->now());
+    pState->currentVoltage = -1.0;
+    pState->request = dev->freqmax_req[dom->part];
+    pState->tdp = dev->fcap_MHz;
+    pState->efficient = -1.0;
+    pState->actual = dev->freq_MHz[dom->part];
+    pState->throttleReasons = dev->fcap_MHz < pState->request ? ZES_FREQ_THROTTLE_REASON_FLAG_AVE_PWR_CAP : 0;
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesTemperatureGetProperties(zes_temp_handle_t hTemperature, zes_temp_properties_t *pProperties)
+{
+    simdelay();
+    if (!pProperties) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hTemperature);
+
+    pProperties->type = (zes_temp_sensors_t)dom->type;
+    pProperties->onSubdevice = dom->part >= 0 && dom->dev->prm->nsubdevs > 0;
+    pProperties->subdeviceId = dom->part >= 0 ? dom->part : 0;
+    pProperties->maxTemperature = 100.0;
+    pProperties->isCriticalTempSupported = 0;
+    pProperties->isThreshold1Supported = 1;
+    pProperties->isThreshold2Supported = 1;
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesTemperatureGetState(zes_temp_handle_t hTemperature, double *pTemperature)
+{
+    simdelay();
+    if (!pTemperature) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hTemperature);
+    SimDevice *dev = dom->dev;
+
+    if (dev->devid == simdrv->prm.tempfail) return ZE_RESULT_ERROR_NOT_AVAILABLE;
+    std::lock_guard<std::mutex> lock(dev->mtx);
+    dev->advance(simdrv->now());
+    *pTemperature = dev->temperature(*dom);
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesTemperatureGetConfig(zes_temp_handle_t hTemperature, zes_temp_config_t *pConfig)
+{
+    simdelay();
+    if (!pConfig) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hTemperature);
+
+    std::lock_guard<std::mutex> lock(dom->dev->mtx);
+    pConfig->enableCritical = dom->tconfig.enableCritical;
+    pConfig->threshold1 = dom->tconfig.threshold1;
+    pConfig->threshold2 = dom->tconfig.threshold2;
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesTemperatureSetConfig(zes_temp_handle_t hTemperature, const zes_temp_config_t *pConfig)
+{
+    simdelay();
+    if (!pConfig) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+    SimDomain *dom = TODOM(hTemperature);
+    if (pConfig->enableCritical) return ZE_RESULT_ERROR_UNSUPPORTED_FEATURE;
+
+    std::lock_guard<std::mutex> lock(dom->dev->mtx);
+    dom->tconfig.threshold1 = pConfig->threshold1;
+    dom->tconfig.threshold2 = pConfig->threshold2;
+    return ZE_RESULT_SUCCESS;
+}
+
+static ze_result_t ZE_APICALL sim_zesDeviceEventRegister(zes_device_handle_t hDevice, zes_event_type_flags_t events)
+{
+    simdelay();
+    SimDevice *dev = TODEV(hDevice);
+
+    std::lock_guard<std::mutex> lock(dev->mtx);
+    dev->checkthresholds(simdrv->now()); // the crossings count from now
+    dev->evregistered = events;
+    dev->evpending = 0;
+    return ZE_RESULT_SUCCESS;
+}
+
+// the thresholds are checked every msec while listening, which stands
+// in for the interrupt of a real device
+static ze_result_t ZE_APICALL sim_zesDriverEventListen(ze_driver_handle_t hDriver, uint32_t timeout, uint32_t count,
+						       zes_device_handle_t *phDevices, uint32_t *pNumDeviceEvents,
+						       zes_event_type_flags_t *pEvents)
+{
+    if (!pNumDeviceEvents || (count > 0 && (!phDevices || !pEvents))) return ZE_RESULT_ERROR_INVALID_NULL_POINTER;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t start_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    for (;;) {
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < count; i++) {
+	    SimDevice *dev = TODEV(phDevices[i]);
+	    std::lock_guard<std::mutex> lock(dev->mtx);
+	    dev->checkthresholds(simdrv->now());
+	    pEvents[i] = dev->evpending;
+	    dev->evpending = 0;
+	    if (pEvents[i]) n++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	if (n > 0 || (timeout != UINT32_MAX && now_ms - start_ms >= timeout)) {
+	    *pNumDeviceEvents = n;
+	    return ZE_RESULT_SUCCESS;
+	}
+	usleep(1000);
+    }
+}
+
+static void sim_fini()
+{
+    if (simdrv) delete simdrv;
+    simdrv = NULL;
+}
+
+// a trace file has 'time_sec util' per line. '#' starts a comment
+static bool loadtrace(const char *fn, SimParams &prm)
+{
+    FILE *fp = fopen(fn, "r");
+    if (!fp) {
+	std::cout << "Error: failed to open the power trace " << fn << std::endl;
+	return false;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+	double t, u;
+	if (line[0] == '#') continue;
+	if (sscanf(line, "%lf %lf", &t, &u) != 2) continue;
+	uint64_t t_us = (uint64_t)(t * 1e6);
+	if (!prm.trace_t_us.empty() && t_us <= prm.trace_t_us.back()) {
+	    std::cout << "Error: the power trace must be sorted by time: " << fn << std::endl;
+	    fclose(fp);
+	    return false;
+	}
+	prm.trace_t_us.push_back(t_us);
+	prm.trace_util.push_back(u);
+    }
+    fclose(fp);
+
+    if (prm.trace_t_us.size() < 2 || prm.trace_t_us[0] != 0) {
+	std::cout << "Error: the power trace needs two or more points starting at time 0: " << fn << std::endl;
+	return false;
+    }
+    return true;
+}
+
+static bool parseparams(const char *params, SimParams &prm)
+{
+    std::string s = params ? params : "";
+    size_t pos = 0;
+
+    while (pos < s.size()) {
+	size_t end = s.find(',', pos);
+	if (end == std::string::npos) end = s.size();
+	std::string kv = s.substr(pos, end - pos);
+	pos = end + 1;
+	if (kv.empty()) continue;
+
+	size_t eq = kv.find('=');
+	std::string key = kv.substr(0, eq);
+	std::string val = eq == std::string::npos ? "" : kv.substr(eq + 1);
+	const char *v = val.c_str();
+
+	if (key == "ndevs") prm.ndevs = atoi(v);
+	else if (key == "nsubdevs") prm.nsubdevs = atoi(v);
+	else if (key == "tdp") prm.tdp_W = atof(v);
+	else if (key == "idle") prm.idle_W = atof(v);
+	else if (key == "fmin") prm.fmin_MHz = atof(v);
+	else if (key == "fmax") prm.fmax_MHz = atof(v);
+	else if (key == "util") prm.util = atof(v);
+	else if (key == "phase") prm.phase_s = atof(v);
+	else if (key == "tamb") prm.tamb_C = atof(v);
+	else if (key == "rth") prm.rth_CperW = atof(v);
+	else if (key == "step_us") prm.step_us = strtoull(v, NULL, 0);
+	else if (key == "latency_us") prm.latency_us = strtoull(v, NULL, 0);
+	else if (key == "ebits") prm.ebits = atoi(v);
+	else if (key == "e0") prm.e0_J = atof(v);
+	else if (key == "tempfail") prm.tempfail = atoi(v);
+	else if (key == "limfail") prm.limfail = atoi(v);
+	else if (key == "clock") {
+	    if (val == "virtual") prm.vclock = true;
+	    else if (val == "real") prm.vclock = false;
+	    else {
+		std::cout << "Error: sim: clock must be real or virtual" << std::endl;
+		return false;
+	    }
+	} else if (key == "trace") {
+	    if (!loadtrace(v, prm)) return false;
+	} else {
+	    std::cout << "Error: sim: unknown parameter " << key << std::endl;
+	    return false;
+	}
+    }
+
+    if (prm.ndevs < 1 || prm.nsubdevs < 0 || prm.fmin_MHz <= 0.0 || prm.fmax_MHz < prm.fmin_MHz ||
+	prm.tdp_W < prm.idle_W || prm.idle_W < 0.0 || prm.step_us == 0 ||
+	prm.ebits < 8 || prm.ebits > 64 || prm.e0_J < 0.0) {
+	std::cout << "Error: sim: invalid parameters" << std::endl;
+	return false;
+    }
+    return true;
+}
+
+const apmidg_backend *apmidg_backend_sim(const char *params, int verbose)
+{
+    sim_fini();
+
+    SimDriver *drv = new SimDriver();
+    if (!parseparams(params, drv->prm)) {
+	delete drv;
+	return NULL;
+    }
+    drv->vclock_us.store(1000000, std::memory_order_relaxed); // start at 1 sec. 0 means no sample
+    uint64_t now = drv->now();
+    for (int i = 0; i < drv->prm.ndevs; i++) drv->devs.push_back(new SimDevice(&drv->prm, i, now));
+    simdrv = drv;
+
+    if (verbose >= 1) {
+	const SimParams &prm = drv->prm;
+	std::cout << "Simulator: ndevs=" << prm.ndevs << " nsubdevs=" << prm.nsubdevs;
+	std::cout << " tdp=" << prm.tdp_W << "W idle=" << prm.idle_W << "W";
+	std::cout << " freq=" << prm.fmin_MHz << "-" << prm.fmax_MHz << "MHz";
+	if (prm.trace_t_us.empty()) std::cout << " util=" << prm.util;
+	else std::cout << " trace=" << prm.trace_t_us.size() << "points";
+	std::cout << " clock=" << (prm.vclock ? "virtual" : "real");
+	if (prm.latency_us > 0) std::cout << " latency=" << prm.latency_us << "us";
+	std::cout << std::endl;
+    }
+
+    apmidg_backend *be = &simbackend;
+
+    be->name = "sim";
+    be->zeInit = sim_zeInit;
+    be->zeDriverGet = sim_zeDriverGet;
+    be->zeDriverGetProperties = sim_zeDriverGetProperties;
+    be->zeDeviceGet = sim_zeDeviceGet;
+    be->zeDeviceGetProperties = sim_zeDeviceGetProperties;
+    be->zesDeviceEnumPowerDomains = sim_zesDeviceEnumPowerDomains;
+    be->zesDeviceEnumFrequencyDomains = sim_zesDeviceEnumFrequencyDomains;
+    be->zesDeviceEnumTemperatureSensors = sim_zesDeviceEnumTemperatureSensors;
+    be->zesDevicePciGetProperties = sim_zesDevicePciGetProperties;
+    be->zesPowerGetProperties = sim_zesPowerGetProperties;
+    be->zesPowerGetEnergyCounter = sim_zesPowerGetEnergyCounter;
+    be->zesPowerGetLimitsExt = sim_zesPowerGetLimitsExt;
+    be->zesPowerSetLimitsExt = sim_zesPowerSetLimitsExt;
+    be->zesFrequencyGetProperties = sim_zesFrequencyGetProperties;
+    be->zesFrequencyGetRange = sim_zesFrequencyGetRange;
+    be->zesFrequencySetRange = sim_zesFrequencySetRange;
+    be->zesFrequencyGetState = sim_zesFrequencyGetState;
+    be->zesTemperatureGetProperties = sim_zesTemperatureGetProperties;
+    be->zesTemperatureGetState = sim_zesTemperatureGetState;
+    be->zesTemperatureGetConfig = sim_zesTemperatureGetConfig;
+    be->zesTemperatureSetConfig = sim_zesTemperatureSetConfig;
+    be->zesDeviceEventRegister = sim_zesDeviceEventRegister;
+    be->zesDriverEventListen = sim_zesDriverEventListen;
+    be->fini = sim_fini;
+
+    return be;
+}
@@ -0,0 +1,68 @@
+#ifndef __APMIDG_CONFIG_H_DEFINED__
+#define __APMIDG_CONFIG_H_DEFINED__
+
+// internal use only
+
+#include <stdint.h>
+
+// The control state blob of apmidg_config_capture()
+//
+// header
+// devices[ndevs]  identify the device the entries belong to
+// entries[nents]  a power limit descriptor or a frequency range each
+//
+// All fields are in the host byte order. A device is identified by
+// its PCI address and subdevice mask, not by its devid, so a blob
+// still applies when the device selection renumbers the devices. The
+// checksum is FNV-1a over the devices and the entries. A power domain
+// has one entry per limit descriptor (zes_power_limit_ext_desc_t), all
+// of them written back with one zesPowerSetLimitsExt().
+//
+// version 2: the full descriptor set per power domain. version 1 had
+// the sustained limit only
+
+#define APMIDG_CONFIG_MAGIC   "APMIDGCF"
+#define APMIDG_CONFIG_VERSION (2)
+
+#define APMIDG_CONFIG_ENT_PWRLIM   (0)  // level ... limit
+#define APMIDG_CONFIG_ENT_FREQLIMS (1)  // min_MHz, max_MHz
+
+struct apmidg_config_hdr {
+    char     magic[8];
+    uint32_t version;
+    uint32_t hdrsize;
+    uint32_t devsize;
+    uint32_t entsize;
+    uint32_t ndevs;
+    uint32_t nents;
+    uint32_t checksum;
+    uint32_t reserved;
+    uint64_t ts_us;   // CLOCK_REALTIME at capture
+};
+
+struct apmidg_config_dev {
+    uint32_t pci_domain;
+    uint32_t pci_bus;
+    uint32_t pci_device;
+    uint32_t pci_function;
+    uint64_t subdevmask;
+    uint32_t npwrdoms;
+    uint32_t nfreqdoms;
+};
+
+struct apmidg_config_ent {
+    uint32_t dev;      // index into devices
+    uint32_t kind;     // APMIDG_CONFIG_ENT_*
+    uint32_t id;       // pwrid or freqid
+    int32_t  level;    // zes_power_level_t
+    int32_t  source;   // zes_power_source_t
+    int32_t  unit;     // zes_limit_unit_t
+    int32_t  enabled;
+    int32_t  interval; // msec
+    int32_t  limit;    // mW or A, see unit
+    uint32_t reserved;
+    double   min_MHz;
+    double   max_MHz;
+};
+
+#endif
@@ -0,0 +1,74 @@
+/*
+  Grace periods for the objects that readers load from an atomic
+  pointer without a lock
+
+  (setq c-basic-offset 4)
+*/
+
+#ifndef __APMIDG_GRACE_H_DEFINED__
+#define __APMIDG_GRACE_H_DEFINED__
+
+// internal use only
+
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+
+// APMIDGGrace tells when no reader can still use an object that was
+// unpublished. A reader brackets the load of the pointer and its last
+// use with enter() and exit() (see APMIDGGraceReader). The writer
+// unpublishes the pointer (e.g., exchange(NULL)) and then calls
+// synchronize(), after which the object can be freed.
+//
+// Readers never wait. They are counted in one of two slots picked by
+// the parity of the epoch. synchronize() flips the epoch, so new
+// readers go to the other slot, and waits for the old slot to drain;
+// a steady stream of readers cannot starve it. A reader rechecks the
+// epoch after it is counted, so it is never counted in a slot that a
+// flip has already retired. synchronize() calls must be serialized,
+// and a reader must not wait for the writer (e.g., take the lock the
+// writer holds) while it is inside.
+class APMIDGGrace {
+    std::atomic<uint64_t> epoch;
+    std::atomic<int64_t> nreaders[2];
+
+public:
+    APMIDGGrace() : epoch(0) {
+	nreaders[0].store(0);
+	nreaders[1].store(0);
+    }
+
+    // return the slot to pass to exit()
+    int enter() {
+	for (;;) {
+	    int slot = epoch.load() & 1;
+	    nreaders[slot].fetch_add(1);
+	    if ((int)(epoch.load() & 1) == slot) return slot;
+	    nreaders[slot].fetch_sub(1);
+	}
+    }
+
+    void exit(int slot) {
+	nreaders[slot].fetch_sub(1, std::memory_order_release);
+    }
+
+    void synchronize() {
+	int slot = epoch.fetch_add(1) & 1;
+	while (nreaders[slot].load(std::memory_order_acquire) > 0)
+	    std::this_thread::yield();
+    }
+};
+
+class APMIDGGraceReader {
+    APMIDGGrace &grace;
+    int slot;
+
+public:
+    explicit APMIDGGraceReader(APMIDGGrace &_grace) : grace(_grace), slot(_grace.enter()) {}
+    ~APMIDGGraceReader() { grace.exit(slot); }
+
+    APMIDGGraceReader(const APMIDGGraceReader&) = delete;
+    APMIDGGraceReader& operator=(const APMIDGGraceReader&) = delete;
+};
+
+#endif
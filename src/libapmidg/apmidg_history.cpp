@@ -0,0 +1,140 @@
+/*
+  Bounded-memory multi-resolution history per domain. See
+  apmidg_history.h and apmidg_history_query()
+
+  (setq c-basic-offset 4)
+*/
+
+#include "apmidg_history.h"
+
+const uint64_t IDGHistory::width_us[HISTORY_NTIERS] = {
+    0, 1000000ULL, 60ULL * 1000000ULL, 3600ULL * 1000000ULL
+};
+
+static void merge(IDGHistBucket &dst, const IDGHistBucket &src)
+{
+    if (dst.count == 0 || src.min < dst.min) dst.min = src.min;
+    if (dst.count == 0 || src.max > dst.max) dst.max = src.max;
+    dst.count += src.count;
+    dst.sum += src.sum;
+    dst.energy_J += src.energy_J;
+}
+
+IDGHistory::IDGHistory(int ndoms, const apmidg_history_config_t &_cfg)
+    : cfg(_cfg), doms(ndoms)
+{
+    double nraw = cfg.raw_s * cfg.raw_hz;
+    size_t n[HISTORY_NTIERS] = {
+	nraw > 0.0 ? (size_t)nraw : 0,
+	(size_t)(cfg.n1s > 0 ? cfg.n1s : 0),
+	(size_t)(cfg.n1m > 0 ? cfg.n1m : 0),
+	(size_t)(cfg.n1h > 0 ? cfg.n1h : 0),
+    };
+    for (auto &d : doms) {
+	for (int t = 0; t < HISTORY_NTIERS; t++) {
+	    d.rings[t].ents.resize(n[t]);
+	    d.rings[t].head = 0;
+	    d.open[t] = {};
+	}
+	d.last_ts_us = 0;
+    }
+}
+
+// merge b into the open bucket of the tier, closing the open one
+// first if b belongs to a later slot
+void IDGHistory::fold(IDGHistDom &d, int tier, const IDGHistBucket &b)
+{
+    uint64_t t0 = b.t0_us / width_us[tier] * width_us[tier];
+    IDGHistBucket &o = d.open[tier];
+
+    if (o.count > 0 && o.t0_us != t0) close(d, tier);
+    o.t0_us = t0;
+    merge(o, b);
+}
+
+void IDGHistory::close(IDGHistDom &d, int tier)
+{
+    IDGHistBucket &o = d.open[tier];
+
+    d.rings[tier].push(o);
+    if (tier + 1 < HISTORY_NTIERS) fold(d, tier + 1, o);
+    o = {};
+}
+
+void IDGHistory::add(int idx, uint64_t ts_us, double v, bool ispower)
+{
+    if (v < 0.0) return;
+
+    IDGHistDom &d = doms[idx];
+    std::lock_guard<std::mutex> lock(d.mtx);
+
+    // a reader racing another keeps the tiers in time order
+    if (ts_us < d.last_ts_us) return;
+
+    IDGHistBucket b = {ts_us, 1, v, v, v, 0.0};
+    if (ispower && d.last_ts_us > 0) b.energy_J = v * (ts_us - d.last_ts_us) * 1e-6;
+    d.last_ts_us = ts_us;
+
+    d.rings[0].push(b);
+    fold(d, 1, b);
+}
+
+static void copyout(apmidg_history_t &h, const IDGHistBucket &b)
+{
+    h.ts_us = b.t0_us;
+    h.count = b.count;
+    h.min = b.min;
+    h.max = b.max;
+    h.mean = b.sum / b.count;
+    h.energy_J = b.energy_J;
+}
+
+int IDGHistory::query(int idx, int tier, uint64_t from_us, uint64_t to_us, apmidg_history_t *buf, int n)
+{
+    IDGHistDom &d = doms[idx];
+    IDGHistRing &r = d.rings[tier];
+    int cnt = 0;
+
+    std::lock_guard<std::mutex> lock(d.mtx);
+
+    uint64_t size = r.ents.size();
+    uint64_t start = r.head > size ? r.head - size : 0;
+    for (uint64_t i = start; i < r.head && cnt < n; i++) {
+	const IDGHistBucket &b = r.ents[i % size];
+	if (b.t0_us >= from_us && b.t0_us < to_us) copyout(buf[cnt++], b);
+    }
+    if (tier == 0) return cnt;
+
+    // the open bucket lacks the open buckets of the finer tiers, which
+    // may also have moved to the next slot already
+    uint64_t w = width_us[tier];
+    IDGHistBucket o = d.open[tier];
+    for (int t = tier - 1; t >= 1; t--) {
+	IDGHistBucket b = d.open[t];
+	if (b.count == 0) continue;
+	b.t0_us = b.t0_us / w * w;
+	if (o.count > 0 && o.t0_us != b.t0_us) {
+	    if (cnt < n && o.t0_us >= from_us && o.t0_us < to_us) copyout(buf[cnt++], o);
+	    o = {};
+	}
+	o.t0_us = b.t0_us;
+	merge(o, b);
+    }
+    if (o.count > 0 && cnt < n && o.t0_us >= from_us && o.t0_us < to_us) copyout(buf[cnt++], o);
+    return cnt;
+}
+
+int IDGHistory::pickt(int idx, uint64_t from_us)
+{
+    IDGHistDom &d = doms[idx];
+
+    std::lock_guard<std::mutex> lock(d.mtx);
+    for (int t = 0; t < HISTORY_NTIERS; t++) {
+	IDGHistRing &r = d.rings[t];
+	uint64_t size = r.ents.size();
+	if (size == 0) continue;
+	// a ring that has not wrapped holds everything since start
+	if (r.head <= size || r.ents[r.head % size].t0_us <= from_us) return t;
+    }
+    return HISTORY_NTIERS - 1;
+}
@@ -0,0 +1,80 @@
+#ifndef __APMIDG_HISTORY_H_DEFINED__
+#define __APMIDG_HISTORY_H_DEFINED__
+
+// internal use only
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+#include "libapmidg.h"
+
+// A tiered time series per domain with a fixed memory ceiling
+//
+//   tier 0: the raw samples, a ring of raw_s * raw_hz entries
+//   tier 1: 1 sec rollups, a ring of n1s entries
+//   tier 2: 1 min rollups, a ring of n1m entries
+//   tier 3: 1 hour rollups, a ring of n1h entries
+//
+// A rollup has the count, min, max, sum and, for power, the energy of
+// its time slot. Each tier above 0 has an open bucket. When a sample
+// falls into a new slot, the open bucket is closed into its ring and
+// merged into the open bucket of the next tier, so the coarser tiers
+// are compacted as a side effect of adding samples. All rings are
+// allocated at start; the oldest entries are overwritten.
+
+#define HISTORY_NTIERS (4)
+
+struct IDGHistBucket {
+    uint64_t t0_us;    // the start of the slot, or the sample time in tier 0
+    uint64_t count;    // 0 if empty
+    double min;
+    double max;
+    double sum;
+    double energy_J;
+};
+
+struct IDGHistRing {
+    std::vector<IDGHistBucket> ents;
+    uint64_t head;     // the number of entries ever pushed
+
+    void push(const IDGHistBucket &b) {
+	if (ents.empty()) return; // the tier is disabled
+	ents[head % ents.size()] = b;
+	head++;
+    }
+};
+
+struct IDGHistDom {
+    std::mutex mtx;
+    IDGHistRing rings[HISTORY_NTIERS];
+    IDGHistBucket open[HISTORY_NTIERS]; // open[0] is unused
+    uint64_t last_ts_us; // the latest sample, 0 if none
+};
+
+class IDGHistory {
+    apmidg_history_config_t cfg;
+    std::vector<IDGHistDom> doms;
+
+    void fold(IDGHistDom &d, int tier, const IDGHistBucket &b);
+    void close(IDGHistDom &d, int tier);
+
+public:
+    static const uint64_t width_us[HISTORY_NTIERS];
+
+    IDGHistory(int ndoms, const apmidg_history_config_t &_cfg);
+
+    // add a sample. negative values (failed reads) are skipped. for
+    // power, the energy is the value times the interval since the
+    // previous sample of the domain
+    void add(int idx, uint64_t ts_us, double v, bool ispower);
+
+    // copy the entries of the tier in [from_us, to_us), oldest first,
+    // including the open bucket. return the number of entries copied
+    int query(int idx, int tier, uint64_t from_us, uint64_t to_us, apmidg_history_t *buf, int n);
+
+    // the finest tier that still holds from_us
+    int pickt(int idx, uint64_t from_us);
+};
+
+#endif
@@ -0,0 +1,169 @@
+/*
+  The CPU RAPL reader: package and subzone energy counters from the
+  powercap sysfs, so that the sampler reads the CPU and the GPUs in
+  the same pass. See apmidg_rapl.h
+
+  (setq c-basic-offset 4)
+*/
+
+#include "apmidg_rapl.h"
+
+#include <iostream>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+static inline uint64_t gettime_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// read a decimal sysfs value without allocating
+static bool readval(int fd, uint64_t &v)
+{
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return false;
+    buf[n] = 0;
+    char *e;
+    v = strtoull(buf, &e, 10);
+    return e != buf;
+}
+
+static bool readfile(const std::string &fn, std::string &s)
+{
+    char buf[64];
+    int fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return false;
+    buf[n] = 0;
+    s = buf;
+    while (!s.empty() && isspace((unsigned char)s.back())) s.pop_back();
+    return true;
+}
+
+// the "intel-rapl:N[:M]" entries of dir, in numerical order
+static std::vector<std::string> listzonedirs(const std::string &dir, const std::string &prefix)
+{
+    std::vector<std::pair<long, std::string>> ents;
+    DIR *d = opendir(dir.c_str());
+    if (!d) return {};
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+	if (strncmp(de->d_name, prefix.c_str(), prefix.size()) != 0) continue;
+	const char *p = de->d_name + prefix.size();
+	char *e;
+	long n = strtol(p, &e, 10);
+	if (e == p || *e != 0) continue; // e.g., intel-rapl:0:0 when looking for intel-rapl:N
+	ents.push_back({n, de->d_name});
+    }
+    closedir(d);
+    std::sort(ents.begin(), ents.end());
+
+    std::vector<std::string> ret;
+    for (auto &e : ents) ret.push_back(dir + "/" + e.second);
+    return ret;
+}
+
+void IDGRapl::addzone(const std::string &dir, const std::string &name)
+{
+    std::string s;
+    uint64_t maxrange = 0;
+
+    if (readfile(dir + "/max_energy_range_uj", s)) maxrange = strtoull(s.c_str(), NULL, 10);
+    int fd = open((dir + "/energy_uj").c_str(), O_RDONLY | O_CLOEXEC);
+    uint64_t raw;
+    if (fd < 0 || !readval(fd, raw)) {
+	// energy_uj is root only on recent kernels
+	if (verbose) std::cout << "Warning: unable to read " << dir << "/energy_uj" << std::endl;
+	if (fd >= 0) close(fd);
+	return;
+    }
+
+    IDGRaplZone *z = new IDGRaplZone;
+    z->name = name;
+    z->fd = fd;
+    z->maxrange_uj = maxrange;
+    z->prev_raw_uj = raw;
+    z->energy_uj = raw;
+    z->ts_us = gettime_us();
+    z->avg_energy_uj = z->energy_uj;
+    z->avg_ts_us = z->ts_us;
+    z->watt = 0.0;
+    zones.push_back(z);
+
+    if (verbose >= 2) std::cout << "rapl: " << name << " " << dir << " max_energy_range_uj=" << maxrange << std::endl;
+}
+
+IDGRapl::IDGRapl(const char *root, int _ver) : verbose(_ver)
+{
+    std::string rapldir = std::string((root && root[0]) ? root : "/sys") + "/devices/virtual/powercap/intel-rapl";
+    std::string name;
+
+    for (auto &dn : listzonedirs(rapldir, "intel-rapl:")) {
+	std::string pname;
+	if (!readfile(dn + "/name", pname)) continue;
+	addzone(dn, pname);
+
+	std::string base = dn.substr(dn.rfind('/') + 1);
+	for (auto &sdn : listzonedirs(dn, base + ":")) {
+	    if (!readfile(sdn + "/name", name)) continue;
+	    addzone(sdn, pname + "/" + name);
+	}
+    }
+
+    if (verbose >= 2) std::cout << "rapl: " << zones.size() << " zones under " << rapldir << std::endl;
+}
+
+IDGRapl::~IDGRapl()
+{
+    for (auto z : zones) {
+	close(z->fd);
+	delete z;
+    }
+}
+
+bool IDGRapl::readenergy(int id, uint64_t &energy_uj, uint64_t &ts_us)
+{
+    IDGRaplZone &z = *zones[id];
+    uint64_t raw;
+
+    std::lock_guard<std::mutex> lock(z.mtx);
+    if (!readval(z.fd, raw)) return false;
+    if (raw >= z.prev_raw_uj)
+	z.energy_uj += raw - z.prev_raw_uj;
+    else if (z.maxrange_uj > z.prev_raw_uj)
+	z.energy_uj += (z.maxrange_uj - z.prev_raw_uj) + raw; // wrapped
+    else
+	z.energy_uj += raw; // no max_energy_range_uj. count from zero
+    z.prev_raw_uj = raw;
+    z.ts_us = gettime_us();
+
+    energy_uj = z.energy_uj;
+    ts_us = z.ts_us;
+    return true;
+}
+
+double IDGRapl::updatepoweravg(int id, uint64_t energy_uj, uint64_t ts_us)
+{
+    IDGRaplZone &z = *zones[id];
+
+    std::lock_guard<std::mutex> lock(z.avgmtx);
+    // another thread may have stored a newer reading. keep its result
+    if (ts_us <= z.avg_ts_us || energy_uj < z.avg_energy_uj) return z.watt;
+    z.watt = (double)(energy_uj - z.avg_energy_uj) / (ts_us - z.avg_ts_us);
+    z.avg_energy_uj = energy_uj;
+    z.avg_ts_us = ts_us;
+    return z.watt;
+}
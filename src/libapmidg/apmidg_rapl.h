@@ -0,0 +1,62 @@
+#ifndef __APMIDG_RAPL_H_DEFINED__
+#define __APMIDG_RAPL_H_DEFINED__
+
+// internal use only
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <mutex>
+
+// The CPU RAPL zones of the node, read through the powercap sysfs
+//
+//   <root>/devices/virtual/powercap/intel-rapl/intel-rapl:N/       package-N or psys
+//   <root>/devices/virtual/powercap/intel-rapl/intel-rapl:N/intel-rapl:N:M/  core, uncore, dram
+//
+// The zones are discovered once and their energy_uj files stay open.
+// The counter wraps at max_energy_range_uj. IDGRapl extends it to a
+// 64-bit counter that starts at the first raw reading, so it never
+// goes backwards while the library is initialized.
+
+struct IDGRaplZone {
+    std::string name;      // e.g., "package-0", "package-0/dram"
+    int fd;                // energy_uj
+    uint64_t maxrange_uj;  // max_energy_range_uj
+
+    // the counter state. the lock is held across the read so that
+    // concurrent readers never see the raw counter go backwards
+    std::mutex mtx;
+    uint64_t prev_raw_uj;
+    uint64_t energy_uj;    // the extended counter
+    uint64_t ts_us;
+
+    // the apmidg_rapl_readpoweravg() state
+    std::mutex avgmtx;
+    uint64_t avg_energy_uj;
+    uint64_t avg_ts_us;
+    double watt;
+};
+
+class IDGRapl {
+    std::vector<IDGRaplZone*> zones;
+    int verbose;
+
+    void addzone(const std::string &dir, const std::string &name);
+
+public:
+    // root is the sysfs mount point. NULL is "/sys"
+    IDGRapl(const char *root, int _ver = 1);
+    ~IDGRapl();
+
+    int getnzones() { return (int)zones.size(); }
+    const char *getzonename(int id) { return zones[id]->name.c_str(); }
+
+    // reads the energy counter of the zone. return false if the read failed
+    bool readenergy(int id, uint64_t &energy_uj, uint64_t &ts_us);
+
+    // the average power since the previous call. the counter reading
+    // is either fresh or taken from the sampler
+    double updatepoweravg(int id, uint64_t energy_uj, uint64_t ts_us);
+};
+
+#endif
@@ -0,0 +1,124 @@
+/*
+  Lock-free containers shared between the sampler thread and readers
+
+  (setq c-basic-offset 4)
+*/
+
+#ifndef __APMIDG_RING_H_DEFINED__
+#define __APMIDG_RING_H_DEFINED__
+
+// internal use only
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+// A single-writer seqlock cell. The writer never waits; readers retry
+// if they race with the writer. T is copied through atomic words so
+// that concurrent read/write is well defined (and TSan-clean).
+template <typename T>
+class APMIDGSeqlock {
+    static_assert(sizeof(T) % sizeof(uint64_t) == 0, "T must be a multiple of 8 bytes");
+    static const int nwords = sizeof(T) / sizeof(uint64_t);
+
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[nwords];
+
+public:
+    APMIDGSeqlock() {
+	seq.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < nwords; i++) words[i].store(0, std::memory_order_relaxed);
+    }
+
+    // tag is any even number identifying this version (e.g., a ring
+    // position). store() leaves the cell at tag+2.
+    void store(const T &v, uint64_t tag) {
+	uint64_t tmp[nwords];
+	memcpy(tmp, &v, sizeof(T));
+
+	// release on each word orders it after the odd seq. on x86
+	// these are plain stores
+	seq.store(tag + 1, std::memory_order_relaxed);
+	for (int i = 0; i < nwords; i++) words[i].store(tmp[i], std::memory_order_release);
+	seq.store(tag + 2, std::memory_order_release);
+    }
+
+    // return the tag seen, or 1 (odd) if the writer was in progress
+    uint64_t load(T &v) const {
+	uint64_t tmp[nwords];
+	uint64_t s1 = seq.load(std::memory_order_acquire);
+	if (s1 & 1) return 1;
+	// a word from a newer store() makes the odd seq visible below
+	for (int i = 0; i < nwords; i++) tmp[i] = words[i].load(std::memory_order_acquire);
+	uint64_t s2 = seq.load(std::memory_order_relaxed);
+	if (s1 != s2) return 1;
+	memcpy(&v, tmp, sizeof(T));
+	return s1;
+    }
+
+    // spin until a consistent copy is obtained
+    void loadlatest(T &v) const {
+	while (load(v) & 1) ;
+    }
+};
+
+
+// A fixed-size single-producer/multi-consumer ring. The producer
+// overwrites the oldest entries and never blocks. Each consumer owns
+// its cursor (the next position to read) and loses entries if it
+// falls behind by more than the capacity.
+template <typename T>
+class APMIDGRing {
+    std::vector<APMIDGSeqlock<T>> slots;
+    uint64_t mask;
+    std::atomic<uint64_t> head; // the next position to be written
+
+    static uint64_t roundup_pow2(uint64_t n) {
+	uint64_t r = 1;
+	while (r < n) r <<= 1;
+	return r;
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    APMIDGRing(uint64_t capacity) : slots(roundup_pow2(capacity)) {
+	mask = slots.size() - 1;
+	head.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t capacity() const { return mask + 1; }
+    uint64_t gethead() const { return head.load(std::memory_order_acquire); }
+
+    // producer only
+    void push(const T &v) {
+	uint64_t pos = head.load(std::memory_order_relaxed);
+	slots[pos & mask].store(v, pos * 2);
+	head.store(pos + 1, std::memory_order_release);
+    }
+
+    // copy up to n entries starting at cursor, which is advanced.
+    // return the number of entries copied.
+    size_t read(uint64_t &cursor, T *out, size_t n) const {
+	size_t cnt = 0;
+
+	while (cnt < n) {
+	    uint64_t h = gethead();
+	    if (cursor >= h) break;
+	    if (h - cursor > capacity()) cursor = h - capacity(); // overrun
+
+	    if (slots[cursor & mask].load(out[cnt]) == cursor * 2 + 2) {
+		cnt++;
+		cursor++;
+	    } else {
+		// overwritten while copying. skip ahead to the oldest
+		// entry that is still valid
+		h = gethead();
+		if (h - cursor >= capacity()) cursor = h - capacity() + 1;
+	    }
+	}
+	return cnt;
+    }
+};
+
+#endif
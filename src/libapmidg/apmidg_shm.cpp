@@ -0,0 +1,283 @@
+/*
+  Shared-memory telemetry segment
+
+  A daemon (apmidgd) owns the IDGPower singleton and periodically
+  publishes apmidg_snapshot() into a POSIX shared-memory segment. Any
+  process on the node can then read power/freq/temp through the
+  apmidg_shm_* reader API (apmidg_shmreader.cpp) without initializing
+  Level Zero. This file intentionally does not include the Level Zero
+  headers.
+
+  Ownership: the publisher holds an flock() on the segment for its
+  lifetime, which the kernel drops if it dies, so a segment whose lock
+  is free has no live publisher. Creating, reclaiming and removing a
+  segment are serialized by an flock() on a companion object,
+  "<name>.lock", so a segment being set up by another publisher is
+  never taken for a stale one. The lock object is left in place.
+
+  (setq c-basic-offset 4)
+*/
+
+#include "libapmidg.h"
+#include "apmidg_shm.h"
+#include "apmidg_stats.h"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <mutex>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define _ERROR_MSG(MSG) {perror((MSG)); printf("errno=%d at %d(%s)\n",errno,__LINE__,__FILE__);}
+
+static uint64_t shm_gettime_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t shm_datawords(int npwr, int nfreq, int ntemp)
+{
+    return 1 + (npwr * sizeof(apmidg_shm_pwr) + nfreq * sizeof(apmidg_shm_freq) +
+		ntemp * sizeof(apmidg_shm_temp)) / sizeof(uint64_t);
+}
+
+
+// publisher side. a process publishes at most one segment
+
+struct apmidg_shm_writer {
+    std::string name;
+    int fd;     // flock()ed while the segment is ours
+    size_t size;
+    apmidg_shm_hdr *hdr;
+    uint64_t *data;
+
+    // preallocated snapshot arrays and a staging area
+    apmidg_snapshot_t snap;
+    std::vector<int> pwr_devid, pwr_id, freq_devid, freq_id, temp_devid, temp_id;
+    std::vector<uint64_t> energy_uj, ts_us;
+    std::vector<double> power_W, freq_actual_MHz, freq_min_MHz, freq_max_MHz, temp_C;
+    std::vector<uint64_t> staging;
+
+    // the seqlock has a single writer. serialize concurrent publishers
+    std::mutex mtx;
+};
+
+static apmidg_shm_writer *shm_writer = NULL;
+
+// take the lock that serializes creating, reclaiming and removing the
+// segment. return the fd to close, which releases it, or -1
+static int shm_lockname(const std::string &name)
+{
+    std::string lname = name + ".lock";
+    int lfd = shm_open(lname.c_str(), O_CREAT | O_RDWR, 0644);
+    if (lfd < 0) {
+	_ERROR_MSG("shm_open");
+	return -1;
+    }
+    if (flock(lfd, LOCK_EX) != 0) {
+	_ERROR_MSG("flock");
+	close(lfd);
+	return -1;
+    }
+    return lfd;
+}
+
+// the caller holds the name lock
+static int shm_createlocked(const char *name)
+{
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST) {
+	// reclaim a segment whose publisher is gone, i.e., whose lock
+	// is free. nobody else creates it while we hold the name lock
+	int oldfd = shm_open(name, O_RDONLY, 0);
+	if (oldfd >= 0) {
+	    if (flock(oldfd, LOCK_EX | LOCK_NB) != 0) {
+		apmidg_shm_hdr tmp = {};
+		if (pread(oldfd, &tmp, sizeof(tmp), 0) != sizeof(tmp)) tmp.writer_pid = -1;
+		std::cout << "Error: apmidg_shm_create: " << name << " is owned by pid " << tmp.writer_pid << std::endl;
+		close(oldfd);
+		return -1;
+	    }
+	    close(oldfd);
+	}
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0) {
+	_ERROR_MSG("shm_open");
+	return -1;
+    }
+    // a new object, so the lock is free
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+	_ERROR_MSG("flock");
+	close(fd);
+	shm_unlink(name);
+	return -1;
+    }
+    return fd;
+}
+
+EXTERNC int apmidg_shm_create(const char *name, int period_us)
+{
+    APMIDG_STATS_CALL();
+    int npwr, nfreq, ntemp;
+
+    if (shm_writer) {
+	std::cout << "Warning: apmidg_shm_create: the segment is already created" << std::endl;
+	return -1;
+    }
+    if (apmidg_getsnapshotsize(&npwr, &nfreq, &ntemp) != 0) {
+	std::cout << "Error: apmidg_shm_create: apmidg is not initialized" << std::endl;
+	return -1;
+    }
+    if (!name) name = APMIDG_SHM_DEFNAME;
+
+    int lfd = shm_lockname(name);
+    if (lfd < 0) return -1;
+    int fd = shm_createlocked(name);
+    if (fd < 0) {
+	close(lfd);
+	return -1;
+    }
+
+    size_t datawords = shm_datawords(npwr, nfreq, ntemp);
+    size_t size = sizeof(apmidg_shm_hdr) + datawords * sizeof(uint64_t);
+    if (ftruncate(fd, size) != 0) {
+	_ERROR_MSG("ftruncate");
+	shm_unlink(name);
+	close(fd);
+	close(lfd);
+	return -1;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+	_ERROR_MSG("mmap");
+	shm_unlink(name);
+	close(fd);
+	close(lfd);
+	return -1;
+    }
+
+    apmidg_shm_writer *w = new apmidg_shm_writer;
+    w->name = name;
+    w->fd = fd;
+    w->size = size;
+    w->hdr = (apmidg_shm_hdr *)p;
+    w->data = (uint64_t *)((char *)p + sizeof(apmidg_shm_hdr));
+
+    w->pwr_devid.resize(npwr); w->pwr_id.resize(npwr);
+    w->energy_uj.resize(npwr); w->ts_us.resize(npwr); w->power_W.resize(npwr);
+    w->freq_devid.resize(nfreq); w->freq_id.resize(nfreq);
+    w->freq_actual_MHz.resize(nfreq); w->freq_min_MHz.resize(nfreq); w->freq_max_MHz.resize(nfreq);
+    w->temp_devid.resize(ntemp); w->temp_id.resize(ntemp); w->temp_C.resize(ntemp);
+    w->staging.resize(datawords);
+
+    apmidg_snapshot_t &s = w->snap;
+    s.npwr = npwr;
+    s.pwr_devid = w->pwr_devid.data(); s.pwr_id = w->pwr_id.data();
+    s.energy_uj = w->energy_uj.data(); s.ts_us = w->ts_us.data(); s.power_W = w->power_W.data();
+    s.nfreq = nfreq;
+    s.freq_devid = w->freq_devid.data(); s.freq_id = w->freq_id.data();
+    s.freq_actual_MHz = w->freq_actual_MHz.data();
+    s.freq_min_MHz = w->freq_min_MHz.data(); s.freq_max_MHz = w->freq_max_MHz.data();
+    s.ntemp = ntemp;
+    s.temp_devid = w->temp_devid.data(); s.temp_id = w->temp_id.data(); s.temp_C = w->temp_C.data();
+
+    apmidg_shm_hdr *h = w->hdr;
+    h->version = APMIDG_SHM_VERSION;
+    h->hdrsize = sizeof(apmidg_shm_hdr);
+    h->ndevs = apmidg_getndevs();
+    h->npwr = npwr;
+    h->nfreq = nfreq;
+    h->ntemp = ntemp;
+    h->datawords = datawords;
+    h->period_us = period_us > 0 ? period_us : 0;
+    h->writer_pid = getpid();
+    __atomic_store_n(&h->seq, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->nupdates, 0, __ATOMIC_RELAXED);
+    // readers check the magic last
+    __atomic_store_n(&h->magic, APMIDG_SHM_MAGIC, __ATOMIC_RELEASE);
+    close(lfd);
+
+    shm_writer = w;
+    return 0;
+}
+
+EXTERNC int apmidg_shm_publish()
+{
+    APMIDG_STATS_CALL();
+    apmidg_shm_writer *w = shm_writer;
+    if (!w) return -1;
+
+    std::lock_guard<std::mutex> lock(w->mtx);
+    apmidg_snapshot_t &s = w->snap;
+    s.npwr = w->pwr_id.size();
+    s.nfreq = w->freq_id.size();
+    s.ntemp = w->temp_id.size();
+    if (apmidg_snapshot(&s) != 0) return -1;
+
+    // pack outside the critical section
+    uint64_t *st = w->staging.data();
+    st[0] = shm_gettime_us();
+    apmidg_shm_pwr *pr = (apmidg_shm_pwr *)(st + 1);
+    for (int i = 0; i < s.npwr; i++) {
+	pr[i].devid = s.pwr_devid[i];
+	pr[i].id = s.pwr_id[i];
+	pr[i].energy_uj = s.energy_uj[i];
+	pr[i].ts_us = s.ts_us[i];
+	pr[i].power_W = s.power_W[i];
+    }
+    apmidg_shm_freq *fr = (apmidg_shm_freq *)(pr + s.npwr);
+    for (int i = 0; i < s.nfreq; i++) {
+	fr[i].devid = s.freq_devid[i];
+	fr[i].id = s.freq_id[i];
+	fr[i].actual_MHz = s.freq_actual_MHz[i];
+	fr[i].min_MHz = s.freq_min_MHz[i];
+	fr[i].max_MHz = s.freq_max_MHz[i];
+    }
+    apmidg_shm_temp *tr = (apmidg_shm_temp *)(fr + s.nfreq);
+    for (int i = 0; i < s.ntemp; i++) {
+	tr[i].devid = s.temp_devid[i];
+	tr[i].id = s.temp_id[i];
+	tr[i].temp_C = s.temp_C[i];
+    }
+
+    // seqlock write
+    apmidg_shm_hdr *h = w->hdr;
+    uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < w->staging.size(); i++)
+	__atomic_store_n(&w->data[i], st[i], __ATOMIC_RELEASE);
+    __atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&h->nupdates, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+EXTERNC void apmidg_shm_destroy()
+{
+    APMIDG_STATS_CALL();
+    apmidg_shm_writer *w = shm_writer;
+    if (!w) return;
+
+    // unlink before the ownership lock is dropped, or a new publisher
+    // could reclaim the name and lose its segment to our unlink
+    int lfd = shm_lockname(w->name);
+    munmap(w->hdr, w->size);
+    shm_unlink(w->name.c_str());
+    close(w->fd);
+    if (lfd >= 0) close(lfd);
+    delete w;
+    shm_writer = NULL;
+}
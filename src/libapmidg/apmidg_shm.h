@@ -0,0 +1,60 @@
+#ifndef __APMIDG_SHM_H_DEFINED__
+#define __APMIDG_SHM_H_DEFINED__
+
+// internal use only
+
+#include <stdint.h>
+
+// Layout of the shared telemetry segment published by apmidgd.
+//
+// The segment starts with apmidg_shm_hdr, followed by 'datawords'
+// 64-bit words protected by the seqlock 'seq'. The data region is
+//   update_ts_us
+//   npwr  x apmidg_shm_pwr
+//   nfreq x apmidg_shm_freq
+//   ntemp x apmidg_shm_temp
+// Only the publisher writes; readers retry while seq is odd or changes
+// during the copy. The topology fields are written once at creation.
+
+#define APMIDG_SHM_MAGIC   (0x48534744494d5041ULL) // "APMIDGSH"
+#define APMIDG_SHM_VERSION (1)
+#define APMIDG_SHM_DEFNAME "/apmidg"
+
+struct apmidg_shm_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hdrsize;
+    uint32_t ndevs;
+    uint32_t npwr;
+    uint32_t nfreq;
+    uint32_t ntemp;
+    uint32_t datawords;
+    uint32_t period_us;  // the publisher's interval, informational
+    int64_t  writer_pid;
+    uint64_t seq;        // seqlock, accessed atomically
+    uint64_t nupdates;   // accessed atomically
+};
+
+struct apmidg_shm_pwr {
+    int32_t  devid;
+    int32_t  id;
+    uint64_t energy_uj;
+    uint64_t ts_us;
+    double   power_W;
+};
+
+struct apmidg_shm_freq {
+    int32_t devid;
+    int32_t id;
+    double  actual_MHz;
+    double  min_MHz;
+    double  max_MHz;
+};
+
+struct apmidg_shm_temp {
+    int32_t devid;
+    int32_t id;
+    double  temp_C;
+};
+
+#endif
@@ -0,0 +1,152 @@
+/*
+  Shared-memory telemetry segment, the reader side
+
+  Built into its own library, libapmidg_shm, which does not link Level
+  Zero or libapmidg, so a process that only reads the telemetry
+  published by apmidgd loads neither. libapmidg links it, so the
+  reader functions are also available through libapmidg. The calls
+  are not counted by APMIDG_STATS.
+
+  (setq c-basic-offset 4)
+*/
+
+#include "libapmidg.h"
+#include "apmidg_shm.h"
+
+#include <iostream>
+#include <vector>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct apmidg_shm {
+    int fd;
+    size_t size;
+    const apmidg_shm_hdr *hdr;
+    const uint64_t *data;
+    std::vector<uint64_t> copy;
+};
+
+EXTERNC apmidg_shm_t *apmidg_shm_attach(const char *name)
+{
+    if (!name) name = APMIDG_SHM_DEFNAME;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(apmidg_shm_hdr)) {
+	close(fd);
+	return NULL;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+	close(fd);
+	return NULL;
+    }
+
+    const apmidg_shm_hdr *h = (const apmidg_shm_hdr *)p;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != APMIDG_SHM_MAGIC ||
+	h->version != APMIDG_SHM_VERSION || h->hdrsize != sizeof(apmidg_shm_hdr) ||
+	sizeof(apmidg_shm_hdr) + h->datawords * sizeof(uint64_t) > (size_t)st.st_size) {
+	std::cout << "Warning: apmidg_shm_attach: " << name << " is not a compatible segment" << std::endl;
+	munmap(p, st.st_size);
+	close(fd);
+	return NULL;
+    }
+
+    apmidg_shm_t *shm = new apmidg_shm_t;
+    shm->fd = fd;
+    shm->size = st.st_size;
+    shm->hdr = h;
+    shm->data = (const uint64_t *)((const char *)p + sizeof(apmidg_shm_hdr));
+    shm->copy.resize(h->datawords);
+    return shm;
+}
+
+EXTERNC void apmidg_shm_detach(apmidg_shm_t *shm)
+{
+    if (!shm) return;
+    munmap((void *)shm->hdr, shm->size);
+    close(shm->fd);
+    delete shm;
+}
+
+EXTERNC int apmidg_shm_getsnapshotsize(apmidg_shm_t *shm, int *npwr, int *nfreq, int *ntemp)
+{
+    if (npwr) *npwr = 0;
+    if (nfreq) *nfreq = 0;
+    if (ntemp) *ntemp = 0;
+    if (!shm) return -1;
+
+    if (npwr) *npwr = shm->hdr->npwr;
+    if (nfreq) *nfreq = shm->hdr->nfreq;
+    if (ntemp) *ntemp = shm->hdr->ntemp;
+    return 0;
+}
+
+EXTERNC int apmidg_shm_getndevs(apmidg_shm_t *shm)
+{
+    if (!shm) return -1;
+    return shm->hdr->ndevs;
+}
+
+EXTERNC int apmidg_shm_read(apmidg_shm_t *shm, apmidg_snapshot_t *snap, uint64_t *update_ts_us)
+{
+    if (update_ts_us) *update_ts_us = 0;
+    if (!shm || !snap) return -1;
+
+    const apmidg_shm_hdr *h = shm->hdr;
+    if ((uint32_t)snap->npwr < h->npwr || (uint32_t)snap->nfreq < h->nfreq ||
+	(uint32_t)snap->ntemp < h->ntemp) return -1;
+
+    // seqlock read. the publisher holds it for a few microseconds, so
+    // bound the retries in case it died in the middle of an update
+    uint64_t *cp = shm->copy.data();
+    bool ok = false;
+    for (int retry = 0; retry < 10000 && !ok; retry++) {
+	uint64_t s1 = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+	if (s1 == 0) return -1; // nothing published yet
+	if (s1 & 1) {
+	    if (retry > 100) sched_yield();
+	    continue;
+	}
+	for (size_t i = 0; i < shm->copy.size(); i++)
+	    cp[i] = __atomic_load_n(&shm->data[i], __ATOMIC_ACQUIRE);
+	ok = (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == s1);
+    }
+    if (!ok) return -1;
+
+    if (update_ts_us) *update_ts_us = cp[0];
+    const apmidg_shm_pwr *pr = (const apmidg_shm_pwr *)(cp + 1);
+    for (uint32_t i = 0; i < h->npwr; i++) {
+	if (snap->pwr_devid) snap->pwr_devid[i] = pr[i].devid;
+	if (snap->pwr_id) snap->pwr_id[i] = pr[i].id;
+	if (snap->energy_uj) snap->energy_uj[i] = pr[i].energy_uj;
+	if (snap->ts_us) snap->ts_us[i] = pr[i].ts_us;
+	if (snap->power_W) snap->power_W[i] = pr[i].power_W;
+    }
+    const apmidg_shm_freq *fr = (const apmidg_shm_freq *)(pr + h->npwr);
+    for (uint32_t i = 0; i < h->nfreq; i++) {
+	if (snap->freq_devid) snap->freq_devid[i] = fr[i].devid;
+	if (snap->freq_id) snap->freq_id[i] = fr[i].id;
+	if (snap->freq_actual_MHz) snap->freq_actual_MHz[i] = fr[i].actual_MHz;
+	if (snap->freq_min_MHz) snap->freq_min_MHz[i] = fr[i].min_MHz;
+	if (snap->freq_max_MHz) snap->freq_max_MHz[i] = fr[i].max_MHz;
+    }
+    const apmidg_shm_temp *tr = (const apmidg_shm_temp *)(fr + h->nfreq);
+    for (uint32_t i = 0; i < h->ntemp; i++) {
+	if (snap->temp_devid) snap->temp_devid[i] = tr[i].devid;
+	if (snap->temp_id) snap->temp_id[i] = tr[i].id;
+	if (snap->temp_C) snap->temp_C[i] = tr[i].temp_C;
+    }
+    snap->npwr = h->npwr;
+    snap->nfreq = h->nfreq;
+    snap->ntemp = h->ntemp;
+
+    return 0;
+}
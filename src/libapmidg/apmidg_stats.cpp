@@ -0,0 +1,431 @@
+/*
+  Call counters and latency histograms: the entry points of libapmidg
+  and the Level Zero calls underneath, with the failures by
+  ze_result_t. See apmidg_stats.h and apmidg_stats_get()
+
+  (setq c-basic-offset 4)
+*/
+
+#include "libapmidg.h"
+#include "apmidg_stats.h"
+#include "apmidg_backend.h"
+#include "apmidg_zmacrostr.h"
+
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// the backend calls, in the order of struct apmidg_backend:
+// X(name, params, args)
+#define STATS_ZES_CALLS(X)						\
+    X(zeInit, (ze_init_flags_t flags), (flags))				\
+    X(zeDriverGet, (uint32_t *pCount, ze_driver_handle_t *phDrivers), (pCount, phDrivers)) \
+    X(zeDriverGetProperties, (ze_driver_handle_t hDriver, ze_driver_properties_t *pProps), (hDriver, pProps)) \
+    X(zeDeviceGet, (ze_driver_handle_t hDriver, uint32_t *pCount, ze_device_handle_t *phDevices), (hDriver, pCount, phDevices)) \
+    X(zeDeviceGetProperties, (ze_device_handle_t hDevice, ze_device_properties_t *pProps), (hDevice, pProps)) \
+    X(zesDeviceEnumPowerDomains, (zes_device_handle_t hDevice, uint32_t *pCount, zes_pwr_handle_t *phPower), (hDevice, pCount, phPower)) \
+    X(zesDeviceEnumFrequencyDomains, (zes_device_handle_t hDevice, uint32_t *pCount, zes_freq_handle_t *phFrequency), (hDevice, pCount, phFrequency)) \
+    X(zesDeviceEnumTemperatureSensors, (zes_device_handle_t hDevice, uint32_t *pCount, zes_temp_handle_t *phTemperature), (hDevice, pCount, phTemperature)) \
+    X(zesDevicePciGetProperties, (zes_device_handle_t hDevice, zes_pci_properties_t *pProperties), (hDevice, pProperties)) \
+    X(zesPowerGetProperties, (zes_pwr_handle_t hPower, zes_power_properties_t *pProps), (hPower, pProps)) \
+    X(zesPowerGetEnergyCounter, (zes_pwr_handle_t hPower, zes_power_energy_counter_t *pEnergy), (hPower, pEnergy)) \
+    X(zesPowerGetLimitsExt, (zes_pwr_handle_t hPower, uint32_t *pCount, zes_power_limit_ext_desc_t *pSustained), (hPower, pCount, pSustained)) \
+    X(zesPowerSetLimitsExt, (zes_pwr_handle_t hPower, uint32_t *pCount, zes_power_limit_ext_desc_t *pSustained), (hPower, pCount, pSustained)) \
+    X(zesFrequencyGetProperties, (zes_freq_handle_t hFrequency, zes_freq_properties_t *pProperties), (hFrequency, pProperties)) \
+    X(zesFrequencyGetRange, (zes_freq_handle_t hFrequency, zes_freq_range_t *pLimits), (hFrequency, pLimits)) \
+    X(zesFrequencySetRange, (zes_freq_handle_t hFrequency, const zes_freq_range_t *pLimits), (hFrequency, pLimits)) \
+    X(zesFrequencyGetState, (zes_freq_handle_t hFrequency, zes_freq_state_t *pState), (hFrequency, pState)) \
+    X(zesTemperatureGetProperties, (zes_temp_handle_t hTemperature, zes_temp_properties_t *pProperties), (hTemperature, pProperties)) \
+    X(zesTemperatureGetState, (zes_temp_handle_t hTemperature, double *pTemperature), (hTemperature, pTemperature)) \
+    X(zesTemperatureGetConfig, (zes_temp_handle_t hTemperature, zes_temp_config_t *pConfig), (hTemperature, pConfig)) \
+    X(zesTemperatureSetConfig, (zes_temp_handle_t hTemperature, const zes_temp_config_t *pConfig), (hTemperature, pConfig)) \
+    X(zesDeviceEventRegister, (zes_device_handle_t hDevice, zes_event_type_flags_t events), (hDevice, events)) \
+    X(zesDriverEventListen, (ze_driver_handle_t hDriver, uint32_t timeout, uint32_t count, zes_device_handle_t *phDevices, uint32_t *pNumDeviceEvents, zes_event_type_flags_t *pEvents), (hDriver, timeout, count, phDevices, pNumDeviceEvents, pEvents))
+
+#define STATS_ENUM(N, P, A) STATS_##N,
+#define STATS_NAME(N, P, A) #N,
+
+enum { STATS_ZES_CALLS(STATS_ENUM) STATS_NZES };
+static const char *stats_zesnames[STATS_NZES] = { STATS_ZES_CALLS(STATS_NAME) };
+
+#define STATS_MAXAPIS   (128)
+#define STATS_NERRSLOTS (16)  // distinct (call, result) pairs per thread
+
+struct IDGStatsZes {
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> hist[APMIDG_STATS_NBUCKETS];
+};
+
+struct IDGStatsErr {
+    std::atomic<uint64_t> key; // (call + 1) << 32 | result. 0 if unused
+    std::atomic<uint64_t> count;
+};
+
+// the counters of a thread. only the owner writes them, with a load
+// and a store, so a reset does not zero them but saves them in base,
+// which apmidg_stats_get() subtracts. a block is never freed; a thread
+// that exits hands it over to the next new thread, so the totals stay
+// correct
+struct IDGStatsThread {
+    std::atomic<bool> inuse;
+    std::atomic<uint64_t> apicalls[STATS_MAXAPIS];
+    IDGStatsZes zes[STATS_NZES];
+    IDGStatsErr errs[STATS_NERRSLOTS];
+    std::atomic<uint64_t> lost_errors; // no free slot in errs
+    IDGStatsThread *base; // the counters at the last reset. NULL if none
+};
+
+static std::mutex stats_mtx; // guards stats_threads and the registration
+static std::vector<IDGStatsThread*> stats_threads;
+static const char *stats_apinames[STATS_MAXAPIS];
+static std::atomic<int> stats_napis(0);
+
+template <typename T>
+static inline void addrelaxed(std::atomic<T> &a, T v)
+{
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+static inline uint64_t gettime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// hist[i] counts [2^i, 2^(i+1)) nsec. the last bucket takes the rest
+static inline int bucketof(uint64_t ns)
+{
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+    return b < APMIDG_STATS_NBUCKETS ? b : APMIDG_STATS_NBUCKETS - 1;
+}
+
+struct IDGStatsHolder {
+    IDGStatsThread *t;
+    ~IDGStatsHolder() {
+	if (t) t->inuse.store(false, std::memory_order_release);
+    }
+};
+
+static IDGStatsThread *claimthread()
+{
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    for (auto t : stats_threads) {
+	if (!t->inuse.load(std::memory_order_acquire)) {
+	    t->inuse.store(true, std::memory_order_relaxed);
+	    return t;
+	}
+    }
+    IDGStatsThread *t = new IDGStatsThread();
+    t->inuse.store(true, std::memory_order_relaxed);
+    stats_threads.push_back(t);
+    return t;
+}
+
+static inline IDGStatsThread &getthread()
+{
+    static thread_local IDGStatsHolder h = {NULL};
+    if (!h.t) h.t = claimthread();
+    return *h.t;
+}
+
+// the entry points the thread is in
+static thread_local int stats_depth = 0;
+
+int apmidg_stats_apiid(const char *name)
+{
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    int n = stats_napis.load(std::memory_order_relaxed);
+    for (int i = 0; i < n; i++)
+	if (strcmp(stats_apinames[i], name) == 0) return i;
+    if (n >= STATS_MAXAPIS) return -1;
+    stats_apinames[n] = name;
+    stats_napis.store(n + 1, std::memory_order_release);
+    return n;
+}
+
+void apmidg_stats_enter(int id)
+{
+    if (stats_depth++ > 0 || id < 0) return;
+    addrelaxed<uint64_t>(getthread().apicalls[id], 1);
+}
+
+void apmidg_stats_exit()
+{
+    stats_depth--;
+}
+
+static void counterror(IDGStatsThread &t, int call, ze_result_t res)
+{
+    uint64_t key = ((uint64_t)(call + 1) << 32) | (uint32_t)res;
+    for (auto &e : t.errs) {
+	uint64_t k = e.key.load(std::memory_order_relaxed);
+	if (k == key) {
+	    addrelaxed<uint64_t>(e.count, 1);
+	    return;
+	}
+	if (k == 0) {
+	    e.count.store(1, std::memory_order_relaxed);
+	    e.key.store(key, std::memory_order_release);
+	    return;
+	}
+    }
+    addrelaxed<uint64_t>(t.lost_errors, 1);
+}
+
+static inline void record(int call, uint64_t ns, ze_result_t res)
+{
+    IDGStatsThread &t = getthread();
+    IDGStatsZes &z = t.zes[call];
+
+    addrelaxed<uint64_t>(z.calls, 1);
+    addrelaxed<uint64_t>(z.total_ns, ns);
+    if (ns > z.max_ns.load(std::memory_order_relaxed)) z.max_ns.store(ns, std::memory_order_relaxed);
+    addrelaxed<uint64_t>(z.hist[bucketof(ns)], 1);
+    if (res != ZE_RESULT_SUCCESS) {
+	addrelaxed<uint64_t>(z.errors, 1);
+	counterror(t, call, res);
+    }
+}
+
+
+// the stats backend: times every call of the base backend
+
+static const apmidg_backend *stats_base = NULL;
+static apmidg_backend statsbackend;
+
+#define STATS_WRAP(N, P, A)						\
+    static ze_result_t ZE_APICALL stats_##N P {				\
+	uint64_t t0 = gettime_ns();					\
+	ze_result_t res = stats_base->N A;				\
+	record(STATS_##N, gettime_ns() - t0, res);			\
+	return res;							\
+    }
+
+STATS_ZES_CALLS(STATS_WRAP)
+
+static void stats_fini()
+{
+    if (stats_base && stats_base->fini) stats_base->fini();
+    stats_base = NULL;
+}
+
+const apmidg_backend *apmidg_backend_stats(const apmidg_backend *base)
+{
+    if (!base) return NULL;
+
+    stats_base = base;
+    apmidg_backend *be = &statsbackend;
+    be->name = base->name;
+#define STATS_SET(N, P, A) be->N = stats_##N;
+    STATS_ZES_CALLS(STATS_SET)
+    be->fini = stats_fini;
+
+    return be;
+}
+
+
+// the C API
+
+// a counter since the last reset of its block. b is the counter in
+// the base, or NULL
+static inline uint64_t sincereset(const std::atomic<uint64_t> &v, const std::atomic<uint64_t> *b)
+{
+    return v.load(std::memory_order_relaxed) - (b ? b->load(std::memory_order_relaxed) : 0);
+}
+
+#define BASEOF(t, field) ((t)->base ? &(t)->base->field : NULL)
+
+// sum the blocks of all threads into one. called with stats_mtx held
+static void sumthreads(IDGStatsThread &sum, std::vector<std::pair<uint64_t, uint64_t>> &errs)
+{
+    for (auto t : stats_threads) {
+	for (int i = 0; i < STATS_MAXAPIS; i++)
+	    addrelaxed<uint64_t>(sum.apicalls[i], sincereset(t->apicalls[i], BASEOF(t, apicalls[i])));
+	for (int i = 0; i < STATS_NZES; i++) {
+	    IDGStatsZes &s = sum.zes[i], &z = t->zes[i];
+	    addrelaxed<uint64_t>(s.calls, sincereset(z.calls, BASEOF(t, zes[i].calls)));
+	    addrelaxed<uint64_t>(s.errors, sincereset(z.errors, BASEOF(t, zes[i].errors)));
+	    addrelaxed<uint64_t>(s.total_ns, sincereset(z.total_ns, BASEOF(t, zes[i].total_ns)));
+	    s.max_ns.store(std::max(s.max_ns.load(std::memory_order_relaxed), z.max_ns.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+	    for (int b = 0; b < APMIDG_STATS_NBUCKETS; b++)
+		addrelaxed<uint64_t>(s.hist[b], sincereset(z.hist[b], BASEOF(t, zes[i].hist[b])));
+	}
+	for (int i = 0; i < STATS_NERRSLOTS; i++) {
+	    IDGStatsErr &e = t->errs[i];
+	    uint64_t key = e.key.load(std::memory_order_acquire);
+	    if (key == 0) break;
+	    // a slot filled after the reset has 0 in the base
+	    uint64_t count = sincereset(e.count, BASEOF(t, errs[i].count));
+	    auto it = std::find_if(errs.begin(), errs.end(), [key](const std::pair<uint64_t, uint64_t> &p) { return p.first == key; });
+	    if (it == errs.end())
+		errs.push_back({key, count});
+	    else
+		it->second += count;
+	}
+	addrelaxed<uint64_t>(sum.lost_errors, sincereset(t->lost_errors, BASEOF(t, lost_errors)));
+    }
+    std::sort(errs.begin(), errs.end());
+}
+
+EXTERNC int apmidg_stats_get(apmidg_stats_t *st, int n)
+{
+    IDGStatsThread *sum = new IDGStatsThread();
+    std::vector<std::pair<uint64_t, uint64_t>> errs;
+    int napis = stats_napis.load(std::memory_order_acquire);
+    int count = 0;
+
+    {
+	std::lock_guard<std::mutex> lock(stats_mtx);
+	sumthreads(*sum, errs);
+    }
+
+    for (int i = 0; i < napis; i++) {
+	uint64_t calls = sum->apicalls[i].load(std::memory_order_relaxed);
+	if (calls == 0) continue;
+	if (st && count < n) {
+	    apmidg_stats_t &e = st[count];
+	    memset(&e, 0, sizeof(e));
+	    e.kind = APMIDG_STATS_API;
+	    e.name = stats_apinames[i];
+	    e.calls = calls;
+	}
+	count++;
+    }
+    for (int i = 0; i < STATS_NZES; i++) {
+	IDGStatsZes &z = sum->zes[i];
+	if (z.calls.load(std::memory_order_relaxed) == 0) continue;
+	if (st && count < n) {
+	    apmidg_stats_t &e = st[count];
+	    memset(&e, 0, sizeof(e));
+	    e.kind = APMIDG_STATS_ZES;
+	    e.name = stats_zesnames[i];
+	    e.calls = z.calls.load(std::memory_order_relaxed);
+	    e.errors = z.errors.load(std::memory_order_relaxed);
+	    e.total_ns = z.total_ns.load(std::memory_order_relaxed);
+	    e.max_ns = z.max_ns.load(std::memory_order_relaxed);
+	    for (int b = 0; b < APMIDG_STATS_NBUCKETS; b++)
+		e.hist[b] = z.hist[b].load(std::memory_order_relaxed);
+	}
+	count++;
+    }
+    for (auto &p : errs) {
+	if (p.second == 0) continue; // reset
+	if (st && count < n) {
+	    apmidg_stats_t &e = st[count];
+	    memset(&e, 0, sizeof(e));
+	    e.kind = APMIDG_STATS_ERR;
+	    e.name = stats_zesnames[(p.first >> 32) - 1];
+	    e.result = (int32_t)(uint32_t)p.first;
+	    e.result_str = str_ze_result_t(e.result);
+	    e.calls = p.second;
+	}
+	count++;
+    }
+    uint64_t lost = sum->lost_errors.load(std::memory_order_relaxed);
+    if (lost > 0 && st && count < n) {
+	// the failures beyond the per-thread slots, as one entry
+	apmidg_stats_t &e = st[count];
+	memset(&e, 0, sizeof(e));
+	e.kind = APMIDG_STATS_ERR;
+	e.name = "other";
+	e.result_str = "other";
+	e.calls = lost;
+    }
+    if (lost > 0) count++;
+
+    delete sum;
+    return count;
+}
+
+// the upper bound of the bucket that holds the q-quantile, but not
+// above the max, in usec
+static double histquantile(const apmidg_stats_t &e, double q)
+{
+    uint64_t rank = (uint64_t)(q * e.calls), acc = 0;
+    for (int b = 0; b < APMIDG_STATS_NBUCKETS; b++) {
+	acc += e.hist[b];
+	if (acc > rank) return std::min((double)(1ULL << (b + 1)), (double)e.max_ns) * 1e-3;
+    }
+    return e.max_ns * 1e-3;
+}
+
+EXTERNC void apmidg_stats_dump()
+{
+    int n = apmidg_stats_get(NULL, 0);
+    std::vector<apmidg_stats_t> st(n);
+    n = std::min(n, apmidg_stats_get(st.data(), n));
+    char buf[160];
+
+    std::cout << "apmidg stats (all threads)" << std::endl;
+    snprintf(buf, sizeof(buf), "%-32s %12s", "entry point", "calls");
+    std::cout << buf << std::endl;
+    for (int i = 0; i < n; i++) {
+	if (st[i].kind != APMIDG_STATS_API) continue;
+	snprintf(buf, sizeof(buf), "%-32s %12lu", st[i].name, (unsigned long)st[i].calls);
+	std::cout << buf << std::endl;
+    }
+
+    snprintf(buf, sizeof(buf), "%-32s %12s %8s %10s %10s %10s %10s",
+	     "Level Zero call", "calls", "errors", "avg_us", "p50_us", "p99_us", "max_us");
+    std::cout << buf << std::endl;
+    for (int i = 0; i < n; i++) {
+	if (st[i].kind != APMIDG_STATS_ZES) continue;
+	snprintf(buf, sizeof(buf), "%-32s %12lu %8lu %10.3f %10.3f %10.3f %10.3f",
+		 st[i].name, (unsigned long)st[i].calls, (unsigned long)st[i].errors,
+		 st[i].total_ns * 1e-3 / st[i].calls,
+		 histquantile(st[i], 0.50),
+		 histquantile(st[i], 0.99),
+		 st[i].max_ns * 1e-3);
+	std::cout << buf << std::endl;
+    }
+
+    bool header = false;
+    for (int i = 0; i < n; i++) {
+	if (st[i].kind != APMIDG_STATS_ERR) continue;
+	if (!header) {
+	    snprintf(buf, sizeof(buf), "%-32s %-40s %8s", "failed call", "result", "count");
+	    std::cout << buf << std::endl;
+	    header = true;
+	}
+	snprintf(buf, sizeof(buf), "%-32s %-40s %8lu", st[i].name, st[i].result_str, (unsigned long)st[i].calls);
+	std::cout << buf << std::endl;
+    }
+}
+
+// save the counters of every block as its base. zeroing them would
+// race with the owner's load and store, which could write back the
+// old count. only max_ns is zeroed, which at worst keeps the max of a
+// call in flight
+EXTERNC void apmidg_stats_reset()
+{
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    for (auto t : stats_threads) {
+	if (!t->base) t->base = new IDGStatsThread();
+	IDGStatsThread &b = *t->base;
+	for (int i = 0; i < STATS_MAXAPIS; i++)
+	    b.apicalls[i].store(t->apicalls[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	for (int i = 0; i < STATS_NZES; i++) {
+	    IDGStatsZes &s = b.zes[i], &z = t->zes[i];
+	    s.calls.store(z.calls.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	    s.errors.store(z.errors.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	    s.total_ns.store(z.total_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	    z.max_ns.store(0, std::memory_order_relaxed);
+	    for (int h = 0; h < APMIDG_STATS_NBUCKETS; h++)
+		s.hist[h].store(z.hist[h].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	for (int i = 0; i < STATS_NERRSLOTS; i++)
+	    b.errs[i].count.store(t->errs[i].count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	b.lost_errors.store(t->lost_errors.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __APMIDG_STATS_H_DEFINED__
+#define __APMIDG_STATS_H_DEFINED__
+
+// internal use only
+
+#include <stdint.h>
+
+// The always-on instrumentation behind apmidg_stats_get(). Each
+// thread counts into its own block, so the hot path is a few relaxed
+// stores without a shared cache line. The Level Zero calls are timed
+// by the stats backend that wraps the selected backend (see
+// apmidg_backend_stats()).
+
+// return the id of an entry point, registering it on the first call
+int apmidg_stats_apiid(const char *name);
+
+// enter and exit an entry point. the call is counted only if it is
+// the outermost one on the thread, so a public function that calls
+// another one (e.g., apmidg_init() -> apmidg_init_select()) counts once
+void apmidg_stats_enter(int id);
+void apmidg_stats_exit();
+
+class APMIDGStatsScope {
+public:
+    explicit APMIDGStatsScope(int id) { apmidg_stats_enter(id); }
+    ~APMIDGStatsScope() { apmidg_stats_exit(); }
+
+    APMIDGStatsScope(const APMIDGStatsScope&) = delete;
+    APMIDGStatsScope& operator=(const APMIDGStatsScope&) = delete;
+};
+
+// put at the top of a public function. the id is looked up once
+#define APMIDG_STATS_CALL()						\
+    static const int _apmidg_stats_id = apmidg_stats_apiid(__func__);	\
+    APMIDGStatsScope _apmidg_stats_scope(_apmidg_stats_id)
+
+#endif
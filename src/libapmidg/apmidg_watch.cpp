@@ -0,0 +1,174 @@
+/*
+  Threshold watches with hysteresis and debounce, and the thread that
+  delivers their callbacks. See apmidg_watch.h and apmidg_watch()
+
+  (setq c-basic-offset 4)
+*/
+
+#include "apmidg_watch.h"
+
+#include <iostream>
+
+IDGWatch::IDGWatch(int ndoms)
+    : bydom(ndoms), ndom(new std::atomic<int>[ndoms]()), nextid(0),
+      delivering(-1), ndropped(0), running(true)
+{
+    th = std::thread(&IDGWatch::loop, this);
+}
+
+IDGWatch::~IDGWatch()
+{
+    {
+	std::lock_guard<std::mutex> lock(mtx);
+	running = false;
+    }
+    cv.notify_all();
+    if (th.joinable()) th.join();
+    if (ndropped > 0) std::cout << "Warning: apmidg_watch: " << ndropped << " events were dropped" << std::endl;
+}
+
+void IDGWatch::loop()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+
+    for (;;) {
+	cv.wait(lock, [this] { return !queue.empty() || !running; });
+	if (!running) break;
+
+	apmidg_watch_event_t ev = queue.front();
+	queue.pop_front();
+
+	// the watch may have been removed after the event was queued
+	auto it = ents.find(ev.watchid);
+	if (it == ents.end()) continue;
+	apmidg_watch_cb_t cb = it->second.cb;
+	void *arg = it->second.arg;
+
+	delivering = ev.watchid;
+	lock.unlock();
+	cb(&ev, arg);
+	lock.lock();
+	delivering = -1;
+	dcv.notify_all();
+    }
+}
+
+int IDGWatch::add(int idx, int devid, int kind, int id, double threshold, double hysteresis,
+		  uint64_t debounce_us, apmidg_watch_cb_t cb, void *arg)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    int wid = nextid++;
+
+    IDGWatchEnt &e = ents[wid];
+    e.idx = idx;
+    e.devid = devid;
+    e.kind = kind;
+    e.id = id;
+    e.threshold = threshold;
+    e.hysteresis = hysteresis > 0.0 ? hysteresis : 0.0;
+    e.debounce_us = debounce_us;
+    e.cb = cb;
+    e.arg = arg;
+    e.hw = false;
+    e.above = false;
+    e.pending = false;
+    e.pending_ts_us = 0;
+
+    bydom[idx].push_back(wid);
+    ndom[idx].store(bydom[idx].size(), std::memory_order_relaxed);
+    return wid;
+}
+
+bool IDGWatch::remove(int wid)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    auto it = ents.find(wid);
+    if (it == ents.end()) return false;
+
+    std::vector<int> &v = bydom[it->second.idx];
+    for (size_t i = 0; i < v.size(); i++) {
+	if (v[i] != wid) continue;
+	v.erase(v.begin() + i);
+	break;
+    }
+    ndom[it->second.idx].store(v.size(), std::memory_order_relaxed);
+    ents.erase(it);
+
+    // a callback may remove its own watch
+    if (std::this_thread::get_id() != th.get_id())
+	dcv.wait(lock, [this, wid] { return delivering != wid; });
+    return true;
+}
+
+void IDGWatch::sethw(int wid, bool hw)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = ents.find(wid);
+    if (it == ents.end()) return;
+    it->second.hw = hw;
+    it->second.pending = false;
+}
+
+int IDGWatch::ishw(int wid)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = ents.find(wid);
+    if (it == ents.end()) return -1;
+    return it->second.hw ? 1 : 0;
+}
+
+bool IDGWatch::haspending(int idx)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    for (int wid : bydom[idx]) {
+	IDGWatchEnt &e = ents[wid];
+	if (e.hw && e.pending) return true;
+    }
+    return false;
+}
+
+void IDGWatch::eval(int idx, uint64_t ts_us, double v, bool hw)
+{
+    bool notify = false;
+
+    if (v < 0.0) return; // a failed read
+
+    {
+	std::lock_guard<std::mutex> lock(mtx);
+	for (int wid : bydom[idx]) {
+	    IDGWatchEnt &e = ents[wid];
+	    if (e.hw != hw) continue;
+
+	    bool crossed = e.above ? v <= e.threshold - e.hysteresis : v >= e.threshold;
+	    if (!crossed) {
+		e.pending = false;
+		continue;
+	    }
+	    if (!e.pending) {
+		e.pending = true;
+		e.pending_ts_us = ts_us;
+	    }
+	    if (ts_us - e.pending_ts_us < e.debounce_us) continue;
+
+	    e.above = !e.above;
+	    e.pending = false;
+	    if (queue.size() >= WATCH_MAXQUEUE) {
+		ndropped++;
+		continue;
+	    }
+	    apmidg_watch_event_t ev;
+	    ev.watchid = wid;
+	    ev.devid = e.devid;
+	    ev.kind = e.kind;
+	    ev.id = e.id;
+	    ev.above = e.above ? 1 : 0;
+	    ev.hw = hw ? 1 : 0;
+	    ev.value = v;
+	    ev.threshold = e.threshold;
+	    ev.ts_us = ts_us;
+	    queue.push_back(ev);
+	    notify = true;
+	}
+    }
+    if (notify) cv.notify_one();
+}
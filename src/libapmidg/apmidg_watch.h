@@ -0,0 +1,94 @@
+#ifndef __APMIDG_WATCH_H_DEFINED__
+#define __APMIDG_WATCH_H_DEFINED__
+
+// internal use only
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+#include "libapmidg.h"
+
+// Threshold watches over the sampled domains
+//
+// A watch is below until a value reaches the threshold, and above
+// until a value falls to threshold - hysteresis. A crossing becomes a
+// transition only if it still holds debounce_us later, so a value
+// that hovers around the threshold does not flap. Each transition is
+// queued as an apmidg_watch_event_t and delivered by a dedicated
+// thread, so eval() never runs a callback on the sampling path.
+//
+// A watch is fed either by polling (the sampler or the read paths,
+// hw == false) or by the temperature threshold events of the device
+// (hw == true), never both.
+
+#define WATCH_MAXQUEUE (4096)
+
+struct IDGWatchEnt {
+    int idx;           // the domain, by IDGDomIndex
+    int devid, kind, id;
+    double threshold;
+    double hysteresis;
+    uint64_t debounce_us;
+    apmidg_watch_cb_t cb;
+    void *arg;
+    bool hw;
+
+    bool above;
+    bool pending;      // a crossing waits for the debounce
+    uint64_t pending_ts_us;
+};
+
+class IDGWatch {
+    std::mutex mtx;
+    std::map<int, IDGWatchEnt> ents;
+    std::vector<std::vector<int>> bydom;   // the watch ids per domain
+    std::unique_ptr<std::atomic<int>[]> ndom; // the size of bydom[idx]
+    int nextid;
+
+    std::deque<apmidg_watch_event_t> queue;
+    std::condition_variable cv;  // queue or running changed
+    std::condition_variable dcv; // delivering changed
+    int delivering;    // the watch id of the running callback, or -1
+    uint64_t ndropped;
+    bool running;
+    std::thread th;
+
+    void loop();
+
+public:
+    IDGWatch(int ndoms);
+    ~IDGWatch();
+
+    // return the watch id
+    int add(int idx, int devid, int kind, int id, double threshold, double hysteresis,
+	    uint64_t debounce_us, apmidg_watch_cb_t cb, void *arg);
+
+    // drop the watch and wait for its running callback unless called
+    // from it. return false if there is no such watch
+    bool remove(int wid);
+
+    // switch the watch to or from the threshold events
+    void sethw(int wid, bool hw);
+    int ishw(int wid); // -1 if there is no such watch
+
+    // true if the domain has a watch. lock-free, for the sampling path
+    bool has(int idx) { return ndom[idx].load(std::memory_order_relaxed) > 0; }
+
+    // true if a crossing of an event-driven watch of the domain waits
+    // for its debounce, so the listener reads it again
+    bool haspending(int idx);
+
+    // evaluate the watches of the domain that are fed by hw (events)
+    // or not (polling) with a new value. negative values (failed
+    // reads) are skipped
+    void eval(int idx, uint64_t ts_us, double v, bool hw);
+};
+
+#endif
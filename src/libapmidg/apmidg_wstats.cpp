@@ -0,0 +1,117 @@
+/*
+  Windowed streaming statistics per domain, fed by the sampler. See
+  apmidg_wstats.h and apmidg_wstats_get()
+
+  (setq c-basic-offset 4)
+*/
+
+#include "apmidg_wstats.h"
+
+#include <algorithm>
+
+#include <math.h>
+#include <string.h>
+
+static void resetpane(IDGWPane &p, uint64_t epoch)
+{
+    p.epoch = epoch;
+    p.n = 0;
+    p.mean = 0.0;
+    p.m2 = 0.0;
+    p.min = 0.0;
+    p.max = 0.0;
+    memset(p.bins, 0, sizeof(p.bins));
+}
+
+IDGWStats::IDGWStats(int ndoms, const double *_windows_s, int nwindows)
+    : doms(ndoms), lngamma(log(WSTATS_GAMMA))
+{
+    int off = 0;
+    for (int w = 0; w < nwindows; w++) {
+	double s = _windows_s[w] > 0.0 ? _windows_s[w] : 0.0;
+	windows_s.push_back(s);
+	pane_us.push_back(s > 0.0 ? std::max<uint64_t>(1, (uint64_t)(s * 1e6 / WSTATS_NPANES)) : 0);
+	npanes.push_back(s > 0.0 ? WSTATS_NPANES : 1);
+	paneoff.push_back(off);
+	off += npanes.back();
+    }
+    for (auto &d : doms) {
+	d.panes.resize(off);
+	for (auto &p : d.panes) resetpane(p, 0);
+    }
+}
+
+int IDGWStats::binof(double v)
+{
+    if (v <= WSTATS_MINVAL) return 0;
+    int b = (int)(log(v / WSTATS_MINVAL) / lngamma);
+    return b < WSTATS_NBINS ? b : WSTATS_NBINS - 1;
+}
+
+void IDGWStats::add(int idx, uint64_t ts_us, double v)
+{
+    if (v < 0.0) return;
+
+    IDGWDom &d = doms[idx];
+    int b = binof(v);
+
+    std::lock_guard<std::mutex> lock(d.mtx);
+    for (int w = 0; w < getnwindows(); w++) {
+	uint64_t epoch = pane_us[w] ? ts_us / pane_us[w] : 0;
+	IDGWPane &p = d.panes[paneoff[w] + epoch % npanes[w]];
+	if (p.epoch != epoch) resetpane(p, epoch);
+
+	p.n++;
+	double delta = v - p.mean;
+	p.mean += delta / p.n;
+	p.m2 += delta * (v - p.mean);
+	if (p.n == 1 || v < p.min) p.min = v;
+	if (p.n == 1 || v > p.max) p.max = v;
+	p.bins[b]++;
+    }
+}
+
+uint64_t IDGWStats::get(int idx, int w, uint64_t now_us, double &min, double &max, double &mean, double &stddev,
+			double &p50, double &p95, double &p99)
+{
+    IDGWDom &d = doms[idx];
+    uint64_t epoch = pane_us[w] ? now_us / pane_us[w] : 0;
+    uint64_t n = 0, bins[WSTATS_NBINS] = {0};
+    double m2 = 0.0;
+
+    min = max = mean = stddev = p50 = p95 = p99 = 0.0;
+    {
+	std::lock_guard<std::mutex> lock(d.mtx);
+	for (int i = 0; i < npanes[w]; i++) {
+	    IDGWPane &p = d.panes[paneoff[w] + i];
+	    // skip the panes that fell out of the window
+	    if (p.n == 0 || p.epoch > epoch || p.epoch + npanes[w] <= epoch) continue;
+
+	    // Chan et al.'s pairwise merge of the Welford states
+	    uint64_t nn = n + p.n;
+	    double delta = p.mean - mean;
+	    mean += delta * p.n / nn;
+	    m2 += p.m2 + delta * delta * ((double)n * p.n / nn);
+	    if (n == 0 || p.min < min) min = p.min;
+	    if (n == 0 || p.max > max) max = p.max;
+	    n = nn;
+	    for (int b = 0; b < WSTATS_NBINS; b++) bins[b] += p.bins[b];
+	}
+    }
+    if (n == 0) return 0;
+    stddev = n > 1 ? sqrt(m2 / (n - 1)) : 0.0;
+
+    // the midpoint of the bin that holds the rank, within [min, max]
+    double *qv[3] = {&p50, &p95, &p99};
+    const double qs[3] = {0.50, 0.95, 0.99};
+    uint64_t acc = 0;
+    int qi = 0;
+    for (int b = 0; b < WSTATS_NBINS && qi < 3; b++) {
+	acc += bins[b];
+	while (qi < 3 && acc > (uint64_t)(qs[qi] * (n - 1))) {
+	    double v = WSTATS_MINVAL * pow(WSTATS_GAMMA, b) * (1.0 + WSTATS_GAMMA) / 2.0;
+	    *qv[qi++] = std::min(std::max(v, min), max);
+	}
+    }
+    return n;
+}
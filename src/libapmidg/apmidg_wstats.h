@@ -0,0 +1,64 @@
+#ifndef __APMIDG_WSTATS_H_DEFINED__
+#define __APMIDG_WSTATS_H_DEFINED__
+
+// internal use only
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+// Streaming statistics of the sampler's values over sliding windows
+//
+// Each window of a domain is a ring of WSTATS_NPANES panes of
+// window/WSTATS_NPANES each. A pane keeps a Welford mean/M2, min, max
+// and a log-binned histogram (the quantile sketch, relative error
+// about (WSTATS_GAMMA-1)/2), and is reset when its time slot comes
+// around again. A query merges the panes still in the window, so the
+// memory is fixed and the cost does not depend on the sample rate.
+// A window of 0 sec is the lifetime since start, a single pane.
+
+#define WSTATS_NPANES (10)
+#define WSTATS_NBINS  (284)   // [WSTATS_MINVAL, WSTATS_MINVAL * WSTATS_GAMMA^WSTATS_NBINS)
+#define WSTATS_GAMMA  (1.05)
+#define WSTATS_MINVAL (0.1)
+
+struct IDGWPane {
+    uint64_t epoch;  // the time slot of the samples, ts_us / pane_us
+    uint64_t n;
+    double mean;
+    double m2;
+    double min;
+    double max;
+    uint32_t bins[WSTATS_NBINS];
+};
+
+struct IDGWDom {
+    std::mutex mtx;  // held by the sampler per sample and by a query
+    std::vector<IDGWPane> panes; // window by window
+};
+
+class IDGWStats {
+    std::vector<double> windows_s;
+    std::vector<uint64_t> pane_us;   // per window. 0 for the lifetime
+    std::vector<int> npanes, paneoff; // per window
+    std::vector<IDGWDom> doms;
+    double lngamma;
+
+    int binof(double v);
+
+public:
+    IDGWStats(int ndoms, const double *_windows_s, int nwindows);
+
+    int getnwindows() { return (int)windows_s.size(); }
+    double getwindow(int w) { return windows_s[w]; }
+
+    // add a sample of the domain. negative values (failed reads) are skipped
+    void add(int idx, uint64_t ts_us, double v);
+
+    // summarize the window w of the domain as of now_us. return the
+    // number of samples in it
+    uint64_t get(int idx, int w, uint64_t now_us, double &min, double &max, double &mean, double &stddev,
+		 double &p50, double &p95, double &p99);
+};
+
+#endif
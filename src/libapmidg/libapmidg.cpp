@@ -11,165 +11,609 @@
 #include <level_zero/zes_api.h>
 
 #include "apmidg_zmacrostr.h"
+#include "libapmidg.h"
+#include "apmidg_ring.h"
+#include "apmidg_grace.h"
+#include "apmidg_backend.h"
+#include "apmidg_rapl.h"
+#include "apmidg_stats.h"
+#include "apmidg_wstats.h"
+#include "apmidg_history.h"
+#include "apmidg_watch.h"
+#include "apmidg_config.h"
 
 #include <iostream>
 #include <fstream>
 #include <cstdio>
 #include <vector>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <deque>
+#include <tuple>
 
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <ctype.h>
+#include <limits.h>
 #include <cstdio>
 
 #define _ZE_ERROR_MSG(NAME,RES) {printf("%s() failed at %d(%s): res=%x:%s\n",(NAME),__LINE__,__FILE__,(RES),str_ze_result_t(RES)); std::terminate();}
 #define _ZE_ERROR_MSG_NOTERMINATE(NAME,RES) {printf("%s() error at %d(%s): res=%x:%s\n",(NAME),__LINE__,__FILE__,(RES),str_ze_result_t(RES));}
 #define _ERROR_MSG(MSG) {perror((MSG)); printf("errno=%d at %d(%s)",errno,__LINE__,__FILE__);}
 
+// every Level Zero call goes through the backend selected by
+// apmidg_init_backend()
+static const apmidg_backend *apmidg_be = NULL;
+
+// static properties of each domain, loaded once by
+// IDGPowerPerDevice::enumpwrdoms() and the like. -1 if the query failed
+struct IDGPwrProps {
+    int onsubdev;
+    int subdevid;
+    int canctrl;
+    int deflim_mw;
+};
+
+struct IDGFreqProps {
+    int onsubdev;
+    int subdevid;
+    int canctrl;
+    double min_MHz;
+    double max_MHz;
+};
+
+struct IDGTempProps {
+    int onsubdev;
+    int subdevid;
+    int type;
+};
+
+// a device picked at init (see apmidg_init_select()). devid is the
+// index in the driver. subdevmask selects its subdevices, 0 for the
+// whole device
+struct IDGDevSel {
+    int devid;
+    uint64_t subdevmask;
+};
+
+// the limits cache. a set updates it on success and a read revalidates
+// it against sysman once it is older than apmidg_limcache_ttl_us
+// (never if negative, always if zero)
+struct IDGPwrLimCache {
+    bool valid;
+    uint64_t ts_us;
+    std::vector<zes_power_limit_ext_desc_t> descs;
+};
+
+struct IDGFreqRangeCache {
+    bool valid;
+    uint64_t ts_us;
+    zes_freq_range_t range;
+};
+
+static std::atomic<int64_t> apmidg_limcache_ttl_us(1000000);
+
+static uint64_t gettime_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool limcache_fresh(bool valid, uint64_t ts_us, uint64_t now_us)
+{
+    int64_t ttl = apmidg_limcache_ttl_us.load(std::memory_order_relaxed);
+    if (!valid || ttl == 0) return false;
+    return ttl < 0 || now_us - ts_us < (uint64_t)ttl;
+}
+
+// add to an atomic that only one thread writes at a time
+template <typename T>
+static inline void addrelaxed(std::atomic<T> &a, T v)
+{
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+// the poweravg state of a power domain. each domain has its own lock,
+// held only for the delta computation, never across a sysman call
+struct IDGEnergyDelta {
+    std::mutex mtx;
+    uint64_t prev_energy_uj;
+    uint64_t prev_ts_us;
+    double watt; // the last result
+};
+
+// the accumulated energy of a power domain. updated by every counter
+// read (see IDGPowerPerDevice::readenergy()). see apmidg_readenergy_acc()
+struct IDGEnergyAcc {
+    std::mutex mtx;
+    bool primed;   // last_* hold a reading
+    bool running;  // if false, readings only move the baseline
+    uint64_t last_energy_uj;
+    uint64_t last_ts_us;
+    uint64_t acc_uj;
+    // never stopped or reset. written under mtx, read without it by
+    // the regions
+    std::atomic<uint64_t> total_uj;
+};
+
+// the time integral of the actual frequency of a frequency domain,
+// updated by every state read (see IDGPowerPerDevice::readfreq()). the
+// last reading is held until the next one
+struct IDGFreqAcc {
+    std::mutex mtx;
+    double last_MHz;    // < 0 until the first reading
+    uint64_t last_ts_us;
+    // written under mtx, read without it by the regions
+    std::atomic<double> int_MHzus;
+    std::atomic<uint64_t> int_us;
+};
+
+// The energy consumed between two counter readings. The counter may
+// wrap at 32 bits (2^32 uJ, about 4.3 kJ) or restart from zero, e.g.,
+// after a driver reload. A wrap is taken only if the implied power is
+// plausible, otherwise the counter is assumed to have restarted.
+#define APMIDG_ENERGY_WRAP_UJ  (1ULL << 32)
+#define APMIDG_MAX_PLAUSIBLE_W (10000.0)
+
+static uint64_t energydelta(uint64_t prev_uj, uint64_t now_uj, uint64_t dt_us)
+{
+    if (now_uj >= prev_uj) return now_uj - prev_uj;
+    if (prev_uj < APMIDG_ENERGY_WRAP_UJ) {
+	uint64_t d = APMIDG_ENERGY_WRAP_UJ - prev_uj + now_uj;
+	if (dt_us > 0 && (double)d / dt_us <= APMIDG_MAX_PLAUSIBLE_W) return d;
+    }
+    return now_uj;
+}
 
 class IDGPowerPerDevice {
     int verbose;
     int devid;
+    int physid;          // the index in the driver
+    uint64_t subdevmask; // see IDGDevSel
+    uint64_t matchedmask; // the selected subdevices that have a domain
+    bool hassubdoms;     // some domain is on a subdevice
     ze_device_handle_t dev;
     zes_device_handle_t smh; // sysman handles
     std::vector<zes_pwr_handle_t> pwrhs;
-    // prev_energy_uj and prev_ts_us are used to calculate poweravg_w
-    // sampleenergy update these values
-    std::vector<uint64_t> prev_energy_uj;
-    std::vector<uint64_t> prev_ts_us;
-    std::vector<double> poweravg_w;
+    // used to calculate the average power. sampleenergy and
+    // updateenergy update these values
+    std::unique_ptr<IDGEnergyDelta[]> edelta;
+    std::unique_ptr<IDGEnergyAcc[]> eacc;
+    // the power domains that make up the device total: the card-level
+    // domains, or the subdevice ones if there is none
+    std::vector<int> totalpwrids;
 
     std::vector<zes_freq_handle_t> freqhs;
+    std::unique_ptr<IDGFreqAcc[]> facc;
     std::vector<zes_temp_handle_t> temphs;
 
     // if a feature is unavailable for some reason, the following flags will be set.
     bool enabled_powerlimit;
 
+    // the frequency domains, the temperature sensors and the power
+    // limit probe are set up on first use (see needfreq(), needtemp()
+    // and is_powerlimit_available()), so init only pays for the power
+    // domains
+    std::once_flag freqonce;
+    std::once_flag temponce;
+    std::once_flag limonce;
+
     // assume these properties are static
     bool isgpu;
     uint32_t npwrdoms;
     uint32_t nfreqdoms;
     uint32_t ntempsensors;
+    std::vector<IDGPwrProps> pwrprops;
+    std::vector<IDGFreqProps> freqprops;
+    std::vector<IDGTempProps> tempprops;
+
+    // Threading: the handles, counts and properties are immutable
+    // after construction (except reload()), so reads and
+    // sysman calls need no lock. mtx serializes the limits cache and
+    // the control writes of this device only. the poweravg state has
+    // a lock per domain (IDGEnergyDelta).
+    std::mutex mtx;
+
+    // limits and ranges last read or written. see get/setpwrlim() and
+    // get/setfreqrange()
+    std::vector<IDGPwrLimCache> pwrlimcache;
+    std::vector<IDGFreqRangeCache> freqrangecache;
+
+    // read all power limit descriptors of the domain
+    ze_result_t querypwrlims(int pwrid, std::vector<zes_power_limit_ext_desc_t> &descs) {
+	zes_pwr_handle_t pwrh = getpwrh(pwrid);
+	uint32_t pCount = 0;
+
+	// the first call returns the count, the second fills descs
+	ze_result_t res = apmidg_be->zesPowerGetLimitsExt(pwrh, &pCount, nullptr);
+	if (res == ZE_RESULT_SUCCESS) {
+	    zes_power_limit_ext_desc_t d = {};
+	    d.stype = ZES_STRUCTURE_TYPE_POWER_LIMIT_EXT_DESC;
+	    descs.assign(pCount, d);
+	    if (pCount > 0) res = apmidg_be->zesPowerGetLimitsExt(pwrh, &pCount, descs.data());
+	    descs.resize(pCount);
+	}
+	if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetLimitsExt", res);
+	return res;
+    }
+
+    // the caller holds mtx
+    int writepwrlims(int pwrid, IDGPwrLimCache &c, std::vector<zes_power_limit_ext_desc_t> descs) {
+	uint32_t pCount = descs.size();
+	ze_result_t res = apmidg_be->zesPowerSetLimitsExt(getpwrh(pwrid), &pCount, descs.data());
+	if (res != ZE_RESULT_SUCCESS) {
+	    _ZE_ERROR_MSG_NOTERMINATE("zesPowerSetLimitsExt", res);
+	    c.valid = false;
+	    return -1;
+	}
+	c.descs = descs;
+	c.valid = true;
+	c.ts_us = gettime_us();
+	return 0;
+    }
+
+    IDGPwrLimCache *getpwrlimcache(int pwrid) {
+	IDGPwrLimCache &c = pwrlimcache[pwrid];
+	uint64_t now = gettime_us();
+
+	if (!limcache_fresh(c.valid, c.ts_us, now)) {
+	    c.valid = querypwrlims(pwrid, c.descs) == ZE_RESULT_SUCCESS;
+	    c.ts_us = now;
+	}
+	return c.valid ? &c : nullptr;
+    }
 
 public:
-    IDGPowerPerDevice(ze_device_handle_t _dev, const int _devid, const int _ver = 1) {
+    IDGPowerPerDevice(ze_device_handle_t _dev, const int _devid, const int _ver = 1,
+		      const int _physid = -1, const uint64_t _subdevmask = 0) {
 	ze_result_t res;
 
 	dev = _dev;
 	devid = _devid;
 	verbose = _ver;
+	physid = _physid < 0 ? _devid : _physid;
+	subdevmask = _subdevmask;
+	matchedmask = 0;
+	hassubdoms = false;
 
 	ze_device_properties_t devprop = {};
 
-	res = zeDeviceGetProperties(dev, &devprop);
+	res = apmidg_be->zeDeviceGetProperties(dev, &devprop);
 	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zeDeviceGetProperties", res);
 	if (devprop.type == ZE_DEVICE_TYPE_GPU) isgpu=true; else isgpu=false;
 
 
 	smh = (zes_device_handle_t)dev;
 
+	nfreqdoms = 0;
+	ntempsensors = 0;
 	npwrdoms = 0;
-	res = zesDeviceEnumPowerDomains(smh, &npwrdoms, nullptr);
+	res = enumpwrdoms(pwrhs, pwrprops, npwrdoms);
 	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zesDeviceEnumPowerDomains", res);
 	if (npwrdoms > 0) {
-	    pwrhs.resize(npwrdoms);
-	    prev_energy_uj.resize(npwrdoms);
-	    prev_ts_us.resize(npwrdoms);
+	    edelta.reset(new IDGEnergyDelta[npwrdoms]);
+	    for (int i = 0; i < npwrdoms; ++i) {
+		edelta[i].prev_energy_uj = 0;
+		edelta[i].prev_ts_us = 0;
+		edelta[i].watt = 0.0;
+	    }
+	    // accumulating from init
+	    eacc.reset(new IDGEnergyAcc[npwrdoms]);
+	    for (int i = 0; i < npwrdoms; ++i) {
+		eacc[i].primed = false;
+		eacc[i].running = true;
+		eacc[i].acc_uj = 0;
+		eacc[i].total_uj = 0;
+	    }
+	}
+	settotalpwrids();
 
-	    res = zesDeviceEnumPowerDomains(smh, &npwrdoms, pwrhs.data());
-	    if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zesDeviceEnumPowerDomains", res);
+	pwrlimcache.resize(npwrdoms);
+	for (auto &c : pwrlimcache) c.valid = false;
 
-	    // to load value into prev_energy_uj and prev_ts_us to
-	    // calculate the average power consumption.
-	    zes_power_energy_counter_t ecounter;
-	    for (int i = 0; i < npwrdoms; ++i)
-		sampleenergy(i, ecounter);
-	    usleep(10*1000); // sleep 10 msec
+	// no baseline energy sample here. the first
+	// sampleenergy() of a domain takes it and returns 0 W, without
+	// waiting for the counter to move
 
-	    zes_pwr_handle_t pwrh = getpwrh(0); // note check only the first domain
+	if (verbose >= 2) std::cout << "IDGPowerPerDivice is constructed" << std::endl;
 
-	    // old API
-	    // zes_power_sustained_limit_t pSustained;
-	    // zes_power_burst_limit_t pBurst;
-	    // zes_power_peak_limit_t pPeak;
-	    // res = zesPowerGetLimits(pwrh, &pSustained, &pBurst, &pPeak);
+    }
 
-	    zes_power_properties_t pprop = {};
-	    res = zesPowerGetProperties(pwrh, &pprop);
-	    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetProperties", res);
+    // the per-domain state lives in this object. never copy it.
+    IDGPowerPerDevice(const IDGPowerPerDevice&) = delete;
+    IDGPowerPerDevice& operator=(const IDGPowerPerDevice&) = delete;
+
+    ~IDGPowerPerDevice() {
+	if (verbose >= 2) std::cout << "IDGPowerPerDevice is destructed" << std::endl;
+    }
 
-	    enabled_powerlimit = false;
+    // drop the domains outside the selected subdevices. the
+    // card-level domains go too. a device without subdevice domains
+    // is kept whole
+    template <typename H, typename P>
+    void selectdoms(std::vector<H> &hs, std::vector<P> &props, uint32_t &n) {
+	if (subdevmask == 0) return;
+
+	bool hassub = false;
+	for (auto &p : props) if (p.onsubdev > 0) hassub = true;
+	if (!hassub) return;
+	hassubdoms = true;
+
+	uint32_t k = 0;
+	for (uint32_t i = 0; i < n; i++) {
+	    const P &p = props[i];
+	    if (p.onsubdev > 0 && p.subdevid >= 0 && p.subdevid < 64 && ((subdevmask >> p.subdevid) & 1)) {
+		matchedmask |= 1ULL << p.subdevid;
+		hs[k] = hs[i];
+		props[k] = props[i];
+		k++;
+	    }
+	}
+	n = k;
+	hs.resize(n);
+	props.resize(n);
+    }
+
+    // probe whether the sustained power limit can be read. the
+    // first domain only
+    void probelimits() {
+	ze_result_t res;
 
-	    if(pprop.canControl > 0) {
-		const int maxpCount = 10;
-		zes_power_limit_ext_desc_t pSustained[maxpCount];
-		uint32_t pCount;
-		pCount = 0;
+	enabled_powerlimit = false;
+	if (npwrdoms == 0) return;
 
-		res = zesPowerGetLimitsExt(pwrh, &pCount, pSustained);
-		if (res != ZE_RESULT_SUCCESS) {
-		    std::cout << "Warning: PowerLimit is unavailable. Disabled the fueature." << std::endl;
-		} else {
-		    if (pCount > maxpCount) {
-			pCount = maxpCount;
-			std::cout << "Warning: pCount is reset to " << pCount << std::endl;
-		    }
+	zes_pwr_handle_t pwrh = getpwrh(0); // note check only the first domain
+
+	// old API
+	// zes_power_sustained_limit_t pSustained;
+	// zes_power_burst_limit_t pBurst;
+	// zes_power_peak_limit_t pPeak;
+	// res = zesPowerGetLimits(pwrh, &pSustained, &pBurst, &pPeak);
 
-		    for (int j=0; j<pCount; j++) {
-			zes_power_limit_ext_desc_t *p;
-			p = pSustained + j;
+	if (pwrprops[0].canctrl > 0) {
+	    const int maxpCount = 10;
+	    zes_power_limit_ext_desc_t pSustained[maxpCount];
+	    uint32_t pCount;
+	    pCount = 0;
 
-			if (p->level == ZES_POWER_LEVEL_SUSTAINED) {
-			    enabled_powerlimit = true;
-			}
+	    // the first call returns the count, the second fills pSustained
+	    res = apmidg_be->zesPowerGetLimitsExt(pwrh, &pCount, pSustained);
+	    if (res == ZE_RESULT_SUCCESS) {
+		if (pCount > maxpCount) pCount = maxpCount;
+		res = apmidg_be->zesPowerGetLimitsExt(pwrh, &pCount, pSustained);
+	    }
+	    if (res != ZE_RESULT_SUCCESS) {
+		std::cout << "Warning: PowerLimit is unavailable. Disabled the fueature." << std::endl;
+	    } else {
+		if (pCount > maxpCount) {
+		    pCount = maxpCount;
+		    std::cout << "Warning: pCount is reset to " << pCount << std::endl;
+		}
+
+		for (int j=0; j<pCount; j++) {
+		    zes_power_limit_ext_desc_t *p;
+		    p = pSustained + j;
+
+		    if (p->level == ZES_POWER_LEVEL_SUSTAINED) {
+			enabled_powerlimit = true;
 		    }
 		}
 	    }
 	}
+    }
 
-	nfreqdoms = 0;
-	res = zesDeviceEnumFrequencyDomains(smh, &nfreqdoms ,NULL);
-	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zesDeviceEnumFrequencyDomains", res);
-	if (nfreqdoms > 0) {
-	    freqhs.resize(nfreqdoms);
-	    res = zesDeviceEnumFrequencyDomains(smh, &nfreqdoms, freqhs.data());
+    // enumerate the frequency domains on first use
+    void needfreq() {
+	std::call_once(freqonce, [this] {
+	    ze_result_t res;
+
+	    nfreqdoms = 0;
+	    res = enumfreqdoms(freqhs, freqprops, nfreqdoms);
 	    if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zesDeviceEnumFrequencyDomains", res);
-	}
+	    if (nfreqdoms > 0) {
+		facc.reset(new IDGFreqAcc[nfreqdoms]);
+		for (int i = 0; i < nfreqdoms; ++i) {
+		    facc[i].last_MHz = -1.0;
+		    facc[i].last_ts_us = 0;
+		    facc[i].int_MHzus = 0.0;
+		    facc[i].int_us = 0;
+		}
+	    }
 
+	    // invalidatelims() may walk the cache concurrently
+	    std::lock_guard<std::mutex> lock(mtx);
+	    freqrangecache.resize(nfreqdoms);
+	    for (auto &c : freqrangecache) c.valid = false;
+	});
+    }
 
-	ntempsensors = 0;
-	res = zesDeviceEnumTemperatureSensors(smh, &ntempsensors ,NULL);
-	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zesDeviceEnumTemperatureSensors", res);
-	if (ntempsensors > 0) {
-	    temphs.resize(ntempsensors);
-	    res = zesDeviceEnumTemperatureSensors(smh, &ntempsensors, temphs.data());
+    // enumerate the temperature sensors on first use
+    void needtemp() {
+	std::call_once(temponce, [this] {
+	    ze_result_t res;
+
+	    ntempsensors = 0;
+	    res = enumtempsensors(temphs, tempprops, ntempsensors);
 	    if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zesDeviceEnumTemperatureSensors", res);
+	});
+    }
+
+    // enumerate the domains of the selected subdevices and query
+    // their static properties into hs, props and n
+    ze_result_t enumpwrdoms(std::vector<zes_pwr_handle_t> &hs, std::vector<IDGPwrProps> &props, uint32_t &n) {
+	n = 0;
+	ze_result_t res = apmidg_be->zesDeviceEnumPowerDomains(smh, &n, nullptr);
+	hs.resize(res == ZE_RESULT_SUCCESS ? n : 0);
+	if (res == ZE_RESULT_SUCCESS && n > 0) res = apmidg_be->zesDeviceEnumPowerDomains(smh, &n, hs.data());
+	if (res != ZE_RESULT_SUCCESS) n = 0;
+	hs.resize(n);
+	loadpwrprops(hs, props);
+	selectdoms(hs, props, n);
+	return res;
+    }
+
+    ze_result_t enumfreqdoms(std::vector<zes_freq_handle_t> &hs, std::vector<IDGFreqProps> &props, uint32_t &n) {
+	n = 0;
+	ze_result_t res = apmidg_be->zesDeviceEnumFrequencyDomains(smh, &n, nullptr);
+	hs.resize(res == ZE_RESULT_SUCCESS ? n : 0);
+	if (res == ZE_RESULT_SUCCESS && n > 0) res = apmidg_be->zesDeviceEnumFrequencyDomains(smh, &n, hs.data());
+	if (res != ZE_RESULT_SUCCESS) n = 0;
+	hs.resize(n);
+	loadfreqprops(hs, props);
+	selectdoms(hs, props, n);
+	return res;
+    }
+
+    ze_result_t enumtempsensors(std::vector<zes_temp_handle_t> &hs, std::vector<IDGTempProps> &props, uint32_t &n) {
+	n = 0;
+	ze_result_t res = apmidg_be->zesDeviceEnumTemperatureSensors(smh, &n, nullptr);
+	hs.resize(res == ZE_RESULT_SUCCESS ? n : 0);
+	if (res == ZE_RESULT_SUCCESS && n > 0) res = apmidg_be->zesDeviceEnumTemperatureSensors(smh, &n, hs.data());
+	if (res != ZE_RESULT_SUCCESS) n = 0;
+	hs.resize(n);
+	loadtempprops(hs, props);
+	selectdoms(hs, props, n);
+	return res;
+    }
+
+    // re-enumerate the domains and reload their properties, e.g.,
+    // after a driver reload invalidated the handles. called by
+    // apmidg_refreshprops() while no other thread uses this device.
+    // the per-domain state is sized by the counts, so the device is
+    // left unchanged and false is returned if a count differs
+    bool reload() {
+	std::vector<zes_pwr_handle_t> ph;
+	std::vector<zes_freq_handle_t> fh;
+	std::vector<zes_temp_handle_t> th;
+	std::vector<IDGPwrProps> pp;
+	std::vector<IDGFreqProps> fp;
+	std::vector<IDGTempProps> tp;
+	uint32_t np, nf, nt;
+
+	needfreq();
+	needtemp();
+	if (enumpwrdoms(ph, pp, np) != ZE_RESULT_SUCCESS ||
+	    enumfreqdoms(fh, fp, nf) != ZE_RESULT_SUCCESS ||
+	    enumtempsensors(th, tp, nt) != ZE_RESULT_SUCCESS) return false;
+	if (np != npwrdoms || nf != nfreqdoms || nt != ntempsensors) {
+	    std::cout << "Warning: the domain counts of device " << devid << " changed. call apmidg_finish() and apmidg_init()" << std::endl;
+	    return false;
 	}
 
-	if (verbose >=1 ) {
-	    std::cout << "Device" << devid << " isgpu=" << isgpu;
-	    std::cout << " npwrdoms=" << npwrdoms;
-	    std::cout << " nfreqdoms=" << nfreqdoms;
-	    std::cout << " ntempsensors=" << ntempsensors << std::endl;
+	pwrhs.swap(ph);
+	freqhs.swap(fh);
+	temphs.swap(th);
+	pwrprops.swap(pp);
+	freqprops.swap(fp);
+	tempprops.swap(tp);
+	settotalpwrids();
+	invalidatelims();
+	return true;
+    }
+
+    void loadpwrprops(const std::vector<zes_pwr_handle_t> &hs, std::vector<IDGPwrProps> &props) {
+	ze_result_t res;
+
+	props.resize(hs.size());
+	for (size_t i = 0; i < hs.size(); i++) {
+	    IDGPwrProps &p = props[i];
+	    zes_power_properties_t pprop = {};
+	    zes_power_ext_properties_t extprop = {};
+	    zes_power_limit_ext_desc_t deflim = {};
+	    extprop.stype = ZES_STRUCTURE_TYPE_POWER_EXT_PROPERTIES;
+	    extprop.defaultLimit = &deflim;
+	    pprop.pNext = &extprop;
+	    res = apmidg_be->zesPowerGetProperties(hs[i], &pprop);
+	    if (res != ZE_RESULT_SUCCESS) {
+		_ZE_ERROR_MSG_NOTERMINATE("zesPowerGetProperties", res);
+		p = {-1, -1, -1, -1};
+		continue;
+	    }
+	    p.onsubdev = (int)pprop.onSubdevice;
+	    p.subdevid = (int)pprop.subdeviceId;
+	    p.canctrl = (int)pprop.canControl;
+	    // pprop.defaultLimit is deprecated
+	    p.deflim_mw = (int)deflim.limit;
 	}
+    }
 
-	if (verbose >= 2) std::cout << "IDGPowerPerDivice is constructed" << std::endl;
+    void settotalpwrids() {
+	totalpwrids.clear();
+	for (int i = 0; i < npwrdoms; i++)
+	    if (pwrprops[i].onsubdev == 0) totalpwrids.push_back(i);
+	if (totalpwrids.empty())
+	    for (int i = 0; i < npwrdoms; i++) totalpwrids.push_back(i);
+    }
+
+    void loadfreqprops(const std::vector<zes_freq_handle_t> &hs, std::vector<IDGFreqProps> &props) {
+	ze_result_t res;
 
+	props.resize(hs.size());
+	for (size_t i = 0; i < hs.size(); i++) {
+	    IDGFreqProps &p = props[i];
+	    zes_freq_properties_t fprop = {};
+	    res = apmidg_be->zesFrequencyGetProperties(hs[i], &fprop);
+	    if (res != ZE_RESULT_SUCCESS) {
+		_ZE_ERROR_MSG_NOTERMINATE("zesFrequencyGetProperties", res);
+		p = {-1, -1, -1, -1.0, -1.0};
+		continue;
+	    }
+	    p.onsubdev = fprop.onSubdevice;
+	    p.subdevid = fprop.subdeviceId;
+	    p.canctrl = fprop.canControl;
+	    p.min_MHz = fprop.min;
+	    p.max_MHz = fprop.max;
+	}
     }
 
-    ~IDGPowerPerDevice() {
-	if (verbose >= 2) std::cout << "IDGPowerPerDevice is destructed" << std::endl;
+    void loadtempprops(const std::vector<zes_temp_handle_t> &hs, std::vector<IDGTempProps> &props) {
+	ze_result_t res;
+
+	props.resize(hs.size());
+	for (size_t i = 0; i < hs.size(); i++) {
+	    IDGTempProps &p = props[i];
+	    zes_temp_properties_t tprop = {};
+	    res = apmidg_be->zesTemperatureGetProperties(hs[i], &tprop);
+	    if (res != ZE_RESULT_SUCCESS) {
+		_ZE_ERROR_MSG_NOTERMINATE("zesTemperatureGetProperties", res);
+		p = {-1, -1, -1};
+		continue;
+	    }
+	    p.onsubdev = tprop.onSubdevice;
+	    p.subdevid = tprop.subdeviceId;
+	    p.type = tprop.type;
+	}
     }
 
     bool isgputype() {return isgpu;}
+    int getphysid() { return physid; }
+    uint64_t getsubdevmask() { return subdevmask; }
+    // the selected subdevices that no domain is on. a device without
+    // subdevice domains is its own subdevice 0
+    uint64_t getmissingsubdevs() {
+	if (subdevmask == 0) return 0;
+	return subdevmask & ~(hassubdoms ? matchedmask : 1ULL);
+    }
     uint32_t getnpwrdoms() { return npwrdoms; }
-    uint32_t getnfreqdoms()  { return nfreqdoms; }
-    uint32_t getntempsensors()  { return ntempsensors; }
+    uint32_t getnfreqdoms()  { needfreq(); return nfreqdoms; }
+    uint32_t getntempsensors()  { needtemp(); return ntempsensors; }
 
     ze_device_handle_t getdev() {return dev; }
     zes_device_handle_t getsysmanh() {return smh; }
-    bool is_powerlimit_available() { return enabled_powerlimit; }
+    bool is_powerlimit_available() {
+	std::call_once(limonce, [this] { probelimits(); });
+	return enabled_powerlimit;
+    }
     zes_pwr_handle_t getpwrh(int id) {
 	if (id >= getnpwrdoms() ) {
 		std::cout << "Warning: getpwrh(): specified id is out of the range: set it to 0" << std::endl;
@@ -191,57 +635,440 @@ public:
 	}
 	return temphs[id];
     }
+    const IDGPwrProps& getpwrprops(int id) {
+	if (id >= getnpwrdoms() ) {
+		std::cout << "Warning: getpwrprops(): specified id is out of the range: set it to 0" << std::endl;
+		id = 0;
+	}
+	return pwrprops[id];
+    }
+    const IDGFreqProps& getfreqprops(int id) {
+	if (id >= getnfreqdoms() ) {
+		std::cout << "Warning: getfreqprops(): specified id is out of the range: set it to 0" << std::endl;
+		id = 0;
+	}
+	return freqprops[id];
+    }
+    const IDGTempProps& gettempprops(int id) {
+	if (id >= getntempsensors() ) {
+		std::cout << "Warning: gettempprops(): specified id is out of the range: set it to 0" << std::endl;
+		id = 0;
+	}
+	return tempprops[id];
+    }
 
-    // return watt
-    double sampleenergy(int pwrid, zes_power_energy_counter_t& ecounter) {
+    // read the energy counter without touching the poweravg state.
+    // every reading also feeds the accumulated energy
+    ze_result_t readenergy(int pwrid, zes_power_energy_counter_t& ecounter) {
 	ze_result_t res;
-	double watt = 0.0;
 
+	if (pwrid >= getnpwrdoms()) pwrid = 0; // getpwrh() warns
 	zes_pwr_handle_t pwrh = getpwrh(pwrid);
 
-	res = zesPowerGetEnergyCounter(pwrh, &ecounter);
-	if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetEnergyCounter", res);
+	res = apmidg_be->zesPowerGetEnergyCounter(pwrh, &ecounter);
+	if (res != ZE_RESULT_SUCCESS) {
+	    _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetEnergyCounter", res);
+	    return res;
+	}
+	accumulate(pwrid, ecounter);
+	return res;
+    }
+
+    void accumulate(int pwrid, const zes_power_energy_counter_t& ecounter) {
+	IDGEnergyAcc &a = eacc[pwrid];
+	std::lock_guard<std::mutex> lock(a.mtx);
+
+	if (a.primed) {
+	    // skip a reading that lost the race with a newer one
+	    if (ecounter.timestamp <= a.last_ts_us) return;
+	    uint64_t d = energydelta(a.last_energy_uj, ecounter.energy, ecounter.timestamp - a.last_ts_us);
+	    if (a.running) a.acc_uj += d;
+	    addrelaxed<uint64_t>(a.total_uj, d);
+	}
+	a.primed = true;
+	a.last_energy_uj = ecounter.energy;
+	a.last_ts_us = ecounter.timestamp;
+    }
+
+    // read the counter and return the accumulated energy and the
+    // timestamp of the last reading
+    ze_result_t readenergy_acc(int pwrid, uint64_t &acc_uj, uint64_t &ts_us) {
+	zes_power_energy_counter_t ecounter;
+
+	if (pwrid >= getnpwrdoms()) pwrid = 0;
+	ze_result_t res = readenergy(pwrid, ecounter);
 
-	double delta_us = ecounter.timestamp - prev_ts_us[pwrid];
-	double delta_uj = ecounter.energy - prev_energy_uj[pwrid];
-	if (delta_us > 0.0) watt = delta_uj/delta_us;
+	IDGEnergyAcc &a = eacc[pwrid];
+	std::lock_guard<std::mutex> lock(a.mtx);
+	acc_uj = a.acc_uj;
+	ts_us = a.last_ts_us;
+	return res;
+    }
+
+    // the accumulated energy of the whole device. fresh reads the
+    // counters first, otherwise it is as of the last reading (e.g., by
+    // the sampler). ok, if given, is cleared when a read fails
+    uint64_t getenergytotal(bool fresh, bool *ok = NULL) {
+	uint64_t sum = 0;
+
+	if (ok) *ok = true;
+	for (int id : totalpwrids) {
+	    if (fresh) {
+		zes_power_energy_counter_t ecounter;
+		if (readenergy(id, ecounter) != ZE_RESULT_SUCCESS && ok) *ok = false;
+	    }
+	    sum += eacc[id].total_uj.load(std::memory_order_relaxed);
+	}
+	return sum;
+    }
+
+    // read the frequency state. every reading also feeds the
+    // frequency integral
+    ze_result_t readfreq(int freqid, zes_freq_state_t &fstate) {
+	if (freqid >= getnfreqdoms()) freqid = 0; // getfreqh() warns
+	ze_result_t res = apmidg_be->zesFrequencyGetState(getfreqh(freqid), &fstate);
+	if (res != ZE_RESULT_SUCCESS) {
+	    _ZE_ERROR_MSG_NOTERMINATE("zesFrequencyGetState", res);
+	    return res;
+	}
+
+	uint64_t now = gettime_us();
+	IDGFreqAcc &f = facc[freqid];
+	std::lock_guard<std::mutex> lock(f.mtx);
+	if (f.last_MHz >= 0.0 && now > f.last_ts_us) {
+	    addrelaxed<double>(f.int_MHzus, f.last_MHz * (now - f.last_ts_us));
+	    addrelaxed<uint64_t>(f.int_us, now - f.last_ts_us);
+	}
+	f.last_MHz = fstate.actual;
+	f.last_ts_us = now;
+	return res;
+    }
+
+    // the frequency integral summed over all domains. fresh as in
+    // getenergytotal()
+    void getfreqtotal(bool fresh, double &MHzus, uint64_t &us) {
+	MHzus = 0.0;
+	us = 0;
+	for (int id = 0; id < getnfreqdoms(); id++) {
+	    if (fresh) {
+		zes_freq_state_t fstate = {};
+		readfreq(id, fstate);
+	    }
+	    MHzus += facc[id].int_MHzus.load(std::memory_order_relaxed);
+	    us += facc[id].int_us.load(std::memory_order_relaxed);
+	}
+    }
+
+    // running: 1 to start, 0 to stop, -1 to keep. start/stop do not
+    // lose the baseline, so a stopped interval is never counted
+    void setenergyacc(int pwrid, int running, bool reset) {
+	if (pwrid >= getnpwrdoms()) return;
+
+	IDGEnergyAcc &a = eacc[pwrid];
+	std::lock_guard<std::mutex> lock(a.mtx);
+	if (running >= 0) a.running = running;
+	if (reset) a.acc_uj = 0;
+    }
+
+    // the sustained power limit in mW, or -1 if the domain has none
+    int getpwrlim(int pwrid) {
+	if (pwrid >= getnpwrdoms()) pwrid = 0; // getpwrh() warns
+
+	std::lock_guard<std::mutex> lock(mtx);
+	IDGPwrLimCache *c = getpwrlimcache(pwrid);
+	if (!c) return -1;
+	for (auto &d : c->descs)
+	    if (d.level == ZES_POWER_LEVEL_SUSTAINED) return d.limit;
+	return -1;
+    }
+
+    // return 0 if successful, -1 if the domain has no sustained limit
+    // or the driver rejected it
+    int setpwrlim(int pwrid, int lim_mw) {
+	if (pwrid >= getnpwrdoms()) pwrid = 0;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	IDGPwrLimCache *c = getpwrlimcache(pwrid);
+	if (!c) return -1;
+
+	// the driver wants every descriptor back. only change sustained
+	std::vector<zes_power_limit_ext_desc_t> descs = c->descs;
+	bool found_sustained = false;
+	for (auto &d : descs) {
+	    if (d.level == ZES_POWER_LEVEL_SUSTAINED) {
+		found_sustained = true;
+		d.limit = lim_mw;
+	    }
+	}
+	if (!found_sustained) return -1;
+	return writepwrlims(pwrid, *c, descs);
+    }
+
+    // every power limit descriptor of the domain. return 0 if successful
+    int getpwrdescs(int pwrid, std::vector<zes_power_limit_ext_desc_t> &descs) {
+	if (pwrid >= getnpwrdoms()) pwrid = 0;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	IDGPwrLimCache *c = getpwrlimcache(pwrid);
+	if (!c) return -1;
+	descs = c->descs;
+	return 0;
+    }
+
+    // write the whole descriptor set at once, as getpwrdescs() returns
+    // it. return 0 if successful
+    int setpwrdescs(int pwrid, const std::vector<zes_power_limit_ext_desc_t> &descs) {
+	if (pwrid >= getnpwrdoms()) pwrid = 0;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	return writepwrlims(pwrid, pwrlimcache[pwrid], descs);
+    }
+
+    // the current frequency range
+    ze_result_t getfreqrange(int freqid, zes_freq_range_t &range) {
+	if (freqid >= getnfreqdoms()) freqid = 0; // getfreqh() warns
 
-	prev_energy_uj[pwrid] = ecounter.energy;
-	prev_ts_us[pwrid] = ecounter.timestamp;
+	std::lock_guard<std::mutex> lock(mtx);
+	IDGFreqRangeCache &c = freqrangecache[freqid];
+	uint64_t now = gettime_us();
+	ze_result_t res = ZE_RESULT_SUCCESS;
 
-	return watt;
+	if (!limcache_fresh(c.valid, c.ts_us, now)) {
+	    res = apmidg_be->zesFrequencyGetRange(getfreqh(freqid), &c.range);
+	    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesFrequencyGetRange", res);
+	    c.valid = (res == ZE_RESULT_SUCCESS);
+	    c.ts_us = now;
+	}
+	range = c.range;
+	return res;
+    }
+
+    ze_result_t setfreqrange(int freqid, const zes_freq_range_t &range) {
+	if (freqid >= getnfreqdoms()) freqid = 0;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	IDGFreqRangeCache &c = freqrangecache[freqid];
+	ze_result_t res = apmidg_be->zesFrequencySetRange(getfreqh(freqid), &range);
+	if (res != ZE_RESULT_SUCCESS) {
+	    _ZE_ERROR_MSG_NOTERMINATE("zesFrequencySetRange", res);
+	    c.valid = false;
+	    return res;
+	}
+	// the driver clamps the range to the hardware limits
+	const IDGFreqProps &props = freqprops[freqid];
+	c.range = range;
+	if (props.min_MHz > 0.0 && c.range.min < props.min_MHz) c.range.min = props.min_MHz;
+	if (props.max_MHz > 0.0 && c.range.max > props.max_MHz) c.range.max = props.max_MHz;
+	c.valid = true;
+	c.ts_us = gettime_us();
+	return res;
+    }
+
+    // forget the cached limits, e.g., another process changed them
+    void invalidatelims() {
+	std::lock_guard<std::mutex> lock(mtx);
+	for (auto &c : pwrlimcache) c.valid = false;
+	for (auto &c : freqrangecache) c.valid = false;
+    }
+
+    // forget the cached limits of one domain only
+    void invalidatepwrlim(int pwrid) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (pwrid >= 0 && pwrid < (int)pwrlimcache.size()) pwrlimcache[pwrid].valid = false;
+    }
+
+    void invalidatefreqrange(int freqid) {
+	needfreq(); // sizes the cache
+	std::lock_guard<std::mutex> lock(mtx);
+	if (freqid >= 0 && freqid < (int)freqrangecache.size()) freqrangecache[freqid].valid = false;
+    }
+
+    // return watt
+    double sampleenergy(int pwrid, zes_power_energy_counter_t& ecounter) {
+	if (pwrid >= getnpwrdoms()) pwrid = 0; // getpwrh() warns
+
+	if (readenergy(pwrid, ecounter) != ZE_RESULT_SUCCESS) {
+	    ecounter = {};
+	    return 0.0;
+	}
+	return updateenergy(pwrid, ecounter);
+    }
+
+    // update the poweravg state with a counter value read elsewhere
+    // (e.g., by the background sampler). return watt
+    double updateenergy(int pwrid, const zes_power_energy_counter_t& ecounter) {
+	IDGEnergyDelta &d = edelta[pwrid];
+	std::lock_guard<std::mutex> lock(d.mtx);
+
+	// the first reading only sets the baseline
+	if (d.prev_ts_us == 0) {
+	    d.prev_energy_uj = ecounter.energy;
+	    d.prev_ts_us = ecounter.timestamp;
+	    return d.watt;
+	}
+	// another thread may have stored a counter read after ours. keep
+	// the newer baseline and return its result
+	if (ecounter.timestamp <= d.prev_ts_us) return d.watt;
+
+	uint64_t delta_us = ecounter.timestamp - d.prev_ts_us;
+	uint64_t delta_uj = energydelta(d.prev_energy_uj, ecounter.energy, delta_us);
+	d.watt = (double)delta_uj/delta_us;
+
+	d.prev_energy_uj = ecounter.energy;
+	d.prev_ts_us = ecounter.timestamp;
+
+	return d.watt;
     }
 };
 
 
+// the number of threads that construct the devices at init.
+// APMIDG_INIT_THREADS overrides the default. 1 constructs them serially
+#define APMIDG_INIT_MAXTHREADS (16)
+
+static int initthreads(uint32_t ndevs)
+{
+    int n = APMIDG_INIT_MAXTHREADS;
+    const char *e = getenv("APMIDG_INIT_THREADS");
+    if (e && atoi(e) > 0) n = atoi(e);
+    if (n > (int)ndevs) n = ndevs;
+    return n;
+}
+
+// parse a ZE_AFFINITY_MASK-style device list, e.g., "0,2,3.1" (device
+// 3 is limited to its subdevice 1). sel is sorted by devid. empty means
+// all devices. return false if the list is malformed
+static bool parsedevsel(const char *list, std::vector<IDGDevSel> &sel)
+{
+    std::string s = list ? list : "";
+    size_t pos = 0;
+
+    sel.clear();
+    while (pos < s.size()) {
+	size_t end = s.find(',', pos);
+	if (end == std::string::npos) end = s.size();
+	std::string tok = s.substr(pos, end - pos);
+	pos = end + 1;
+	if (tok.empty()) continue;
+
+	const char *p = tok.c_str();
+	char *e;
+	if (!isdigit(p[0])) return false;
+	long d = strtol(p, &e, 10);
+	long sd = -1;
+	if (*e == '.') {
+	    if (!isdigit(e[1])) return false;
+	    sd = strtol(e + 1, &e, 10);
+	    if (sd >= 64) return false;
+	}
+	if (*e != 0 || d > INT_MAX) return false;
+
+	uint64_t mask = sd < 0 ? 0 : (1ULL << sd);
+	auto it = std::find_if(sel.begin(), sel.end(), [d](const IDGDevSel &x) { return x.devid == d; });
+	if (it == sel.end()) {
+	    sel.push_back({(int)d, mask});
+	} else if (it->subdevmask != 0) {
+	    // the whole device wins over its subdevices
+	    it->subdevmask = mask == 0 ? 0 : it->subdevmask | mask;
+	}
+    }
+    std::sort(sel.begin(), sel.end(), [](const IDGDevSel &a, const IDGDevSel &b) { return a.devid < b.devid; });
+    return true;
+}
+
 class IDGPowerPerDriver {
     int verbose;
     int drvid;
 
     ze_driver_handle_t drv;
-    std::vector<IDGPowerPerDevice> devs;
+    // IDGPowerPerDevice holds per-domain state (e.g., prev_energy_uj)
+    // that must persist across calls, so each object is allocated
+    // once and handed out by reference.
+    std::vector<IDGPowerPerDevice*> devs;
 
 public:
-    IDGPowerPerDriver(ze_driver_handle_t _drv, const int _drvid, const int _ver=1) {
+    // sel picks the devices, which are numbered from 0 in its
+    // order. empty means all. devs stays empty if sel is out of range
+    IDGPowerPerDriver(ze_driver_handle_t _drv, const int _drvid, const int _ver=1,
+		      const std::vector<IDGDevSel> &sel = std::vector<IDGDevSel>()) {
 	ze_result_t res;
 	verbose = _ver;
 	drv = _drv;
+	drvid = _drvid;
 
 	// populating devices
 	std::vector<ze_device_handle_t> tmpdevs;
 
 	uint32_t tmpdevcnt = 0;
-	res = zeDeviceGet(drv, &tmpdevcnt, nullptr);
+	res = apmidg_be->zeDeviceGet(drv, &tmpdevcnt, nullptr);
 	if (res != ZE_RESULT_SUCCESS || tmpdevcnt == 0) {
 	    std::cout << "ERROR: No device found!" << std::endl;
 	    _ZE_ERROR_MSG("zeDeviceGet", res);
 	}
 	tmpdevs.resize(tmpdevcnt);
 
-	res = zeDeviceGet(drv, &tmpdevcnt, tmpdevs.data());
+	res = apmidg_be->zeDeviceGet(drv, &tmpdevcnt, tmpdevs.data());
 	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zeDeviceGet", res);
 
-	for(uint32_t i = 0; i < tmpdevcnt; i++) devs.push_back(IDGPowerPerDevice(tmpdevs[i], i, verbose));
+	std::vector<IDGDevSel> picked = sel;
+	if (picked.empty()) {
+	    for (uint32_t i = 0; i < tmpdevcnt; i++) picked.push_back({(int)i, 0});
+	}
+	for (auto &ds : picked) {
+	    if (ds.devid >= (int)tmpdevcnt) {
+		std::cout << "Error: device " << ds.devid << " is not found. driver" << drvid;
+		std::cout << " has " << tmpdevcnt << " devices" << std::endl;
+		return;
+	    }
+	}
+	uint32_t ndevs = picked.size();
+
+	// the devices are independent, so construct them in parallel.
+	// the sysman calls of a device are mostly waits on the driver
+	devs.assign(ndevs, nullptr);
+	int nthreads = initthreads(ndevs);
+	std::atomic<uint32_t> next(0);
+	auto worker = [&] {
+	    for (uint32_t i = next++; i < ndevs; i = next++)
+		devs[i] = new IDGPowerPerDevice(tmpdevs[picked[i].devid], i, verbose,
+						picked[i].devid, picked[i].subdevmask);
+	};
+	if (nthreads <= 1) {
+	    worker();
+	} else {
+	    std::vector<std::thread> threads;
+	    for (int t = 0; t < nthreads; t++) threads.emplace_back(worker);
+	    for (auto &t : threads) t.join();
+	}
+
+	// a selected subdevice without any domain would leave the device
+	// empty (e.g., "0.5" on a device of 2 subdevices)
+	for (uint32_t i = 0; i < ndevs; i++) {
+	    uint64_t missing = devs[i]->getmissingsubdevs();
+	    if (missing == 0) continue;
+	    std::cout << "Error: device " << picked[i].devid << " has no subdevice";
+	    for (int sd = 0; sd < 64; sd++) if ((missing >> sd) & 1) std::cout << " " << sd;
+	    std::cout << std::endl;
+	    for (auto d : devs) delete d;
+	    devs.clear();
+	    return;
+	}
+
+	if (verbose >= 1) {
+	    for (uint32_t i = 0; i < ndevs; i++) {
+		IDGPowerPerDevice *d = devs[i];
+		std::cout << "Device" << i;
+		if (!sel.empty()) {
+		    std::cout << " (driver device " << d->getphysid();
+		    if (d->getsubdevmask()) std::cout << " subdevmask=0x" << std::hex << d->getsubdevmask() << std::dec;
+		    std::cout << ")";
+		}
+		std::cout << " isgpu=" << d->isgputype();
+		std::cout << " npwrdoms=" << d->getnpwrdoms();
+		std::cout << " nfreqdoms=" << d->getnfreqdoms();
+		std::cout << " ntempsensors=" << d->getntempsensors() << std::endl;
+	    }
+	}
 
 
 	if (verbose >= 1) std::cout << "The number of the detected devices: " << devs.size() << std::endl;
@@ -250,26 +1077,31 @@ public:
 	if (verbose >= 2) std::cout << "IDGPowerPerDriver is constructed" << std::endl;
     }
 
+    IDGPowerPerDriver(const IDGPowerPerDriver&) = delete;
+    IDGPowerPerDriver& operator=(const IDGPowerPerDriver&) = delete;
+
     ~IDGPowerPerDriver() {
+	for (auto d : devs) delete d;
 	if (verbose >= 2) std::cout << "IDGPowerPerDriver is destructed" << std::endl;
     }
 
     void getVersion(uint32_t &version) {
 	ze_driver_properties_t prop;
-	ze_result_t res = zeDriverGetProperties(drv, &prop);
+	ze_result_t res = apmidg_be->zeDriverGetProperties(drv, &prop);
 	if (res != ZE_RESULT_SUCCESS ) {
 	    _ZE_ERROR_MSG_NOTERMINATE("zeDriverGetProperties", res);
 	}
     }
 
     int getndevs() { return devs.size(); }
+    ze_driver_handle_t getdrvh() { return drv; }
 
-    IDGPowerPerDevice getIDGPowerPerDevice(int devid) {
+    IDGPowerPerDevice& getIDGPowerPerDevice(int devid) {
 		if (devid >= getndevs()) {
 			std::cout << "Warning: devid is out of the range. Set devid 0" << std::endl;
-			return devs[0];
+			return *devs[0];
 		}
-	    return devs[devid];
+	    return *devs[devid];
     }
 };
 
@@ -277,120 +1109,1796 @@ class IDGPower {
     bool enabled;
     int  drvselected;
 
-    std::vector<IDGPowerPerDriver> drvs;
+    // only the selected driver is set up
+    IDGPowerPerDriver *drv;
 
     int verbose;
 
 public:
-    IDGPower(const int _verbose = 1) {
+    // drvid selects the driver and sel its devices (see
+    // IDGPowerPerDriver). isEnabled() is false if they do not exist
+    IDGPower(const int _verbose = 1, const int drvid = 0,
+	     const std::vector<IDGDevSel> &sel = std::vector<IDGDevSel>()) {
 	ze_result_t res;
 
 	verbose = _verbose;
 	enabled = false;
+	drv = nullptr;
+	drvselected = drvid;
 
-	res = zeInit(ZE_INIT_FLAG_GPU_ONLY);
+	res = apmidg_be->zeInit(ZE_INIT_FLAG_GPU_ONLY);
 	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zeInit", res);
 
 	std::vector<ze_driver_handle_t> tmpdrvs;
 
 	uint32_t tmpdrvcnt = 0;
 	// populate drivers
-	res = zeDriverGet(&tmpdrvcnt, nullptr);
+	res = apmidg_be->zeDriverGet(&tmpdrvcnt, nullptr);
 	if (res != ZE_RESULT_SUCCESS || tmpdrvcnt == 0) {
 	    std::cout << "ERROR: No driver found!" << std::endl;
 	    _ZE_ERROR_MSG("zeDriverGet", res);
 	}
 	tmpdrvs.resize(tmpdrvcnt);
-	res = zeDriverGet(&tmpdrvcnt, tmpdrvs.data());
+	res = apmidg_be->zeDriverGet(&tmpdrvcnt, tmpdrvs.data());
 	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG("zeDriverGet", res);
 
-	for(uint32_t i = 0; i < tmpdrvcnt; i++)  drvs.push_back(IDGPowerPerDriver(tmpdrvs[i], i, verbose));
-
 	if (verbose >= 1) std::cout << "The number of drivers detected: " << tmpdrvcnt << std::endl;
 
-	enabled = true;
-	drvselected = 0; // for now, it is set to zero. TODO:
-			 // implement some kind of selector later
+	if (drvselected < 0 || drvselected >= (int)tmpdrvcnt) {
+	    std::cout << "Error: driver " << drvselected << " is not found" << std::endl;
+	    return;
+	}
+	drv = new IDGPowerPerDriver(tmpdrvs[drvselected], drvselected, verbose, sel);
+
+	enabled = drv->getndevs() > 0;
     }
     ~IDGPower() {
+	if (drv) delete drv;
 	if (verbose >= 2) std::cout << "IDGPower is destructed" << std::endl;
     }
 
     int isEnabled() { return enabled; }
-    int getndevs() { return drvs[drvselected].getndevs(); }
-    IDGPowerPerDevice getIDGPowerPerDevice(int devid) {
-	return drvs[drvselected].getIDGPowerPerDevice(devid);
+    int getdrvid() { return drvselected; }
+    int getndevs() { return drv->getndevs(); }
+    ze_driver_handle_t getdrvh() { return drv->getdrvh(); }
+    IDGPowerPerDevice& getIDGPowerPerDevice(int devid) {
+	return drv->getIDGPowerPerDevice(devid);
     }
 };
 
-// singleton object of IDGPower
-static IDGPower *apmidg = NULL;
+// IDGDomIndex numbers every sampled domain: the power, frequency and
+// temperature domains device by device, then the CPU RAPL zones. The
+// sampler, the windowed statistics and the history use it for their
+// per-domain arrays
+class IDGDomIndex {
+    std::vector<int> pwr_base, freq_base, temp_base;
+    int rapl_base;
+    int nrapl;
 
-// protect control features
-static std::mutex apmidg_mutex;
+public:
+    IDGDomIndex(IDGPower *pm, IDGRapl *rapl) {
+	int idx = 0;
+	for (int di = 0; di < pm->getndevs(); di++) {
+	    IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+	    pwr_base.push_back(idx);
+	    idx += perdev.getnpwrdoms();
+	    freq_base.push_back(idx);
+	    idx += perdev.getnfreqdoms();
+	    temp_base.push_back(idx);
+	    idx += perdev.getntempsensors();
+	}
+	rapl_base = idx;
+	nrapl = rapl ? rapl->getnzones() : 0;
+    }
 
-// the availablity of features
+    int getndoms() const { return rapl_base + nrapl; }
+    int getngpudoms() const { return rapl_base; }
+
+    int pwr(int devid, int id) const { return pwr_base[devid] + id; }
+    int freq(int devid, int id) const { return freq_base[devid] + id; }
+    int temp(int devid, int id) const { return temp_base[devid] + id; }
+    int cpu(int id) const { return rapl_base + id; }
+
+    // return -1 if the domain does not exist. devid is ignored for
+    // APMIDG_SAMPLE_CPU_POWER
+    int get(IDGPower *pm, int devid, int kind, int id) const {
+	if (id < 0) return -1;
+	if (kind == APMIDG_SAMPLE_CPU_POWER) return id < nrapl ? cpu(id) : -1;
+	if (devid < 0 || devid >= pm->getndevs()) return -1;
+	IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(devid);
+	switch (kind) {
+	case APMIDG_SAMPLE_POWER:
+	    return id < perdev.getnpwrdoms() ? pwr(devid, id) : -1;
+	case APMIDG_SAMPLE_FREQ:
+	    return id < perdev.getnfreqdoms() ? freq(devid, id) : -1;
+	case APMIDG_SAMPLE_TEMP:
+	    return id < perdev.getntempsensors() ? temp(devid, id) : -1;
+	}
+	return -1;
+    }
+};
 
+// the readers of apmidg_sampler, apmidg_wstats and apmidg_history,
+// which load them without a lock. a stopped one is freed after a
+// grace period (see apmidg_grace.h)
+static APMIDGGrace apmidg_grace;
 
-#define EXTERNC extern "C"
+// the windowed statistics. NULL unless apmidg_wstats_start() is
+// called. fed by the sampler
+static std::atomic<IDGWStats*> apmidg_wstats(NULL);
 
-EXTERNC int apmidg_getndevs() {
-    if (!apmidg) return -1;
-    return apmidg->getndevs();
-}
+// the telemetry history. NULL unless apmidg_history_start() is called.
+// fed by the sampler, or by the read paths while it does not run
+static std::atomic<IDGHistory*> apmidg_history(NULL);
 
-EXTERNC int apmidg_getnpwrdoms(int devid) {
-    if (!apmidg) return -1;
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    return perdev.getnpwrdoms();
-}
+// the threshold watches. NULL until apmidg_watch() is first called.
+// the polled ones are fed like the history
+static std::atomic<IDGWatch*> apmidg_watches(NULL);
 
-EXTERNC void apmidg_getpwrprops(int devid, int pwrid, int *onsubdev, int *subdevid, int *canctrl, int *deflim_mw, int *minlim_mw, int *maxlim_mw) {
+// IDGSampler polls all domains on a dedicated thread and publishes
+// apmidg_sample_t into a lock-free ring. The sampler keeps its own
+// energy baseline, so it does not disturb apmidg_readpoweravg().
+class IDGSampler {
+    IDGPower *pm;
+    int verbose;
+    double rate_hz;
+    IDGDomIndex dix;
+
+    APMIDGRing<apmidg_sample_t> ring;
+
+    // the latest sample of each domain, by the IDGDomIndex
+    std::vector<APMIDGSeqlock<apmidg_sample_t>> latest;
+    std::vector<zes_power_energy_counter_t> prev_ecounter; // sampler thread only
+    IDGRapl *rapl; // NULL if no RAPL zone
+    std::vector<zes_power_energy_counter_t> prev_rapl; // sampler thread only
+    IDGWStats *wstats; // loaded once per pass, within a grace reader
+    IDGHistory *history; // loaded once per pass, within a grace reader
+    IDGWatch *watches; // loaded once per pass
+    uint64_t nticks;
+
+    std::atomic<bool> running;
+    std::thread th;
+
+    static uint64_t defcapacity(int ndoms, double rate_hz, int capacity) {
+	if (capacity > 0) return capacity;
+	uint64_t n = (uint64_t)(ndoms * rate_hz); // about one second
+	return n < 4096 ? 4096 : n;
+    }
 
-    if (onsubdev) *onsubdev = -1;
-    if (subdevid) *subdevid = -1;
-    if (canctrl)  *canctrl = -1;
-    if (deflim_mw) *deflim_mw = -1;
-    if (minlim_mw) *minlim_mw = -1;
-    if (maxlim_mw) *maxlim_mw = -1;
+    // a power sample without an interval is published as 0 W but not
+    // counted in the statistics
+    void publish(apmidg_sample_t &s, int idx, bool valid = true) {
+	ring.push(s);
+	latest[idx].store(s, nticks * 2);
+	if (!valid) return;
+	if (wstats) wstats->add(idx, s.ts_us, s.value);
+	if (history) history->add(idx, s.ts_us, s.value, s.kind == APMIDG_SAMPLE_POWER || s.kind == APMIDG_SAMPLE_CPU_POWER);
+	if (watches && watches->has(idx)) watches->eval(idx, s.ts_us, s.value, false);
+    }
 
-    if (!apmidg) return;
+    void sampleall() {
+	ze_result_t res;
+	apmidg_sample_t s = {};
+
+	APMIDGGraceReader reader(apmidg_grace);
+	nticks++;
+	wstats = apmidg_wstats.load(std::memory_order_acquire);
+	history = apmidg_history.load(std::memory_order_acquire);
+	watches = apmidg_watches.load(std::memory_order_acquire);
+	for (int di = 0; di < pm->getndevs(); di++) {
+	    IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+	    s.devid = di;
+
+	    s.kind = APMIDG_SAMPLE_POWER;
+	    for (int id = 0; id < perdev.getnpwrdoms(); id++) {
+		zes_power_energy_counter_t ecounter;
+		zes_power_energy_counter_t &prev = prev_ecounter[dix.pwr(di, id)];
+		if (perdev.readenergy(id, ecounter) != ZE_RESULT_SUCCESS) continue;
+		s.ts_us = gettime_us();
+		s.id = id;
+		s.energy_uj = ecounter.energy;
+		s.energy_ts_us = ecounter.timestamp;
+		s.value = 0.0;
+		bool valid = ecounter.timestamp > prev.timestamp && prev.timestamp > 0;
+		if (valid)
+		    s.value = (double)energydelta(prev.energy, ecounter.energy, ecounter.timestamp - prev.timestamp) / (ecounter.timestamp - prev.timestamp);
+		prev = ecounter;
+		publish(s, dix.pwr(di, id), valid);
+	    }
 
-    ze_result_t res;
+	    s.kind = APMIDG_SAMPLE_FREQ;
+	    s.energy_uj = 0;
+	    s.energy_ts_us = 0;
+	    for (int id = 0; id < perdev.getnfreqdoms(); id++) {
+		zes_freq_state_t fstate = {};
+		// a failed read publishes nothing, as a sentinel value
+		// would look like data to the ring readers
+		if (perdev.readfreq(id, fstate) != ZE_RESULT_SUCCESS) continue;
+		s.ts_us = gettime_us();
+		s.id = id;
+		s.value = fstate.actual;
+		publish(s, dix.freq(di, id));
+	    }
 
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_pwr_handle_t pwrh = perdev.getpwrh(pwrid);
-
-    zes_power_properties_t pprop = {};
-    zes_power_ext_properties_t extprop = {};
-    zes_power_limit_ext_desc_t deflim = {};
-    extprop.stype = ZES_STRUCTURE_TYPE_POWER_EXT_PROPERTIES;
-    extprop.defaultLimit = &deflim;
-    pprop.pNext = &extprop;
-    res = zesPowerGetProperties(pwrh, &pprop);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetProperties", res);
-
-    if (onsubdev) *onsubdev = (int)pprop.onSubdevice;
-    if (subdevid) *subdevid = (int)pprop.subdeviceId;
-    if (canctrl)  *canctrl = (int)pprop.canControl;
-    if (0) {
-	if (deflim_mw) *deflim_mw = (int)pprop.defaultLimit; // deprecated
-	if (minlim_mw) *minlim_mw = (int)pprop.minLimit; // deprecated
-	if (maxlim_mw) *maxlim_mw = (int)pprop.maxLimit; // deprecated
-    }
-    if (deflim_mw) *deflim_mw = (int)deflim.limit;
-    if (minlim_mw) *minlim_mw = (int)-1; // doesn't look like there is an API to retrieve minlim
-    if (maxlim_mw) *maxlim_mw = (int)deflim.limit;
+	    s.kind = APMIDG_SAMPLE_TEMP;
+	    for (int id = 0; id < perdev.getntempsensors(); id++) {
+		double temp_C = -1.0;
+		res = apmidg_be->zesTemperatureGetState(perdev.gettemph(id), &temp_C);
+		if (res != ZE_RESULT_SUCCESS) {
+		    _ZE_ERROR_MSG_NOTERMINATE("zesTemperatureGetState", res);
+		    continue;
+		}
+		s.ts_us = gettime_us();
+		s.id = id;
+		s.value = temp_C;
+		publish(s, dix.temp(di, id));
+	    }
+	}
 
-#if 0
-    // Workaround. L0 sets defaultLimit, mixLimit, and maxLimt -1 (looks like deprecated)
-    // minLimt may not be available (depends on sysfs entried created by the hwmon driver)
-    // Remove this later once an alternative way to read deflim and maxlim is implemented
-    static bool msgdisplayed = false;
-    std::string buf;
-    std::fstream fs;
-    int workaround_maxlimit=-1;
-    for (int id=0; id<8; id++) {
+	// the CPU in the same pass, so the node power is time-aligned
+	if (rapl) {
+	    s.devid = -1;
+	    s.kind = APMIDG_SAMPLE_CPU_POWER;
+	    for (int id = 0; id < rapl->getnzones(); id++) {
+		zes_power_energy_counter_t &prev = prev_rapl[id];
+		uint64_t energy_uj, ts_us;
+		if (!rapl->readenergy(id, energy_uj, ts_us)) continue;
+		s.ts_us = ts_us;
+		s.id = id;
+		s.energy_uj = energy_uj;
+		s.energy_ts_us = ts_us;
+		s.value = 0.0;
+		bool valid = ts_us > prev.timestamp && prev.timestamp > 0;
+		if (valid)
+		    s.value = (double)(energy_uj - prev.energy) / (ts_us - prev.timestamp);
+		prev.energy = energy_uj;
+		prev.timestamp = ts_us;
+		publish(s, dix.cpu(id), valid);
+	    }
+	}
+    }
+
+    void loop() {
+	struct timespec next;
+	long period_ns = (long)(1e9 / rate_hz);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (running.load(std::memory_order_relaxed)) {
+	    sampleall();
+
+	    next.tv_nsec += period_ns;
+	    while (next.tv_nsec >= 1000000000L) {
+		next.tv_nsec -= 1000000000L;
+		next.tv_sec++;
+	    }
+	    // skip missed periods instead of bursting to catch up
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+		next = now;
+	    else
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+    }
+
+public:
+    IDGSampler(IDGPower *_pm, IDGRapl *_rapl, double _rate_hz, int capacity, int _ver = 1)
+	: pm(_pm), verbose(_ver), rate_hz(_rate_hz > 0.0 ? _rate_hz : 1000.0), dix(_pm, _rapl),
+	  ring(defcapacity(dix.getndoms(), rate_hz, capacity)),
+	  latest(dix.getndoms()), rapl(_rapl), wstats(NULL), history(NULL), watches(NULL), nticks(0) {
+	prev_ecounter.resize(dix.getngpudoms());
+	for (auto &e : prev_ecounter) e = {};
+	prev_rapl.resize(rapl ? rapl->getnzones() : 0);
+	for (auto &e : prev_rapl) e = {};
+
+	running = true;
+	th = std::thread(&IDGSampler::loop, this);
+
+	if (verbose >= 2) std::cout << "IDGSampler is started: rate_hz=" << rate_hz << " capacity=" << ring.capacity() << std::endl;
+    }
+
+    ~IDGSampler() {
+	stop();
+    }
+
+    void stop() {
+	running = false;
+	if (th.joinable()) {
+	    th.join();
+	    if (verbose >= 2) std::cout << "IDGSampler is stopped" << std::endl;
+	}
+    }
+
+    double getrate() const { return rate_hz; }
+
+    uint64_t gethead() { return ring.gethead(); }
+
+    int read(uint64_t &cursor, apmidg_sample_t *buf, int n) {
+	return (int)ring.read(cursor, buf, n);
+    }
+
+    int getlatest(int devid, int kind, int id, apmidg_sample_t &s) {
+	int idx = dix.get(pm, devid, kind, id);
+	if (idx < 0) return -1;
+	latest[idx].loadlatest(s);
+	return s.ts_us > 0 ? 0 : -1; // no sample yet
+    }
+};
+
+// IDGEnergyPoll reads every energy counter at a fixed period on a
+// dedicated thread, so the accumulated energy (IDGEnergyAcc) catches
+// every 32-bit wrap even if nobody reads the counters. A pass is
+// skipped while the sampler reads them at least as often. The
+// default period covers up to 4.2 kW per domain.
+#define APMIDG_ACC_POLL_MS (1000)
+
+class IDGEnergyPoll {
+    IDGPower *pm;
+    std::atomic<IDGSampler*> &sampler;
+    uint64_t period_ms;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool running;
+    std::thread th;
+
+    void loop() {
+	std::unique_lock<std::mutex> lock(mtx);
+
+	while (!cv.wait_for(lock, std::chrono::milliseconds(period_ms), [this] { return !running; })) {
+	    lock.unlock();
+	    {
+		APMIDGGraceReader reader(apmidg_grace);
+		IDGSampler *sp = sampler.load(std::memory_order_acquire);
+		if (sp && sp->getrate() * period_ms >= 1000.0) {
+		    lock.lock();
+		    continue;
+		}
+	    }
+	    for (int di = 0; di < pm->getndevs(); di++) {
+		IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+		for (int id = 0; id < perdev.getnpwrdoms(); id++) {
+		    zes_power_energy_counter_t ecounter;
+		    perdev.readenergy(id, ecounter); // feeds the accumulation
+		}
+	    }
+	    lock.lock();
+	}
+    }
+
+public:
+    IDGEnergyPoll(IDGPower *_pm, std::atomic<IDGSampler*> &_sampler, uint64_t _period_ms)
+	: pm(_pm), sampler(_sampler), period_ms(_period_ms), running(true) {
+	th = std::thread(&IDGEnergyPoll::loop, this);
+    }
+
+    ~IDGEnergyPoll() {
+	{
+	    std::lock_guard<std::mutex> lock(mtx);
+	    running = false;
+	}
+	cv.notify_all();
+	if (th.joinable()) th.join();
+    }
+
+    uint64_t getperiod() const { return period_ms; }
+};
+
+// IDGController holds a power or temperature target with one PID loop
+// per device (or one for the node) on a dedicated thread, actuating
+// the sustained power limit or the max frequency. See apmidg_ctrl_start().
+//
+// The loop is in the positional form u = kp*e + I + kd*d, where the
+// integral I is kept in output units and starts at the output found at
+// start, so starting is bumpless. I stops integrating while the output
+// is clamped or rate-limited in the direction of the error
+// (conditional integration), so the loop recovers at once when the
+// demand comes back. d is the derivative of the measurement, not of
+// the error, so a target change does not kick.
+struct IDGCtrlLoop {
+    double target;
+    double measured;
+    double prev_measured;
+    double output;
+    double integral;
+    uint64_t nsteps;
+    bool saturated;
+    uint64_t nheld;
+};
+
+class IDGController {
+    IDGPower *pm;
+    int verbose;
+    apmidg_ctrl_config_t cfg;
+    bool nodemode;
+
+    std::vector<IDGCtrlLoop> loops; // one, or one per device
+    std::vector<double> outmin, outmax; // per device
+    std::vector<int> pwrid; // the power domain to actuate. -1 if none
+
+    // per device. the last measurement and the applied output
+    std::vector<double> devmeas, devout;
+    std::vector<char> devvalid; // the last measurement succeeded
+    std::vector<uint64_t> prev_energy_uj, prev_meas_us;
+    uint64_t prev_ts_us;
+
+    // restored by stop(true)
+    std::vector<int> saved_pwrlim_mw;
+    std::vector<std::vector<zes_freq_range_t>> saved_freqrange;
+
+    std::mutex mtx; // the loops and devmeas/devout, vs. the API
+    std::condition_variable cv;
+    bool running;
+    std::thread th;
+
+    bool ispower() { return cfg.mode != APMIDG_CTRL_DEV_TEMP; }
+
+    void initoutputs() {
+	int ndevs = pm->getndevs();
+
+	pwrid.assign(ndevs, -1);
+	outmin.resize(ndevs);
+	outmax.resize(ndevs);
+	devout.resize(ndevs);
+	saved_pwrlim_mw.assign(ndevs, -1);
+	saved_freqrange.resize(ndevs);
+	for (int di = 0; di < ndevs; di++) {
+	    IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+
+	    if (cfg.actuator == APMIDG_CTRL_ACT_PWRLIM) {
+		for (int id = 0; id < perdev.getnpwrdoms(); id++) {
+		    const IDGPwrProps &p = perdev.getpwrprops(id);
+		    if (p.canctrl > 0 && p.onsubdev == 0) {
+			pwrid[di] = id;
+			break;
+		    }
+		}
+		if (pwrid[di] < 0) {
+		    outmin[di] = outmax[di] = devout[di] = 0.0;
+		    continue;
+		}
+		// no API reports the range. the default limit is the max
+		double deflim_W = perdev.getpwrprops(pwrid[di]).deflim_mw / 1000.0;
+		int lim_mw = perdev.getpwrlim(pwrid[di]);
+		saved_pwrlim_mw[di] = lim_mw;
+		outmax[di] = cfg.out_max > 0.0 ? cfg.out_max : deflim_W;
+		outmin[di] = cfg.out_min > 0.0 ? cfg.out_min : deflim_W / 4.0;
+		devout[di] = lim_mw > 0 ? lim_mw / 1000.0 : outmax[di];
+	    } else {
+		double fmin = 0.0, fmax = 0.0;
+		for (int id = 0; id < perdev.getnfreqdoms(); id++) {
+		    const IDGFreqProps &p = perdev.getfreqprops(id);
+		    zes_freq_range_t r = {-1.0, -1.0};
+		    perdev.getfreqrange(id, r);
+		    saved_freqrange[di].push_back(r);
+		    if (id == 0 || p.min_MHz < fmin) fmin = p.min_MHz;
+		    if (id == 0 || p.max_MHz > fmax) fmax = p.max_MHz;
+		    if (id == 0) devout[di] = r.max > 0.0 ? r.max : p.max_MHz;
+		}
+		outmax[di] = cfg.out_max > 0.0 ? cfg.out_max : fmax;
+		outmin[di] = cfg.out_min > 0.0 ? cfg.out_min : fmin;
+	    }
+	    devout[di] = std::min(std::max(devout[di], outmin[di]), outmax[di]);
+	}
+    }
+
+    // the loop bounds. the node loop outputs the sum of the power
+    // limits, or a common frequency cap
+    void getbounds(int li, double &lo, double &hi) {
+	if (!nodemode) {
+	    lo = outmin[li];
+	    hi = outmax[li];
+	    return;
+	}
+	lo = hi = 0.0;
+	for (int di = 0; di < pm->getndevs(); di++) {
+	    if (cfg.actuator == APMIDG_CTRL_ACT_PWRLIM) {
+		lo += outmin[di];
+		hi += outmax[di];
+	    } else {
+		if (di == 0 || outmin[di] < lo) lo = outmin[di];
+		if (di == 0 || outmax[di] > hi) hi = outmax[di];
+	    }
+	}
+    }
+
+    // return false until there are two readings. a device whose
+    // reads all failed (or that has no sensor) is marked invalid and
+    // keeps its last measurement
+    bool measure(double dt_s) {
+	for (int di = 0; di < pm->getndevs(); di++) {
+	    IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+
+	    devvalid[di] = 0;
+	    if (ispower()) {
+		bool ok;
+		uint64_t e = perdev.getenergytotal(true, &ok);
+		if (!ok) continue;
+		// over the time since the last good reading, which spans
+		// the failed periods
+		uint64_t now = gettime_us();
+		if (prev_meas_us[di] > 0 && now > prev_meas_us[di]) {
+		    devmeas[di] = (e - prev_energy_uj[di]) / (double)(now - prev_meas_us[di]);
+		    devvalid[di] = 1;
+		}
+		prev_energy_uj[di] = e;
+		prev_meas_us[di] = now;
+	    } else {
+		bool any = false;
+		double tmax = 0.0;
+		for (int id = 0; id < perdev.getntempsensors(); id++) {
+		    double temp_C = -1.0;
+		    ze_result_t res = apmidg_be->zesTemperatureGetState(perdev.gettemph(id), &temp_C);
+		    if (res != ZE_RESULT_SUCCESS) {
+			_ZE_ERROR_MSG_NOTERMINATE("zesTemperatureGetState", res);
+			continue;
+		    }
+		    if (!any || temp_C > tmax) tmax = temp_C;
+		    any = true;
+		}
+		if (any) {
+		    devmeas[di] = tmax;
+		    devvalid[di] = 1;
+		}
+	    }
+	}
+	return dt_s > 0.0 || !ispower();
+    }
+
+    void pidstep(IDGCtrlLoop &l, double meas, double dt_s, double lo, double hi) {
+	double e = l.target - meas;
+	double d = l.nsteps > 0 ? -(meas - l.prev_measured) / dt_s : 0.0;
+	double integral = l.integral + cfg.ki * e * dt_s;
+	double u = cfg.kp * e + integral + cfg.kd * d;
+
+	// clamp, then limit the rate
+	double ulim = std::min(std::max(u, lo), hi);
+	if (cfg.max_step > 0.0)
+	    ulim = std::min(std::max(ulim, l.output - cfg.max_step), l.output + cfg.max_step);
+
+	l.saturated = ulim != u;
+	// anti-windup: hold the integral if it would push further into
+	// the limit
+	if (!(l.saturated && (u - ulim) * e > 0.0))
+	    l.integral = std::min(std::max(integral, lo), hi);
+
+	l.measured = meas;
+	l.prev_measured = meas;
+	l.output = ulim;
+	l.nsteps++;
+    }
+
+    void actuate(int di, double u) {
+	IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+
+	u = std::min(std::max(u, outmin[di]), outmax[di]);
+	bool ok = true;
+	if (cfg.actuator == APMIDG_CTRL_ACT_PWRLIM) {
+	    if (pwrid[di] < 0) return;
+	    // skip writes that would not change the limit
+	    if ((int)(u * 1000.0) != (int)(devout[di] * 1000.0))
+		ok = perdev.setpwrlim(pwrid[di], (int)(u * 1000.0)) == 0;
+	} else {
+	    if ((int)u != (int)devout[di]) {
+		for (int id = 0; id < perdev.getnfreqdoms(); id++) {
+		    zes_freq_range_t r = {perdev.getfreqprops(id).min_MHz, (double)(int)u};
+		    if (perdev.setfreqrange(id, r) != ZE_RESULT_SUCCESS) ok = false;
+		}
+	    }
+	}
+	// devout is what the device has. after a failed write the next
+	// step sees the difference and writes again
+	if (ok) devout[di] = u;
+    }
+
+    void step(double dt_s) {
+	std::lock_guard<std::mutex> lock(mtx);
+	int ndevs = pm->getndevs();
+
+	if (!measure(dt_s)) return;
+
+	// an invalid measurement holds the output of its loop, rather
+	// than driving it toward a bound
+	if (!nodemode) {
+	    for (int di = 0; di < ndevs; di++) {
+		double lo, hi;
+		if (!devvalid[di]) {
+		    loops[di].nheld++;
+		    continue;
+		}
+		getbounds(di, lo, hi);
+		pidstep(loops[di], devmeas[di], dt_s, lo, hi);
+		actuate(di, loops[di].output);
+	    }
+	    return;
+	}
+
+	double lo, hi, sum = 0.0;
+	for (int di = 0; di < ndevs; di++) {
+	    if (!devvalid[di]) {
+		loops[0].nheld++;
+		return;
+	    }
+	    sum += devmeas[di];
+	}
+	getbounds(0, lo, hi);
+	pidstep(loops[0], sum, dt_s, lo, hi);
+	// split the node budget in proportion to the max limits
+	for (int di = 0; di < ndevs; di++) {
+	    double u = loops[0].output;
+	    if (cfg.actuator == APMIDG_CTRL_ACT_PWRLIM) u = hi > 0.0 ? u * outmax[di] / hi : 0.0;
+	    actuate(di, u);
+	}
+    }
+
+    void loop() {
+	uint64_t period_us = (uint64_t)(cfg.period_ms * 1000.0);
+	std::unique_lock<std::mutex> lock(mtx);
+	auto next = std::chrono::steady_clock::now();
+
+	prev_ts_us = 0;
+	while (running) {
+	    lock.unlock();
+	    uint64_t now = gettime_us();
+	    step(prev_ts_us > 0 ? (now - prev_ts_us) * 1e-6 : 0.0);
+	    prev_ts_us = now;
+	    lock.lock();
+
+	    next += std::chrono::microseconds(period_us);
+	    cv.wait_until(lock, next, [this] { return !running; });
+	}
+    }
+
+public:
+    IDGController(IDGPower *_pm, const apmidg_ctrl_config_t &_cfg, int _ver = 1)
+	: pm(_pm), verbose(_ver), cfg(_cfg), prev_ts_us(0), running(false) {
+	int ndevs = pm->getndevs();
+
+	nodemode = cfg.mode == APMIDG_CTRL_NODE_POWER;
+	devmeas.assign(ndevs, 0.0);
+	devvalid.assign(ndevs, 0);
+	prev_energy_uj.assign(ndevs, 0);
+	prev_meas_us.assign(ndevs, 0);
+	initoutputs();
+
+	loops.resize(nodemode ? 1 : ndevs);
+	for (int li = 0; li < (int)loops.size(); li++) {
+	    IDGCtrlLoop &l = loops[li];
+	    double u = 0.0;
+	    if (nodemode && cfg.actuator == APMIDG_CTRL_ACT_PWRLIM)
+		for (int di = 0; di < ndevs; di++) u += devout[di];
+	    else
+		u = devout[nodemode ? 0 : li];
+	    l = {cfg.target, 0.0, 0.0, u, u, 0, false, 0};
+	}
+    }
+
+    ~IDGController() {
+	stop(false);
+    }
+
+    // check the config before a thread is started
+    static const char *validate(const apmidg_ctrl_config_t &cfg) {
+	if (cfg.mode < APMIDG_CTRL_NODE_POWER || cfg.mode > APMIDG_CTRL_DEV_TEMP) return "invalid mode";
+	if (cfg.actuator < APMIDG_CTRL_ACT_PWRLIM || cfg.actuator > APMIDG_CTRL_ACT_FREQ) return "invalid actuator";
+	if (!(cfg.period_ms >= 1.0)) return "period_ms must be 1 or larger";
+	if (!(cfg.target > 0.0)) return "target must be positive";
+	if (cfg.kp < 0.0 || cfg.ki < 0.0 || cfg.kd < 0.0 || cfg.max_step < 0.0) return "negative gain or step";
+	return NULL;
+    }
+
+    void start() {
+	running = true;
+	th = std::thread(&IDGController::loop, this);
+	if (verbose >= 2) std::cout << "IDGController is started: mode=" << cfg.mode << " actuator=" << cfg.actuator << std::endl;
+    }
+
+    void stop(bool restore) {
+	{
+	    std::lock_guard<std::mutex> lock(mtx);
+	    running = false;
+	}
+	cv.notify_all();
+	if (th.joinable()) {
+	    th.join();
+	    if (verbose >= 2) std::cout << "IDGController is stopped" << std::endl;
+	}
+	if (!restore) return;
+
+	for (int di = 0; di < pm->getndevs(); di++) {
+	    IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+	    if (cfg.actuator == APMIDG_CTRL_ACT_PWRLIM) {
+		if (pwrid[di] >= 0 && saved_pwrlim_mw[di] > 0) perdev.setpwrlim(pwrid[di], saved_pwrlim_mw[di]);
+	    } else {
+		for (int id = 0; id < (int)saved_freqrange[di].size(); id++)
+		    if (saved_freqrange[di][id].max > 0.0) perdev.setfreqrange(id, saved_freqrange[di][id]);
+	    }
+	}
+    }
+
+    int getactuator() { return cfg.actuator; }
+
+    // devid < 0 sets all loops
+    int settarget(int devid, double target) {
+	if (!(target > 0.0)) return -1;
+	std::lock_guard<std::mutex> lock(mtx);
+	if (nodemode || devid < 0) {
+	    for (auto &l : loops) l.target = target;
+	    return 0;
+	}
+	if (devid >= (int)loops.size()) return -1;
+	loops[devid].target = target;
+	return 0;
+    }
+
+    // in the node mode, devid < 0 returns the node loop and devid >= 0
+    // the measurement and the output of the device. the output of a
+    // device is the limit it has, not one that failed to be written
+    int getstate(int devid, apmidg_ctrl_state_t &st) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (devid >= pm->getndevs() || (devid < 0 && !nodemode)) return -1;
+
+	const IDGCtrlLoop &l = loops[nodemode ? 0 : devid];
+	st.mode = cfg.mode;
+	st.actuator = cfg.actuator;
+	st.target = l.target;
+	st.measured = (nodemode && devid >= 0) ? devmeas[devid] : l.measured;
+	st.output = devid >= 0 ? devout[devid] : l.output;
+	st.integral = l.integral;
+	st.nsteps = l.nsteps;
+	st.saturated = l.saturated;
+	st.nheld = l.nheld;
+	return 0;
+    }
+};
+
+// IDGBudget keeps the sum of the sustained power limits of all devices
+// at a node budget and periodically moves watts from the devices that
+// run under their limit to the devices pinned at it. See
+// apmidg_budget_start().
+struct IDGBudgetDev {
+    int pwrid;         // the card domain. -1 if the limit is not controllable
+    double lo_W, hi_W; // the bounds of the limit
+    double fair_W;     // the share of the budget in proportion to hi_W
+    int saved_mw;      // the limit at start
+    double limit_W;
+    double power_W;
+    double freq_MHz, freqreq_MHz; // the average over the domains
+    uint64_t prev_energy_uj;
+    bool pinned;       // draws the limit and is throttled by it
+};
+
+class IDGBudget {
+    IDGPower *pm;
+    int verbose;
+    apmidg_budget_config_t cfg;
+
+    std::vector<IDGBudgetDev> devs;
+    uint64_t nsteps;
+    double moved_W; // the total moved so far
+
+    std::mutex mtx; // devs, cfg.budget_W, vs. the API
+    std::condition_variable cv;
+    bool running;
+    std::thread th;
+
+    double sumlimits() {
+	double s = 0.0;
+	for (auto &d : devs) if (d.pwrid >= 0) s += d.limit_W;
+	return s;
+    }
+
+    void setfair() {
+	double sumhi = 0.0;
+	for (auto &d : devs) if (d.pwrid >= 0) sumhi += d.hi_W;
+	for (auto &d : devs)
+	    d.fair_W = (d.pwrid >= 0 && sumhi > 0.0) ? std::min(std::max(cfg.budget_W * d.hi_W / sumhi, d.lo_W), d.hi_W) : 0.0;
+    }
+
+    void apply(int di) {
+	IDGBudgetDev &d = devs[di];
+	int mw = (int)(d.limit_W * 1000.0);
+	if (mw != pm->getIDGPowerPerDevice(di).getpwrlim(d.pwrid))
+	    pm->getIDGPowerPerDevice(di).setpwrlim(d.pwrid, mw);
+    }
+
+    void measure(double dt_s) {
+	for (int di = 0; di < (int)devs.size(); di++) {
+	    IDGBudgetDev &d = devs[di];
+	    IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+
+	    uint64_t e = perdev.getenergytotal(true);
+	    if (dt_s > 0.0) d.power_W = (e - d.prev_energy_uj) * 1e-6 / dt_s;
+	    d.prev_energy_uj = e;
+
+	    int n = 0;
+	    bool throttled = false;
+	    d.freq_MHz = d.freqreq_MHz = 0.0;
+	    for (int id = 0; id < perdev.getnfreqdoms(); id++) {
+		zes_freq_state_t fstate = {};
+		if (perdev.readfreq(id, fstate) != ZE_RESULT_SUCCESS) continue;
+		d.freq_MHz += fstate.actual;
+		d.freqreq_MHz += fstate.request;
+		if (fstate.throttleReasons & (ZES_FREQ_THROTTLE_REASON_FLAG_AVE_PWR_CAP |
+					      ZES_FREQ_THROTTLE_REASON_FLAG_BURST_PWR_CAP)) throttled = true;
+		n++;
+	    }
+	    if (n > 0) {
+		d.freq_MHz /= n;
+		d.freqreq_MHz /= n;
+	    }
+	    // within 5% of the limit, and the frequency is held below the
+	    // request by a power cap (or unknown)
+	    d.pinned = d.pwrid >= 0 && d.power_W >= d.limit_W * 0.95 &&
+		(n == 0 || throttled || d.freq_MHz < d.freqreq_MHz * 0.97);
+	}
+    }
+
+    // one redistribution. donors are the devices with slack beyond
+    // guard_W, and, while a pinned device is below its fair share, the
+    // pinned devices above theirs. receivers are the other pinned
+    // devices. a donation not taken by a receiver is given back, so
+    // the limits only move when someone can use the watts
+    void redistribute() {
+	int n = devs.size();
+	std::vector<double> give(n, 0.0);
+	bool starved = false;
+
+	for (auto &d : devs)
+	    if (d.pinned && d.limit_W < d.fair_W) starved = true;
+
+	double pool = cfg.budget_W - sumlimits(); // nonzero after a budget change
+	double given = 0.0;
+	for (int i = 0; i < n; i++) {
+	    IDGBudgetDev &d = devs[i];
+	    if (d.pwrid < 0) continue;
+	    double g = 0.0;
+	    if (!d.pinned) g = d.limit_W - d.power_W - cfg.guard_W;
+	    else if (starved) g = d.limit_W - d.fair_W;
+	    g = std::min(std::min(g, cfg.max_step_W), d.limit_W - d.lo_W);
+	    if (g > 0.0) {
+		give[i] = g;
+		given += g;
+	    }
+	}
+
+	if (pool < 0.0) {
+	    // the budget was lowered. cut in proportion to the room above lo
+	    double room = 0.0;
+	    for (auto &d : devs) if (d.pwrid >= 0) room += d.limit_W - d.lo_W;
+	    for (auto &d : devs) {
+		if (d.pwrid < 0 || room <= 0.0) continue;
+		d.limit_W -= std::min(-pool, room) * (d.limit_W - d.lo_W) / room;
+	    }
+	    pool = 0.0;
+	}
+	pool += given;
+
+	// water-fill the receivers, max_step_W each per period
+	std::vector<double> take(n, 0.0);
+	for (int iter = 0; iter < n && pool > 1e-6; iter++) {
+	    int nrecv = 0;
+	    for (int i = 0; i < n; i++) {
+		IDGBudgetDev &d = devs[i];
+		if (d.pinned && give[i] == 0.0 && d.limit_W + take[i] < d.hi_W && take[i] < cfg.max_step_W) nrecv++;
+	    }
+	    if (nrecv == 0) break;
+	    double share = pool / nrecv;
+	    for (int i = 0; i < n; i++) {
+		IDGBudgetDev &d = devs[i];
+		if (!(d.pinned && give[i] == 0.0 && d.limit_W + take[i] < d.hi_W && take[i] < cfg.max_step_W)) continue;
+		double t = std::min(std::min(share, d.hi_W - d.limit_W - take[i]), cfg.max_step_W - take[i]);
+		take[i] += t;
+		pool -= t;
+	    }
+	}
+
+	// give back what nobody took, in proportion to the donations. a
+	// raised budget nobody could use stays unallocated
+	double used = given - std::max(pool, 0.0);
+	double ratio = given > 0.0 ? std::max(used, 0.0) / given : 0.0;
+	for (int i = 0; i < n; i++) {
+	    IDGBudgetDev &d = devs[i];
+	    if (d.pwrid < 0) continue;
+	    double delta = take[i] - give[i] * ratio;
+	    d.limit_W = std::min(std::max(d.limit_W + delta, d.lo_W), d.hi_W);
+	    moved_W += std::max(delta, 0.0);
+	    apply(i); // writes only if the limit changed
+	}
+    }
+
+    void step(double dt_s) {
+	std::lock_guard<std::mutex> lock(mtx);
+
+	measure(dt_s);
+	if (dt_s <= 0.0) return; // no power yet
+	redistribute();
+	nsteps++;
+    }
+
+    void loop() {
+	uint64_t period_us = (uint64_t)(cfg.period_ms * 1000.0);
+	std::unique_lock<std::mutex> lock(mtx);
+	auto next = std::chrono::steady_clock::now();
+	uint64_t prev_ts_us = 0;
+
+	while (running) {
+	    lock.unlock();
+	    uint64_t now = gettime_us();
+	    step(prev_ts_us > 0 ? (now - prev_ts_us) * 1e-6 : 0.0);
+	    prev_ts_us = now;
+	    lock.lock();
+
+	    next += std::chrono::microseconds(period_us);
+	    cv.wait_until(lock, next, [this] { return !running; });
+	}
+    }
+
+public:
+    IDGBudget(IDGPower *_pm, const apmidg_budget_config_t &_cfg, int _ver = 1)
+	: pm(_pm), verbose(_ver), cfg(_cfg), nsteps(0), moved_W(0.0), running(false) {
+	int ndevs = pm->getndevs();
+
+	devs.resize(ndevs);
+	for (int di = 0; di < ndevs; di++) {
+	    IDGBudgetDev &d = devs[di];
+	    IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(di);
+
+	    d = {};
+	    d.pwrid = -1;
+	    for (int id = 0; id < perdev.getnpwrdoms(); id++) {
+		const IDGPwrProps &p = perdev.getpwrprops(id);
+		if (p.canctrl > 0 && p.onsubdev == 0 && p.deflim_mw > 0) {
+		    d.pwrid = id;
+		    break;
+		}
+	    }
+	    if (d.pwrid < 0) continue;
+	    // the default limit is the max (see apmidg_getpwrprops())
+	    d.hi_W = perdev.getpwrprops(d.pwrid).deflim_mw / 1000.0;
+	    d.lo_W = cfg.min_W > 0.0 ? std::min(cfg.min_W, d.hi_W) : d.hi_W / 4.0;
+	    d.saved_mw = perdev.getpwrlim(d.pwrid);
+	}
+	setfair();
+    }
+
+    ~IDGBudget() {
+	stop(false);
+    }
+
+    static const char *validate(const apmidg_budget_config_t &cfg) {
+	if (!(cfg.budget_W > 0.0)) return "budget_W must be positive";
+	if (!(cfg.period_ms >= 1.0)) return "period_ms must be 1 or larger";
+	if (!(cfg.max_step_W > 0.0)) return "max_step_W must be positive";
+	if (cfg.guard_W < 0.0 || cfg.min_W < 0.0) return "negative guard_W or min_W";
+	return NULL;
+    }
+
+    // start from the fair shares
+    void start() {
+	for (int di = 0; di < (int)devs.size(); di++) {
+	    if (devs[di].pwrid < 0) continue;
+	    devs[di].limit_W = devs[di].fair_W;
+	    apply(di);
+	}
+	running = true;
+	th = std::thread(&IDGBudget::loop, this);
+	if (verbose >= 2) std::cout << "IDGBudget is started: budget_W=" << cfg.budget_W << std::endl;
+    }
+
+    void stop(bool restore) {
+	{
+	    std::lock_guard<std::mutex> lock(mtx);
+	    running = false;
+	}
+	cv.notify_all();
+	if (th.joinable()) {
+	    th.join();
+	    if (verbose >= 2) std::cout << "IDGBudget is stopped" << std::endl;
+	}
+	if (!restore) return;
+	for (int di = 0; di < (int)devs.size(); di++)
+	    if (devs[di].pwrid >= 0 && devs[di].saved_mw > 0)
+		pm->getIDGPowerPerDevice(di).setpwrlim(devs[di].pwrid, devs[di].saved_mw);
+    }
+
+    // the lowest budget the limits can add up to
+    double getfloor() {
+	double s = 0.0;
+	for (auto &d : devs) if (d.pwrid >= 0) s += d.lo_W;
+	return s;
+    }
+
+    // the next period moves the limits to the new sum
+    int setbudget(double budget_W) {
+	if (!(budget_W > 0.0)) return -1;
+	std::lock_guard<std::mutex> lock(mtx);
+	if (budget_W < getfloor()) {
+	    std::cout << "Warning: apmidg_budget_setbudget: " << budget_W
+		      << " W is below the sum of the lower bounds " << getfloor() << " W" << std::endl;
+	    return -1;
+	}
+	cfg.budget_W = budget_W;
+	setfair();
+	return 0;
+    }
+
+    int getstate(int devid, apmidg_budget_state_t &st) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (devid >= (int)devs.size()) return -1;
+
+	st.budget_W = cfg.budget_W;
+	st.allocated_W = sumlimits();
+	st.nsteps = nsteps;
+	st.moved_W = moved_W;
+	if (devid < 0) {
+	    st.limit_W = st.power_W = st.freq_MHz = st.lo_W = st.hi_W = -1.0;
+	    st.pinned = -1;
+	    st.power_W = 0.0;
+	    for (auto &d : devs) st.power_W += d.power_W;
+	    return 0;
+	}
+	const IDGBudgetDev &d = devs[devid];
+	st.limit_W = d.pwrid >= 0 ? d.limit_W : -1.0;
+	st.power_W = d.power_W;
+	st.freq_MHz = d.freq_MHz;
+	st.lo_W = d.lo_W;
+	st.hi_W = d.hi_W;
+	st.pinned = d.pinned;
+	return 0;
+    }
+};
+
+// IDGTempEvents drives temperature watches with the threshold events
+// of the sensors: threshold1 rises at the threshold and threshold2
+// falls at threshold - hysteresis. A thread listens to the devices of
+// the armed sensors and reads a sensor only when its device reports a
+// crossing, or while a crossing waits for its debounce. A sensor is
+// armed for one watch at most; the others are polled.
+struct IDGTempArm {
+    int wid;
+    int devid, tempid, idx;
+    zes_device_handle_t smh;
+    zes_temp_config_t saved; // restored at disarm
+};
+
+#define TEMPEV_FLAGS (ZES_EVENT_TYPE_FLAG_TEMP_THRESHOLD1 | ZES_EVENT_TYPE_FLAG_TEMP_THRESHOLD2)
+
+class IDGTempEvents {
+    IDGPower *pm;
+    IDGWatch *watches;
+    int verbose;
+
+    std::mutex mtx; // guards arms
+    std::vector<IDGTempArm> arms;
+
+    std::atomic<bool> running;
+    std::thread th;
+
+    // register the events of the device if an armed sensor is on it.
+    // the caller holds mtx
+    ze_result_t registerdev(zes_device_handle_t smh) {
+	zes_event_type_flags_t flags = 0;
+	for (auto &a : arms)
+	    if (a.smh == smh) flags = TEMPEV_FLAGS;
+	return apmidg_be->zesDeviceEventRegister(smh, flags);
+    }
+
+    void readeval(const IDGTempArm &a) {
+	IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(a.devid);
+	double temp_C = -1.0;
+	ze_result_t res = apmidg_be->zesTemperatureGetState(perdev.gettemph(a.tempid), &temp_C);
+	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG_NOTERMINATE("zesTemperatureGetState", res);
+	if (res == ZE_RESULT_SUCCESS) watches->eval(a.idx, gettime_us(), temp_C, true);
+    }
+
+    void loop() {
+	while (running.load(std::memory_order_relaxed)) {
+	    std::vector<IDGTempArm> snap;
+	    std::vector<zes_device_handle_t> devs;
+	    {
+		std::lock_guard<std::mutex> lock(mtx);
+		snap = arms;
+	    }
+	    bool pending = false;
+	    for (auto &a : snap) {
+		if (std::find(devs.begin(), devs.end(), a.smh) == devs.end()) devs.push_back(a.smh);
+		if (watches->haspending(a.idx)) pending = true;
+	    }
+	    // short while a debounce runs, otherwise only to notice stop
+	    uint32_t timeout_ms = pending ? 10 : 200;
+	    if (devs.empty()) {
+		usleep(timeout_ms * 1000);
+		continue;
+	    }
+
+	    std::vector<zes_event_type_flags_t> evs(devs.size(), 0);
+	    uint32_t nevs = 0;
+	    ze_result_t res = apmidg_be->zesDriverEventListen(pm->getdrvh(), timeout_ms, devs.size(), devs.data(), &nevs, evs.data());
+	    if (res != ZE_RESULT_SUCCESS) {
+		_ZE_ERROR_MSG_NOTERMINATE("zesDriverEventListen", res);
+		usleep(timeout_ms * 1000);
+		continue;
+	    }
+	    for (auto &a : snap) {
+		size_t j = std::find(devs.begin(), devs.end(), a.smh) - devs.begin();
+		if ((evs[j] & TEMPEV_FLAGS) || watches->haspending(a.idx)) readeval(a);
+	    }
+	}
+    }
+
+public:
+    IDGTempEvents(IDGPower *_pm, IDGWatch *_watches, int _ver = 1)
+	: pm(_pm), watches(_watches), verbose(_ver), running(false) {}
+
+    ~IDGTempEvents() {
+	running = false;
+	if (th.joinable()) th.join();
+	std::lock_guard<std::mutex> lock(mtx);
+	while (!arms.empty()) {
+	    IDGTempArm a = arms.back();
+	    arms.pop_back();
+	    apmidg_be->zesTemperatureSetConfig(pm->getIDGPowerPerDevice(a.devid).gettemph(a.tempid), &a.saved);
+	    registerdev(a.smh);
+	}
+    }
+
+    // return false if the sensor has no thresholds, is taken, or the
+    // configuration is not permitted. the watch is polled then
+    bool arm(int wid, int devid, int tempid, int idx, double threshold, double hysteresis) {
+	std::lock_guard<std::mutex> lock(mtx);
+	for (auto &a : arms)
+	    if (a.devid == devid && a.tempid == tempid) return false;
+
+	IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(devid);
+	zes_temp_handle_t temph = perdev.gettemph(tempid);
+	zes_temp_properties_t props = {};
+	props.stype = ZES_STRUCTURE_TYPE_TEMP_PROPERTIES;
+	if (apmidg_be->zesTemperatureGetProperties(temph, &props) != ZE_RESULT_SUCCESS) return false;
+	if (!props.isThreshold1Supported || !props.isThreshold2Supported) return false;
+
+	IDGTempArm a;
+	a.wid = wid;
+	a.devid = devid;
+	a.tempid = tempid;
+	a.idx = idx;
+	a.smh = perdev.getsysmanh();
+	a.saved = {};
+	a.saved.stype = ZES_STRUCTURE_TYPE_TEMP_CONFIG;
+	if (apmidg_be->zesTemperatureGetConfig(temph, &a.saved) != ZE_RESULT_SUCCESS) return false;
+
+	zes_temp_config_t cfg = a.saved;
+	cfg.threshold1 = {1, 0, threshold};
+	cfg.threshold2 = {0, 1, threshold - hysteresis};
+	ze_result_t res = apmidg_be->zesTemperatureSetConfig(temph, &cfg);
+	if (res != ZE_RESULT_SUCCESS) {
+	    // typically needs privileges. not an error
+	    if (verbose >= 2) std::cout << "apmidg_watch: zesTemperatureSetConfig: " << str_ze_result_t(res) << ". polling" << std::endl;
+	    return false;
+	}
+	arms.push_back(a);
+	res = registerdev(a.smh);
+	if (res != ZE_RESULT_SUCCESS) {
+	    if (verbose >= 2) std::cout << "apmidg_watch: zesDeviceEventRegister: " << str_ze_result_t(res) << ". polling" << std::endl;
+	    arms.pop_back();
+	    apmidg_be->zesTemperatureSetConfig(temph, &a.saved);
+	    return false;
+	}
+
+	if (!th.joinable()) {
+	    running = true;
+	    th = std::thread(&IDGTempEvents::loop, this);
+	}
+	return true;
+    }
+
+    // take the current temperature of a newly armed sensor, so one
+    // already above the threshold is reported
+    void poke(int wid) {
+	IDGTempArm a;
+	{
+	    std::lock_guard<std::mutex> lock(mtx);
+	    auto it = std::find_if(arms.begin(), arms.end(), [wid](const IDGTempArm &x) { return x.wid == wid; });
+	    if (it == arms.end()) return;
+	    a = *it;
+	}
+	readeval(a);
+    }
+
+    void disarm(int wid) {
+	std::lock_guard<std::mutex> lock(mtx);
+	auto it = std::find_if(arms.begin(), arms.end(), [wid](const IDGTempArm &x) { return x.wid == wid; });
+	if (it == arms.end()) return;
+	IDGTempArm a = *it;
+	arms.erase(it);
+	apmidg_be->zesTemperatureSetConfig(pm->getIDGPowerPerDevice(a.devid).gettemph(a.tempid), &a.saved);
+	registerdev(a.smh);
+    }
+
+    bool armed() {
+	std::lock_guard<std::mutex> lock(mtx);
+	return !arms.empty();
+    }
+};
+
+// IDGSetQueue applies the asynchronous limit changes on a worker
+// thread. Only the latest request of a domain is kept: a queued one
+// that is replaced completes as superseded. The domains are served in
+// the order they became pending, so a busy domain does not starve the
+// others. The completions are kept in a ring by request id for
+// apmidg_set_status().
+struct IDGSetReq {
+    uint64_t reqid;
+    int devid, kind, id;
+    int lim_mw;
+    zes_freq_range_t range;
+    apmidg_set_cb_t cb;
+    void *arg;
+    uint64_t ts_us; // when it was queued
+};
+
+#define SETQ_NRESULTS (4096)
+
+class IDGSetQueue {
+    IDGPower *pm;
+
+    std::mutex mtx;
+    std::condition_variable cv;     // work arrived or stop
+    std::condition_variable donecv; // a request completed
+    std::map<std::tuple<int, int, int>, IDGSetReq> pending; // by (kind, devid, id)
+    std::deque<std::tuple<int, int, int>> order;
+    std::deque<std::pair<IDGSetReq, apmidg_set_result_t>> notify; // superseded, to call back
+    std::vector<apmidg_set_result_t> results; // by reqid % SETQ_NRESULTS
+    uint64_t nextid;
+    int busy;       // a write or a callback in progress
+    bool running;
+    std::thread th;
+
+    apmidg_set_result_t mkresult(const IDGSetReq &r, int status) {
+	apmidg_set_result_t res;
+	res.reqid = r.reqid;
+	res.devid = r.devid;
+	res.kind = r.kind;
+	res.id = r.id;
+	res.status = status;
+	res.lim_mw = r.kind == APMIDG_SET_PWRLIM ? r.lim_mw : -1;
+	res.min_MHz = r.kind == APMIDG_SET_FREQLIMS ? r.range.min : -1.0;
+	res.max_MHz = r.kind == APMIDG_SET_FREQLIMS ? r.range.max : -1.0;
+	res.latency_us = gettime_us() - r.ts_us;
+	return res;
+    }
+
+    // the caller holds mtx
+    void record(const apmidg_set_result_t &res) {
+	results[res.reqid % SETQ_NRESULTS] = res;
+	donecv.notify_all();
+    }
+
+    int apply(const IDGSetReq &r) {
+	IDGPowerPerDevice &perdev = pm->getIDGPowerPerDevice(r.devid);
+
+	// compare with the driver, not with a cached value that another
+	// process may have changed since. the other domains keep their
+	// cache
+	if (r.kind == APMIDG_SET_PWRLIM) {
+	    if (!perdev.is_powerlimit_available()) return APMIDG_SET_FAILED;
+	    perdev.invalidatepwrlim(r.id);
+	    if (perdev.getpwrlim(r.id) == r.lim_mw) return APMIDG_SET_SKIPPED;
+	    return perdev.setpwrlim(r.id, r.lim_mw) == 0 ? APMIDG_SET_DONE : APMIDG_SET_FAILED;
+	}
+
+	// compare as the driver would store it. see setfreqrange()
+	const IDGFreqProps &props = perdev.getfreqprops(r.id);
+	zes_freq_range_t want = r.range, cur;
+	perdev.invalidatefreqrange(r.id);
+	if (props.min_MHz > 0.0 && want.min < props.min_MHz) want.min = props.min_MHz;
+	if (props.max_MHz > 0.0 && want.max > props.max_MHz) want.max = props.max_MHz;
+	if (perdev.getfreqrange(r.id, cur) == ZE_RESULT_SUCCESS && cur.min == want.min && cur.max == want.max)
+	    return APMIDG_SET_SKIPPED;
+	return perdev.setfreqrange(r.id, r.range) == ZE_RESULT_SUCCESS ? APMIDG_SET_DONE : APMIDG_SET_FAILED;
+    }
+
+    void loop() {
+	std::unique_lock<std::mutex> lock(mtx);
+
+	for (;;) {
+	    cv.wait(lock, [this] { return !order.empty() || !notify.empty() || !running; });
+	    // drain before stopping
+	    if (order.empty() && notify.empty()) break;
+
+	    busy++;
+	    if (!notify.empty()) {
+		auto n = notify.front();
+		notify.pop_front();
+		lock.unlock();
+		n.first.cb(&n.second, n.first.arg);
+		lock.lock();
+	    } else {
+		auto key = order.front();
+		order.pop_front();
+		IDGSetReq r = pending[key];
+		pending.erase(key);
+
+		lock.unlock();
+		apmidg_set_result_t res = mkresult(r, apply(r));
+		lock.lock();
+		record(res);
+		if (r.cb) {
+		    lock.unlock();
+		    r.cb(&res, r.arg);
+		    lock.lock();
+		}
+	    }
+	    busy--;
+	    donecv.notify_all();
+	}
+    }
+
+public:
+    IDGSetQueue(IDGPower *_pm)
+	: pm(_pm), results(SETQ_NRESULTS), nextid(1), busy(0), running(true) {
+	for (auto &r : results) r.reqid = 0;
+	th = std::thread(&IDGSetQueue::loop, this);
+    }
+
+    ~IDGSetQueue() {
+	shutdown();
+    }
+
+    // refuse new requests and apply the queued ones, so every waiter
+    // sees its request completed. must not be called from a callback
+    void shutdown() {
+	{
+	    std::lock_guard<std::mutex> lock(mtx);
+	    running = false;
+	}
+	cv.notify_all();
+	if (th.joinable()) th.join();
+    }
+
+    // nothing queued and nothing being applied
+    bool idle() {
+	std::lock_guard<std::mutex> lock(mtx);
+	return order.empty() && notify.empty() && busy == 0;
+    }
+
+    // return 0 after shutdown()
+    uint64_t enqueue(IDGSetReq r) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!running) return 0;
+	auto key = std::make_tuple(r.kind, r.devid, r.id);
+
+	r.reqid = nextid++;
+	r.ts_us = gettime_us();
+	auto it = pending.find(key);
+	if (it != pending.end()) {
+	    apmidg_set_result_t res = mkresult(it->second, APMIDG_SET_SUPERSEDED);
+	    record(res);
+	    if (it->second.cb) notify.push_back(std::make_pair(it->second, res));
+	    it->second = r; // keeps its place in order
+	} else {
+	    pending[key] = r;
+	    order.push_back(key);
+	}
+	results[r.reqid % SETQ_NRESULTS].reqid = 0; // queued
+	cv.notify_one();
+	return r.reqid;
+    }
+
+    // the caller holds mtx
+    int statuslocked(uint64_t reqid) {
+	if (reqid == 0 || reqid >= nextid) return APMIDG_SET_UNKNOWN;
+	const apmidg_set_result_t &res = results[reqid % SETQ_NRESULTS];
+	if (res.reqid == reqid) return res.status;
+	// the slot is not ours. it is queued if it is among the latest
+	return nextid - reqid <= SETQ_NRESULTS ? APMIDG_SET_QUEUED : APMIDG_SET_UNKNOWN;
+    }
+
+    int status(uint64_t reqid) {
+	std::lock_guard<std::mutex> lock(mtx);
+	return statuslocked(reqid);
+    }
+
+    int wait(uint64_t reqid, int timeout_ms) {
+	std::unique_lock<std::mutex> lock(mtx);
+	auto done = [this, reqid] { return statuslocked(reqid) != APMIDG_SET_QUEUED; };
+	if (timeout_ms < 0) donecv.wait(lock, done);
+	else donecv.wait_for(lock, std::chrono::milliseconds(timeout_ms), done);
+	return statuslocked(reqid);
+    }
+
+    void flush() {
+	std::unique_lock<std::mutex> lock(mtx);
+	// a callback that flushes would wait for itself
+	if (std::this_thread::get_id() == th.get_id()) return;
+	donecv.wait(lock, [this] { return order.empty() && notify.empty() && busy == 0; });
+    }
+};
+
+// singleton object of IDGPower
+static IDGPower *apmidg = NULL;
+
+// the CPU RAPL zones, discovered at init. NULL if there is none or
+// APMIDG_RAPL is 0
+static IDGRapl *apmidg_rapl = NULL;
+
+// the background sampler. NULL unless apmidg_sampler_start() is
+// called. readers load it within apmidg_grace
+static std::atomic<IDGSampler*> apmidg_sampler(NULL);
+
+// the poll of the accumulated energy. NULL if APMIDG_ACC_POLL_MS is
+// 0. started by apmidg_init() and stopped by apmidg_finish(). guarded
+// by apmidg_mutex
+static IDGEnergyPoll *apmidg_accpoll = NULL;
+
+// the domain numbering of apmidg_wstats and apmidg_history. guarded
+// by apmidg_mutex
+static IDGDomIndex *apmidg_dix = NULL;
+
+// the listener of the temperature watches. NULL until apmidg_watch()
+// is first called. guarded by apmidg_mutex
+static IDGTempEvents *apmidg_tempev = NULL;
+
+// the worker of the asynchronous limit changes. NULL until the first
+// request. readers load it within apmidg_setq_grace, which is apart
+// from apmidg_grace because wait() and flush() block on the worker,
+// whose callbacks may take apmidg_mutex. only apmidg_finish() waits
+// for it, after the worker is done
+static std::atomic<IDGSetQueue*> apmidg_setq(NULL);
+static APMIDGGrace apmidg_setq_grace;
+
+// feed the history and the polled watches from a read path. the
+// sampler feeds them while it runs
+static void feedread(int devid, int kind, int id, double v)
+{
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGHistory *h = apmidg_history.load(std::memory_order_acquire);
+    IDGWatch *w = apmidg_watches.load(std::memory_order_acquire);
+    if ((!h && !w) || apmidg_sampler.load(std::memory_order_acquire)) return;
+    int idx = apmidg_dix->get(apmidg, devid, kind, id);
+    if (idx < 0) return;
+    uint64_t now = gettime_us();
+    if (h) h->add(idx, now, v, kind == APMIDG_SAMPLE_POWER || kind == APMIDG_SAMPLE_CPU_POWER);
+    if (w && w->has(idx)) w->eval(idx, now, v, false);
+}
+
+// the controller. NULL unless apmidg_ctrl_start() is called. guarded
+// by apmidg_mutex
+static IDGController *apmidg_ctrl = NULL;
+
+// the budget engine. NULL unless apmidg_budget_start() is called.
+// guarded by apmidg_mutex
+static IDGBudget *apmidg_budget = NULL;
+
+// protect the life cycle (init/finish, sampler start/stop). the
+// per-device state has its own locks
+static std::mutex apmidg_mutex;
+
+static int apmidg_verbose = 1;
+
+// Region (phase) energy accounting. see apmidg_region_begin().
+//
+// Names are interned into a fixed table. A lookup is lock-free and
+// only the first use of a name takes the table lock. Each thread
+// keeps its own nesting stack and its own per-region totals, so
+// begin/end neither allocate nor write shared cache lines. The totals
+// of all threads are summed when they are read. When a thread exits,
+// its totals are folded into those of the exited threads and freed.
+#define APMIDG_MAX_REGIONS     (256)
+#define APMIDG_REGION_NAMELEN  (64)
+#define APMIDG_REGION_MAXDEPTH (64)
+#define APMIDG_REGION_NSLOTS   (APMIDG_MAX_REGIONS * 2) // a power of two
+
+// the totals of one thread. only the owner thread writes them.
+// relaxed atomics let another thread sum them without a lock
+struct IDGRegionTotals {
+    std::atomic<uint64_t> count[APMIDG_MAX_REGIONS];
+    std::atomic<uint64_t> time_us[APMIDG_MAX_REGIONS];
+    std::atomic<uint64_t> energy_uj[APMIDG_MAX_REGIONS];
+    std::atomic<double>   freq_MHzus[APMIDG_MAX_REGIONS];
+    std::atomic<uint64_t> freq_us[APMIDG_MAX_REGIONS];
+    std::atomic<uint64_t> nerrors; // unmatched end, too deep
+};
+
+// the readings at a region begin, summed over all devices
+struct IDGRegionFrame {
+    int id;
+    uint64_t ts_us;
+    uint64_t energy_uj;
+    double freq_MHzus;
+    uint64_t freq_us;
+};
+
+struct IDGRegionThread {
+    uint64_t gen; // the IDGRegions this state belongs to
+    int depth;
+    IDGRegionFrame stack[APMIDG_REGION_MAXDEPTH];
+    IDGRegionTotals *totals;
+
+    ~IDGRegionThread(); // folds the totals. see IDGRegions::retire()
+};
+
+class IDGRegions {
+    uint64_t gen;
+
+    std::mutex mtx; // interning and the list of totals
+    std::atomic<int> nregions;
+    uint32_t hashes[APMIDG_MAX_REGIONS];
+    char names[APMIDG_MAX_REGIONS][APMIDG_REGION_NAMELEN];
+    std::atomic<int> slots[APMIDG_REGION_NSLOTS]; // id + 1, 0 if empty
+    // one per live thread. totals[0] holds the exited threads
+    std::vector<std::unique_ptr<IDGRegionTotals>> totals;
+
+    std::atomic<bool> warned;
+
+    static uint32_t hashname(const char *name) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for (int i = 0; name[i] && i < APMIDG_REGION_NAMELEN - 1; i++) {
+	    h ^= (unsigned char)name[i];
+	    h *= 16777619u;
+	}
+	return h;
+    }
+
+    // return the id of name, or -1 if it is not interned yet
+    int lookup(const char *name, uint32_t h) {
+	for (uint32_t i = h;; i++) {
+	    int v = slots[i & (APMIDG_REGION_NSLOTS - 1)].load(std::memory_order_acquire);
+	    if (v == 0) return -1;
+	    if (hashes[v - 1] == h && strncmp(names[v - 1], name, APMIDG_REGION_NAMELEN - 1) == 0)
+		return v - 1;
+	}
+    }
+
+    // the devices' readings. the counters are read unless the sampler
+    // keeps them current
+    void sample(IDGRegionFrame &f) {
+	bool fresh = !apmidg_sampler.load(std::memory_order_acquire);
+
+	f.energy_uj = 0;
+	f.freq_MHzus = 0.0;
+	f.freq_us = 0;
+	for (int di = 0; di < apmidg->getndevs(); di++) {
+	    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(di);
+	    double MHzus;
+	    uint64_t us;
+	    f.energy_uj += perdev.getenergytotal(fresh);
+	    perdev.getfreqtotal(fresh, MHzus, us);
+	    f.freq_MHzus += MHzus;
+	    f.freq_us += us;
+	}
+	f.ts_us = gettime_us();
+    }
+
+    IDGRegionThread &getthread() {
+	static thread_local IDGRegionThread t;
+
+	if (t.gen != gen) { // the first call on this thread since init
+	    std::lock_guard<std::mutex> lock(mtx);
+	    totals.emplace_back(new IDGRegionTotals());
+	    t.totals = totals.back().get();
+	    t.depth = 0;
+	    t.gen = gen;
+	}
+	return t;
+    }
+
+    void error(IDGRegionThread &t, const char *msg, int id) {
+	addrelaxed<uint64_t>(t.totals->nerrors, 1);
+	if (!warned.exchange(true))
+	    std::cout << "Warning: " << msg << ": " << (id >= 0 ? names[id] : "?") << " (reported once)" << std::endl;
+    }
+
+public:
+    IDGRegions(uint64_t _gen) : gen(_gen), nregions(0), warned(false) {
+	for (auto &s : slots) s.store(0);
+	totals.emplace_back(new IDGRegionTotals());
+    }
+
+    uint64_t getgen() const { return gen; }
+
+    // fold the totals of an exiting thread into totals[0] and free
+    // them. the owner no longer writes them
+    void retire(IDGRegionTotals *r) {
+	std::lock_guard<std::mutex> lock(mtx);
+	auto it = std::find_if(totals.begin() + 1, totals.end(),
+			       [r](const std::unique_ptr<IDGRegionTotals> &p) { return p.get() == r; });
+	if (it == totals.end()) return;
+	IDGRegionTotals &x = *totals[0];
+	for (int id = 0; id < nregions.load(std::memory_order_acquire); id++) {
+	    addrelaxed<uint64_t>(x.count[id], r->count[id].load(std::memory_order_relaxed));
+	    addrelaxed<uint64_t>(x.time_us[id], r->time_us[id].load(std::memory_order_relaxed));
+	    addrelaxed<uint64_t>(x.energy_uj[id], r->energy_uj[id].load(std::memory_order_relaxed));
+	    addrelaxed<double>(x.freq_MHzus[id], r->freq_MHzus[id].load(std::memory_order_relaxed));
+	    addrelaxed<uint64_t>(x.freq_us[id], r->freq_us[id].load(std::memory_order_relaxed));
+	}
+	addrelaxed<uint64_t>(x.nerrors, r->nerrors.load(std::memory_order_relaxed));
+	totals.erase(it);
+    }
+
+    // return the id of name, or -1 if it was never used
+    int find(const char *name) {
+	return name ? lookup(name, hashname(name)) : -1;
+    }
+
+    int intern(const char *name) {
+	if (!name) return -1;
+	uint32_t h = hashname(name);
+	int id = lookup(name, h);
+	if (id >= 0) return id;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	id = lookup(name, h); // lost the race?
+	if (id >= 0) return id;
+	id = nregions.load(std::memory_order_relaxed);
+	if (id >= APMIDG_MAX_REGIONS) {
+	    std::cout << "Warning: too many regions: " << name << std::endl;
+	    return -1;
+	}
+	hashes[id] = h;
+	strncpy(names[id], name, APMIDG_REGION_NAMELEN - 1);
+	names[id][APMIDG_REGION_NAMELEN - 1] = 0;
+	uint32_t i = h;
+	while (slots[i & (APMIDG_REGION_NSLOTS - 1)].load(std::memory_order_relaxed) != 0) i++;
+	slots[i & (APMIDG_REGION_NSLOTS - 1)].store(id + 1, std::memory_order_release);
+	nregions.store(id + 1, std::memory_order_release);
+	return id;
+    }
+
+    int begin(int id) {
+	if (id < 0 || id >= nregions.load(std::memory_order_acquire)) return -1;
+	IDGRegionThread &t = getthread();
+	if (t.depth >= APMIDG_REGION_MAXDEPTH) {
+	    error(t, "regions are nested too deep", id);
+	    return -1;
+	}
+	IDGRegionFrame &f = t.stack[t.depth];
+	f.id = id;
+	sample(f);
+	t.depth++;
+	return 0;
+    }
+
+    int end(int id) {
+	IDGRegionThread &t = getthread();
+	if (id < 0 || t.depth == 0 || t.stack[t.depth - 1].id != id) {
+	    error(t, "region end without a matching begin", id);
+	    return -1;
+	}
+	IDGRegionFrame now;
+	sample(now);
+	IDGRegionFrame &f = t.stack[--t.depth];
+	IDGRegionTotals &r = *t.totals;
+	addrelaxed<uint64_t>(r.count[id], 1);
+	addrelaxed<uint64_t>(r.time_us[id], now.ts_us - f.ts_us);
+	addrelaxed<uint64_t>(r.energy_uj[id], now.energy_uj - f.energy_uj);
+	addrelaxed<double>(r.freq_MHzus[id], now.freq_MHzus - f.freq_MHzus);
+	addrelaxed<uint64_t>(r.freq_us[id], now.freq_us - f.freq_us);
+	return 0;
+    }
+
+    int getnregions() { return nregions.load(std::memory_order_acquire); }
+
+    // sum the totals of all threads. return -1 if id is invalid
+    int getstats(int id, uint64_t &count, double &time_s, double &energy_J, double &freq_MHz) {
+	if (id < 0 || id >= getnregions()) return -1;
+
+	uint64_t time_us = 0, energy_uj = 0, freq_us = 0;
+	double freq_MHzus = 0.0;
+	count = 0;
+	std::lock_guard<std::mutex> lock(mtx);
+	for (auto &r : totals) {
+	    count += r->count[id].load(std::memory_order_relaxed);
+	    time_us += r->time_us[id].load(std::memory_order_relaxed);
+	    energy_uj += r->energy_uj[id].load(std::memory_order_relaxed);
+	    freq_MHzus += r->freq_MHzus[id].load(std::memory_order_relaxed);
+	    freq_us += r->freq_us[id].load(std::memory_order_relaxed);
+	}
+	time_s = time_us * 1e-6;
+	energy_J = energy_uj * 1e-6;
+	// unknown if no frequency reading fell into the region
+	freq_MHz = freq_us > 0 ? freq_MHzus / freq_us : -1.0;
+	return 0;
+    }
+
+    uint64_t getnerrors() {
+	uint64_t n = 0;
+	std::lock_guard<std::mutex> lock(mtx);
+	for (auto &r : totals) n += r->nerrors.load(std::memory_order_relaxed);
+	return n;
+    }
+
+    const char *getname(int id) {
+	return (id >= 0 && id < getnregions()) ? names[id] : NULL;
+    }
+
+    void printsummary() {
+	char buf[160];
+
+	std::cout << "apmidg regions (inclusive of nested regions, energy of all devices)" << std::endl;
+	snprintf(buf, sizeof(buf), "%-24s %10s %12s %12s %10s %10s",
+		 "region", "calls", "time_s", "energy_J", "avg_W", "avg_MHz");
+	std::cout << buf << std::endl;
+	for (int id = 0; id < getnregions(); id++) {
+	    uint64_t count;
+	    double time_s, energy_J, freq_MHz;
+	    getstats(id, count, time_s, energy_J, freq_MHz);
+	    snprintf(buf, sizeof(buf), "%-24s %10lu %12.6f %12.6f %10.3f %10.1f",
+		     names[id], (unsigned long)count, time_s, energy_J,
+		     time_s > 0.0 ? energy_J / time_s : 0.0, freq_MHz);
+	    std::cout << buf << std::endl;
+	}
+	uint64_t nerrors = getnerrors();
+	if (nerrors > 0) std::cout << "unmatched or too deep: " << nerrors << std::endl;
+    }
+};
+
+// NULL until apmidg_init(). the generation tells a thread that its
+// cached state belongs to an earlier init. apmidg_regions_mutex keeps
+// an exiting thread from folding into regions that apmidg_finish()
+// is freeing
+static IDGRegions *apmidg_regions = NULL;
+static uint64_t apmidg_regions_gen = 0;
+static std::mutex apmidg_regions_mutex;
+
+IDGRegionThread::~IDGRegionThread()
+{
+    if (!totals) return;
+    std::lock_guard<std::mutex> lock(apmidg_regions_mutex);
+    // the totals of an earlier init were freed with its IDGRegions
+    if (apmidg_regions && apmidg_regions->getgen() == gen) apmidg_regions->retire(totals);
+}
+
+// the availablity of features
+
+
+#define EXTERNC extern "C"
+
+EXTERNC int apmidg_getndevs() {
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+    return apmidg->getndevs();
+}
+
+EXTERNC int apmidg_getnpwrdoms(int devid) {
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    return perdev.getnpwrdoms();
+}
+
+EXTERNC void apmidg_getpwrprops(int devid, int pwrid, int *onsubdev, int *subdevid, int *canctrl, int *deflim_mw, int *minlim_mw, int *maxlim_mw) {
+    APMIDG_STATS_CALL();
+
+    if (onsubdev) *onsubdev = -1;
+    if (subdevid) *subdevid = -1;
+    if (canctrl)  *canctrl = -1;
+    if (deflim_mw) *deflim_mw = -1;
+    if (minlim_mw) *minlim_mw = -1;
+    if (maxlim_mw) *maxlim_mw = -1;
+
+    if (!apmidg) return;
+
+    // cached at init. see IDGPowerPerDevice::enumpwrdoms()
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    const IDGPwrProps &props = perdev.getpwrprops(pwrid);
+
+    if (onsubdev) *onsubdev = props.onsubdev;
+    if (subdevid) *subdevid = props.subdevid;
+    if (canctrl)  *canctrl = props.canctrl;
+    if (deflim_mw) *deflim_mw = props.deflim_mw;
+    if (minlim_mw) *minlim_mw = (int)-1; // doesn't look like there is an API to retrieve minlim
+    if (maxlim_mw) *maxlim_mw = props.deflim_mw;
+
+#if 0
+    // Workaround. L0 sets defaultLimit, mixLimit, and maxLimt -1 (looks like deprecated)
+    // minLimt may not be available (depends on sysfs entried created by the hwmon driver)
+    // Remove this later once an alternative way to read deflim and maxlim is implemented
+    static bool msgdisplayed = false;
+    std::string buf;
+    std::fstream fs;
+    int workaround_maxlimit=-1;
+    for (int id=0; id<8; id++) {
 	char fn[100];
 	std::snprintf(fn, sizeof(fn), "/sys/class/drm/card0/device/hwmon/hwmon%d/power1_rated_max", id);
 	fs.open(fn, std::ios::in);
@@ -401,324 +2909,1529 @@ EXTERNC void apmidg_getpwrprops(int devid, int pwrid, int *onsubdev, int *subdev
 	    break;
 	}
     }
-    if (canctrl>0 && (int)pprop.defaultLimit == -1 && workaround_maxlimit > 0) {
-	if (deflim_mw) *deflim_mw = workaround_maxlimit;
-	if (maxlim_mw) *maxlim_mw = workaround_maxlimit;
-	if (!msgdisplayed) {
-	    std::cout << "apmidg_getpwrprops: deflim_mw workaround applied" << std::endl;
-	    msgdisplayed = true;
+    if (props.canctrl>0 && props.deflim_mw <= 0 && workaround_maxlimit > 0) {
+	if (deflim_mw) *deflim_mw = workaround_maxlimit;
+	if (maxlim_mw) *maxlim_mw = workaround_maxlimit;
+	if (!msgdisplayed) {
+	    std::cout << "apmidg_getpwrprops: deflim_mw workaround applied" << std::endl;
+	    msgdisplayed = true;
+	}
+    }
+#endif
+}
+
+static void prlevel(int level) {
+    switch(level) {
+	case ZES_POWER_LEVEL_SUSTAINED:
+	    std::cout << "Sustained" << std::endl;
+	    break;
+	case ZES_POWER_LEVEL_PEAK:
+	    std::cout << "Peak" << std::endl;
+	    break;
+	case ZES_POWER_LEVEL_BURST:
+	    std::cout << "Burst" << std::endl;
+	    break;
+	case ZES_POWER_LEVEL_INSTANTANEOUS:
+	    std::cout << "Instantaneous" << std::endl;
+	    break;
+	default:
+	    std::cout << "Invalid Power Limit" << std::endl;
+    }
+}
+
+
+EXTERNC void apmidg_getpwrlim(int devid, int pwrid, int *lim_mw) {// sustained only
+    APMIDG_STATS_CALL();
+    if (lim_mw) *lim_mw = -1;
+    if (!apmidg) return;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    if (!perdev.is_powerlimit_available()) return;
+
+    // served from the limits cache. see IDGPwrLimCache
+    int lim_mw_queried = perdev.getpwrlim(pwrid);
+
+    if (lim_mw && lim_mw_queried > 0) {
+	*lim_mw = lim_mw_queried;
+    } else {
+	std::cout << "Warning: apmidg_getpwrlim found no target power level." << std::endl;
+    }
+}
+
+EXTERNC void apmidg_setpwrlim(int devid, int pwrid, int lim_mw) { // sustained only
+    APMIDG_STATS_CALL();
+    if (!apmidg) return;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    if (!perdev.is_powerlimit_available()) return;
+
+    int ret = perdev.setpwrlim(pwrid, lim_mw);
+
+    if (ret != 0) {
+	std::cout << "Warning: apmidg_setpwrlim failed to set the sustained power limit" << std::endl;
+    }
+}
+
+EXTERNC void apmidg_readenergy(int devid, int pwrid, uint64_t *energy_uj, uint64_t *ts_us) {
+    APMIDG_STATS_CALL();
+    if (energy_uj)  *energy_uj = -1;
+    if (ts_us) *ts_us = -1;
+    if (!apmidg) return;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+
+    // a raw read. sampleenergy() is reserved for apmidg_readpoweravg
+    // so that reading the counter does not shorten the poweravg interval
+    zes_power_energy_counter_t ecounter;
+    if (perdev.readenergy(pwrid, ecounter) != ZE_RESULT_SUCCESS) return;
+
+    if (energy_uj) *energy_uj = ecounter.energy;
+    if (ts_us) *ts_us = ecounter.timestamp;
+}
+
+EXTERNC int apmidg_readenergy_acc(int devid, int pwrid, uint64_t *acc_uj, uint64_t *ts_us) {
+    APMIDG_STATS_CALL();
+    if (acc_uj) *acc_uj = 0;
+    if (ts_us) *ts_us = 0;
+    if (!apmidg) return -1;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    uint64_t acc, ts;
+    ze_result_t res = perdev.readenergy_acc(pwrid, acc, ts);
+
+    if (acc_uj) *acc_uj = acc;
+    if (ts_us) *ts_us = ts;
+    return res == ZE_RESULT_SUCCESS ? 0 : -1;
+}
+
+// apply to one domain or all of them (devid or pwrid < 0)
+static void setenergyacc(int devid, int pwrid, int running, bool reset)
+{
+    if (!apmidg) return;
+
+    for (int di = 0; di < apmidg->getndevs(); di++) {
+	if (devid >= 0 && di != devid) continue;
+	IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(di);
+	for (int id = 0; id < perdev.getnpwrdoms(); id++) {
+	    if (pwrid >= 0 && id != pwrid) continue;
+	    if (running >= 0) {
+		// move the baseline to now so that the interval up to a
+		// start is not counted and the one up to a stop is
+		zes_power_energy_counter_t ecounter;
+		perdev.readenergy(id, ecounter);
+	    }
+	    perdev.setenergyacc(id, running, reset);
+	}
+    }
+}
+
+EXTERNC void apmidg_energy_acc_start(int devid, int pwrid) {
+    APMIDG_STATS_CALL();
+    setenergyacc(devid, pwrid, 1, false);
+}
+
+EXTERNC void apmidg_energy_acc_stop(int devid, int pwrid) {
+    APMIDG_STATS_CALL();
+    setenergyacc(devid, pwrid, 0, false);
+}
+
+EXTERNC void apmidg_energy_acc_reset(int devid, int pwrid) {
+    APMIDG_STATS_CALL();
+    setenergyacc(devid, pwrid, -1, true);
+}
+
+EXTERNC double apmidg_readpoweravg(int devid, int pwrid) {
+    APMIDG_STATS_CALL();
+    double watt = 0.0;
+    if (!apmidg) return watt;
+
+    ze_result_t res;
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    zes_power_energy_counter_t ecounter;
+    apmidg_sample_t s;
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGSampler *sampler = apmidg_sampler.load(std::memory_order_acquire);
+
+    if (sampler && sampler->getlatest(devid, APMIDG_SAMPLE_POWER, pwrid, s) == 0) {
+	// the sampler has a fresh counter reading. no sysman call needed
+	ecounter.energy = s.energy_uj;
+	ecounter.timestamp = s.energy_ts_us;
+	watt = perdev.updateenergy(pwrid, ecounter);
+    } else {
+	watt = perdev.sampleenergy(pwrid, ecounter);
+	if (ecounter.timestamp) feedread(devid, APMIDG_SAMPLE_POWER, pwrid, watt);
+    }
+
+    return watt;
+}
+
+
+EXTERNC int apmidg_getnfreqdoms(int devid) {
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    return perdev.getnfreqdoms();
+}
+
+
+EXTERNC void apmidg_getfreqprops(int devid, int freqid, int *onsubdev,
+				int *subdevid, int *canctrl,
+				 double *min_MHz, double *max_MHz)
+{
+    APMIDG_STATS_CALL();
+    if (onsubdev) *onsubdev = -1;
+    if (subdevid) *subdevid = -1;
+    if (canctrl)  *canctrl = -1;
+    if (min_MHz) *min_MHz = -1.0;
+    if (max_MHz) *max_MHz = -1.0;
+    if (!apmidg) return;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    const IDGFreqProps &props = perdev.getfreqprops(freqid);
+
+    if (onsubdev) *onsubdev = props.onsubdev;
+    if (subdevid) *subdevid = props.subdevid;
+    if (canctrl)  *canctrl = props.canctrl;
+    if (min_MHz) *min_MHz = props.min_MHz;
+    if (max_MHz) *max_MHz = props.max_MHz;
+}
+
+EXTERNC void apmidg_getfreqlims(int devid, int freqid,
+				 double *min_MHz, double *max_MHz) {
+    APMIDG_STATS_CALL();
+    if (min_MHz) *min_MHz = -1.0;
+    if (max_MHz) *max_MHz = -1.0;
+
+    if (!apmidg) return;
+
+    ze_result_t res;
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    zes_freq_range_t frange;
+
+    // served from the limits cache. see IDGFreqRangeCache
+    res = perdev.getfreqrange(freqid, frange);
+    if (res != ZE_RESULT_SUCCESS) return;
+
+    if (min_MHz) *min_MHz = frange.min;
+    if (max_MHz) *max_MHz = frange.max;
+}
+
+EXTERNC void apmidg_setfreqlims(int devid, int freqid,
+				 double min_MHz, double max_MHz) {
+    APMIDG_STATS_CALL();
+    if (!apmidg) return;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    zes_freq_range_t frange;
+
+    frange.min = min_MHz;
+    frange.max = max_MHz;
+
+    perdev.setfreqrange(freqid, frange);
+}
+
+EXTERNC void apmidg_setlimcachettl(int ttl_ms)
+{
+    APMIDG_STATS_CALL();
+    apmidg_limcache_ttl_us = ttl_ms < 0 ? -1 : (int64_t)ttl_ms * 1000;
+}
+
+EXTERNC void apmidg_invalidatelims(int devid)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg) return;
+
+    for (int di = 0; di < apmidg->getndevs(); di++) {
+	if (devid >= 0 && di != devid) continue;
+	apmidg->getIDGPowerPerDevice(di).invalidatelims();
+    }
+}
+
+
+static uint64_t setasync(IDGSetReq &r)
+{
+    if (!apmidg || r.devid < 0 || r.devid >= apmidg->getndevs() || r.id < 0) return 0;
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(r.devid);
+    if (r.id >= (r.kind == APMIDG_SET_PWRLIM ? perdev.getnpwrdoms() : perdev.getnfreqdoms())) return 0;
+
+    if (!apmidg_setq.load(std::memory_order_acquire)) {
+	std::lock_guard<std::mutex> lock(apmidg_mutex);
+	if (!apmidg_setq.load()) apmidg_setq.store(new IDGSetQueue(apmidg), std::memory_order_release);
+    }
+    APMIDGGraceReader reader(apmidg_setq_grace);
+    IDGSetQueue *q = apmidg_setq.load(std::memory_order_acquire);
+    return q ? q->enqueue(r) : 0;
+}
+
+EXTERNC uint64_t apmidg_setpwrlim_async(int devid, int pwrid, int lim_mw,
+					 apmidg_set_cb_t cb, void *arg)
+{
+    APMIDG_STATS_CALL();
+    IDGSetReq r = {};
+    r.devid = devid;
+    r.kind = APMIDG_SET_PWRLIM;
+    r.id = pwrid;
+    r.lim_mw = lim_mw;
+    r.cb = cb;
+    r.arg = arg;
+    return setasync(r);
+}
+
+EXTERNC uint64_t apmidg_setfreqlims_async(int devid, int freqid, double min_MHz, double max_MHz,
+					   apmidg_set_cb_t cb, void *arg)
+{
+    APMIDG_STATS_CALL();
+    IDGSetReq r = {};
+    r.devid = devid;
+    r.kind = APMIDG_SET_FREQLIMS;
+    r.id = freqid;
+    r.range.min = min_MHz;
+    r.range.max = max_MHz;
+    r.cb = cb;
+    r.arg = arg;
+    return setasync(r);
+}
+
+EXTERNC int apmidg_set_status(uint64_t reqid)
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_setq_grace);
+    IDGSetQueue *q = apmidg_setq.load(std::memory_order_acquire);
+    return q ? q->status(reqid) : APMIDG_SET_UNKNOWN;
+}
+
+EXTERNC int apmidg_set_wait(uint64_t reqid, int timeout_ms)
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_setq_grace);
+    IDGSetQueue *q = apmidg_setq.load(std::memory_order_acquire);
+    return q ? q->wait(reqid, timeout_ms) : APMIDG_SET_UNKNOWN;
+}
+
+EXTERNC void apmidg_set_flush()
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_setq_grace);
+    IDGSetQueue *q = apmidg_setq.load(std::memory_order_acquire);
+    if (q) q->flush();
+}
+
+
+// control state snapshots. see apmidg_config.h for the blob
+
+static uint32_t fnv1a(uint32_t h, const void *p, size_t n)
+{
+    const uint8_t *b = (const uint8_t *)p;
+    for (size_t i = 0; i < n; i++) {
+	h ^= b[i];
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t configsum(const apmidg_config_dev *devs, uint32_t ndevs,
+			  const apmidg_config_ent *ents, uint32_t nents)
+{
+    uint32_t h = fnv1a(2166136261u, devs, ndevs * sizeof(*devs));
+    return fnv1a(h, ents, nents * sizeof(*ents));
+}
+
+// call fn(devid) for every device, the devices in parallel as at
+// init. fn must not touch another device
+template <typename F>
+static void foreachdev(int ndevs, F fn)
+{
+    int nthreads = initthreads(ndevs);
+    std::atomic<int> next(0);
+    auto worker = [&] {
+	for (int i = next++; i < ndevs; i = next++) fn(i);
+    };
+    if (nthreads <= 1) {
+	worker();
+	return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) threads.emplace_back(worker);
+    for (auto &t : threads) t.join();
+}
+
+static bool configdev(IDGPowerPerDevice &perdev, apmidg_config_dev &d)
+{
+    zes_pci_properties_t pci = {};
+    ze_result_t res = apmidg_be->zesDevicePciGetProperties(perdev.getsysmanh(), &pci);
+    if (res != ZE_RESULT_SUCCESS) {
+	_ZE_ERROR_MSG_NOTERMINATE("zesDevicePciGetProperties", res);
+	return false;
+    }
+    d = {};
+    d.pci_domain = pci.address.domain;
+    d.pci_bus = pci.address.bus;
+    d.pci_device = pci.address.device;
+    d.pci_function = pci.address.function;
+    d.subdevmask = perdev.getsubdevmask();
+    d.npwrdoms = perdev.getnpwrdoms();
+    d.nfreqdoms = perdev.getnfreqdoms();
+    return true;
+}
+
+// read the current limits of a domain into cur, one entry per power
+// limit descriptor or one frequency range. the caller invalidates the
+// limits cache first
+static bool configread(IDGPowerPerDevice &perdev, uint32_t kind, uint32_t id, std::vector<apmidg_config_ent> &cur)
+{
+    apmidg_config_ent e = {};
+    e.kind = kind;
+    e.id = id;
+    e.min_MHz = e.max_MHz = -1.0;
+    cur.clear();
+    if (kind == APMIDG_CONFIG_ENT_PWRLIM) {
+	std::vector<zes_power_limit_ext_desc_t> descs;
+	if (perdev.getpwrdescs(id, descs) != 0) return false;
+	for (auto &d : descs) {
+	    e.level = d.level;
+	    e.source = d.source;
+	    e.unit = d.limitUnit;
+	    e.enabled = d.enabled;
+	    e.interval = d.interval;
+	    e.limit = d.limit;
+	    cur.push_back(e);
+	}
+	return true;
+    }
+    zes_freq_range_t r;
+    if (perdev.getfreqrange(id, r) != ZE_RESULT_SUCCESS) return false;
+    e.min_MHz = r.min;
+    e.max_MHz = r.max;
+    cur.push_back(e);
+    return true;
+}
+
+// the descriptor of the same level and source, or NULL
+template <typename T>
+static T *configfind(std::vector<T> &v, int level, int source)
+{
+    for (auto &d : v)
+	if ((int)d.level == level && (int)d.source == source) return &d;
+    return NULL;
+}
+
+// compare as the driver would store want. see setfreqrange()
+static bool configequal(IDGPowerPerDevice &perdev, const std::vector<apmidg_config_ent> &want,
+			std::vector<apmidg_config_ent> cur)
+{
+    if (want.empty() || cur.empty()) return want.empty() && cur.empty();
+    if (want[0].kind == APMIDG_CONFIG_ENT_PWRLIM) {
+	for (auto &w : want) {
+	    apmidg_config_ent *c = configfind(cur, w.level, w.source);
+	    if (!c || c->unit != w.unit || c->enabled != w.enabled || c->interval != w.interval || c->limit != w.limit)
+		return false;
 	}
+	return true;
     }
-#endif
+
+    const IDGFreqProps &props = perdev.getfreqprops(want[0].id);
+    double min = want[0].min_MHz, max = want[0].max_MHz;
+    if (props.min_MHz > 0.0 && min < props.min_MHz) min = props.min_MHz;
+    if (props.max_MHz > 0.0 && max > props.max_MHz) max = props.max_MHz;
+    return min == cur[0].min_MHz && max == cur[0].max_MHz;
 }
 
-static void prlevel(int level) {
-    switch(level) {
-	case ZES_POWER_LEVEL_SUSTAINED:
-	    std::cout << "Sustained" << std::endl;
-	    break;
-	case ZES_POWER_LEVEL_PEAK:
-	    std::cout << "Peak" << std::endl;
-	    break;
-	case ZES_POWER_LEVEL_BURST:
-	    std::cout << "Burst" << std::endl;
-	    break;
-	case ZES_POWER_LEVEL_INSTANTANEOUS:
-	    std::cout << "Instantaneous" << std::endl;
-	    break;
-	default:
-	    std::cout << "Invalid Power Limit" << std::endl;
+// the power limits of a domain go back with one zesPowerSetLimitsExt(),
+// the descriptors not in want unchanged
+static bool configwrite(IDGPowerPerDevice &perdev, const std::vector<apmidg_config_ent> &want)
+{
+    if (want.empty()) return true;
+    uint32_t id = want[0].id;
+    if (want[0].kind == APMIDG_CONFIG_ENT_PWRLIM) {
+	std::vector<zes_power_limit_ext_desc_t> descs;
+	if (perdev.getpwrdescs(id, descs) != 0) return false;
+	for (auto &w : want) {
+	    zes_power_limit_ext_desc_t *d = configfind(descs, w.level, w.source);
+	    if (!d) return false;
+	    d->limitUnit = (zes_limit_unit_t)w.unit;
+	    d->enabled = w.enabled;
+	    d->interval = w.interval;
+	    d->limit = w.limit;
+	}
+	return perdev.setpwrdescs(id, descs) == 0;
     }
+    zes_freq_range_t r = {want[0].min_MHz, want[0].max_MHz};
+    return perdev.setfreqrange(id, r) == ZE_RESULT_SUCCESS;
 }
 
+static void configprint(const std::vector<apmidg_config_ent> &v)
+{
+    if (v.empty()) {
+	std::cout << "unknown";
+	return;
+    }
+    if (v[0].kind == APMIDG_CONFIG_ENT_FREQLIMS) {
+	std::cout << v[0].min_MHz << "-" << v[0].max_MHz << " MHz";
+	return;
+    }
+    for (size_t i = 0; i < v.size(); i++) {
+	const apmidg_config_ent &e = v[i];
+	const char *level = "level";
+	switch (e.level) {
+	case ZES_POWER_LEVEL_SUSTAINED:     level = "sustained"; break;
+	case ZES_POWER_LEVEL_PEAK:          level = "peak"; break;
+	case ZES_POWER_LEVEL_BURST:         level = "burst"; break;
+	case ZES_POWER_LEVEL_INSTANTANEOUS: level = "instantaneous"; break;
+	}
+	if (i > 0) std::cout << ", ";
+	std::cout << level << " " << e.limit << (e.unit == ZES_LIMIT_UNIT_CURRENT ? " mA" : " mW");
+	if (e.interval > 0) std::cout << "/" << e.interval << " ms";
+	if (!e.enabled) std::cout << " (disabled)";
+    }
+}
 
-EXTERNC void apmidg_getpwrlim(int devid, int pwrid, int *lim_mw) {// sustained only
-    if (lim_mw) *lim_mw = -1;
+static void configcapture(std::vector<uint8_t> &blob)
+{
+    int ndevs = apmidg->getndevs();
+    std::vector<apmidg_config_dev> devs(ndevs);
+    std::vector<std::vector<apmidg_config_ent>> perents(ndevs);
+    std::vector<char> ok(ndevs, 0);
+
+    foreachdev(ndevs, [&](int di) {
+	IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(di);
+	if (!configdev(perdev, devs[di])) return;
+	perdev.invalidatelims();
+
+	std::vector<apmidg_config_ent> cur;
+	auto add = [&](uint32_t kind, uint32_t id) {
+	    if (!configread(perdev, kind, id, cur)) return;
+	    for (auto &e : cur) e.dev = di;
+	    perents[di].insert(perents[di].end(), cur.begin(), cur.end());
+	};
+	if (perdev.is_powerlimit_available()) {
+	    for (int id = 0; id < perdev.getnpwrdoms(); id++)
+		if (perdev.getpwrprops(id).canctrl > 0) add(APMIDG_CONFIG_ENT_PWRLIM, id);
+	}
+	for (int id = 0; id < perdev.getnfreqdoms(); id++)
+	    if (perdev.getfreqprops(id).canctrl > 0) add(APMIDG_CONFIG_ENT_FREQLIMS, id);
+	ok[di] = 1;
+    });
+
+    blob.clear();
+    if (std::find(ok.begin(), ok.end(), 0) != ok.end()) return;
+
+    std::vector<apmidg_config_ent> ents;
+    for (auto &v : perents) ents.insert(ents.end(), v.begin(), v.end());
+
+    apmidg_config_hdr hdr = {};
+    memcpy(hdr.magic, APMIDG_CONFIG_MAGIC, sizeof(hdr.magic));
+    hdr.version = APMIDG_CONFIG_VERSION;
+    hdr.hdrsize = sizeof(hdr);
+    hdr.devsize = sizeof(apmidg_config_dev);
+    hdr.entsize = sizeof(apmidg_config_ent);
+    hdr.ndevs = ndevs;
+    hdr.nents = ents.size();
+    hdr.checksum = configsum(devs.data(), hdr.ndevs, ents.data(), hdr.nents);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.ts_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    size_t devbytes = devs.size() * sizeof(apmidg_config_dev);
+    size_t entbytes = ents.size() * sizeof(apmidg_config_ent);
+    blob.resize(sizeof(hdr) + devbytes + entbytes);
+    memcpy(blob.data(), &hdr, sizeof(hdr));
+    memcpy(blob.data() + sizeof(hdr), devs.data(), devbytes);
+    memcpy(blob.data() + sizeof(hdr) + devbytes, ents.data(), entbytes);
+}
+
+// the limits of a domain to restore: the power limit descriptors or
+// the frequency range
+struct IDGConfigOp {
+    uint32_t kind;
+    uint32_t id;
+    std::vector<apmidg_config_ent> want;
+    std::vector<apmidg_config_ent> prev; // before the restore
+    bool known;             // prev was read
+    bool diff;
+    bool written;           // a write was attempted
+    bool ok;                // matches want at the end
+};
+
+static int configrestore(const void *buf, int size, int flags, apmidg_config_report_t *rep)
+{
+    uint64_t t0 = gettime_us();
+    apmidg_config_report_t r = {};
+    bool verbose = flags & APMIDG_CONFIG_VERBOSE;
+
+    if (rep) *rep = r;
+    if (!buf || size < (int)sizeof(apmidg_config_hdr)) {
+	std::cout << "Warning: apmidg_config_restore: the blob is truncated" << std::endl;
+	return -1;
+    }
+
+    apmidg_config_hdr hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (memcmp(hdr.magic, APMIDG_CONFIG_MAGIC, sizeof(hdr.magic)) || hdr.version != APMIDG_CONFIG_VERSION ||
+	hdr.hdrsize != sizeof(hdr) || hdr.devsize != sizeof(apmidg_config_dev) ||
+	hdr.entsize != sizeof(apmidg_config_ent)) {
+	std::cout << "Warning: apmidg_config_restore: not a blob of this version" << std::endl;
+	return -1;
+    }
+    if ((uint64_t)size < sizeof(hdr) + (uint64_t)hdr.ndevs * hdr.devsize + (uint64_t)hdr.nents * hdr.entsize) {
+	std::cout << "Warning: apmidg_config_restore: the blob is truncated" << std::endl;
+	return -1;
+    }
+    std::vector<apmidg_config_dev> devs(hdr.ndevs);
+    std::vector<apmidg_config_ent> ents(hdr.nents);
+    const uint8_t *p = (const uint8_t *)buf + sizeof(hdr);
+    memcpy(devs.data(), p, hdr.ndevs * sizeof(apmidg_config_dev));
+    memcpy(ents.data(), p + hdr.ndevs * sizeof(apmidg_config_dev), hdr.nents * sizeof(apmidg_config_ent));
+    if (configsum(devs.data(), hdr.ndevs, ents.data(), hdr.nents) != hdr.checksum) {
+	std::cout << "Warning: apmidg_config_restore: the checksum does not match" << std::endl;
+	return -1;
+    }
+
+    // group the entries by domain
+    std::vector<std::vector<IDGConfigOp>> blobops(hdr.ndevs);
+    for (auto &e : ents) {
+	if (e.dev >= hdr.ndevs || e.kind > APMIDG_CONFIG_ENT_FREQLIMS ||
+	    e.id >= (e.kind == APMIDG_CONFIG_ENT_PWRLIM ? devs[e.dev].npwrdoms : devs[e.dev].nfreqdoms)) {
+	    std::cout << "Warning: apmidg_config_restore: the blob has an invalid entry" << std::endl;
+	    return -1;
+	}
+	std::vector<IDGConfigOp> &v = blobops[e.dev];
+	auto it = std::find_if(v.begin(), v.end(), [&](const IDGConfigOp &op) {
+	    return op.kind == e.kind && op.id == e.id;
+	});
+	if (it == v.end()) {
+	    IDGConfigOp op = {};
+	    op.kind = e.kind;
+	    op.id = e.id;
+	    it = v.insert(v.end(), op);
+	}
+	it->want.push_back(e);
+    }
+    for (auto &v : blobops) r.nents += v.size();
+
+    // a queued request would land in the middle of the restore
+    {
+	APMIDGGraceReader reader(apmidg_setq_grace);
+	IDGSetQueue *q = apmidg_setq.load(std::memory_order_acquire);
+	if (q) q->flush();
+    }
+
+    // keep the engines from starting until the restore is over
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (apmidg_ctrl || apmidg_budget) {
+	std::cout << "Warning: apmidg_config_restore: the " << (apmidg_ctrl ? "controller" : "budget engine")
+		  << " owns the limits" << std::endl;
+	if (rep) *rep = r;
+	return -1;
+    }
+
+    // find the devices of the blob among the current ones. the limits
+    // of a missing device are skipped, the others still restored
+    int ndevs = apmidg->getndevs();
+    std::vector<apmidg_config_dev> curdevs(ndevs);
+    std::vector<char> known(ndevs, 0);
+    foreachdev(ndevs, [&](int di) {
+	known[di] = configdev(apmidg->getIDGPowerPerDevice(di), curdevs[di]);
+    });
+    std::vector<std::vector<IDGConfigOp>> ops(ndevs);
+    for (uint32_t i = 0; i < hdr.ndevs; i++) {
+	const apmidg_config_dev &d = devs[i];
+	int devid = -1;
+	for (int di = 0; di < ndevs; di++) {
+	    const apmidg_config_dev &c = curdevs[di];
+	    if (known[di] && c.pci_domain == d.pci_domain && c.pci_bus == d.pci_bus &&
+		c.pci_device == d.pci_device && c.pci_function == d.pci_function &&
+		c.subdevmask == d.subdevmask && c.npwrdoms == d.npwrdoms && c.nfreqdoms == d.nfreqdoms) {
+		devid = di;
+		break;
+	    }
+	}
+	if (devid < 0) {
+	    printf("Warning: apmidg_config_restore: device %04x:%02x:%02x.%x (subdevmask=0x%lx) is not found\n",
+		   d.pci_domain, d.pci_bus, d.pci_device, d.pci_function, (unsigned long)d.subdevmask);
+	    r.nmissing++;
+	    continue;
+	}
+	for (auto &op : blobops[i]) {
+	    for (auto &e : op.want) e.dev = devid;
+	    ops[devid].push_back(op);
+	}
+    }
+
+    bool dryrun = flags & APMIDG_CONFIG_DRYRUN;
+    foreachdev(ndevs, [&](int di) {
+	IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(di);
+	if (ops[di].empty()) return;
+
+	perdev.invalidatelims();
+	for (auto &op : ops[di]) {
+	    op.known = configread(perdev, op.kind, op.id, op.prev);
+	    op.diff = !op.known || !configequal(perdev, op.want, op.prev);
+	    op.ok = !op.diff;
+	    if (!op.diff || dryrun) continue;
+	    op.written = true;
+	    configwrite(perdev, op.want);
+	}
+	if (dryrun) return;
+
+	// read back what was written. the driver may clamp or refuse
+	// silently
+	perdev.invalidatelims();
+	for (auto &op : ops[di]) {
+	    if (!op.written) continue;
+	    std::vector<apmidg_config_ent> cur;
+	    op.ok = configread(perdev, op.kind, op.id, cur) && configequal(perdev, op.want, cur);
+	}
+    });
+
+    for (int di = 0; di < ndevs; di++) {
+	for (auto &op : ops[di]) {
+	    if (op.diff) r.ndiffs++;
+	    if (op.written && op.ok) r.nwritten++;
+	    if (op.written && !op.ok) r.nfailed++;
+	    if (!verbose || !op.diff) continue;
+	    std::cout << "Device" << di << (op.kind == APMIDG_CONFIG_ENT_PWRLIM ? " pwr" : " freq") << op.id << ": ";
+	    configprint(op.prev);
+	    std::cout << " -> ";
+	    configprint(op.want);
+	    if (!dryrun) std::cout << (op.ok ? " ok" : " failed");
+	    std::cout << std::endl;
+	}
+    }
+
+    if (r.nfailed > 0 && !(flags & APMIDG_CONFIG_NOROLLBACK)) {
+	// a limit that could not be read before has nothing to go back to
+	std::atomic<int> nlost(0);
+	foreachdev(ndevs, [&](int di) {
+	    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(di);
+	    for (auto &op : ops[di]) {
+		if (!op.written) continue;
+		if (!op.known || !configwrite(perdev, op.prev)) nlost++;
+	    }
+	});
+	if (nlost > 0) std::cout << "Warning: apmidg_config_restore: " << nlost << " limits could not be rolled back" << std::endl;
+	r.rolledback = 1;
+    }
+
+    r.elapsed_us = gettime_us() - t0;
+    if (rep) *rep = r;
+    if (r.nmissing > 0) return -1;
+    if (dryrun) return r.ndiffs == 0 ? 0 : -1;
+    return r.nfailed == 0 ? 0 : -1;
+}
+
+EXTERNC int apmidg_config_capture(void *buf, int size)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+
+    std::vector<uint8_t> blob;
+    configcapture(blob);
+    if (blob.empty()) return -1;
+    if (buf && size >= (int)blob.size()) memcpy(buf, blob.data(), blob.size());
+    return blob.size();
+}
+
+EXTERNC int apmidg_config_restore(const void *buf, int size, int flags,
+				  apmidg_config_report_t *rep)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+    return configrestore(buf, size, flags, rep);
+}
+
+EXTERNC int apmidg_config_save(const char *path)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg || !path) return -1;
+
+    std::vector<uint8_t> blob;
+    configcapture(blob);
+    if (blob.empty()) return -1;
+
+    // a reader never sees a partial file
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp) {
+	_ERROR_MSG(tmp.c_str());
+	return -1;
+    }
+    bool ok = fwrite(blob.data(), 1, blob.size(), fp) == blob.size();
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+	_ERROR_MSG(path);
+	unlink(tmp.c_str());
+	return -1;
+    }
+    return 0;
+}
+
+EXTERNC int apmidg_config_apply(const char *path, int flags,
+				apmidg_config_report_t *rep)
+{
+    APMIDG_STATS_CALL();
+    if (rep) *rep = {};
+    if (!apmidg || !path) return -1;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+	_ERROR_MSG(path);
+	return -1;
+    }
+    std::vector<uint8_t> blob;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) blob.insert(blob.end(), chunk, chunk + n);
+    fclose(fp);
+    if (blob.size() > INT_MAX) return -1;
+
+    return configrestore(blob.data(), blob.size(), flags, rep);
+}
+
+EXTERNC void apmidg_readfreq(int devid, int freqid, double *actual_MHz) {
+    APMIDG_STATS_CALL();
+    if (actual_MHz) *actual_MHz = -1.0;
+    if (!apmidg) return;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    zes_freq_state_t fstate;
+
+    if (perdev.readfreq(freqid, fstate) != ZE_RESULT_SUCCESS) return;
+    if (actual_MHz) *actual_MHz = fstate.actual;
+    feedread(devid, APMIDG_SAMPLE_FREQ, freqid, fstate.actual);
+
+}
+
+
+EXTERNC int apmidg_getntempsensors(int devid) {
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    return perdev.getntempsensors();
+}
+
+EXTERNC void apmidg_gettempprops(int devid, int tempid, int *onsubdev,
+				 int *subdevid,  int *type) {
+    APMIDG_STATS_CALL();
+    if (onsubdev) *onsubdev = -1;
+    if (subdevid) *subdevid = -1;
+    if (type) *type = -1;
+
+    if (!apmidg) return;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    const IDGTempProps &props = perdev.gettempprops(tempid);
+
+    if (onsubdev) *onsubdev = props.onsubdev;
+    if (subdevid) *subdevid = props.subdevid;
+    if (type) *type = props.type;
+}
+
+EXTERNC int apmidg_refreshprops(int devid)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+    if (devid >= apmidg->getndevs()) return -1;
+
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    // the handles and the properties are swapped in place, which the
+    // background threads would race with
+    bool setqbusy;
+    {
+	APMIDGGraceReader reader(apmidg_setq_grace);
+	IDGSetQueue *q = apmidg_setq.load(std::memory_order_acquire);
+	setqbusy = q && !q->idle();
+    }
+    if (apmidg_sampler.load() || apmidg_ctrl || apmidg_budget ||
+	setqbusy || (apmidg_tempev && apmidg_tempev->armed())) {
+	std::cout << "Warning: apmidg_refreshprops: stop the sampler, the controller, the budget, the watches and the asynchronous limit changes first" << std::endl;
+	return -1;
+    }
+    // the poll reads the handles too. restart it around the reload
+    uint64_t poll_ms = apmidg_accpoll ? apmidg_accpoll->getperiod() : 0;
+    delete apmidg_accpoll;
+    apmidg_accpoll = NULL;
+    int rc = 0;
+    for (int di = 0; di < apmidg->getndevs(); di++) {
+	if (devid >= 0 && di != devid) continue;
+	if (!apmidg->getIDGPowerPerDevice(di).reload()) rc = -1;
+    }
+    if (poll_ms > 0) apmidg_accpoll = new IDGEnergyPoll(apmidg, apmidg_sampler, poll_ms);
+    return rc;
+}
+
+EXTERNC const char* apmidg_sensortype_str(int type)
+{
+    APMIDG_STATS_CALL();
+    const char *pre = "ZES_TEMP_SENSORS_";
+    const char *typestr = str_zes_temp_sensors_t(type);
+
+    if (strncmp(typestr, pre, strlen(pre)) == 0 && strlen(typestr) > strlen(pre))
+	return typestr+strlen(pre);
+
+    return "UNKNOWN";
+}
+
+
+EXTERNC void apmidg_readtemp(int devid, int tempid, double *temp_C) {
+    APMIDG_STATS_CALL();
+    if (temp_C) *temp_C = -1.0;
     if (!apmidg) return;
 
     ze_result_t res;
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    if (!perdev.is_powerlimit_available()) return;
-    zes_pwr_handle_t pwrh = perdev.getpwrh(pwrid);
-
-#if 0 // OLD API
-    zes_power_sustained_limit_t pSustained;
-    zes_power_burst_limit_t pBurst;
-    zes_power_peak_limit_t pPeak;
-    res = zesPowerGetLimits(pwrh, &pSustained, &pBurst, &pPeak);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetLimits", res);
-    if (lim_mw) *lim_mw = pSustained.power;
-#endif
 
-    const int maxpCount = 10;
-    zes_power_limit_ext_desc_t pSustained[maxpCount];
-    uint32_t pCount;
-    pCount = 0;
-    res = zesPowerGetLimitsExt(pwrh, &pCount, pSustained);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetLimitsExt", res);
-    res = zesPowerGetLimitsExt(pwrh, &pCount, pSustained);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetLimitsExt", res);
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    zes_temp_handle_t temph = perdev.gettemph(tempid);
+
+    if (temp_C) {
+	res = apmidg_be->zesTemperatureGetState(temph, temp_C);
+	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG_NOTERMINATE("zesTemperatureGetState", res);
+	if (res == ZE_RESULT_SUCCESS) feedread(devid, APMIDG_SAMPLE_TEMP, tempid, *temp_C);
+    }
+}
+
+
+EXTERNC int apmidg_getsnapshotsize(int *npwr, int *nfreq, int *ntemp)
+{
+    APMIDG_STATS_CALL();
+    if (npwr) *npwr = 0;
+    if (nfreq) *nfreq = 0;
+    if (ntemp) *ntemp = 0;
+    if (!apmidg) return -1;
+
+    for (int di = 0; di < apmidg->getndevs(); di++) {
+	IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(di);
+	if (npwr) *npwr += perdev.getnpwrdoms();
+	if (nfreq) *nfreq += perdev.getnfreqdoms();
+	if (ntemp) *ntemp += perdev.getntempsensors();
+    }
+    return 0;
+}
+
+EXTERNC int apmidg_snapshot(apmidg_snapshot_t *snap)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg || !snap) return -1;
+
+    int npwr, nfreq, ntemp;
+    apmidg_getsnapshotsize(&npwr, &nfreq, &ntemp);
+    if (snap->npwr < npwr || snap->nfreq < nfreq || snap->ntemp < ntemp) {
+	std::cout << "Warning: apmidg_snapshot: the arrays are too small" << std::endl;
+	return -1;
+    }
+
+    ze_result_t res;
+    int pi = 0, fi = 0, ti = 0;
+
+    for (int di = 0; di < apmidg->getndevs(); di++) {
+	IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(di);
+
+	for (int id = 0; id < perdev.getnpwrdoms(); id++, pi++) {
+	    if (snap->pwr_devid) snap->pwr_devid[pi] = di;
+	    if (snap->pwr_id) snap->pwr_id[pi] = id;
+	    if (snap->power_W) {
+		zes_power_energy_counter_t ecounter;
+		double watt = perdev.sampleenergy(id, ecounter);
+		if (snap->energy_uj) snap->energy_uj[pi] = ecounter.energy;
+		if (snap->ts_us) snap->ts_us[pi] = ecounter.timestamp;
+		snap->power_W[pi] = watt;
+		if (ecounter.timestamp) feedread(di, APMIDG_SAMPLE_POWER, id, watt);
+	    } else if (snap->energy_uj || snap->ts_us) {
+		// the raw counter. the poweravg interval stays where it is
+		zes_power_energy_counter_t ecounter = {};
+		if (perdev.readenergy(id, ecounter) != ZE_RESULT_SUCCESS) ecounter = {};
+		if (snap->energy_uj) snap->energy_uj[pi] = ecounter.energy;
+		if (snap->ts_us) snap->ts_us[pi] = ecounter.timestamp;
+	    }
+	}
+
+	for (int id = 0; id < perdev.getnfreqdoms(); id++, fi++) {
+	    if (snap->freq_devid) snap->freq_devid[fi] = di;
+	    if (snap->freq_id) snap->freq_id[fi] = id;
+	    if (snap->freq_actual_MHz) {
+		zes_freq_state_t fstate = {};
+		res = perdev.readfreq(id, fstate);
+		snap->freq_actual_MHz[fi] = (res == ZE_RESULT_SUCCESS) ? fstate.actual : -1.0;
+		feedread(di, APMIDG_SAMPLE_FREQ, id, snap->freq_actual_MHz[fi]);
+	    }
+	    if (snap->freq_min_MHz || snap->freq_max_MHz) {
+		zes_freq_range_t frange = {-1.0, -1.0};
+		if (perdev.getfreqrange(id, frange) != ZE_RESULT_SUCCESS) frange = {-1.0, -1.0};
+		if (snap->freq_min_MHz) snap->freq_min_MHz[fi] = frange.min;
+		if (snap->freq_max_MHz) snap->freq_max_MHz[fi] = frange.max;
+	    }
+	}
 
-    if (pCount > maxpCount) {
-	pCount = maxpCount;
-	std::cout << "Warning: pCount is reset to " << pCount << std::endl;
+	for (int id = 0; id < perdev.getntempsensors(); id++, ti++) {
+	    if (snap->temp_devid) snap->temp_devid[ti] = di;
+	    if (snap->temp_id) snap->temp_id[ti] = id;
+	    if (snap->temp_C) {
+		double temp_C = -1.0;
+		res = apmidg_be->zesTemperatureGetState(perdev.gettemph(id), &temp_C);
+		if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG_NOTERMINATE("zesTemperatureGetState", res);
+		snap->temp_C[ti] = temp_C;
+		feedread(di, APMIDG_SAMPLE_TEMP, id, temp_C);
+	    }
+	}
     }
 
-    int lim_mw_queried = -1;
+    snap->npwr = pi;
+    snap->nfreq = fi;
+    snap->ntemp = ti;
 
-    for (int j=0; j<pCount; j++) {
-	zes_power_limit_ext_desc_t *p;
-	p = pSustained + j;
+    return 0;
+}
 
-	if (p->level == ZES_POWER_LEVEL_SUSTAINED) {
-	    lim_mw_queried = p->limit;
-	}
-    }
 
-    if (lim_mw && lim_mw_queried > 0) {
-	*lim_mw = lim_mw_queried;
-    } else {
-	std::cout << "Warning: apmidg_getpwrlim found no target power level." << std::endl;
+EXTERNC int apmidg_sampler_start(double rate_hz, int capacity)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (apmidg_sampler.load()) {
+	std::cout << "Warning: the sampler is already running" << std::endl;
+	return -1;
     }
+    apmidg_sampler.store(new IDGSampler(apmidg, apmidg_rapl, rate_hz, capacity, apmidg_verbose), std::memory_order_release);
+    return 0;
 }
 
-EXTERNC void apmidg_setpwrlim(int devid, int pwrid, int lim_mw) { // sustained only
-    if (!apmidg) return;
-
-    ze_result_t res;
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    if (!perdev.is_powerlimit_available()) return;
-    zes_pwr_handle_t pwrh = perdev.getpwrh(pwrid);
+EXTERNC void apmidg_sampler_stop()
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    IDGSampler *sampler = apmidg_sampler.exchange(NULL);
+    if (sampler) {
+	sampler->stop();
+	// wait for the readers that may still hold the pointer
+	apmidg_grace.synchronize();
+	delete sampler;
+    }
+}
 
-#if 0 // OLD API
-    zes_power_sustained_limit_t pSustained;
+EXTERNC int apmidg_sampler_isrunning()
+{
+    APMIDG_STATS_CALL();
+    return apmidg_sampler.load(std::memory_order_acquire) ? 1 : 0;
+}
 
-    apmidg_mutex.lock();
-    res = zesPowerGetLimits(pwrh, &pSustained, NULL, NULL);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetLimits", res);
+EXTERNC uint64_t apmidg_sampler_head()
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGSampler *sampler = apmidg_sampler.load(std::memory_order_acquire);
+    if (!sampler) return 0;
+    return sampler->gethead();
+}
 
-    pSustained.power = lim_mw;
+EXTERNC int apmidg_sampler_read(uint64_t *cursor, apmidg_sample_t *buf, int n)
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGSampler *sampler = apmidg_sampler.load(std::memory_order_acquire);
+    if (!sampler || !cursor || !buf) return -1;
+    return sampler->read(*cursor, buf, n);
+}
 
-    res = zesPowerSetLimits(pwrh, &pSustained, NULL, NULL);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerSetLimits", res);
-    apmidg_mutex.unlock();
-#endif
+EXTERNC int apmidg_sampler_latest(int devid, int kind, int id, apmidg_sample_t *sample)
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGSampler *sampler = apmidg_sampler.load(std::memory_order_acquire);
+    if (!sampler || !sample) return -1;
+    return sampler->getlatest(devid, kind, id, *sample);
+}
 
-    const int maxpCount = 10;
-    zes_power_limit_ext_desc_t pSustained[maxpCount];
-    uint32_t pCount;
-    pCount = 0;
-    res = zesPowerGetLimitsExt(pwrh, &pCount, pSustained);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetLimitsExt", res);
 
-    res = zesPowerGetLimitsExt(pwrh, &pCount, pSustained);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerGetLimitsExt", res);
+EXTERNC int apmidg_wstats_start(const double *windows_s, int nwindows)
+{
+    APMIDG_STATS_CALL();
+    static const double defwindows_s[] = {1.0, 10.0, 60.0, 0.0};
 
-    if (pCount > maxpCount) {
-	pCount = maxpCount;
-	std::cout << "Warning: pCount is reset to " << pCount << std::endl;
+    if (!apmidg) return -1;
+    if (!windows_s) {
+	windows_s = defwindows_s;
+	nwindows = sizeof(defwindows_s) / sizeof(defwindows_s[0]);
+    }
+    if (nwindows <= 0 || nwindows > APMIDG_WSTATS_MAXWINDOWS) {
+	std::cout << "Warning: apmidg_wstats_start: 1 to " << APMIDG_WSTATS_MAXWINDOWS << " windows" << std::endl;
+	return -1;
     }
 
-    bool found_sustained = false;
-
-    for (int j=0; j<pCount; j++) {
-	zes_power_limit_ext_desc_t *p;
-	p = pSustained + j;
-	if (p->level == ZES_POWER_LEVEL_SUSTAINED) {
-	    found_sustained = true;
-	    p->limit = lim_mw;
-	}
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (apmidg_wstats.load()) {
+	std::cout << "Warning: the windowed statistics are already running" << std::endl;
+	return -1;
     }
+    if (!apmidg_dix) apmidg_dix = new IDGDomIndex(apmidg, apmidg_rapl);
+    apmidg_wstats.store(new IDGWStats(apmidg_dix->getndoms(), windows_s, nwindows), std::memory_order_release);
+    return 0;
+}
 
-    if (found_sustained) {
-	res = zesPowerSetLimitsExt(pwrh, &pCount, pSustained);
-	if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesPowerSetLimitsExt", res);
-    } else {
-	std::cout << "Warning: apmidg_setpwrlim found no target power level" << std::endl;
+EXTERNC void apmidg_wstats_stop()
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    IDGWStats *ws = apmidg_wstats.exchange(NULL);
+    if (ws) {
+	// wait for the sampler pass or the query that may still hold it
+	apmidg_grace.synchronize();
+	delete ws;
     }
 }
 
-EXTERNC void apmidg_readenergy(int devid, int pwrid, uint64_t *energy_uj, uint64_t *ts_us) {
-    if (energy_uj)  *energy_uj = -1;
-    if (ts_us) *ts_us = -1;
-    if (!apmidg) return;
+EXTERNC int apmidg_wstats_getnwindows()
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGWStats *ws = apmidg_wstats.load(std::memory_order_acquire);
+    return ws ? ws->getnwindows() : -1;
+}
 
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_pwr_handle_t pwrh = perdev.getpwrh(pwrid);
+EXTERNC int apmidg_wstats_get(int devid, int kind, int id, int window, apmidg_wstats_t *st)
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGWStats *ws = apmidg_wstats.load(std::memory_order_acquire);
+    if (!ws || !st || window < 0 || window >= ws->getnwindows()) return -1;
+    int idx = apmidg_dix->get(apmidg, devid, kind, id);
+    if (idx < 0) return -1;
+
+    st->window_s = ws->getwindow(window);
+    st->count = ws->get(idx, window, gettime_us(), st->min, st->max, st->mean, st->stddev,
+			st->p50, st->p95, st->p99);
+    return 0;
+}
 
-    // sampleenergy
-    zes_power_energy_counter_t ecounter;
-    perdev.sampleenergy(pwrid, ecounter);
 
-    if (energy_uj) *energy_uj = ecounter.energy;
-    if (ts_us) *ts_us = ecounter.timestamp;
+EXTERNC void apmidg_history_defaults(apmidg_history_config_t *cfg)
+{
+    APMIDG_STATS_CALL();
+    if (!cfg) return;
+    cfg->raw_s = 10.0;
+    cfg->raw_hz = 100.0;
+    cfg->n1s = 15 * 60;
+    cfg->n1m = 24 * 60;
+    cfg->n1h = 7 * 24;
 }
 
-EXTERNC double apmidg_readpoweravg(int devid, int pwrid) {
-    double watt = 0.0;
-    if (!apmidg) return watt;
+EXTERNC int apmidg_history_start(const apmidg_history_config_t *cfg)
+{
+    APMIDG_STATS_CALL();
+    apmidg_history_config_t defcfg;
 
-    ze_result_t res;
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_pwr_handle_t pwrh = perdev.getpwrh(pwrid);
-    zes_power_energy_counter_t ecounter;
+    if (!apmidg) return -1;
+    if (!cfg) {
+	apmidg_history_defaults(&defcfg);
+	cfg = &defcfg;
+    }
+    if (cfg->raw_s < 0.0 || cfg->raw_hz < 0.0 || cfg->raw_s * cfg->raw_hz > 1e8) {
+	std::cout << "Warning: apmidg_history_start: invalid raw_s or raw_hz" << std::endl;
+	return -1;
+    }
 
-    apmidg_mutex.lock();
-    watt = perdev.sampleenergy(pwrid, ecounter);
-    apmidg_mutex.unlock();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (apmidg_history.load()) {
+	std::cout << "Warning: the history is already running" << std::endl;
+	return -1;
+    }
+    if (!apmidg_dix) apmidg_dix = new IDGDomIndex(apmidg, apmidg_rapl);
+    apmidg_history.store(new IDGHistory(apmidg_dix->getndoms(), *cfg), std::memory_order_release);
+    return 0;
+}
 
-    return watt;
+EXTERNC void apmidg_history_stop()
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    IDGHistory *h = apmidg_history.exchange(NULL);
+    if (h) {
+	// wait for the feeder or the query that may still hold it
+	apmidg_grace.synchronize();
+	delete h;
+    }
+}
+
+EXTERNC int apmidg_history_query(int devid, int kind, int id, int tier,
+				 uint64_t from_us, uint64_t to_us,
+				 apmidg_history_t *buf, int n)
+{
+    APMIDG_STATS_CALL();
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGHistory *h = apmidg_history.load(std::memory_order_acquire);
+    if (!h || !buf || n < 0 || tier < APMIDG_HISTORY_AUTO || tier > APMIDG_HISTORY_1H) return -1;
+    int idx = apmidg_dix->get(apmidg, devid, kind, id);
+    if (idx < 0) return -1;
+
+    if (tier == APMIDG_HISTORY_AUTO) tier = h->pickt(idx, from_us);
+    return h->query(idx, tier, from_us, to_us, buf, n);
 }
 
 
-EXTERNC int apmidg_getnfreqdoms(int devid) {
-    if (!apmidg) return -1;
+EXTERNC int apmidg_watch(int devid, int kind, int id, double threshold, double hysteresis,
+			 double debounce_ms, apmidg_watch_cb_t cb, void *arg)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg || !cb) return -1;
+
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (!apmidg_dix) apmidg_dix = new IDGDomIndex(apmidg, apmidg_rapl);
+    int idx = apmidg_dix->get(apmidg, devid, kind, id);
+    if (idx < 0) {
+	std::cout << "Warning: apmidg_watch: no such domain" << std::endl;
+	return -1;
+    }
+    IDGWatch *w = apmidg_watches.load();
+    if (!w) {
+	w = new IDGWatch(apmidg_dix->getndoms());
+	apmidg_tempev = new IDGTempEvents(apmidg, w, apmidg_verbose);
+	apmidg_watches.store(w, std::memory_order_release);
+    }
 
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    return perdev.getnfreqdoms();
+    uint64_t debounce_us = debounce_ms > 0.0 ? (uint64_t)(debounce_ms * 1000.0) : 0;
+    int wid = w->add(idx, devid, kind, id, threshold, hysteresis, debounce_us, cb, arg);
+    if (kind == APMIDG_SAMPLE_TEMP &&
+	apmidg_tempev->arm(wid, devid, id, idx, threshold, hysteresis > 0.0 ? hysteresis : 0.0)) {
+	w->sethw(wid, true);
+	apmidg_tempev->poke(wid);
+    }
+    return wid;
 }
 
+EXTERNC int apmidg_unwatch(int watchid)
+{
+    APMIDG_STATS_CALL();
+    IDGWatch *w = apmidg_watches.load(std::memory_order_acquire);
+    if (!w) return -1;
 
-EXTERNC void apmidg_getfreqprops(int devid, int freqid, int *onsubdev,
-				int *subdevid, int *canctrl,
-				 double *min_MHz, double *max_MHz)
+    {
+	std::lock_guard<std::mutex> lock(apmidg_mutex);
+	if (apmidg_tempev) apmidg_tempev->disarm(watchid);
+    }
+    // outside the lock. it waits for a running callback of the watch
+    return w->remove(watchid) ? 0 : -1;
+}
+
+EXTERNC int apmidg_watch_ishw(int watchid)
 {
-    if (onsubdev) *onsubdev = -1;
-    if (subdevid) *subdevid = -1;
-    if (canctrl)  *canctrl = -1;
-    if (min_MHz) *min_MHz = -1.0;
-    if (max_MHz) *max_MHz = -1.0;
-    if (!apmidg) return;
+    APMIDG_STATS_CALL();
+    IDGWatch *w = apmidg_watches.load(std::memory_order_acquire);
+    if (!w) return -1;
+    return w->ishw(watchid);
+}
 
-    ze_result_t res;
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_freq_handle_t freqh = perdev.getfreqh(freqid);
-    zes_freq_properties_t fprop;
 
-    res = zesFrequencyGetProperties(freqh, &fprop);
-    if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG_NOTERMINATE("zesFrequencyGetProperties", res);
-    if (onsubdev) *onsubdev = fprop.onSubdevice;
-    if (subdevid) *subdevid = fprop.subdeviceId;
-    if (canctrl)  *canctrl = fprop.canControl;
-    if (min_MHz) *min_MHz = fprop.min;
-    if (max_MHz) *max_MHz = fprop.max;
+EXTERNC int apmidg_rapl_getnzones()
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+    return apmidg_rapl ? apmidg_rapl->getnzones() : 0;
+}
 
+static bool validzone(int zoneid)
+{
+    return apmidg_rapl && zoneid >= 0 && zoneid < apmidg_rapl->getnzones();
 }
 
-EXTERNC void apmidg_getfreqlims(int devid, int freqid,
-				 double *min_MHz, double *max_MHz) {
-    if (min_MHz) *min_MHz = -1.0;
-    if (max_MHz) *max_MHz = -1.0;
+EXTERNC const char *apmidg_rapl_getzonename(int zoneid)
+{
+    APMIDG_STATS_CALL();
+    if (!validzone(zoneid)) return NULL;
+    return apmidg_rapl->getzonename(zoneid);
+}
 
-    if (!apmidg) return;
+EXTERNC int apmidg_rapl_readenergy(int zoneid, uint64_t *energy_uj, uint64_t *ts_us)
+{
+    APMIDG_STATS_CALL();
+    uint64_t e, t;
+    if (!validzone(zoneid)) return -1;
+    if (!apmidg_rapl->readenergy(zoneid, e, t)) return -1;
+    if (energy_uj) *energy_uj = e;
+    if (ts_us) *ts_us = t;
+    return 0;
+}
 
-    ze_result_t res;
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_freq_handle_t freqh = perdev.getfreqh(freqid);
-    zes_freq_range_t frange;
+EXTERNC double apmidg_rapl_readpoweravg(int zoneid)
+{
+    APMIDG_STATS_CALL();
+    uint64_t e, t;
+    apmidg_sample_t s;
+    if (!validzone(zoneid)) return 0.0;
+
+    APMIDGGraceReader reader(apmidg_grace);
+    IDGSampler *sampler = apmidg_sampler.load(std::memory_order_acquire);
+    if (sampler && sampler->getlatest(-1, APMIDG_SAMPLE_CPU_POWER, zoneid, s) == 0) {
+	e = s.energy_uj;
+	t = s.energy_ts_us;
+    } else if (!apmidg_rapl->readenergy(zoneid, e, t)) {
+	return 0.0;
+    }
+    double watt = apmidg_rapl->updatepoweravg(zoneid, e, t);
+    feedread(-1, APMIDG_SAMPLE_CPU_POWER, zoneid, watt);
+    return watt;
+}
 
-    res = zesFrequencyGetRange(freqh, &frange);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesFrequencyGetRange", res);
 
-    if (min_MHz) *min_MHz = frange.min;
-    if (max_MHz) *max_MHz = frange.max;
+EXTERNC void apmidg_ctrl_defaults(int mode, int actuator, apmidg_ctrl_config_t *cfg)
+{
+    APMIDG_STATS_CALL();
+    if (!cfg) return;
+
+    // output units per W or C of error. the node loop sees the sum of
+    // all devices, so a common frequency cap gets a share of the gain
+    int ndevs = (apmidg && apmidg->getndevs() > 0) ? apmidg->getndevs() : 1;
+    bool node = mode == APMIDG_CTRL_NODE_POWER;
+    bool temp = mode == APMIDG_CTRL_DEV_TEMP;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->mode = mode;
+    cfg->actuator = actuator;
+    cfg->period_ms = 100.0;
+    if (actuator == APMIDG_CTRL_ACT_PWRLIM) {
+	cfg->kp = temp ? 4.0 : 0.3;   // W/C or W/W
+	cfg->ki = temp ? 2.0 : 3.0;   // per sec
+	cfg->max_step = node ? 25.0 * ndevs : 25.0; // W
+    } else {
+	cfg->kp = temp ? 10.0 : (node ? 1.0 / ndevs : 1.0); // MHz/C or MHz/W
+	cfg->ki = temp ? 5.0 : (node ? 4.0 / ndevs : 4.0);
+	cfg->max_step = 100.0; // MHz
+    }
 }
 
-EXTERNC void apmidg_setfreqlims(int devid, int freqid,
-				 double min_MHz, double max_MHz) {
-    if (!apmidg) return;
-
-    ze_result_t res;
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_freq_handle_t freqh = perdev.getfreqh(freqid);
-    zes_freq_range_t frange;
+EXTERNC int apmidg_ctrl_start(const apmidg_ctrl_config_t *cfg)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg || !cfg) return -1;
 
-    frange.min = min_MHz;
-    frange.max = max_MHz;
+    const char *err = IDGController::validate(*cfg);
+    if (err) {
+	std::cout << "Warning: apmidg_ctrl_start: " << err << std::endl;
+	return -1;
+    }
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (apmidg_ctrl) {
+	std::cout << "Warning: the controller is already running" << std::endl;
+	return -1;
+    }
+    if (apmidg_budget && cfg->actuator == APMIDG_CTRL_ACT_PWRLIM) {
+	std::cout << "Warning: the budget engine owns the power limits" << std::endl;
+	return -1;
+    }
+    apmidg_ctrl = new IDGController(apmidg, *cfg, apmidg_verbose);
+    apmidg_ctrl->start();
+    return 0;
+}
 
-    apmidg_mutex.lock();
-    res = zesFrequencySetRange(freqh, &frange);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesFrequencySetRange", res);
-    apmidg_mutex.unlock();
+EXTERNC void apmidg_ctrl_stop(int restore)
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (apmidg_ctrl) {
+	apmidg_ctrl->stop(restore != 0);
+	delete apmidg_ctrl;
+	apmidg_ctrl = NULL;
+    }
+}
 
+EXTERNC int apmidg_ctrl_isrunning()
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    return apmidg_ctrl ? 1 : 0;
 }
 
-EXTERNC void apmidg_readfreq(int devid, int freqid, double *actual_MHz) {
-    if (actual_MHz) *actual_MHz = -1.0;
-    if (!apmidg) return;
+EXTERNC int apmidg_ctrl_settarget(int devid, double target)
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (!apmidg_ctrl) return -1;
+    return apmidg_ctrl->settarget(devid, target);
+}
 
-    ze_result_t res;
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_freq_handle_t freqh = perdev.getfreqh(freqid);
-    zes_freq_state_t fstate;
+EXTERNC int apmidg_ctrl_getstate(int devid, apmidg_ctrl_state_t *st)
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (!apmidg_ctrl || !st) return -1;
+    return apmidg_ctrl->getstate(devid, *st);
+}
 
-    res = zesFrequencyGetState(freqh, &fstate);
-    if (res != ZE_RESULT_SUCCESS)  _ZE_ERROR_MSG_NOTERMINATE("zesFrequencyGetState", res);
-    if (actual_MHz) *actual_MHz = fstate.actual;
 
+EXTERNC void apmidg_budget_defaults(apmidg_budget_config_t *cfg)
+{
+    APMIDG_STATS_CALL();
+    if (!cfg) return;
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->period_ms = 500.0;
+    cfg->max_step_W = 20.0;
+    cfg->guard_W = 10.0;
 }
 
+EXTERNC int apmidg_budget_start(const apmidg_budget_config_t *cfg)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg || !cfg) return -1;
 
-EXTERNC int apmidg_getntempsensors(int devid) {
-    if (!apmidg) return -1;
+    const char *err = IDGBudget::validate(*cfg);
+    if (err) {
+	std::cout << "Warning: apmidg_budget_start: " << err << std::endl;
+	return -1;
+    }
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (apmidg_budget) {
+	std::cout << "Warning: the budget engine is already running" << std::endl;
+	return -1;
+    }
+    if (apmidg_ctrl && apmidg_ctrl->getactuator() == APMIDG_CTRL_ACT_PWRLIM) {
+	std::cout << "Warning: the controller owns the power limits" << std::endl;
+	return -1;
+    }
+    IDGBudget *b = new IDGBudget(apmidg, *cfg, apmidg_verbose);
+    // the limits cannot go below lo_W, so a lower budget would be
+    // silently exceeded
+    if (cfg->budget_W < b->getfloor()) {
+	std::cout << "Warning: apmidg_budget_start: budget_W " << cfg->budget_W
+		  << " W is below the sum of the lower bounds " << b->getfloor() << " W" << std::endl;
+	delete b;
+	return -1;
+    }
+    apmidg_budget = b;
+    apmidg_budget->start();
+    return 0;
+}
 
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    return perdev.getntempsensors();
+EXTERNC void apmidg_budget_stop(int restore)
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (apmidg_budget) {
+	apmidg_budget->stop(restore != 0);
+	delete apmidg_budget;
+	apmidg_budget = NULL;
+    }
 }
 
-EXTERNC void apmidg_gettempprops(int devid, int tempid, int *onsubdev,
-				 int *subdevid,  int *type) {
-    if (onsubdev) *onsubdev = -1;
-    if (subdevid) *subdevid = -1;
-    if (type) *type = -1;
+EXTERNC int apmidg_budget_isrunning()
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    return apmidg_budget ? 1 : 0;
+}
 
-    if (!apmidg) return;
+EXTERNC int apmidg_budget_setbudget(double budget_W)
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (!apmidg_budget) return -1;
+    return apmidg_budget->setbudget(budget_W);
+}
 
-    ze_result_t res;
+EXTERNC int apmidg_budget_getstate(int devid, apmidg_budget_state_t *st)
+{
+    APMIDG_STATS_CALL();
+    std::lock_guard<std::mutex> lock(apmidg_mutex);
+    if (!apmidg_budget || !st) return -1;
+    return apmidg_budget->getstate(devid, *st);
+}
 
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_temp_handle_t temph = perdev.gettemph(tempid);
-    zes_temp_properties_t tprop;
 
-    res = zesTemperatureGetProperties(temph, &tprop);
-    if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG_NOTERMINATE("zesTemperatureGetProperties", res);
-    if (onsubdev) *onsubdev = tprop.onSubdevice;
-    if (subdevid) *subdevid = tprop.subdeviceId;
-    if (type) *type = tprop.type;
+EXTERNC int apmidg_region_id(const char *name)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg_regions) return -1;
+    return apmidg_regions->intern(name);
 }
 
-EXTERNC const char* apmidg_sensortype_str(int type)
+EXTERNC int apmidg_region_begin(const char *name)
 {
-    const char *pre = "ZES_TEMP_SENSORS_";
-    const char *typestr = str_zes_temp_sensors_t(type);
+    APMIDG_STATS_CALL();
+    if (!apmidg_regions) return -1;
+    return apmidg_regions->begin(apmidg_regions->intern(name));
+}
 
-    if (strncmp(typestr, pre, strlen(pre)) == 0 && strlen(typestr) > strlen(pre))
-	return typestr+strlen(pre);
+EXTERNC int apmidg_region_end(const char *name)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg_regions) return -1;
+    return apmidg_regions->end(apmidg_regions->find(name));
+}
 
-    return "UNKNOWN";
+EXTERNC int apmidg_region_begin_id(int id)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg_regions) return -1;
+    return apmidg_regions->begin(id);
 }
 
+EXTERNC int apmidg_region_end_id(int id)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg_regions) return -1;
+    return apmidg_regions->end(id);
+}
 
-EXTERNC void apmidg_readtemp(int devid, int tempid, double *temp_C) {
-    if (temp_C) *temp_C = -1.0;
-    if (!apmidg) return;
+EXTERNC int apmidg_region_getstats(const char *name, uint64_t *calls,
+				   double *time_s, double *energy_J, double *freq_MHz)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg_regions || !name) return -1;
+
+    uint64_t c;
+    double t, e, f;
+    if (apmidg_regions->getstats(apmidg_regions->find(name), c, t, e, f) != 0) return -1;
+    if (calls) *calls = c;
+    if (time_s) *time_s = t;
+    if (energy_J) *energy_J = e;
+    if (freq_MHz) *freq_MHz = f;
+    return 0;
+}
 
-    ze_result_t res;
+EXTERNC void apmidg_region_summary()
+{
+    APMIDG_STATS_CALL();
+    if (apmidg_regions) apmidg_regions->printsummary();
+}
 
-    IDGPowerPerDevice perdev = apmidg->getIDGPowerPerDevice(devid);
-    zes_temp_handle_t temph = perdev.gettemph(tempid);
 
-    if (temp_C) {
-	res = zesTemperatureGetState(temph, temp_C);
-	if (res != ZE_RESULT_SUCCESS) _ZE_ERROR_MSG_NOTERMINATE("zesTemperatureGetState", res);
+// spec is "l0", "sim[:params]" or "hwmon[:base spec]". NULL or empty
+// is "l0"
+static const apmidg_backend *selectbackend(const char *spec, int verbose)
+{
+    if (!spec || spec[0] == 0 || strcmp(spec, "l0") == 0) {
+	return apmidg_backend_l0();
+    } else if (strncmp(spec, "sim", 3) == 0 && (spec[3] == 0 || spec[3] == ':')) {
+	return apmidg_backend_sim(spec[3] ? spec + 4 : "", verbose);
+    } else if (strncmp(spec, "hwmon", 5) == 0 && (spec[5] == 0 || spec[5] == ':')) {
+	const char *root = getenv("APMIDG_SYSFS_ROOT");
+	const char *base = spec[5] ? spec + 6 : NULL;
+	// there is one hwmon backend, which would be its own base
+	if (base && strncmp(base, "hwmon", 5) == 0 && (base[5] == 0 || base[5] == ':')) {
+	    std::cout << "Error: hwmon cannot be the base of hwmon" << std::endl;
+	    return NULL;
+	}
+	return apmidg_backend_hwmon(selectbackend(base, verbose), root, verbose);
     }
+    std::cout << "Error: unknown backend " << spec << std::endl;
+    return NULL;
 }
 
-
 EXTERNC int apmidg_init(int verbose)
 {
-    int ret;
+    APMIDG_STATS_CALL();
+    return apmidg_init_backend(verbose, NULL);
+}
+
+EXTERNC int apmidg_init_backend(int verbose, const char *spec)
+{
+    APMIDG_STATS_CALL();
+    return apmidg_init_select(verbose, spec, -1, NULL);
+}
 
+EXTERNC int apmidg_init_select(int verbose, const char *spec, int drvid, const char *devices)
+{
+    APMIDG_STATS_CALL();
     if(setenv("ZES_ENABLE_SYSMAN", "1", 1) != 0) {
 	perror("setenv() failed");
 	exit(1);
@@ -737,16 +4450,128 @@ EXTERNC int apmidg_init(int verbose)
 	return -1;
     }
 
-    apmidg = new IDGPower(verbose); // the arg is the verbose level
+    if (!spec) spec = getenv("APMIDG_BACKEND");
+    apmidg_be = apmidg_backend_stats(selectbackend(spec, verbose)); // timed for apmidg_stats_get()
+    if (!apmidg_be) return -1;
+
+    if (drvid < 0) {
+	const char *e = getenv("APMIDG_DRIVER");
+	drvid = (e && e[0]) ? atoi(e) : 0;
+    }
+    if (!devices) devices = getenv("APMIDG_DEVICES");
+    std::vector<IDGDevSel> sel;
+    if (!parsedevsel(devices, sel)) {
+	std::cout << "Error: invalid device list: " << devices << std::endl;
+	if (apmidg_be->fini) apmidg_be->fini();
+	apmidg_be = NULL;
+	return -1;
+    }
+
+    apmidg_verbose = verbose;
+    apmidg = new IDGPower(verbose, drvid, sel); // the arg is the verbose level
     if (! (apmidg && apmidg->isEnabled()) ) {
+	delete apmidg;
+	apmidg = NULL;
+	if (apmidg_be->fini) apmidg_be->fini();
+	apmidg_be = NULL;
 	return -1;
     }
+    {
+	std::lock_guard<std::mutex> lock(apmidg_regions_mutex);
+	apmidg_regions = new IDGRegions(++apmidg_regions_gen);
+    }
+
+    // the accumulation runs from init, so the counters are polled from
+    // init too
+    const char *pe = getenv("APMIDG_ACC_POLL_MS");
+    uint64_t poll_ms = (pe && pe[0]) ? strtoull(pe, NULL, 0) : APMIDG_ACC_POLL_MS;
+    if (poll_ms > 0) apmidg_accpoll = new IDGEnergyPoll(apmidg, apmidg_sampler, poll_ms);
+
+    const char *e = getenv("APMIDG_RAPL");
+    if (!(e && e[0] == '0')) {
+	apmidg_rapl = new IDGRapl(getenv("APMIDG_SYSFS_ROOT"), verbose);
+	if (apmidg_rapl->getnzones() == 0) {
+	    delete apmidg_rapl;
+	    apmidg_rapl = NULL;
+	}
+    }
 
     return 0;
 }
 
 EXTERNC void apmidg_finish()
 {
+    APMIDG_STATS_CALL();
+    if (apmidg_regions) {
+	if (apmidg_regions->getnregions() > 0) apmidg_regions->printsummary();
+	std::lock_guard<std::mutex> lock(apmidg_regions_mutex);
+	delete apmidg_regions;
+	apmidg_regions = NULL;
+    }
+    // the segment and its ownership lock go with the devices it describes
+    apmidg_shm_destroy();
+    apmidg_mutex.lock();
+    IDGEnergyPoll *accpoll = apmidg_accpoll;
+    apmidg_accpoll = NULL;
+    apmidg_mutex.unlock();
+    delete accpoll;
+    // the queued limit changes land before the engines restore theirs.
+    // the waiters see them completed and leave the grace period
+    IDGSetQueue *setq = apmidg_setq.exchange(NULL);
+    if (setq) {
+	setq->shutdown();
+	apmidg_setq_grace.synchronize();
+	delete setq;
+    }
+    apmidg_ctrl_stop(1);
+    apmidg_budget_stop(1);
+    apmidg_sampler_stop();
+    apmidg_wstats_stop();
+    apmidg_history_stop();
+    apmidg_mutex.lock();
+    IDGTempEvents *tempev = apmidg_tempev;
+    IDGWatch *watches = apmidg_watches.exchange(NULL);
+    apmidg_tempev = NULL;
+    apmidg_mutex.unlock();
+    // unlocked, as a running callback may call apmidg_unwatch(). the
+    // listener feeds the watches, so it goes first
+    delete tempev;
+    delete watches;
+    apmidg_mutex.lock();
+    delete apmidg_dix;
+    apmidg_dix = NULL;
+    apmidg_mutex.unlock();
     if (apmidg)   delete apmidg;
     apmidg = NULL;
+    delete apmidg_rapl;
+    apmidg_rapl = NULL;
+    if (apmidg_be && apmidg_be->fini) apmidg_be->fini();
+    apmidg_be = NULL;
+
+    const char *e = getenv("APMIDG_STATS");
+    if (e && e[0] == '1') apmidg_stats_dump();
+}
+
+EXTERNC const char *apmidg_getbackend()
+{
+    APMIDG_STATS_CALL();
+    return apmidg_be ? apmidg_be->name : NULL;
+}
+
+EXTERNC int apmidg_getdrvid()
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+    return apmidg->getdrvid();
+}
+
+EXTERNC int apmidg_getphysdevid(int devid, uint64_t *subdevmask)
+{
+    APMIDG_STATS_CALL();
+    if (!apmidg) return -1;
+    if (devid < 0 || devid >= apmidg->getndevs()) return -1;
+
+    IDGPowerPerDevice &perdev = apmidg->getIDGPowerPerDevice(devid);
+    if (subdevmask) *subdevmask = perdev.getsubdevmask();
+    return perdev.getphysid();
 }
@@ -14,6 +14,12 @@
  * convenient or required for many situations. The native C++ API
  * offers more flexibility than the functionality defined in this C
  * header.
+ *
+ * After apmidg_init(), the functions can be called from multiple
+ * threads. Calls on different devices do not serialize on a library
+ * lock, and reads are lock-free except for the short per-domain
+ * update of apmidg_readpoweravg(). apmidg_init(), apmidg_finish() and
+ * apmidg_refreshprops() must not race with other calls.
  */
 
 #ifndef __LIBIDGPUPOWER_H_DEFINED__
@@ -30,12 +36,86 @@
 
 /**
  * @brief Initializes the power management functionality for Intel
- * discrete GPUs
+ * discrete GPUs. The devices are set up in parallel, by up to 16
+ * threads or APMIDG_INIT_THREADS if it is set (1 for serial). Only the
+ * power domains are set up here; the frequency domains, the
+ * temperature sensors and the power limit probe are set up on first
+ * use.
  * @param[in] verbose
  * @return    return 0 if successful
  */
 EXTERNC int  apmidg_init(int verbose); // return 0 if successful
 
+/**
+ * @brief Same as apmidg_init() but selects the backend that the
+ * library talks to. spec is "l0" for Level Zero or "sim[:params]" for
+ * the built-in GPU simulator, e.g., "sim:ndevs=64,util=0.8". If spec
+ * is NULL, the APMIDG_BACKEND environment variable is used, and "l0"
+ * if it is unset. apmidg_init() follows the same rule.
+ *
+ * The simulator parameters (comma separated key=value):
+ * ndevs, nsubdevs, tdp (W), idle (W), fmin and fmax (MHz), util (0-1),
+ * trace (a file of 'time_sec util' lines, looped), phase (the trace
+ * offset per device in sec), tamb (C), rth (C/W), clock (real or
+ * virtual), step_us (the virtual time advanced per energy read),
+ * latency_us (a delay added to every device call, to mimic a driver),
+ * ebits (the energy counter width, e.g., 32 to make it wrap), e0
+ * (the initial energy counter value in J), tempfail (the device
+ * whose temperature reads fail, to mimic a broken sensor) and limfail
+ * (the device whose power limit writes fail).
+ *
+ * "hwmon[:base]" reads the card-level energy counter and power limits
+ * from the hwmon sysfs files of the i915/xe driver, with the files kept
+ * open, and uses base ("l0" by default, hwmon is refused) for the
+ * rest, including any domain or file that hwmon lacks at init. A
+ * failed read of a hwmon file returns an error, so a domain always
+ * reads the same counter. The sysfs root is APMIDG_SYSFS_ROOT,
+ * "/sys" if it is unset, so a fake tree can be used, e.g.,
+ * "hwmon:sim:ndevs=2" with APMIDG_SYSFS_ROOT=/tmp/fakesys, where
+ * simulated device i is at PCI address 0000:<i+1>:00.0.
+ * @return    return 0 if successful
+ */
+EXTERNC int  apmidg_init_backend(int verbose, const char *spec);
+
+/**
+ * @brief Same as apmidg_init_backend() but sets up only one driver and
+ * a subset of its devices, e.g., one GPU or tile per MPI rank. drvid
+ * selects the driver; if it is negative, APMIDG_DRIVER is used, and 0
+ * if it is unset. devices is a ZE_AFFINITY_MASK-style list such as
+ * "0,2,3.1", where "3.1" limits device 3 to the domains of its
+ * subdevice 1 (its card-level domains are dropped, so the device total
+ * is the sum of the selected subdevices). If devices is NULL,
+ * APMIDG_DEVICES is used, and all devices if it is unset.
+ * apmidg_init() and apmidg_init_backend() follow the same rule.
+ *
+ * The selected devices are numbered from 0 in ascending order, like
+ * ZE_AFFINITY_MASK does. The ids in the list refer to the devices the
+ * driver exposes, i.e., after ZE_AFFINITY_MASK if it is also set. See
+ * apmidg_getphysdevid().
+ * @return    return 0 if successful, -1 if the list is malformed or
+ * names a missing driver, device or subdevice (one that no domain is
+ * on; a device without subdevices only has subdevice 0)
+ */
+EXTERNC int  apmidg_init_select(int verbose, const char *spec, int drvid, const char *devices);
+
+/**
+ * @brief Returns the selected driver, or -1 if not initialized.
+ */
+EXTERNC int apmidg_getdrvid();
+
+/**
+ * @brief Returns the index in the driver of device devid and, if
+ * subdevmask is not NULL, its selected subdevices as a bit mask (0 for
+ * the whole device). -1 if devid is invalid.
+ */
+EXTERNC int apmidg_getphysdevid(int devid, uint64_t *subdevmask);
+
+/**
+ * @brief Returns the name of the active backend ("l0", "sim" or "hwmon"), or
+ * NULL if not initialized.
+ */
+EXTERNC const char *apmidg_getbackend();
+
 /**
  * @brief Finalizes the power management.
  */
@@ -65,6 +145,8 @@ EXTERNC int apmidg_getnpwrdoms(int devid);
  * @param[out] deflim_mw the default power capping in milliwatt
  * @param[out] minlim_mw the minimum power capping in milliwatt
  * @param[out] maxlim_mw the maximum power capping in milliwatt
+ *
+ * The properties are cached at init (see apmidg_refreshprops()).
  */
 EXTERNC void apmidg_getpwrprops(int devid, int pwrid, int *onsubdev,
 				int *subdevid, int *canctrl, int *deflim_mw,
@@ -72,6 +154,7 @@ EXTERNC void apmidg_getpwrprops(int devid, int pwrid, int *onsubdev,
 
 /**
  * @brief Gets the sustainable power limit. The unit is milliwatt.
+ * Served from the limits cache (see apmidg_setlimcachettl()).
  */
 EXTERNC void apmidg_getpwrlim(int devid, int pwrid, int *lim_mw);
 /**
@@ -86,7 +169,45 @@ EXTERNC void apmidg_readenergy(int devid, int pwrid,
 			       uint64_t *enery_uj, uint64_t *ts_usec);
 
 /**
- * @brief Reads the average power. The unit is watt.
+ * @brief Reads the counter and returns the energy accumulated since
+ * apmidg_init() or the last apmidg_energy_acc_reset(), excluding
+ * stopped intervals. Unlike the raw counter, it is monotonic: a 32-bit
+ * counter wrap is added back and a counter restart (e.g., a driver
+ * reload) is not taken as negative energy. Every counter read by the
+ * library (this, apmidg_readenergy(), apmidg_readpoweravg(),
+ * apmidg_snapshot() and the background sampler) updates it. A wrap is
+ * only caught if the counter is read within a wrap period (2^32 uJ is
+ * about 7 sec at 600 W), so apmidg_init() starts a thread that reads
+ * all counters every APMIDG_ACC_POLL_MS msec (1000 by default, enough
+ * for 4.2 kW per domain; 0 disables it). It skips the pass while the
+ * sampler reads them at least as often. The unit is micro joule.
+ * @param[out] ts_us  the timestamp of the last counter reading
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_readenergy_acc(int devid, int pwrid,
+				  uint64_t *acc_uj, uint64_t *ts_us);
+
+/**
+ * @brief Resumes the accumulation (it runs from apmidg_init()).
+ * devid < 0 applies to all devices and pwrid < 0 to all domains.
+ */
+EXTERNC void apmidg_energy_acc_start(int devid, int pwrid);
+
+/**
+ * @brief Pauses the accumulation. The value is kept.
+ */
+EXTERNC void apmidg_energy_acc_stop(int devid, int pwrid);
+
+/**
+ * @brief Zeroes the accumulated energy without changing whether it is
+ * running.
+ */
+EXTERNC void apmidg_energy_acc_reset(int devid, int pwrid);
+
+/**
+ * @brief Reads the average power since the previous call. The unit is
+ * watt. The first call on a domain only takes the baseline and
+ * returns 0.
  */
 EXTERNC double apmidg_readpoweravg(int devid, int pwrid);
 
@@ -106,7 +227,8 @@ EXTERNC void apmidg_getfreqprops(int devid, int freqid, int *onsubdev,
 				 double *min_MHz, double *max_MHz);
 
 /**
- * @brief Gets the frequency max and min limits.
+ * @brief Gets the frequency max and min limits. Served from the
+ * limits cache (see apmidg_setlimcachettl()).
  */
 EXTERNC void apmidg_getfreqlims(int devid, int freqid,
 				double *min_MHz, double *max_MHz);
@@ -118,6 +240,164 @@ EXTERNC void apmidg_getfreqlims(int devid, int freqid,
 EXTERNC void apmidg_setfreqlims(int devid, int freqid,
 				double min_MHz, double max_MHz);
 
+/**
+ * @brief Sets how long the power limits and frequency ranges read by
+ * apmidg_getpwrlim() and apmidg_getfreqlims() are served from memory
+ * before they are read again from the driver. apmidg_setpwrlim() and
+ * apmidg_setfreqlims() update the cache on success. 0 disables the
+ * cache and a negative value never revalidates. The default is 1000
+ * msec.
+ */
+EXTERNC void apmidg_setlimcachettl(int ttl_ms);
+
+/**
+ * @brief Drops the cached limits of the device (all devices if devid
+ * < 0), e.g., after another process has changed them. The next read
+ * goes to the driver.
+ */
+EXTERNC void apmidg_invalidatelims(int devid);
+
+
+// asynchronous limit changes
+
+#define APMIDG_SET_PWRLIM   (0)
+#define APMIDG_SET_FREQLIMS (1)
+
+#define APMIDG_SET_QUEUED     (0)  /* not written yet */
+#define APMIDG_SET_DONE       (1)  /* written */
+#define APMIDG_SET_SKIPPED    (2)  /* equal to the current value. not written */
+#define APMIDG_SET_SUPERSEDED (3)  /* replaced by a later request of the domain before it was written */
+#define APMIDG_SET_FAILED     (-1) /* rejected by the driver, or no such limit */
+#define APMIDG_SET_UNKNOWN    (-2) /* no such request, or too old to be kept */
+
+/**
+ * @brief The outcome of an asynchronous request, passed to its
+ * callback.
+ */
+typedef struct {
+    uint64_t reqid;
+    int32_t  devid;
+    int32_t  kind;       /**< APMIDG_SET_PWRLIM or _FREQLIMS */
+    int32_t  id;         /**< pwrid or freqid */
+    int32_t  status;     /**< APMIDG_SET_* */
+    int32_t  lim_mw;     /**< the requested power limit */
+    double   min_MHz;    /**< the requested frequency range */
+    double   max_MHz;
+    uint64_t latency_us; /**< from the request to its completion */
+} apmidg_set_result_t;
+
+typedef void (*apmidg_set_cb_t)(const apmidg_set_result_t *res, void *arg);
+
+/**
+ * @brief Queues a sustained power limit change and returns at once.
+ * A worker thread writes the latest request of each domain: a queued
+ * request that a later one of the same domain replaces is completed
+ * as APMIDG_SET_SUPERSEDED without a write, and a request equal to
+ * the current limit, as read from the driver when its turn comes, as
+ * APMIDG_SET_SKIPPED. cb(res, arg) is called on the worker thread at
+ * completion if cb is not NULL. A callback must not call
+ * apmidg_finish(), which waits for the worker to exit. A synchronous
+ * apmidg_setpwrlim() is not ordered with the queue.
+ * @return    return the request id (> 0), or 0 on error (including
+ * after apmidg_finish() has started)
+ */
+EXTERNC uint64_t apmidg_setpwrlim_async(int devid, int pwrid, int lim_mw,
+					 apmidg_set_cb_t cb, void *arg);
+
+/**
+ * @brief Queues a frequency range change. See apmidg_setpwrlim_async().
+ * @return    return the request id (> 0), or 0 on error
+ */
+EXTERNC uint64_t apmidg_setfreqlims_async(int devid, int freqid, double min_MHz, double max_MHz,
+					   apmidg_set_cb_t cb, void *arg);
+
+/**
+ * @brief Returns the status of a request (APMIDG_SET_*). The last
+ * 4096 completions are kept.
+ */
+EXTERNC int apmidg_set_status(uint64_t reqid);
+
+/**
+ * @brief Waits until the request is completed, up to timeout_ms (< 0
+ * waits forever). The callback may still be running.
+ * @return    return the status. APMIDG_SET_QUEUED on timeout
+ */
+EXTERNC int apmidg_set_wait(uint64_t reqid, int timeout_ms);
+
+/**
+ * @brief Waits until every queued request is completed and its
+ * callback has returned. Called from a callback, it returns at once,
+ * since the worker would wait for itself. apmidg_finish() flushes the
+ * queue first.
+ */
+EXTERNC void apmidg_set_flush();
+
+
+// control state snapshots
+
+#define APMIDG_CONFIG_DRYRUN     (0x1) /* diff only. nothing is written */
+#define APMIDG_CONFIG_NOROLLBACK (0x2) /* keep the writes that succeeded on failure */
+#define APMIDG_CONFIG_VERBOSE    (0x4) /* print every difference and its outcome */
+
+/**
+ * @brief The outcome of apmidg_config_restore().
+ */
+typedef struct {
+    int32_t  nents;      /**< the domains in the blob, the power limits of a domain count once */
+    int32_t  ndiffs;     /**< the domains that differed from the current state */
+    int32_t  nwritten;   /**< the domains written and verified */
+    int32_t  nfailed;    /**< the domains rejected or not read back as written */
+    int32_t  rolledback; /**< 1 if the written limits were restored */
+    int32_t  nmissing;   /**< the devices of the blob that were not found */
+    uint64_t elapsed_us;
+} apmidg_config_report_t;
+
+/**
+ * @brief Captures every power limit descriptor (level, interval,
+ * limit) and the frequency range of every controllable domain of
+ * every device into buf. The limits are read from the driver, not
+ * from the limits cache. The blob identifies the devices by their PCI
+ * address, so it can be restored under another device selection.
+ * @return    return the size of the blob. nothing is written if it
+ *            exceeds size (buf may be NULL). -1 on error
+ */
+EXTERNC int apmidg_config_capture(void *buf, int size);
+
+/**
+ * @brief Restores a blob of apmidg_config_capture(). Every domain is
+ * compared with the current state and only those that differ are
+ * written, the devices in parallel. The power limit descriptors of a
+ * domain are written back together with one zesPowerSetLimitsExt().
+ * The written limits are read back and, if any write fails or does
+ * not stick, the written ones are set back to their previous values
+ * unless APMIDG_CONFIG_NOROLLBACK is given. A device of the blob that
+ * is not found is skipped and counted in nmissing, the others are
+ * still restored. It fails without a write if the blob is corrupt or
+ * of another version, or the controller or the budget engine owns the
+ * limits. Queued asynchronous requests are flushed first.
+ * @param flags    APMIDG_CONFIG_* or 0
+ * @param rep      the outcome if not NULL. ndiffs and nmissing are 0
+ *                 when it fails without a compare
+ * @return    return 0 if the current state matches the blob, -1 otherwise
+ *            (including a missing device)
+ */
+EXTERNC int apmidg_config_restore(const void *buf, int size, int flags,
+				  apmidg_config_report_t *rep);
+
+/**
+ * @brief apmidg_config_capture() into a file. The file is replaced
+ * atomically.
+ * @return    return 0 if successful, -1 otherwise
+ */
+EXTERNC int apmidg_config_save(const char *path);
+
+/**
+ * @brief apmidg_config_restore() from a file saved by
+ * apmidg_config_save().
+ */
+EXTERNC int apmidg_config_apply(const char *path, int flags,
+				apmidg_config_report_t *rep);
+
 /**
  * @brief Reads the current actual frequency.
  */
@@ -138,6 +418,20 @@ EXTERNC int apmidg_getntempsensors(int devid);
 EXTERNC void apmidg_gettempprops(int devid, int tempid, int *onsubdev,
 				 int *subdevid,  int *type);
 
+/**
+ * @brief Re-enumerates the domain handles and re-reads the cached
+ * properties returned by apmidg_get{pwr,freq,temp}props(), e.g.,
+ * after the driver reset the device. devid < 0 refreshes all devices.
+ * The handles and the properties are replaced in place, so it needs a
+ * quiescent library: no other thread may call into it meanwhile, and
+ * it fails if the sampler, the controller, the budget, an event-based
+ * watch or an asynchronous limit change is active. A device whose
+ * domain counts changed is left as it was and needs apmidg_finish()
+ * and apmidg_init().
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_refreshprops(int devid);
+
 /**
  * @brief Returns the name string of specified sensor type
  */
@@ -148,4 +442,678 @@ EXTERNC const char* apmidg_sensortype_str(int type);
  */
 EXTERNC void apmidg_readtemp(int devid, int tempid, double *temp_C);
 
+
+// whole-node snapshot
+
+/**
+ * @brief A flat struct-of-arrays filled by apmidg_snapshot().
+ *
+ * The caller allocates every array and sets npwr, nfreq and ntemp to
+ * their capacity (see apmidg_getsnapshotsize()). Entries are laid
+ * out device by device, domain by domain, e.g., the power domains of
+ * device0 come first, then the ones of device1. An array pointer can
+ * be NULL, in which case the field is skipped (and so is the
+ * underlying sysman call when nothing else needs it).
+ */
+typedef struct {
+    int       npwr;       /**< [in] capacity [out] the number of entries */
+    int      *pwr_devid;  /**< device id of each power domain */
+    int      *pwr_id;     /**< power domain id within the device */
+    uint64_t *energy_uj;  /**< energy counter in micro joule */
+    uint64_t *ts_us;      /**< timestamp of the energy counter */
+    double   *power_W;    /**< average power since the previous sample */
+
+    int     nfreq;            /**< [in] capacity [out] the number of entries */
+    int    *freq_devid;
+    int    *freq_id;
+    double *freq_actual_MHz;  /**< current actual frequency */
+    double *freq_min_MHz;     /**< current min frequency limit */
+    double *freq_max_MHz;     /**< current max frequency limit */
+
+    int     ntemp;            /**< [in] capacity [out] the number of entries */
+    int    *temp_devid;
+    int    *temp_id;
+    double *temp_C;
+} apmidg_snapshot_t;
+
+/**
+ * @brief Returns the total number of power domains, frequency domains
+ * and temperature sensors across all devices, i.e., the array sizes
+ * needed by apmidg_snapshot().
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_getsnapshotsize(int *npwr, int *nfreq, int *ntemp);
+
+/**
+ * @brief Reads every power, frequency and temperature domain of all
+ * devices in one pass. It does not allocate memory and takes no
+ * global lock. power_W shares its interval with
+ * apmidg_readpoweravg(). Without power_W, the energy counters are
+ * read as they are and that interval does not move.
+ * @return    return 0 if successful, -1 if not initialized or the
+ *            arrays are too small
+ */
+EXTERNC int apmidg_snapshot(apmidg_snapshot_t *snap);
+
+
+// background sampler
+
+#define APMIDG_SAMPLE_POWER (0)
+#define APMIDG_SAMPLE_FREQ  (1)
+#define APMIDG_SAMPLE_TEMP  (2)
+#define APMIDG_SAMPLE_CPU_POWER (3) /**< a CPU RAPL zone. devid is -1 */
+
+/**
+ * @brief A timestamped sample published by the background sampler.
+ */
+typedef struct {
+    uint64_t ts_us;        /**< host monotonic time in usec when sampled */
+    int32_t  devid;
+    int32_t  kind;         /**< APMIDG_SAMPLE_POWER, _FREQ, _TEMP or _CPU_POWER */
+    int32_t  id;           /**< domain or sensor id within the device, or the RAPL zone id */
+    int32_t  reserved;
+    uint64_t energy_uj;    /**< power only: the energy counter */
+    uint64_t energy_ts_us; /**< power only: the timestamp of the energy counter */
+    double   value;        /**< watt, MHz or C */
+} apmidg_sample_t;
+
+/**
+ * @brief Starts a dedicated thread that polls every power, frequency
+ * and temperature domain, and the CPU RAPL zones in the same pass, at
+ * rate_hz (1000 if rate_hz <= 0) and publishes the samples into a
+ * lock-free ring of 'capacity' entries (chosen automatically if
+ * capacity <= 0). While the sampler runs,
+ * apmidg_readpoweravg() is served from its latest energy reading
+ * without calling sysman.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_sampler_start(double rate_hz, int capacity);
+
+/**
+ * @brief Stops the background sampler and releases its memory once
+ * the calls that are reading it return.
+ */
+EXTERNC void apmidg_sampler_stop();
+
+/**
+ * @brief Returns 1 if the background sampler is running.
+ */
+EXTERNC int apmidg_sampler_isrunning();
+
+/**
+ * @brief Returns the position of the next sample to be published. A
+ * reader that only wants new samples initializes its cursor with this.
+ */
+EXTERNC uint64_t apmidg_sampler_head();
+
+/**
+ * @brief Copies up to n samples starting at *cursor into buf and
+ * advances *cursor. It never blocks the sampler. If the reader falls
+ * behind by more than the ring capacity, the oldest samples are
+ * skipped. Multiple readers can drain the ring with their own cursors.
+ * A failed read of a domain publishes no sample.
+ * @return    the number of samples copied, or -1 if no sampler is running
+ */
+EXTERNC int apmidg_sampler_read(uint64_t *cursor, apmidg_sample_t *buf, int n);
+
+/**
+ * @brief Returns the latest successful sample of the specified
+ * domain. For APMIDG_SAMPLE_POWER and _CPU_POWER, value is the average
+ * power over the last sampling interval. devid is ignored for
+ * _CPU_POWER.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_sampler_latest(int devid, int kind, int id, apmidg_sample_t *sample);
+
+
+// windowed statistics
+
+#define APMIDG_WSTATS_MAXWINDOWS (8)
+
+/**
+ * @brief The summary of a domain over a window, returned by
+ * apmidg_wstats_get(). The unit is the one of the sampler's value
+ * (W, MHz or C).
+ */
+typedef struct {
+    double   window_s; /**< the window length, 0 for the lifetime */
+    uint64_t count;    /**< the number of samples in the window */
+    double   min;
+    double   max;
+    double   mean;
+    double   stddev;   /**< the sample standard deviation */
+    double   p50;      /**< the percentiles, within about 2.5% */
+    double   p95;
+    double   p99;
+} apmidg_wstats_t;
+
+/**
+ * @brief Keeps streaming statistics of every domain the sampler
+ * publishes, over each of the windows_s sliding windows (in seconds,
+ * up to APMIDG_WSTATS_MAXWINDOWS; 0 is the lifetime since start).
+ * NULL selects {1, 10, 60, 0}. A window slides by a tenth of its
+ * length. The memory per domain is fixed regardless of the sample
+ * rate. The statistics are fed only while the sampler runs (see
+ * apmidg_sampler_start()); failed reads are not counted.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_wstats_start(const double *windows_s, int nwindows);
+
+/**
+ * @brief Stops and discards the windowed statistics.
+ */
+EXTERNC void apmidg_wstats_stop();
+
+/**
+ * @brief Returns the number of windows, or -1 if not started.
+ */
+EXTERNC int apmidg_wstats_getnwindows();
+
+/**
+ * @brief Summarizes the domain over the window (an index into the
+ * windows_s given to apmidg_wstats_start()) as of now. kind and the
+ * ids are the ones of apmidg_sampler_latest(). The cost does not
+ * depend on the number of samples.
+ * @return    return 0 if successful. st->count is 0 if no sample fell
+ *            into the window
+ */
+EXTERNC int apmidg_wstats_get(int devid, int kind, int id, int window, apmidg_wstats_t *st);
+
+
+// telemetry history
+
+#define APMIDG_HISTORY_AUTO (-1) /* the finest tier that holds the start */
+#define APMIDG_HISTORY_RAW  (0)  /* every sample */
+#define APMIDG_HISTORY_1S   (1)  /* 1 sec rollups */
+#define APMIDG_HISTORY_1M   (2)  /* 1 min rollups */
+#define APMIDG_HISTORY_1H   (3)  /* 1 hour rollups */
+
+/**
+ * @brief The history configuration. Fill it with
+ * apmidg_history_defaults(). A tier of 0 entries is disabled.
+ */
+typedef struct {
+    double raw_s;  /**< the span of the raw tier at raw_hz */
+    double raw_hz; /**< the expected sample rate. the raw tier holds raw_s * raw_hz samples */
+    int    n1s;    /**< the number of 1 sec rollups kept */
+    int    n1m;    /**< the number of 1 min rollups kept */
+    int    n1h;    /**< the number of 1 hour rollups kept */
+} apmidg_history_config_t;
+
+/**
+ * @brief An entry of apmidg_history_query(). A raw entry is a single
+ * sample (count 1, min = max = mean).
+ */
+typedef struct {
+    uint64_t ts_us;    /**< the start of the rollup, or the sample time (CLOCK_MONOTONIC) */
+    uint64_t count;    /**< the number of samples in the rollup */
+    double   min;
+    double   max;
+    double   mean;
+    double   energy_J; /**< power only: the energy over the samples' intervals */
+} apmidg_history_t;
+
+/**
+ * @brief Fills cfg with the defaults: 10 sec of raw samples at 100 Hz,
+ * 15 min of 1 sec, 1 day of 1 min and 1 week of 1 hour rollups, about
+ * 168 KB per domain (3508 entries of 48 bytes).
+ */
+EXTERNC void apmidg_history_defaults(apmidg_history_config_t *cfg);
+
+/**
+ * @brief Keeps a tiered history of every domain: the raw samples, and
+ * the min/max/mean/energy rollups over 1 sec, 1 min and 1 hour. All
+ * memory is allocated here; the oldest entries of a tier are
+ * overwritten, so the coarser tiers reach further back. It is fed by
+ * the sampler while it runs (see apmidg_sampler_start()), and
+ * otherwise by apmidg_readpoweravg(), apmidg_readfreq(),
+ * apmidg_readtemp(), apmidg_rapl_readpoweravg() and
+ * apmidg_snapshot(). NULL selects the defaults.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_history_start(const apmidg_history_config_t *cfg);
+
+/**
+ * @brief Stops and discards the history.
+ */
+EXTERNC void apmidg_history_stop();
+
+/**
+ * @brief Copies the entries of a domain's tier whose ts_us is in
+ * [from_us, to_us), oldest first, up to n. kind and the ids are the
+ * ones of apmidg_sampler_latest(). The last rollup of a tier is the
+ * one still open, so it is partial. With APMIDG_HISTORY_AUTO, the
+ * finest tier that reaches back to from_us is used, or the coarsest.
+ * @return    return the number of entries copied, or -1
+ */
+EXTERNC int apmidg_history_query(int devid, int kind, int id, int tier,
+				 uint64_t from_us, uint64_t to_us,
+				 apmidg_history_t *buf, int n);
+
+
+// threshold watches
+
+/**
+ * @brief A threshold crossing, passed to the callback of apmidg_watch()
+ */
+typedef struct {
+    int32_t  watchid;
+    int32_t  devid;
+    int32_t  kind;      /**< APMIDG_SAMPLE_* */
+    int32_t  id;
+    int32_t  above;     /**< 1 if the value reached the threshold, 0 if it fell to threshold - hysteresis */
+    int32_t  hw;        /**< 1 if reported by a temperature threshold event of the device */
+    double   value;     /**< the value that completed the crossing */
+    double   threshold;
+    uint64_t ts_us;     /**< CLOCK_MONOTONIC */
+} apmidg_watch_event_t;
+
+typedef void (*apmidg_watch_cb_t)(const apmidg_watch_event_t *ev, void *arg);
+
+/**
+ * @brief Calls cb(ev, arg) when a domain crosses the threshold: once
+ * when a value reaches it, and once when a value falls to threshold -
+ * hysteresis, and so on. A crossing is reported only if it still
+ * holds debounce_ms later. kind and the ids are the ones of
+ * apmidg_sampler_latest(). The callbacks run one at a time on a
+ * thread of the library and must not call apmidg_finish().
+ *
+ * A temperature watch uses the threshold events of the sensor
+ * (zesTemperatureSetConfig() and zesDriverEventListen()) if the
+ * device supports them and no other watch holds the sensor, so no
+ * polling is needed; see apmidg_watch_ishw(). Any other watch is
+ * evaluated on every sample of the sampler while it runs (see
+ * apmidg_sampler_start()), and otherwise on the reads of the domain
+ * (e.g., apmidg_readtemp(), apmidg_snapshot()).
+ * @return    return the watch id, or -1
+ */
+EXTERNC int apmidg_watch(int devid, int kind, int id, double threshold, double hysteresis,
+			 double debounce_ms, apmidg_watch_cb_t cb, void *arg);
+
+/**
+ * @brief Removes the watch. Once it returns, no callback of the
+ * watch runs, unless it is called from that callback. The threshold
+ * configuration of the sensor is restored.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_unwatch(int watchid);
+
+/**
+ * @brief Returns 1 if the watch is driven by the device's temperature
+ * threshold events, 0 if it is polled, or -1 if there is no such watch.
+ */
+EXTERNC int apmidg_watch_ishw(int watchid);
+
+
+// CPU RAPL
+
+/**
+ * @brief Returns the number of CPU RAPL zones found at init under
+ * $APMIDG_SYSFS_ROOT/devices/virtual/powercap/intel-rapl (the root
+ * is /sys by default). Zones whose energy_uj is not readable are
+ * skipped. APMIDG_RAPL=0 disables the discovery.
+ * @return    the number of zones, or -1 if not initialized
+ */
+EXTERNC int apmidg_rapl_getnzones();
+
+/**
+ * @brief Returns the name of the zone, e.g., "package-0" or
+ * "package-0/dram" for a subzone. NULL if zoneid is invalid.
+ */
+EXTERNC const char *apmidg_rapl_getzonename(int zoneid);
+
+/**
+ * @brief Reads the energy counter of the zone. The counter is
+ * extended to 64 bits across max_energy_range_uj wraparounds, so it
+ * never goes backwards. ts_us is the host monotonic time of the read.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_rapl_readenergy(int zoneid, uint64_t *energy_uj, uint64_t *ts_us);
+
+/**
+ * @brief Returns the average power in watt of the zone since the
+ * previous call, like apmidg_readpoweravg(). It is served from the
+ * sampler while it runs.
+ */
+EXTERNC double apmidg_rapl_readpoweravg(int zoneid);
+
+
+// instrumentation
+
+#define APMIDG_STATS_NBUCKETS (32)
+
+#define APMIDG_STATS_API (0) /**< a libapmidg entry point. calls only */
+#define APMIDG_STATS_ZES (1) /**< a Level Zero call made through the backend */
+#define APMIDG_STATS_ERR (2) /**< the failures of a Level Zero call with one result */
+
+/**
+ * @brief An entry of apmidg_stats_get().
+ */
+typedef struct {
+    int32_t     kind;       /**< APMIDG_STATS_API, _ZES or _ERR */
+    int32_t     result;     /**< _ERR only: the ze_result_t */
+    const char *name;       /**< the function name */
+    const char *result_str; /**< _ERR only: the name of the result */
+    uint64_t    calls;      /**< the number of calls, or of failures for _ERR */
+    uint64_t    errors;     /**< _ZES only: the calls that did not succeed */
+    uint64_t    total_ns;   /**< _ZES only: the time spent in the call */
+    uint64_t    max_ns;     /**< _ZES only */
+    uint64_t    hist[APMIDG_STATS_NBUCKETS]; /**< _ZES only: hist[i] counts the calls that took [2^i, 2^(i+1)) nsec */
+} apmidg_stats_t;
+
+/**
+ * @brief Copies up to n entries of the call statistics into st: the
+ * libapmidg entry points, the Level Zero calls underneath with their
+ * latency histograms, and their failures by ze_result_t. Only called
+ * functions are listed. The counters are kept per thread, always on,
+ * and summed here. They live for the process, across apmidg_init()
+ * and apmidg_finish(). st can be NULL to get the number of entries.
+ * @return    the number of entries available, which can exceed n
+ */
+EXTERNC int apmidg_stats_get(apmidg_stats_t *st, int n);
+
+/**
+ * @brief Prints the call statistics to stdout. apmidg_finish() does
+ * this if APMIDG_STATS=1.
+ */
+EXTERNC void apmidg_stats_dump();
+
+/**
+ * @brief Zeroes the call statistics. A call in flight on another
+ * thread is either counted or not, and its latency may stay the max.
+ */
+EXTERNC void apmidg_stats_reset();
+
+
+// closed-loop controller
+
+#define APMIDG_CTRL_NODE_POWER (0) /**< the sum of the device power (W) */
+#define APMIDG_CTRL_DEV_POWER  (1) /**< the power of each device (W) */
+#define APMIDG_CTRL_DEV_TEMP   (2) /**< the hottest sensor of each device (C) */
+
+#define APMIDG_CTRL_ACT_PWRLIM (0) /**< the sustained power limit (W) */
+#define APMIDG_CTRL_ACT_FREQ   (1) /**< the max frequency of all domains (MHz) */
+
+/**
+ * @brief The controller configuration. Fill it with
+ * apmidg_ctrl_defaults() and set target.
+ */
+typedef struct {
+    int32_t mode;      /**< APMIDG_CTRL_NODE_POWER, _DEV_POWER or _DEV_TEMP */
+    int32_t actuator;  /**< APMIDG_CTRL_ACT_PWRLIM or _FREQ */
+    double target;     /**< W or C. the initial target of every loop */
+    double kp;         /**< output units (W or MHz) per unit of error (W or C) */
+    double ki;         /**< kp per second */
+    double kd;         /**< kp times second */
+    double period_ms;  /**< the loop period */
+    double max_step;   /**< the largest output change per period. 0 for no limit */
+    double out_min;    /**< the output bounds per device. 0 for the defaults */
+    double out_max;
+} apmidg_ctrl_config_t;
+
+/**
+ * @brief The state of a loop after its last step
+ */
+typedef struct {
+    int32_t mode;
+    int32_t actuator;
+    double target;
+    double measured;   /**< W or C */
+    double output;     /**< W or MHz. a device has the limit last written successfully */
+    double integral;   /**< the integral term in output units */
+    uint64_t nsteps;
+    int32_t saturated; /**< 1 if the output was clamped or rate-limited */
+    uint64_t nheld;    /**< the periods the output was held as the measurement failed */
+} apmidg_ctrl_state_t;
+
+/**
+ * @brief Fills cfg with the defaults of the mode and the actuator: a
+ * 100 msec period, PI gains and a rate limit of 25 W or 100 MHz per
+ * period. target is left 0.
+ */
+EXTERNC void apmidg_ctrl_defaults(int mode, int actuator, apmidg_ctrl_config_t *cfg);
+
+/**
+ * @brief Starts a controller thread that holds cfg->target by a PID
+ * loop per device (one loop for APMIDG_CTRL_NODE_POWER, whose power
+ * limit budget is split in proportion to the default limits of the
+ * devices, or which sets a common frequency cap). The power is
+ * measured from the energy counters over each period. The output is
+ * clamped to the bounds (by default a quarter of the default limit to
+ * the default limit, or the frequency range of the hardware), rate
+ * limited by max_step, and the integral is held while the output is
+ * limited (anti-windup). A period whose measurement fails (all the
+ * reads of a device failed, or it has no temperature sensor) holds
+ * the output of the loop and counts in nheld. A target works as a
+ * cap: a device that draws less drifts up to the upper bound. Do not
+ * set the actuated limits from elsewhere while it runs.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_ctrl_start(const apmidg_ctrl_config_t *cfg);
+
+/**
+ * @brief Stops the controller. If restore is nonzero, the power
+ * limits or the frequency ranges found at start are written back.
+ * apmidg_finish() stops it with restore.
+ */
+EXTERNC void apmidg_ctrl_stop(int restore);
+
+EXTERNC int apmidg_ctrl_isrunning();
+
+/**
+ * @brief Changes the target of a device loop, or of all loops if
+ * devid < 0 or in the node mode. The integral is kept (bumpless).
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_ctrl_settarget(int devid, double target);
+
+/**
+ * @brief Returns the state of the device loop. In the node mode,
+ * devid < 0 returns the node loop, and devid >= 0 the device's power
+ * and output with the node loop's other fields.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_ctrl_getstate(int devid, apmidg_ctrl_state_t *st);
+
+
+// node power budget
+
+/**
+ * @brief The budget engine configuration. Fill it with
+ * apmidg_budget_defaults() and set budget_W.
+ */
+typedef struct {
+    double budget_W;   /**< the sum of the power limits of all devices */
+    double period_ms;  /**< the redistribution period */
+    double max_step_W; /**< the largest change of a limit per period */
+    double guard_W;    /**< the headroom a donor keeps above its power */
+    double min_W;      /**< the lowest limit. 0 for a quarter of the default limit */
+} apmidg_budget_config_t;
+
+/**
+ * @brief The state of the engine, and of a device if devid >= 0
+ */
+typedef struct {
+    double budget_W;
+    double allocated_W; /**< the sum of the limits */
+    double moved_W;     /**< the total watts moved since start */
+    uint64_t nsteps;
+    double limit_W;     /**< the device's limit. -1 if not controllable */
+    double power_W;     /**< the device's power (the sum if devid < 0) */
+    double freq_MHz;    /**< the device's actual frequency */
+    double lo_W;        /**< the bounds of the device's limit */
+    double hi_W;
+    int32_t pinned;     /**< 1 if the device is held back by its limit */
+} apmidg_budget_state_t;
+
+/**
+ * @brief Fills cfg with the defaults: 500 msec period, 20 W steps and
+ * a 10 W guard. budget_W is left 0.
+ */
+EXTERNC void apmidg_budget_defaults(apmidg_budget_config_t *cfg);
+
+/**
+ * @brief Starts a thread that keeps the sum of the sustained power
+ * limits of all devices at cfg->budget_W and moves watts to where
+ * they are used. The devices start at their share of the budget in
+ * proportion to their default limits (apmidg_getpwrprops()), which are
+ * also the upper bounds. Every period, a device drawing less than its
+ * limit minus guard_W donates the slack, and a device pinned at its
+ * limit (power within 5% of it and the frequency throttled below the
+ * request) receives, up to max_step_W each. While a pinned device is
+ * below its share, the pinned devices above theirs donate too, so
+ * busy devices converge to the fair split. Donations nobody can use
+ * are given back. It fails if the controller actuates the power
+ * limits, and vice versa, or if budget_W is below the sum of the
+ * lower bounds (lo_W in apmidg_budget_state_t), which the limits
+ * cannot go under.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_budget_start(const apmidg_budget_config_t *cfg);
+
+/**
+ * @brief Stops the engine. If restore is nonzero, the limits found at
+ * start are written back. apmidg_finish() stops it with restore.
+ */
+EXTERNC void apmidg_budget_stop(int restore);
+
+EXTERNC int apmidg_budget_isrunning();
+
+/**
+ * @brief Changes the budget. A lower budget is cut from all devices
+ * in proportion to their room above the lower bound at the next
+ * period, a higher one is handed out to the pinned devices. A budget
+ * below the sum of the lower bounds is refused.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_budget_setbudget(double budget_W);
+
+/**
+ * @brief Returns the state. devid < 0 for the node only.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_budget_getstate(int devid, apmidg_budget_state_t *st);
+
+
+// region (phase) energy accounting
+
+/**
+ * @brief Starts a region on the calling thread. Regions nest per
+ * thread and are closed by apmidg_region_end() with the same name.
+ * The energy of all devices, the elapsed time and the time-weighted
+ * actual frequency of all frequency domains are attributed to each
+ * open region (inclusive), summed over threads, and printed as a
+ * table by apmidg_finish().
+ *
+ * begin/end take no library-wide lock and do not allocate except the
+ * first call on a thread and the first use of a name. Without the
+ * sampler, each call reads the energy counters of the device totals
+ * and the frequency of every domain, one driver call each (e.g., 6
+ * calls of tens of microseconds on 2 devices of 2 subdevices), and
+ * the frequency is only read at begin and end, so the average holds
+ * the value read at begin. For short or frequent regions, start the
+ * sampler (apmidg_sampler_start()): its readings are used instead and
+ * a call costs well under a microsecond, at the resolution of the
+ * sampling period. The totals of a thread are kept per thread and
+ * folded into a shared total when it exits. Up to 256 names of up to
+ * 63 characters and a depth of 64.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_region_begin(const char *name);
+
+/**
+ * @brief Ends the innermost region of the calling thread, which must
+ * be name. An unmatched end is counted as an error and ignored.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_region_end(const char *name);
+
+/**
+ * @brief Returns the id of name, registering it on first use, to
+ * skip the name lookup in apmidg_region_begin_id()/_end_id().
+ * @return    the id or -1
+ */
+EXTERNC int apmidg_region_id(const char *name);
+
+EXTERNC int apmidg_region_begin_id(int id);
+EXTERNC int apmidg_region_end_id(int id);
+
+/**
+ * @brief Returns the totals of a region over all threads. freq_MHz
+ * is -1 if no frequency reading fell into the region.
+ * @return    return 0 if successful, -1 if name was never used
+ */
+EXTERNC int apmidg_region_getstats(const char *name, uint64_t *calls,
+				   double *time_s, double *energy_J, double *freq_MHz);
+
+/**
+ * @brief Prints the region table to stdout. apmidg_finish() does this
+ * if any region was used.
+ */
+EXTERNC void apmidg_region_summary();
+
+
+// shared telemetry segment
+
+/**
+ * @brief Creates a POSIX shared-memory segment (APMIDG_SHM_DEFNAME
+ * "/apmidg" if name is NULL) sized for all domains of this node. A
+ * segment left by a dead publisher is reclaimed; one owned by a live
+ * publisher, even one still setting it up, makes this fail. Requires
+ * apmidg_init(). period_us is recorded for readers.
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_shm_create(const char *name, int period_us);
+
+/**
+ * @brief Takes apmidg_snapshot() and publishes it into the segment
+ * under a seqlock. Call this periodically (see apmidgd).
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_shm_publish();
+
+/**
+ * @brief Unmaps and removes the segment created by apmidg_shm_create().
+ * apmidg_finish() calls this.
+ */
+EXTERNC void apmidg_shm_destroy();
+
+/**
+ * @brief An opaque handle of an attached segment.
+ */
+typedef struct apmidg_shm apmidg_shm_t;
+
+/**
+ * @brief Maps the segment published by another process. This and the
+ * other apmidg_shm_* reader functions do not require apmidg_init()
+ * and never call Level Zero. They are also in libapmidg_shm, which
+ * does not link Level Zero, for processes that only read.
+ * @return    a handle, or NULL if no compatible segment is found
+ */
+EXTERNC apmidg_shm_t *apmidg_shm_attach(const char *name);
+
+/**
+ * @brief Unmaps the segment.
+ */
+EXTERNC void apmidg_shm_detach(apmidg_shm_t *shm);
+
+/**
+ * @brief Returns the number of devices recorded in the segment.
+ */
+EXTERNC int apmidg_shm_getndevs(apmidg_shm_t *shm);
+
+/**
+ * @brief Returns the array sizes needed by apmidg_shm_read().
+ * @return    return 0 if successful
+ */
+EXTERNC int apmidg_shm_getsnapshotsize(apmidg_shm_t *shm, int *npwr, int *nfreq, int *ntemp);
+
+/**
+ * @brief Copies the latest published snapshot into snap (same layout
+ * as apmidg_snapshot()). update_ts_us receives the publisher's
+ * CLOCK_MONOTONIC time of the update, which tells how stale it is.
+ * @return    return 0 if successful, -1 if nothing is published yet
+ */
+EXTERNC int apmidg_shm_read(apmidg_shm_t *shm, apmidg_snapshot_t *snap, uint64_t *update_ts_us);
+
 #endif
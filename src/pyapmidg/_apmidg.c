@@ -0,0 +1,271 @@
+/*
+  _apmidg: the native backend of pyapmidg
+
+  pyapmidg.clr_apmidg calls these functions instead of going through
+  ctypes when the module is importable. The per-domain reads skip the
+  ctypes argument conversion, and the bulk reads fill numpy arrays for
+  all domains of all devices with one apmidg_snapshot() call. The GIL
+  is released during every library call, so a monitor thread does not
+  stall the rest of the interpreter.
+
+  (setq c-basic-offset 4)
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include "libapmidg.h"
+
+static PyObject *py_init_select(PyObject *self, PyObject *args)
+{
+    int verbose = 1, drvid = -1, ret;
+    const char *spec = NULL, *devices = NULL;
+
+    if (!PyArg_ParseTuple(args, "|iziz", &verbose, &spec, &drvid, &devices)) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    ret = apmidg_init_select(verbose, spec, drvid, devices);
+    Py_END_ALLOW_THREADS
+    return PyLong_FromLong(ret);
+}
+
+static PyObject *py_finish(PyObject *self, PyObject *args)
+{
+    Py_BEGIN_ALLOW_THREADS
+    apmidg_finish();
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_getndevs(PyObject *self, PyObject *args)
+{
+    return PyLong_FromLong(apmidg_getndevs());
+}
+
+/*
+ * per-domain reads. the same arguments and results as clr_apmidg
+ */
+
+static PyObject *py_readpoweravg(PyObject *self, PyObject *args)
+{
+    int devid = 0, pwrid = 0;
+    double watt;
+
+    if (!PyArg_ParseTuple(args, "|ii", &devid, &pwrid)) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    watt = apmidg_readpoweravg(devid, pwrid);
+    Py_END_ALLOW_THREADS
+    return PyFloat_FromDouble(watt);
+}
+
+static PyObject *py_readenergy(PyObject *self, PyObject *args)
+{
+    int devid = 0, pwrid = 0;
+    uint64_t energy_uj = 0, ts_us = 0;
+
+    if (!PyArg_ParseTuple(args, "|ii", &devid, &pwrid)) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    apmidg_readenergy(devid, pwrid, &energy_uj, &ts_us);
+    Py_END_ALLOW_THREADS
+    return Py_BuildValue("(KK)", (unsigned long long)energy_uj, (unsigned long long)ts_us);
+}
+
+static PyObject *py_readfreq(PyObject *self, PyObject *args)
+{
+    int devid = 0, freqid = 0;
+    double actual_MHz = 0.0;
+
+    if (!PyArg_ParseTuple(args, "|ii", &devid, &freqid)) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    apmidg_readfreq(devid, freqid, &actual_MHz);
+    Py_END_ALLOW_THREADS
+    return PyFloat_FromDouble(actual_MHz);
+}
+
+static PyObject *py_readtemp(PyObject *self, PyObject *args)
+{
+    int devid = 0, tempid = 0;
+    double temp_C = 0.0;
+
+    if (!PyArg_ParseTuple(args, "|ii", &devid, &tempid)) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    apmidg_readtemp(devid, tempid, &temp_C);
+    Py_END_ALLOW_THREADS
+    return PyFloat_FromDouble(temp_C);
+}
+
+static PyObject *py_getpwrlim(PyObject *self, PyObject *args)
+{
+    int devid = 0, pwrid = 0, lim_mw = 0;
+
+    if (!PyArg_ParseTuple(args, "|ii", &devid, &pwrid)) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    apmidg_getpwrlim(devid, pwrid, &lim_mw);
+    Py_END_ALLOW_THREADS
+    return PyLong_FromLong(lim_mw);
+}
+
+static PyObject *py_getfreqlims(PyObject *self, PyObject *args)
+{
+    int devid = 0, freqid = 0;
+    double min_MHz = 0.0, max_MHz = 0.0;
+
+    if (!PyArg_ParseTuple(args, "|ii", &devid, &freqid)) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    apmidg_getfreqlims(devid, freqid, &min_MHz, &max_MHz);
+    Py_END_ALLOW_THREADS
+    return Py_BuildValue("(dd)", min_MHz, max_MHz);
+}
+
+/*
+ * bulk reads
+ */
+
+#define SNAP_PWR   (1 << 0)
+#define SNAP_FREQ  (1 << 1)
+#define SNAP_TEMP  (1 << 2)
+#define SNAP_ALL   (SNAP_PWR | SNAP_FREQ | SNAP_TEMP)
+
+static PyObject *newarray(npy_intp n, int type)
+{
+    return PyArray_ZEROS(1, &n, type, 0);
+}
+
+#define DATA(a, t)  ((t *)PyArray_DATA((PyArrayObject *)(a)))
+
+// read the selected domain kinds with one apmidg_snapshot() call.
+// return a dict of 1-d arrays named after the apmidg_snapshot_t fields
+static PyObject *snapshot_dict(int what)
+{
+    int npwr = 0, nfreq = 0, ntemp = 0, ret;
+    npy_intp np_, nf, nt;
+    apmidg_snapshot_t s;
+    PyObject *a[13] = {NULL};
+    static const char *names[13] = {
+	"pwr_devid", "pwr_id", "energy_uj", "ts_us", "power_W",
+	"freq_devid", "freq_id", "freq_actual_MHz", "freq_min_MHz", "freq_max_MHz",
+	"temp_devid", "temp_id", "temp_C",
+    };
+    PyObject *d = NULL;
+
+    if (apmidg_getsnapshotsize(&npwr, &nfreq, &ntemp) != 0) {
+	PyErr_SetString(PyExc_RuntimeError, "apmidg is not initialized");
+	return NULL;
+    }
+    // the unselected kinds get empty arrays
+    np_ = (what & SNAP_PWR) ? npwr : 0;
+    nf = (what & SNAP_FREQ) ? nfreq : 0;
+    nt = (what & SNAP_TEMP) ? ntemp : 0;
+
+    a[0] = newarray(np_, NPY_INT);
+    a[1] = newarray(np_, NPY_INT);
+    a[2] = newarray(np_, NPY_UINT64);
+    a[3] = newarray(np_, NPY_UINT64);
+    a[4] = newarray(np_, NPY_DOUBLE);
+    a[5] = newarray(nf, NPY_INT);
+    a[6] = newarray(nf, NPY_INT);
+    a[7] = newarray(nf, NPY_DOUBLE);
+    a[8] = newarray(nf, NPY_DOUBLE);
+    a[9] = newarray(nf, NPY_DOUBLE);
+    a[10] = newarray(nt, NPY_INT);
+    a[11] = newarray(nt, NPY_INT);
+    a[12] = newarray(nt, NPY_DOUBLE);
+    for (int i = 0; i < 13; i++) if (!a[i]) goto out;
+
+    // a NULL array skips its field and, if nothing else needs it, the
+    // sysman call behind it. the capacities stay the full sizes
+    s.npwr = npwr;
+    s.pwr_devid = np_ ? DATA(a[0], int) : NULL;
+    s.pwr_id = np_ ? DATA(a[1], int) : NULL;
+    s.energy_uj = np_ ? DATA(a[2], uint64_t) : NULL;
+    s.ts_us = np_ ? DATA(a[3], uint64_t) : NULL;
+    s.power_W = np_ ? DATA(a[4], double) : NULL;
+    s.nfreq = nfreq;
+    s.freq_devid = nf ? DATA(a[5], int) : NULL;
+    s.freq_id = nf ? DATA(a[6], int) : NULL;
+    s.freq_actual_MHz = nf ? DATA(a[7], double) : NULL;
+    s.freq_min_MHz = nf ? DATA(a[8], double) : NULL;
+    s.freq_max_MHz = nf ? DATA(a[9], double) : NULL;
+    s.ntemp = ntemp;
+    s.temp_devid = nt ? DATA(a[10], int) : NULL;
+    s.temp_id = nt ? DATA(a[11], int) : NULL;
+    s.temp_C = nt ? DATA(a[12], double) : NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = apmidg_snapshot(&s);
+    Py_END_ALLOW_THREADS
+    if (ret != 0) {
+	PyErr_SetString(PyExc_RuntimeError, "apmidg_snapshot() failed");
+	goto out;
+    }
+
+    d = PyDict_New();
+    if (!d) goto out;
+    for (int i = 0; i < 13; i++) {
+	if (PyDict_SetItemString(d, names[i], a[i]) != 0) {
+	    Py_CLEAR(d);
+	    goto out;
+	}
+    }
+out:
+    for (int i = 0; i < 13; i++) Py_XDECREF(a[i]);
+    return d;
+}
+
+static PyObject *py_snapshot(PyObject *self, PyObject *args)
+{
+    return snapshot_dict(SNAP_ALL);
+}
+
+// one array from a single-kind snapshot
+static PyObject *snapshot_field(int what, const char *name)
+{
+    PyObject *d = snapshot_dict(what);
+    if (!d) return NULL;
+    PyObject *a = PyDict_GetItemString(d, name);
+    Py_XINCREF(a);
+    Py_DECREF(d);
+    return a;
+}
+
+static PyObject *py_readpoweravg_all(PyObject *self, PyObject *args)
+{
+    return snapshot_field(SNAP_PWR, "power_W");
+}
+
+static PyObject *py_readfreq_all(PyObject *self, PyObject *args)
+{
+    return snapshot_field(SNAP_FREQ, "freq_actual_MHz");
+}
+
+static PyObject *py_readtemp_all(PyObject *self, PyObject *args)
+{
+    return snapshot_field(SNAP_TEMP, "temp_C");
+}
+
+static PyMethodDef methods[] = {
+    {"init_select", py_init_select, METH_VARARGS, "init_select(verbose, backend, drvid, devices). see apmidg_init_select()"},
+    {"finish", py_finish, METH_NOARGS, "apmidg_finish()"},
+    {"getndevs", py_getndevs, METH_NOARGS, "the number of devices"},
+    {"readpoweravg", py_readpoweravg, METH_VARARGS, "readpoweravg(devid, pwrid) -> W"},
+    {"readenergy", py_readenergy, METH_VARARGS, "readenergy(devid, pwrid) -> (energy_uj, ts_us)"},
+    {"readfreq", py_readfreq, METH_VARARGS, "readfreq(devid, freqid) -> MHz"},
+    {"readtemp", py_readtemp, METH_VARARGS, "readtemp(devid, tempid) -> C"},
+    {"getpwrlim", py_getpwrlim, METH_VARARGS, "getpwrlim(devid, pwrid) -> mW"},
+    {"getfreqlims", py_getfreqlims, METH_VARARGS, "getfreqlims(devid, freqid) -> (min_MHz, max_MHz)"},
+    {"snapshot", py_snapshot, METH_NOARGS, "all domains of all devices as a dict of numpy arrays"},
+    {"readpoweravg_all", py_readpoweravg_all, METH_NOARGS, "the average power of all power domains (numpy array)"},
+    {"readfreq_all", py_readfreq_all, METH_NOARGS, "the actual frequency of all frequency domains (numpy array)"},
+    {"readtemp_all", py_readtemp_all, METH_NOARGS, "the temperature of all sensors (numpy array)"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef moddef = {
+    PyModuleDef_HEAD_INIT, "_apmidg", "the native backend of pyapmidg", -1, methods,
+};
+
+PyMODINIT_FUNC PyInit__apmidg(void)
+{
+    import_array();
+    return PyModule_Create(&moddef);
+}
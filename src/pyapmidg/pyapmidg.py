@@ -13,6 +13,17 @@ from ctypes import *
 import time
 import keypress
 
+# the native backend (_apmidg.c) and numpy are optional. without
+# _apmidg, every call goes through ctypes
+try:
+    import _apmidg
+except ImportError:
+    _apmidg = None
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
 class rtype_getpwrprops:
     def __init__(self, onsubdev, subdevid, canctrl, deflim_mw, minlim_mw, maxlim_mw):
         self.onsubdev = onsubdev.value
@@ -24,8 +35,9 @@ class rtype_getpwrprops:
 
 class rtype_readenergy:
     def __init__(self, energy_uj, ts_usec):
-        self.energy_uj = energy_uj.value
-        self.ts_usec = ts_usec.value
+        # ctypes objects, or ints from _apmidg
+        self.energy_uj = getattr(energy_uj, 'value', energy_uj)
+        self.ts_usec = getattr(ts_usec, 'value', ts_usec)
 
 class rtype_getfreqprops:
     def __init__(self, onsubdev, subdevid, canctrl, min_MHz, max_MHz):
@@ -37,8 +49,8 @@ class rtype_getfreqprops:
 
 class rtype_getfreqlims:
     def __init__(self, min_MHz, max_MHz):
-        self.min_MHz = min_MHz.value
-        self.max_MHz = max_MHz.value
+        self.min_MHz = getattr(min_MHz, 'value', min_MHz)
+        self.max_MHz = getattr(max_MHz, 'value', max_MHz)
 
 class rtype_gettempprops:
     def __init__(self, onsubdev, subdevid, sensortype):
@@ -47,6 +59,188 @@ class rtype_gettempprops:
         self.sensortype = sensortype.value
 
 
+class apmidg_snapshot_t(Structure):
+    _fields_ = [('npwr', c_int),
+                ('pwr_devid', POINTER(c_int)),
+                ('pwr_id', POINTER(c_int)),
+                ('energy_uj', POINTER(c_ulonglong)),
+                ('ts_us', POINTER(c_ulonglong)),
+                ('power_W', POINTER(c_double)),
+                ('nfreq', c_int),
+                ('freq_devid', POINTER(c_int)),
+                ('freq_id', POINTER(c_int)),
+                ('freq_actual_MHz', POINTER(c_double)),
+                ('freq_min_MHz', POINTER(c_double)),
+                ('freq_max_MHz', POINTER(c_double)),
+                ('ntemp', c_int),
+                ('temp_devid', POINTER(c_int)),
+                ('temp_id', POINTER(c_int)),
+                ('temp_C', POINTER(c_double))]
+
+SAMPLE_POWER = 0
+SAMPLE_FREQ = 1
+SAMPLE_TEMP = 2
+SAMPLE_CPU_POWER = 3
+
+SET_QUEUED = 0
+SET_DONE = 1
+SET_SKIPPED = 2
+SET_SUPERSEDED = 3
+SET_FAILED = -1
+SET_UNKNOWN = -2
+
+# see apmidg_config_restore()
+CONFIG_DRYRUN = 0x1
+CONFIG_NOROLLBACK = 0x2
+CONFIG_VERBOSE = 0x4
+
+# see apmidg_ctrl_start()
+CTRL_NODE_POWER = 0
+CTRL_DEV_POWER = 1
+CTRL_DEV_TEMP = 2
+CTRL_ACT_PWRLIM = 0
+CTRL_ACT_FREQ = 1
+
+class apmidg_ctrl_config_t(Structure):
+    _fields_ = [('mode', c_int),
+                ('actuator', c_int),
+                ('target', c_double),
+                ('kp', c_double),
+                ('ki', c_double),
+                ('kd', c_double),
+                ('period_ms', c_double),
+                ('max_step', c_double),
+                ('out_min', c_double),
+                ('out_max', c_double)]
+
+class apmidg_budget_config_t(Structure):
+    _fields_ = [('budget_W', c_double),
+                ('period_ms', c_double),
+                ('max_step_W', c_double),
+                ('guard_W', c_double),
+                ('min_W', c_double)]
+
+class apmidg_budget_state_t(Structure):
+    _fields_ = [('budget_W', c_double),
+                ('allocated_W', c_double),
+                ('moved_W', c_double),
+                ('nsteps', c_ulonglong),
+                ('limit_W', c_double),
+                ('power_W', c_double),
+                ('freq_MHz', c_double),
+                ('lo_W', c_double),
+                ('hi_W', c_double),
+                ('pinned', c_int)]
+
+class apmidg_ctrl_state_t(Structure):
+    _fields_ = [('mode', c_int),
+                ('actuator', c_int),
+                ('target', c_double),
+                ('measured', c_double),
+                ('output', c_double),
+                ('integral', c_double),
+                ('nsteps', c_ulonglong),
+                ('saturated', c_int),
+                ('nheld', c_ulonglong)]
+
+# see apmidg_stats_get()
+STATS_API = 0
+STATS_ZES = 1
+STATS_ERR = 2
+STATS_NBUCKETS = 32
+
+class apmidg_stats_t(Structure):
+    _fields_ = [('kind', c_int),
+                ('result', c_int),
+                ('name', c_char_p),
+                ('result_str', c_char_p),
+                ('calls', c_ulonglong),
+                ('errors', c_ulonglong),
+                ('total_ns', c_ulonglong),
+                ('max_ns', c_ulonglong),
+                ('hist', c_ulonglong * STATS_NBUCKETS)]
+
+class apmidg_wstats_t(Structure):
+    _fields_ = [('window_s', c_double),
+                ('count', c_ulonglong),
+                ('min', c_double),
+                ('max', c_double),
+                ('mean', c_double),
+                ('stddev', c_double),
+                ('p50', c_double),
+                ('p95', c_double),
+                ('p99', c_double)]
+
+HISTORY_AUTO = -1
+HISTORY_RAW = 0
+HISTORY_1S = 1
+HISTORY_1M = 2
+HISTORY_1H = 3
+
+class apmidg_history_config_t(Structure):
+    _fields_ = [('raw_s', c_double),
+                ('raw_hz', c_double),
+                ('n1s', c_int),
+                ('n1m', c_int),
+                ('n1h', c_int)]
+
+class apmidg_history_t(Structure):
+    _fields_ = [('ts_us', c_ulonglong),
+                ('count', c_ulonglong),
+                ('min', c_double),
+                ('max', c_double),
+                ('mean', c_double),
+                ('energy_J', c_double)]
+
+class apmidg_watch_event_t(Structure):
+    _fields_ = [('watchid', c_int),
+                ('devid', c_int),
+                ('kind', c_int),
+                ('id', c_int),
+                ('above', c_int),
+                ('hw', c_int),
+                ('value', c_double),
+                ('threshold', c_double),
+                ('ts_us', c_ulonglong)]
+
+class apmidg_config_report_t(Structure):
+    _fields_ = [('nents', c_int),
+                ('ndiffs', c_int),
+                ('nwritten', c_int),
+                ('nfailed', c_int),
+                ('rolledback', c_int),
+                ('nmissing', c_int),
+                ('elapsed_us', c_ulonglong)]
+
+apmidg_watch_cb_t = CFUNCTYPE(None, POINTER(apmidg_watch_event_t), c_void_p)
+
+class apmidg_sample_t(Structure):
+    _fields_ = [('ts_us', c_ulonglong),
+                ('devid', c_int),
+                ('kind', c_int),
+                ('id', c_int),
+                ('reserved', c_int),
+                ('energy_uj', c_ulonglong),
+                ('energy_ts_us', c_ulonglong),
+                ('value', c_double)]
+
+class rtype_snapshot:
+    def __init__(self, s):
+        self.pwr_devid = s.pwr_devid[:s.npwr]
+        self.pwr_id = s.pwr_id[:s.npwr]
+        self.energy_uj = s.energy_uj[:s.npwr]
+        self.ts_us = s.ts_us[:s.npwr]
+        self.power_W = s.power_W[:s.npwr]
+        self.freq_devid = s.freq_devid[:s.nfreq]
+        self.freq_id = s.freq_id[:s.nfreq]
+        self.freq_actual_MHz = s.freq_actual_MHz[:s.nfreq]
+        self.freq_min_MHz = s.freq_min_MHz[:s.nfreq]
+        self.freq_max_MHz = s.freq_max_MHz[:s.nfreq]
+        self.temp_devid = s.temp_devid[:s.ntemp]
+        self.temp_id = s.temp_id[:s.ntemp]
+        self.temp_C = s.temp_C[:s.ntemp]
+
+
 class clr_apmidg:
     """The clr_apmidg class provides APIs for reading energy/power
     consumption and temperatures and controlling hardware power
@@ -57,9 +251,17 @@ class clr_apmidg:
     this class.
     """
 
-    def __init__(self, verbose =1):
+    def __init__(self, verbose =1, backend = None, drvid = -1, devices = None, native = True):
+        """backend: None (APMIDG_BACKEND or Level Zero), "l0" or
+        "sim[:params]" for the built-in GPU simulator.
+        drvid, devices: the driver and a device list such as "0,3.1"
+        (see apmidg_init_select()).
+        native: use the _apmidg extension for the reads if available"""
         self.apm = CDLL("libapmidg.so")
-        ret = self.apm.apmidg_init(verbose)
+        self.native = _apmidg if native else None
+        self.apm.apmidg_init_select.argtypes = [c_int, c_char_p, c_int, c_char_p]
+        ret = self.apm.apmidg_init_select(verbose, backend.encode() if backend else None,
+                                          drvid, devices.encode() if devices else None)
 
         # define argtypes here if needed
         self.func_getpwrprops = self.apm.apmidg_getpwrprops
@@ -71,18 +273,15 @@ class clr_apmidg:
         self.func_readenergy = self.apm.apmidg_readenergy
         self.func_readenergy.argstypes = [c_int, c_int, POINTER(c_ulonglong), POINTER(c_ulonglong)]
         #
+        # the library keeps the previous energy reading per domain
+        self.func_readpoweravg = self.apm.apmidg_readpoweravg
+        self.func_readpoweravg.argtypes = [c_int, c_int]
+        self.func_readpoweravg.restype = c_double
+        #
+        self.func_readenergy_acc = self.apm.apmidg_readenergy_acc
+        self.func_readenergy_acc.argtypes = [c_int, c_int, POINTER(c_ulonglong), POINTER(c_ulonglong)]
 
         self.ndevs = self.getndevs()
-        self.prev_e = []
-        for devid in range(0, self.ndevs):
-            npwrdoms = self.getnpwrdoms(devid)
-            tmp = []
-            for pwrid in range(0, npwrdoms):
-                e = self.readenergy(devid, pwrid)
-                tmp.append(e)
-                # print(devid, pwrid, e.energy_uj, e.ts_usec)
-            self.prev_e.append(tmp)
-        time.sleep(0.1) # this is a workaround for readpoweravg() to be called immediately after this object is created
 
         #
         self.func_getfreqprops = self.apm.apmidg_getfreqprops
@@ -104,6 +303,60 @@ class clr_apmidg:
         self.func_readtemp = self.apm.apmidg_readtemp
         self.func_readtemp.argtypes = [c_int, c_int, POINTER(c_double)]
         #
+        self.func_getsnapshotsize = self.apm.apmidg_getsnapshotsize
+        self.func_getsnapshotsize.argtypes = [POINTER(c_int), POINTER(c_int), POINTER(c_int)]
+        self.func_snapshot = self.apm.apmidg_snapshot
+        self.func_snapshot.argtypes = [POINTER(apmidg_snapshot_t)]
+        self.snapbuf = None
+        #
+        self.func_sampler_start = self.apm.apmidg_sampler_start
+        self.func_sampler_start.argtypes = [c_double, c_int]
+        self.func_sampler_latest = self.apm.apmidg_sampler_latest
+        self.func_sampler_latest.argtypes = [c_int, c_int, c_int, POINTER(apmidg_sample_t)]
+        #
+        self.apm.apmidg_rapl_getzonename.restype = c_char_p
+        self.func_rapl_readenergy = self.apm.apmidg_rapl_readenergy
+        self.func_rapl_readenergy.argtypes = [c_int, POINTER(c_ulonglong), POINTER(c_ulonglong)]
+        self.func_rapl_readpoweravg = self.apm.apmidg_rapl_readpoweravg
+        self.func_rapl_readpoweravg.argtypes = [c_int]
+        self.func_rapl_readpoweravg.restype = c_double
+        #
+        self.apm.apmidg_ctrl_defaults.argtypes = [c_int, c_int, POINTER(apmidg_ctrl_config_t)]
+        self.apm.apmidg_ctrl_start.argtypes = [POINTER(apmidg_ctrl_config_t)]
+        self.apm.apmidg_ctrl_settarget.argtypes = [c_int, c_double]
+        self.apm.apmidg_ctrl_getstate.argtypes = [c_int, POINTER(apmidg_ctrl_state_t)]
+        #
+        self.apm.apmidg_history_defaults.argtypes = [POINTER(apmidg_history_config_t)]
+        self.apm.apmidg_history_start.argtypes = [POINTER(apmidg_history_config_t)]
+        self.apm.apmidg_history_query.argtypes = [c_int, c_int, c_int, c_int, c_ulonglong, c_ulonglong,
+                                                  POINTER(apmidg_history_t), c_int]
+        #
+        self.apm.apmidg_watch.argtypes = [c_int, c_int, c_int, c_double, c_double, c_double,
+                                          apmidg_watch_cb_t, c_void_p]
+        self.watch_cbs = {} # keep the ctypes callbacks alive
+        #
+        self.apm.apmidg_setpwrlim_async.argtypes = [c_int, c_int, c_int, c_void_p, c_void_p]
+        self.apm.apmidg_setpwrlim_async.restype = c_ulonglong
+        self.apm.apmidg_setfreqlims_async.argtypes = [c_int, c_int, c_double, c_double, c_void_p, c_void_p]
+        self.apm.apmidg_setfreqlims_async.restype = c_ulonglong
+        self.apm.apmidg_set_status.argtypes = [c_ulonglong]
+        self.apm.apmidg_set_wait.argtypes = [c_ulonglong, c_int]
+        #
+        self.apm.apmidg_config_capture.argtypes = [c_void_p, c_int]
+        self.apm.apmidg_config_restore.argtypes = [c_char_p, c_int, c_int, POINTER(apmidg_config_report_t)]
+        self.apm.apmidg_config_save.argtypes = [c_char_p]
+        self.apm.apmidg_config_apply.argtypes = [c_char_p, c_int, POINTER(apmidg_config_report_t)]
+        #
+        self.apm.apmidg_budget_defaults.argtypes = [POINTER(apmidg_budget_config_t)]
+        self.apm.apmidg_budget_start.argtypes = [POINTER(apmidg_budget_config_t)]
+        self.apm.apmidg_budget_setbudget.argtypes = [c_double]
+        self.apm.apmidg_budget_getstate.argtypes = [c_int, POINTER(apmidg_budget_state_t)]
+        #
+        self.apm.apmidg_region_begin.argtypes = [c_char_p]
+        self.apm.apmidg_region_end.argtypes = [c_char_p]
+        self.func_region_getstats = self.apm.apmidg_region_getstats
+        self.func_region_getstats.argtypes = [c_char_p, POINTER(c_ulonglong), POINTER(c_double), POINTER(c_double), POINTER(c_double)]
+        #
 
     def __del__(self):
         self.apm.apmidg_finish()
@@ -111,6 +364,13 @@ class clr_apmidg:
     def getndevs(self):
         return self.apm.apmidg_getndevs()
 
+    def getphysdevid(self, devid=0):
+        """return (the device index in the driver, subdevice mask)"""
+        mask = c_ulonglong()
+        self.apm.apmidg_getphysdevid.argtypes = [c_int, POINTER(c_ulonglong)]
+        physid = self.apm.apmidg_getphysdevid(devid, byref(mask))
+        return (physid, mask.value)
+
 
     #
     # Power domain
@@ -131,6 +391,8 @@ class clr_apmidg:
         return rtype_getpwrprops(onsubdev, subdevid, canctrl, deflim_mw, minlim_mw, maxlim_mw)
 
     def getpwrlim(self, devid=0, pwrid=0):
+        if self.native:
+            return self.native.getpwrlim(devid, pwrid)
         lim_mw = c_int()
         self.func_getpwrlim(devid, pwrid, byref(lim_mw))
         return lim_mw.value
@@ -139,6 +401,8 @@ class clr_apmidg:
         self.apm.apmidg_setpwrlim(devid, pwrid, lim_mw)
 
     def readenergy(self, devid=0, pwrid=0):
+        if self.native:
+            return rtype_readenergy(*self.native.readenergy(devid, pwrid))
         energy_uj = c_ulonglong()
         ts_usec = c_ulonglong()
         self.func_readenergy(devid, pwrid, byref(energy_uj), byref(ts_usec))
@@ -148,10 +412,27 @@ class clr_apmidg:
         return (cur_energy.energy_uj - prev_energy.energy_uj)/(cur_energy.ts_usec - prev_energy.ts_usec)
 
     def readpoweravg(self, devid=0, pwrid=0):
-        cur_e = self.readenergy(devid, pwrid)
-        p = self.diffenergy(self.prev_e[devid][pwrid], cur_e)
-        self.prev_e[devid][pwrid] = cur_e
-        return p
+        if self.native:
+            return self.native.readpoweravg(devid, pwrid)
+        return self.func_readpoweravg(devid, pwrid)
+
+    def readenergy_acc(self, devid=0, pwrid=0):
+        """Return the wrap-corrected energy accumulated since init or
+        the last energy_acc_reset() as rtype_readenergy, or None"""
+        acc_uj = c_ulonglong()
+        ts_usec = c_ulonglong()
+        if self.func_readenergy_acc(devid, pwrid, byref(acc_uj), byref(ts_usec)) != 0:
+            return None
+        return rtype_readenergy(acc_uj, ts_usec)
+
+    def energy_acc_start(self, devid=-1, pwrid=-1):
+        self.apm.apmidg_energy_acc_start(devid, pwrid)
+
+    def energy_acc_stop(self, devid=-1, pwrid=-1):
+        self.apm.apmidg_energy_acc_stop(devid, pwrid)
+
+    def energy_acc_reset(self, devid=-1, pwrid=-1):
+        self.apm.apmidg_energy_acc_reset(devid, pwrid)
 
     #
     # Frequency domain
@@ -171,6 +452,8 @@ class clr_apmidg:
         return rtype_getfreqprops(onsubdev, subdevid, canctrl,min_MHz, max_MHz)
 
     def getfreqlims(self, devid=0, freqid=0):
+        if self.native:
+            return rtype_getfreqlims(*self.native.getfreqlims(devid, freqid))
         min_MHz = c_double()
         max_MHz = c_double()
 
@@ -180,7 +463,63 @@ class clr_apmidg:
     def setfreqlims(self, devid, freqid, min_MHz, max_MHz):
         self.func_setfreqlims(devid, freqid, min_MHz, max_MHz)
 
+    def setlimcachettl(self, ttl_ms):
+        """How long getpwrlim()/getfreqlims() are served from memory.
+        0 disables the cache, a negative value never revalidates"""
+        self.apm.apmidg_setlimcachettl(ttl_ms)
+
+    def invalidatelims(self, devid=-1):
+        """Drop the cached limits, e.g., another process changed them"""
+        self.apm.apmidg_invalidatelims(devid)
+
+    def setpwrlim_async(self, devid, pwrid, lim_mw):
+        """Queue a power limit change. Return the request id for
+        set_status()/set_wait(), or 0. Only the latest request of a
+        domain is written"""
+        return self.apm.apmidg_setpwrlim_async(devid, pwrid, lim_mw, None, None)
+
+    def setfreqlims_async(self, devid, freqid, min_MHz, max_MHz):
+        return self.apm.apmidg_setfreqlims_async(devid, freqid, min_MHz, max_MHz, None, None)
+
+    def set_status(self, reqid):
+        """Return SET_QUEUED, _DONE, _SKIPPED, _SUPERSEDED, _FAILED or _UNKNOWN"""
+        return self.apm.apmidg_set_status(reqid)
+
+    def set_wait(self, reqid, timeout_ms=-1):
+        return self.apm.apmidg_set_wait(reqid, timeout_ms)
+
+    def set_flush(self):
+        self.apm.apmidg_set_flush()
+
+    def config_capture(self):
+        """Return the power limits and frequency ranges of all devices
+        as bytes for config_restore(), or None"""
+        n = self.apm.apmidg_config_capture(None, 0)
+        if n < 0:
+            return None
+        buf = create_string_buffer(n)
+        n = self.apm.apmidg_config_capture(buf, n)
+        return buf.raw[:n] if n >= 0 else None
+
+    def config_restore(self, blob, flags=0):
+        """Write only the limits that differ from blob, rolling back on
+        a failure. Return (True if the node matches blob, the report)"""
+        rep = apmidg_config_report_t()
+        rc = self.apm.apmidg_config_restore(blob, len(blob), flags, byref(rep))
+        return (rc == 0, rep)
+
+    def config_save(self, path):
+        return self.apm.apmidg_config_save(path.encode()) == 0
+
+    def config_apply(self, path, flags=0):
+        """config_restore() from a file of config_save()"""
+        rep = apmidg_config_report_t()
+        rc = self.apm.apmidg_config_apply(path.encode(), flags, byref(rep))
+        return (rc == 0, rep)
+
     def readfreq(self, devid=0, freqid=0):
+        if self.native:
+            return self.native.readfreq(devid, freqid)
         actual_MHz = c_double()
         self.func_readfreq(devid, freqid, byref(actual_MHz))
         return actual_MHz.value
@@ -209,10 +548,303 @@ class clr_apmidg:
         return rtype_gettempprops(onsubdev, subdevid, sensortype)
 
     def readtemp(self, devid=0, tempid=0):
+        if self.native:
+            return self.native.readtemp(devid, tempid)
         temp_C = c_double()
         self.func_readtemp(devid, tempid, byref(temp_C))
         return temp_C.value
 
+    def refreshprops(self, devid=-1):
+        """Re-read the cached domain properties (all devices if devid < 0)"""
+        return self.apm.apmidg_refreshprops(devid)
+
+    #
+    # Whole-node snapshot
+    #
+
+    def snapshot(self):
+        """Read all power, frequency and temperature domains of all
+        devices with one library call. The buffers are allocated on
+        the first call and reused afterwards."""
+        if self.snapbuf is None:
+            npwr = c_int()
+            nfreq = c_int()
+            ntemp = c_int()
+            self.func_getsnapshotsize(byref(npwr), byref(nfreq), byref(ntemp))
+            s = apmidg_snapshot_t()
+            np, nf, nt = max(npwr.value, 1), max(nfreq.value, 1), max(ntemp.value, 1)
+            # keep the arrays referenced; the struct only holds pointers
+            self.snaparrays = [(c_int*np)(), (c_int*np)(), (c_ulonglong*np)(), (c_ulonglong*np)(), (c_double*np)(),
+                               (c_int*nf)(), (c_int*nf)(), (c_double*nf)(), (c_double*nf)(), (c_double*nf)(),
+                               (c_int*nt)(), (c_int*nt)(), (c_double*nt)()]
+            a = self.snaparrays
+            s.pwr_devid, s.pwr_id, s.energy_uj, s.ts_us, s.power_W = a[0], a[1], a[2], a[3], a[4]
+            s.freq_devid, s.freq_id, s.freq_actual_MHz, s.freq_min_MHz, s.freq_max_MHz = a[5], a[6], a[7], a[8], a[9]
+            s.temp_devid, s.temp_id, s.temp_C = a[10], a[11], a[12]
+            self.snapbuf = s
+            self.snapcap = (np, nf, nt)
+
+        s = self.snapbuf
+        s.npwr, s.nfreq, s.ntemp = self.snapcap
+        if self.func_snapshot(byref(s)) != 0:
+            return None
+        return rtype_snapshot(s)
+
+    #
+    # Bulk reads into numpy arrays. all domains of all devices in one
+    # library call, ordered as in snapshot()
+    #
+
+    def snapshot_arrays(self):
+        """snapshot() as a dict of numpy arrays keyed by the
+        apmidg_snapshot_t field names (e.g., 'power_W', 'temp_C')"""
+        if self.native:
+            return self.native.snapshot()
+        s = self.snapshot()
+        if s is None:
+            return None
+        return {k: numpy.array(v) for k, v in vars(s).items()}
+
+    def readpoweravg_all(self):
+        """the average power of every power domain"""
+        if self.native:
+            return self.native.readpoweravg_all()
+        return self.snapshot_arrays()['power_W']
+
+    def readfreq_all(self):
+        """the actual frequency of every frequency domain"""
+        if self.native:
+            return self.native.readfreq_all()
+        return self.snapshot_arrays()['freq_actual_MHz']
+
+    def readtemp_all(self):
+        """the temperature of every sensor"""
+        if self.native:
+            return self.native.readtemp_all()
+        return self.snapshot_arrays()['temp_C']
+
+    #
+    # Background sampler
+    #
+
+    def sampler_start(self, rate_hz=1000.0, capacity=0):
+        """Start the library's sampler thread. readpoweravg() is then
+        served from the sampler without calling sysman."""
+        return self.func_sampler_start(rate_hz, capacity)
+
+    def sampler_stop(self):
+        self.apm.apmidg_sampler_stop()
+
+    def sampler_latest(self, devid=0, kind=SAMPLE_POWER, id=0):
+        """Return the latest apmidg_sample_t of the domain or None"""
+        s = apmidg_sample_t()
+        if self.func_sampler_latest(devid, kind, id, byref(s)) != 0:
+            return None
+        return s
+
+    #
+    # Windowed statistics
+    #
+
+    def wstats_start(self, windows_s=None):
+        """Keep per-domain statistics of the sampler's values over
+        sliding windows in seconds (0 for the lifetime). None selects
+        [1, 10, 60, 0]. The sampler must run to feed them"""
+        if windows_s is None:
+            return self.apm.apmidg_wstats_start(None, 0)
+        w = (c_double * len(windows_s))(*windows_s)
+        return self.apm.apmidg_wstats_start(w, len(windows_s))
+
+    def wstats_stop(self):
+        self.apm.apmidg_wstats_stop()
+
+    def wstats_get(self, devid=0, kind=SAMPLE_POWER, id=0, window=0):
+        """Return apmidg_wstats_t of the domain over the window (an
+        index into windows_s) or None"""
+        st = apmidg_wstats_t()
+        self.apm.apmidg_wstats_get.argtypes = [c_int, c_int, c_int, c_int, POINTER(apmidg_wstats_t)]
+        if self.apm.apmidg_wstats_get(devid, kind, id, window, byref(st)) != 0:
+            return None
+        return st
+
+    #
+    # Telemetry history
+    #
+
+    def history_start(self, raw_s=None, raw_hz=None, n1s=None, n1m=None, n1h=None):
+        """Keep the raw samples and the 1 sec, 1 min and 1 hour
+        rollups of every domain. None keeps the default of a field"""
+        cfg = apmidg_history_config_t()
+        self.apm.apmidg_history_defaults(byref(cfg))
+        for k, v in (('raw_s', raw_s), ('raw_hz', raw_hz), ('n1s', n1s), ('n1m', n1m), ('n1h', n1h)):
+            if v is not None:
+                setattr(cfg, k, v)
+        return self.apm.apmidg_history_start(byref(cfg))
+
+    def history_stop(self):
+        self.apm.apmidg_history_stop()
+
+    def history_query(self, devid=0, kind=SAMPLE_POWER, id=0, tier=HISTORY_AUTO,
+                      from_us=0, to_us=(1 << 64) - 1, n=4096):
+        """Return the list of apmidg_history_t of the domain's tier in
+        [from_us, to_us) (CLOCK_MONOTONIC), oldest first, or None"""
+        buf = (apmidg_history_t * n)()
+        n = self.apm.apmidg_history_query(devid, kind, id, tier, from_us, to_us, buf, n)
+        if n < 0:
+            return None
+        return buf[:n]
+
+    #
+    # Threshold watches
+    #
+
+    def watch(self, devid, kind, id, threshold, hysteresis, callback, debounce_ms=0.0):
+        """Call callback(ev) with apmidg_watch_event_t when the domain
+        reaches threshold or falls to threshold - hysteresis. It runs
+        on a thread of the library. Return the watch id or -1"""
+        cb = apmidg_watch_cb_t(lambda ev, arg: callback(ev.contents))
+        wid = self.apm.apmidg_watch(devid, kind, id, threshold, hysteresis, debounce_ms, cb, None)
+        if wid >= 0:
+            self.watch_cbs[wid] = cb
+        return wid
+
+    def unwatch(self, wid):
+        ret = self.apm.apmidg_unwatch(wid)
+        self.watch_cbs.pop(wid, None)
+        return ret
+
+    def watch_ishw(self, wid):
+        return self.apm.apmidg_watch_ishw(wid)
+
+    #
+    # CPU RAPL
+    #
+
+    def rapl_getnzones(self):
+        """Return the number of CPU RAPL zones found at init"""
+        return self.apm.apmidg_rapl_getnzones()
+
+    def rapl_getzonename(self, zoneid=0):
+        """Return the zone name, e.g., 'package-0' or 'package-0/dram'"""
+        n = self.apm.apmidg_rapl_getzonename(zoneid)
+        return n.decode() if n else None
+
+    def rapl_readenergy(self, zoneid=0):
+        """Return the wrap-corrected energy counter of the zone as
+        rtype_readenergy, or None"""
+        energy_uj = c_ulonglong()
+        ts_usec = c_ulonglong()
+        if self.func_rapl_readenergy(zoneid, byref(energy_uj), byref(ts_usec)) != 0:
+            return None
+        return rtype_readenergy(energy_uj, ts_usec)
+
+    def rapl_readpoweravg(self, zoneid=0):
+        return self.func_rapl_readpoweravg(zoneid)
+
+    def rapl_readpower_total(self):
+        """Return the sum of the average power of the packages, i.e.,
+        clr_rapl.rapl_reader().sample()['power']['total']"""
+        total = 0.0
+        for zoneid in range(0, self.rapl_getnzones()):
+            name = self.rapl_getzonename(zoneid)
+            if name.startswith('package-') and '/' not in name:
+                total += self.rapl_readpoweravg(zoneid)
+        return total
+
+    #
+    # Controller
+    #
+
+    def ctrl_defaults(self, mode=CTRL_DEV_POWER, actuator=CTRL_ACT_PWRLIM):
+        """Return apmidg_ctrl_config_t filled with the defaults. Set target."""
+        cfg = apmidg_ctrl_config_t()
+        self.apm.apmidg_ctrl_defaults(mode, actuator, byref(cfg))
+        return cfg
+
+    def ctrl_start(self, cfg):
+        return self.apm.apmidg_ctrl_start(byref(cfg))
+
+    def ctrl_stop(self, restore=True):
+        self.apm.apmidg_ctrl_stop(1 if restore else 0)
+
+    def ctrl_settarget(self, target, devid=-1):
+        return self.apm.apmidg_ctrl_settarget(devid, target)
+
+    def ctrl_getstate(self, devid=-1):
+        """Return apmidg_ctrl_state_t of the loop or None"""
+        st = apmidg_ctrl_state_t()
+        if self.apm.apmidg_ctrl_getstate(devid, byref(st)) != 0:
+            return None
+        return st
+
+    #
+    # Node power budget
+    #
+
+    def budget_start(self, budget_W, period_ms=None):
+        """Keep the sum of the power limits at budget_W and move watts
+        to the devices pinned at their limit"""
+        cfg = apmidg_budget_config_t()
+        self.apm.apmidg_budget_defaults(byref(cfg))
+        cfg.budget_W = budget_W
+        if period_ms:
+            cfg.period_ms = period_ms
+        return self.apm.apmidg_budget_start(byref(cfg))
+
+    def budget_stop(self, restore=True):
+        self.apm.apmidg_budget_stop(1 if restore else 0)
+
+    def budget_set(self, budget_W):
+        return self.apm.apmidg_budget_setbudget(budget_W)
+
+    def budget_getstate(self, devid=-1):
+        """Return apmidg_budget_state_t or None"""
+        st = apmidg_budget_state_t()
+        if self.apm.apmidg_budget_getstate(devid, byref(st)) != 0:
+            return None
+        return st
+
+    #
+    # Regions
+    #
+
+    def region_begin(self, name):
+        return self.apm.apmidg_region_begin(name.encode())
+
+    def region_end(self, name):
+        return self.apm.apmidg_region_end(name.encode())
+
+    def region_getstats(self, name):
+        """Return (calls, time_s, energy_J, freq_MHz) of the region or None"""
+        calls = c_ulonglong()
+        time_s = c_double()
+        energy_J = c_double()
+        freq_MHz = c_double()
+        if self.func_region_getstats(name.encode(), byref(calls), byref(time_s), byref(energy_J), byref(freq_MHz)) != 0:
+            return None
+        return (calls.value, time_s.value, energy_J.value, freq_MHz.value)
+
+    def region_summary(self):
+        self.apm.apmidg_region_summary()
+
+    #
+    # Call statistics
+    #
+
+    def stats_get(self):
+        """Return the call statistics as a list of apmidg_stats_t"""
+        self.apm.apmidg_stats_get.argtypes = [POINTER(apmidg_stats_t), c_int]
+        n = self.apm.apmidg_stats_get(None, 0)
+        st = (apmidg_stats_t * n)()
+        n = min(n, self.apm.apmidg_stats_get(st, n))
+        return st[:n]
+
+    def stats_dump(self):
+        self.apm.apmidg_stats_dump()
+
+    def stats_reset(self):
+        self.apm.apmidg_stats_reset()
+
     #
     # reset2default
     #
@@ -235,6 +867,61 @@ class clr_apmidg:
                     curpwrlim_mw = self.getpwrlim(devid, pwrid)
                     # print("devid%d/pwrdid%d: deflim_mw=%d curpwrlim_mw=%d" % (devid, pwrid, pwrprops.deflim_mw, curpwrlim_mw))
 
+
+class clr_apmidg_shm:
+    """Reads the telemetry published by apmidgd through shared
+    memory. Unlike clr_apmidg, this does not initialize Level Zero, so
+    it is cheap to create in every process. It only loads
+    libapmidg_shm, which does not link Level Zero."""
+
+    def __init__(self, name=None):
+        self.apm = CDLL("libapmidg_shm.so")
+        self.apm.apmidg_shm_attach.argtypes = [c_char_p]
+        self.apm.apmidg_shm_attach.restype = c_void_p
+        self.apm.apmidg_shm_detach.argtypes = [c_void_p]
+        self.apm.apmidg_shm_getndevs.argtypes = [c_void_p]
+        self.apm.apmidg_shm_getsnapshotsize.argtypes = [c_void_p, POINTER(c_int), POINTER(c_int), POINTER(c_int)]
+        self.apm.apmidg_shm_read.argtypes = [c_void_p, POINTER(apmidg_snapshot_t), POINTER(c_ulonglong)]
+
+        self.shm = self.apm.apmidg_shm_attach(name.encode() if name else None)
+        if not self.shm:
+            raise RuntimeError("no apmidg shared memory segment found. is apmidgd running?")
+
+        npwr = c_int()
+        nfreq = c_int()
+        ntemp = c_int()
+        self.apm.apmidg_shm_getsnapshotsize(self.shm, byref(npwr), byref(nfreq), byref(ntemp))
+        self.cap = (npwr.value, nfreq.value, ntemp.value)
+        np, nf, nt = [max(v, 1) for v in self.cap]
+        self.arrays = [(c_int*np)(), (c_int*np)(), (c_ulonglong*np)(), (c_ulonglong*np)(), (c_double*np)(),
+                       (c_int*nf)(), (c_int*nf)(), (c_double*nf)(), (c_double*nf)(), (c_double*nf)(),
+                       (c_int*nt)(), (c_int*nt)(), (c_double*nt)()]
+        a = self.arrays
+        s = apmidg_snapshot_t()
+        s.pwr_devid, s.pwr_id, s.energy_uj, s.ts_us, s.power_W = a[0], a[1], a[2], a[3], a[4]
+        s.freq_devid, s.freq_id, s.freq_actual_MHz, s.freq_min_MHz, s.freq_max_MHz = a[5], a[6], a[7], a[8], a[9]
+        s.temp_devid, s.temp_id, s.temp_C = a[10], a[11], a[12]
+        self.snapbuf = s
+
+    def __del__(self):
+        if getattr(self, 'shm', None):
+            self.apm.apmidg_shm_detach(self.shm)
+
+    def getndevs(self):
+        return self.apm.apmidg_shm_getndevs(self.shm)
+
+    def snapshot(self):
+        """Return the latest published snapshot (see
+        clr_apmidg.snapshot()) with update_ts_us, or None"""
+        s = self.snapbuf
+        s.npwr, s.nfreq, s.ntemp = self.cap
+        ts = c_ulonglong()
+        if self.apm.apmidg_shm_read(self.shm, byref(s), byref(ts)) != 0:
+            return None
+        r = rtype_snapshot(s)
+        r.update_ts_us = ts.value
+        return r
+
                 
 def basictest(pm, ndevs):
     print("Basic tests")
@@ -0,0 +1,72 @@
+/*
+  A fake sysfs tree for the tests of the sysfs readers (hwmon, RAPL),
+  built under a temporary directory that APMIDG_SYSFS_ROOT points to.
+ */
+#ifndef __APMIDG_FAKESYS_H_DEFINED__
+#define __APMIDG_FAKESYS_H_DEFINED__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// create a temporary root into root (at least 64 bytes) and set
+// APMIDG_SYSFS_ROOT to it. return 0 if successful
+static inline int fakesys_init(char *root)
+{
+    strcpy(root, "/tmp/apmidg_fakesys_XXXXXX");
+    if (!mkdtemp(root)) return -1;
+    return setenv("APMIDG_SYSFS_ROOT", root, 1);
+}
+
+// write root/path, creating its directories. return 0 if successful
+static inline int fakesys_write(const char *root, const char *path, const char *content)
+{
+    char fn[1024];
+    snprintf(fn, sizeof(fn), "%s/%s", root, path);
+    for (char *p = fn + strlen(root) + 1; (p = strchr(p, '/')) != NULL; p++) {
+	*p = 0;
+	mkdir(fn, 0755);
+	*p = '/';
+    }
+    FILE *fp = fopen(fn, "w");
+    if (!fp) return -1;
+    fputs(content, fp);
+    return fclose(fp);
+}
+
+// read root/path into buf. return 0 if successful
+static inline int fakesys_read(const char *root, const char *path, char *buf, int len)
+{
+    char fn[1024];
+    snprintf(fn, sizeof(fn), "%s/%s", root, path);
+    FILE *fp = fopen(fn, "r");
+    if (!fp) return -1;
+    int n = fread(buf, 1, len - 1, fp);
+    buf[n] = 0;
+    fclose(fp);
+    return 0;
+}
+
+// remove dir and everything under it
+static inline void fakesys_remove(const char *dir)
+{
+    DIR *dp = opendir(dir);
+    if (dp) {
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+	    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+	    char fn[1024];
+	    struct stat st;
+	    snprintf(fn, sizeof(fn), "%s/%s", dir, de->d_name);
+	    if (lstat(fn, &st) == 0 && S_ISDIR(st.st_mode)) fakesys_remove(fn);
+	    else unlink(fn);
+	}
+	closedir(dp);
+    }
+    rmdir(dir);
+}
+
+#endif
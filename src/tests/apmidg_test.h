@@ -0,0 +1,33 @@
+/*
+  A minimal check helper for the tests. Each test is a program that
+  returns 0 if every CHECK() held. The tests run on the simulated
+  backend, so they need no GPU.
+ */
+#ifndef __APMIDG_TEST_H_DEFINED__
+#define __APMIDG_TEST_H_DEFINED__
+
+#include <stdio.h>
+#include <math.h>
+
+static int apmidg_test_nfail = 0;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+	    printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);	\
+	    apmidg_test_nfail++;					\
+	}								\
+    } while (0)
+
+// |a - b| <= tol
+#define CHECK_NEAR(a, b, tol) do {					\
+	double _a = (a), _b = (b);					\
+	if (!(fabs(_a - _b) <= (tol))) {				\
+	    printf("FAIL %s:%d: %s = %g, expected %g +- %g\n",		\
+		   __FILE__, __LINE__, #a, _a, _b, (double)(tol));	\
+	    apmidg_test_nfail++;					\
+	}								\
+    } while (0)
+
+#define TEST_RESULT() (apmidg_test_nfail > 0 ? 1 : 0)
+
+#endif
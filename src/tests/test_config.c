@@ -0,0 +1,114 @@
+/*
+  The control state snapshots: the diff, the restore of the domains
+  that differ, the rollback when a device refuses its limit (the
+  simulator's limfail), a blob with a device that is not found, and
+  the whole power limit descriptor set of a hwmon domain over a fake
+  sysfs.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include "apmidg_fakesys.h"
+
+#define SPEC "sim:ndevs=2,nsubdevs=0"
+
+#define DEV0 "bus/pci/devices/0000:01:00.0/hwmon/hwmon0/"
+
+static int getlim(int devid)
+{
+    int lim_mw;
+    apmidg_invalidatelims(devid);
+    apmidg_getpwrlim(devid, 0, &lim_mw);
+    return lim_mw;
+}
+
+int main()
+{
+    char root[64], fn[128], buf[64];
+    unsigned char blob[4096];
+    apmidg_config_report_t rep;
+    int n;
+
+    if (fakesys_init(root) != 0) {
+	printf("Failed to create a fake sysfs\n");
+	return 1;
+    }
+    snprintf(fn, sizeof(fn), "%s/node.cfg", root);
+
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	fakesys_remove(root);
+	return 1;
+    }
+    apmidg_setpwrlim(0, 0, 300000);
+    apmidg_setpwrlim(1, 0, 350000);
+    CHECK(apmidg_config_save(fn) == 0);
+    n = apmidg_config_capture(blob, sizeof(blob));
+    CHECK(n > 0 && n <= (int)sizeof(blob));
+
+    CHECK(apmidg_config_restore(blob, n, APMIDG_CONFIG_DRYRUN, &rep) == 0);
+    CHECK(rep.nents == 4); // the power and the frequency domain of each device
+    CHECK(rep.ndiffs == 0);
+
+    // a diff writes nothing
+    apmidg_setpwrlim(0, 0, 400000);
+    CHECK(apmidg_config_restore(blob, n, APMIDG_CONFIG_DRYRUN, &rep) == -1);
+    CHECK(rep.ndiffs == 1 && rep.nwritten == 0);
+    CHECK(getlim(0) == 400000);
+
+    CHECK(apmidg_config_restore(blob, n, 0, &rep) == 0);
+    CHECK(rep.ndiffs == 1 && rep.nwritten == 1 && rep.nfailed == 0);
+    CHECK(getlim(0) == 300000);
+
+    // a corrupt blob is refused before the compare
+    blob[n - 1] ^= 0xff;
+    CHECK(apmidg_config_restore(blob, n, APMIDG_CONFIG_DRYRUN, &rep) == -1);
+    CHECK(rep.ndiffs == 0 && rep.nmissing == 0);
+    apmidg_finish();
+
+    // device 1 refuses its limit, so device 0 goes back
+    CHECK(apmidg_init_backend(0, SPEC ",limfail=1") == 0);
+    CHECK(apmidg_config_apply(fn, 0, &rep) == -1);
+    CHECK(rep.ndiffs == 2 && rep.nwritten == 1 && rep.nfailed == 1);
+    CHECK(rep.rolledback == 1);
+    CHECK(getlim(0) == 600000);
+
+    CHECK(apmidg_config_apply(fn, APMIDG_CONFIG_NOROLLBACK, &rep) == -1);
+    CHECK(rep.nfailed == 1 && rep.rolledback == 0);
+    CHECK(getlim(0) == 300000);
+    apmidg_finish();
+
+    // the device that is found is restored, the other reported
+    CHECK(apmidg_init_backend(0, "sim:ndevs=1,nsubdevs=0") == 0);
+    CHECK(apmidg_config_apply(fn, 0, &rep) == -1);
+    CHECK(rep.nmissing == 1 && rep.nwritten == 1 && rep.nfailed == 0);
+    CHECK(getlim(0) == 300000);
+    CHECK(apmidg_config_apply(fn, APMIDG_CONFIG_DRYRUN, &rep) == -1);
+    CHECK(rep.nmissing == 1 && rep.ndiffs == 0);
+    apmidg_finish();
+
+    // every level and the interval of a hwmon domain come back at once
+    fakesys_write(root, DEV0 "name", "xe\n");
+    fakesys_write(root, DEV0 "power1_max", "250000000\n");
+    fakesys_write(root, DEV0 "power1_max_interval", "1000\n");
+    fakesys_write(root, DEV0 "power1_crit", "400000000\n");
+    CHECK(apmidg_init_backend(0, "hwmon:sim:ndevs=1,nsubdevs=0") == 0);
+    n = apmidg_config_capture(blob, sizeof(blob));
+    CHECK(n > 0 && n <= (int)sizeof(blob));
+    fakesys_write(root, DEV0 "power1_max", "200000000\n");
+    fakesys_write(root, DEV0 "power1_max_interval", "500\n");
+    fakesys_write(root, DEV0 "power1_crit", "300000000\n");
+    CHECK(apmidg_config_restore(blob, n, APMIDG_CONFIG_DRYRUN, &rep) == -1);
+    CHECK(rep.ndiffs == 1);
+    CHECK(apmidg_config_restore(blob, n, 0, &rep) == 0);
+    CHECK(rep.nwritten == 1);
+    CHECK(fakesys_read(root, DEV0 "power1_max", buf, sizeof(buf)) == 0);
+    CHECK(strcmp(buf, "250000000\n") == 0);
+    CHECK(fakesys_read(root, DEV0 "power1_max_interval", buf, sizeof(buf)) == 0);
+    CHECK(strcmp(buf, "1000\n") == 0);
+    CHECK(fakesys_read(root, DEV0 "power1_crit", buf, sizeof(buf)) == 0);
+    CHECK(strcmp(buf, "400000000\n") == 0);
+    apmidg_finish();
+
+    fakesys_remove(root);
+    return TEST_RESULT();
+}
@@ -0,0 +1,105 @@
+/*
+  The controller at its bounds. A loop whose target is out of reach
+  saturates at the bound without winding up its integral, so it leaves
+  the bound as soon as the target is reachable again. A device whose
+  measurement fails holds its output instead of being driven to a
+  bound, and one whose limit writes fail reports the limit it has.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+// a device draws 600 W at fmax, which is also the default limit
+#define SPEC_POWER "sim:ndevs=2,nsubdevs=0"
+// the temperature reads of device 0 fail. device 1 runs at
+// 30 + 0.15 * 600 = 120 C at the default limit
+#define SPEC_TEMP  "sim:ndevs=2,nsubdevs=0,tempfail=0"
+// the power limit writes of device 0 fail
+#define SPEC_LIMFAIL SPEC_POWER ",limfail=0"
+
+int main()
+{
+    apmidg_ctrl_config_t cfg;
+    apmidg_ctrl_state_t st;
+    int lim_mw;
+
+    if (apmidg_init_backend(0, SPEC_POWER) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    apmidg_ctrl_defaults(APMIDG_CTRL_DEV_POWER, APMIDG_CTRL_ACT_PWRLIM, &cfg);
+    cfg.period_ms = 10.0;
+    cfg.ki = 10.0; // settles within the test
+    cfg.target = 300.0;
+    CHECK(apmidg_ctrl_start(&cfg) == 0);
+    usleep(1000000);
+    CHECK(apmidg_ctrl_getstate(0, &st) == 0);
+    CHECK_NEAR(st.measured, 300.0, 15.0);
+    CHECK(st.nheld == 0);
+
+    // out of reach: pinned at the default limit for a while
+    apmidg_ctrl_settarget(-1, 10000.0);
+    usleep(1000000);
+    CHECK(apmidg_ctrl_getstate(0, &st) == 0);
+    CHECK_NEAR(st.output, 600.0, 1e-6);
+    CHECK(st.saturated == 1);
+    CHECK(st.integral <= 600.0);
+
+    // reachable again. the integral did not wind up, so the output
+    // leaves the bound at the max_step rate (25 W per period)
+    apmidg_ctrl_settarget(-1, 300.0);
+    usleep(100000);
+    CHECK(apmidg_ctrl_getstate(0, &st) == 0);
+    CHECK(st.output < 500.0);
+    usleep(900000);
+    CHECK(apmidg_ctrl_getstate(0, &st) == 0);
+    CHECK_NEAR(st.measured, 300.0, 15.0);
+    apmidg_ctrl_stop(1);
+    apmidg_finish();
+
+    if (apmidg_init_backend(0, SPEC_TEMP) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    apmidg_ctrl_defaults(APMIDG_CTRL_DEV_TEMP, APMIDG_CTRL_ACT_PWRLIM, &cfg);
+    cfg.period_ms = 10.0;
+    cfg.ki = 60.0;
+    cfg.target = 75.0;
+    CHECK(apmidg_ctrl_start(&cfg) == 0);
+    usleep(1000000);
+    // device 0 is held at its limit
+    CHECK(apmidg_ctrl_getstate(0, &st) == 0);
+    CHECK(st.nsteps == 0);
+    CHECK(st.nheld > 0);
+    CHECK_NEAR(st.output, 600.0, 1e-6);
+    apmidg_getpwrlim(0, 0, &lim_mw);
+    CHECK(lim_mw == 600000);
+    // device 1 is controlled to 75 C, or 300 W
+    CHECK(apmidg_ctrl_getstate(1, &st) == 0);
+    CHECK(st.nsteps > 0);
+    CHECK(st.nheld == 0);
+    CHECK_NEAR(st.measured, 75.0, 3.0);
+    apmidg_ctrl_stop(1);
+    apmidg_finish();
+
+    if (apmidg_init_backend(0, SPEC_LIMFAIL) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    apmidg_ctrl_defaults(APMIDG_CTRL_DEV_POWER, APMIDG_CTRL_ACT_PWRLIM, &cfg);
+    cfg.period_ms = 10.0;
+    cfg.target = 300.0;
+    CHECK(apmidg_ctrl_start(&cfg) == 0);
+    usleep(300000);
+    // device 0 still has the default limit, and the loop keeps trying
+    CHECK(apmidg_ctrl_getstate(0, &st) == 0);
+    CHECK(st.nsteps > 0);
+    CHECK_NEAR(st.output, 600.0, 1e-6);
+    CHECK(apmidg_ctrl_getstate(1, &st) == 0);
+    CHECK(st.output < 600.0);
+    apmidg_ctrl_stop(1);
+    apmidg_finish();
+
+    return TEST_RESULT();
+}
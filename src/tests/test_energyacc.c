@@ -0,0 +1,88 @@
+/*
+  The accumulated energy across 32-bit counter wraps. The simulated
+  counters are narrowed to 32 bits (ebits=32) and start near the wrap
+  (e0), so they wrap within the test.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include <stdlib.h>
+#include <time.h>
+
+// every read advances the clock by 1 sec, so 600 J per read
+#define SPEC_VIRTUAL "sim:ndevs=1,nsubdevs=0,clock=virtual,step_us=1000000,ebits=32,e0=3000"
+// 8 kW wraps every 0.54 sec
+#define SPEC_REAL    "sim:ndevs=1,nsubdevs=0,tdp=8000,idle=100,ebits=32,e0=4290"
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the power over sec without reading the counters in between
+static double idlepower(double sec)
+{
+    uint64_t acc0, acc1, ts;
+
+    apmidg_readenergy_acc(0, 0, &acc0, &ts);
+    double t0 = now_s();
+    struct timespec d = {(time_t)sec, (long)((sec - (time_t)sec) * 1e9)};
+    nanosleep(&d, NULL);
+    apmidg_readenergy_acc(0, 0, &acc1, &ts);
+    return (acc1 - acc0) / 1e6 / (now_s() - t0);
+}
+
+int main()
+{
+    uint64_t acc, prev_acc, e, prev_e, ts;
+    int nwraps = 0;
+
+    // every read is taken by the test. no poll, so the clock only
+    // moves with the test's reads
+    setenv("APMIDG_ACC_POLL_MS", "0", 1);
+    if (apmidg_init_backend(0, SPEC_VIRTUAL) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    apmidg_readenergy(0, 0, &prev_e, &ts);
+    CHECK(prev_e >= 3000000000ULL); // not wrapped yet
+    apmidg_readenergy_acc(0, 0, &prev_acc, &ts);
+    for (int i = 0; i < 30; i++) {
+	apmidg_readenergy(0, 0, &e, &ts);
+	if (e < prev_e) nwraps++;
+	prev_e = e;
+	CHECK(apmidg_readenergy_acc(0, 0, &acc, &ts) == 0);
+	// the raw read in between is accumulated too
+	CHECK(acc - prev_acc == 1200000000ULL);
+	prev_acc = acc;
+    }
+    CHECK(nwraps >= 8);
+
+    // a reset zeroes the accumulation. the next read adds its interval
+    apmidg_energy_acc_reset(0, 0);
+    apmidg_readenergy_acc(0, 0, &acc, &ts);
+    CHECK(acc == 600000000ULL);
+    apmidg_finish();
+
+    // on the real clock, the poll catches the wraps that happen while
+    // nobody reads the counters
+    setenv("APMIDG_ACC_POLL_MS", "100", 1);
+    if (apmidg_init_backend(0, SPEC_REAL) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    CHECK_NEAR(idlepower(1.5), 8000.0, 200.0);
+    apmidg_finish();
+
+    // and misses them without it (about 3 wraps in 1.5 sec)
+    setenv("APMIDG_ACC_POLL_MS", "0", 1);
+    if (apmidg_init_backend(0, SPEC_REAL) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    CHECK(idlepower(1.5) < 8000.0 * 0.8);
+    apmidg_finish();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,78 @@
+/*
+  The hwmon backend over the simulator and a fake sysfs tree. Device 0
+  has the energy counter and the limits in hwmon, device 1 only the
+  limits, so its counter comes from the simulator.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include "apmidg_fakesys.h"
+
+#define SPEC "hwmon:sim:ndevs=2,nsubdevs=0"
+
+#define DEV0 "bus/pci/devices/0000:01:00.0/hwmon/hwmon3/"
+#define DEV1 "bus/pci/devices/0000:02:00.0/hwmon/hwmon5/"
+
+int main()
+{
+    char root[64], buf[64];
+    uint64_t e, ts;
+    int lim_mw;
+
+    if (fakesys_init(root) != 0) {
+	printf("Failed to create a fake sysfs\n");
+	return 1;
+    }
+    fakesys_write(root, DEV0 "name", "xe\n");
+    fakesys_write(root, DEV0 "energy1_input", "123456789\n");
+    fakesys_write(root, DEV0 "power1_max", "250000000\n");
+    fakesys_write(root, DEV0 "power1_max_interval", "1000\n");
+    fakesys_write(root, DEV0 "power1_crit", "400000000\n");
+    fakesys_write(root, DEV1 "name", "i915\n");
+    fakesys_write(root, DEV1 "power1_max", "200000000\n");
+    // not the driver's hwmon
+    fakesys_write(root, "bus/pci/devices/0000:02:00.0/hwmon/hwmon4/name", "acpitz\n");
+
+    setenv("APMIDG_ACC_POLL_MS", "0", 1);
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	fakesys_remove(root);
+	return 1;
+    }
+    CHECK(strcmp(apmidg_getbackend(), "hwmon") == 0);
+
+    apmidg_readenergy(0, 0, &e, &ts);
+    CHECK(e == 123456789ULL);
+    fakesys_write(root, DEV0 "energy1_input", "123556789\n");
+    apmidg_readenergy(0, 0, &e, &ts);
+    CHECK(e == 123556789ULL);
+    // a failed read is an error, not a read of the simulator
+    fakesys_write(root, DEV0 "energy1_input", "");
+    apmidg_readenergy(0, 0, &e, &ts);
+    CHECK(e == (uint64_t)-1);
+    fakesys_write(root, DEV0 "energy1_input", "123656789\n");
+    apmidg_readenergy(0, 0, &e, &ts);
+    CHECK(e == 123656789ULL);
+
+    // device 1 counts from the simulator
+    apmidg_readenergy(1, 0, &e, &ts);
+    CHECK(e != (uint64_t)-1 && e < 123456789ULL);
+
+    apmidg_getpwrlim(0, 0, &lim_mw);
+    CHECK(lim_mw == 250000);
+    apmidg_getpwrlim(1, 0, &lim_mw);
+    CHECK(lim_mw == 200000);
+    apmidg_setpwrlim(0, 0, 300000);
+    CHECK(fakesys_read(root, DEV0 "power1_max", buf, sizeof(buf)) == 0);
+    CHECK(strcmp(buf, "300000000\n") == 0);
+    apmidg_invalidatelims(-1);
+    apmidg_getpwrlim(0, 0, &lim_mw);
+    CHECK(lim_mw == 300000);
+    apmidg_finish();
+
+    // hwmon over hwmon would call itself
+    CHECK(apmidg_init_backend(0, "hwmon:hwmon") == -1);
+    CHECK(apmidg_init_backend(0, "hwmon:hwmon:sim") == -1);
+
+    fakesys_remove(root);
+    return TEST_RESULT();
+}
@@ -0,0 +1,69 @@
+/*
+  poweravg and limits on the simulator with the virtual clock, so
+  every energy read advances the time by step_us and the expected
+  powers are exact. A device draws
+  idle + (tdp - idle) * (f/fmax)^3, 600 W at fmax by default.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+
+#define SPEC "sim:ndevs=2,nsubdevs=0,clock=virtual"
+
+int main()
+{
+    int lim_mw;
+    double fmin, fmax;
+
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    CHECK(apmidg_getndevs() == 2);
+    CHECK(apmidg_getnpwrdoms(0) == 1);
+
+    // a snapshot without power_W takes no baseline
+    uint64_t energy_uj[2];
+    apmidg_snapshot_t snap = {0};
+    apmidg_getsnapshotsize(&snap.npwr, &snap.nfreq, &snap.ntemp);
+    CHECK(snap.npwr == 2);
+    snap.energy_uj = energy_uj;
+    CHECK(apmidg_snapshot(&snap) == 0);
+    CHECK(energy_uj[0] > 0 && energy_uj[1] > 0);
+
+    // the first call only takes the baseline
+    CHECK(apmidg_readpoweravg(0, 0) == 0.0);
+    CHECK(apmidg_readpoweravg(1, 0) == 0.0);
+    CHECK_NEAR(apmidg_readpoweravg(0, 0), 600.0, 0.5);
+    CHECK_NEAR(apmidg_readpoweravg(1, 0), 600.0, 0.5);
+
+    // back-to-back calls return the power since the previous call,
+    // not the average since init. the clock is shared, so the first
+    // interval after the change also has the reads of device 1 at 600 W
+    apmidg_setpwrlim(0, 0, 300000);
+    CHECK(apmidg_readpoweravg(0, 0) > 300.5);
+    CHECK_NEAR(apmidg_readpoweravg(0, 0), 300.0, 0.5);
+    CHECK_NEAR(apmidg_readpoweravg(0, 0), 300.0, 0.5);
+    CHECK_NEAR(apmidg_readpoweravg(1, 0), 600.0, 0.5);
+
+    apmidg_getpwrlim(0, 0, &lim_mw);
+    CHECK(lim_mw == 300000);
+    apmidg_invalidatelims(0);
+    apmidg_getpwrlim(0, 0, &lim_mw);
+    CHECK(lim_mw == 300000);
+
+    // 100 + 500 * (1000/1600)^3 W
+    apmidg_setfreqlims(1, 0, 500.0, 1000.0);
+    apmidg_getfreqlims(1, 0, &fmin, &fmax);
+    CHECK(fmin == 500.0 && fmax == 1000.0);
+    apmidg_readpoweravg(1, 0); // the cap starts in the middle of this interval
+    CHECK_NEAR(apmidg_readpoweravg(1, 0), 100.0 + 500.0 * pow(1000.0 / 1600.0, 3), 0.5);
+
+    // the range is clamped to the hardware limits
+    apmidg_setfreqlims(1, 0, 1.0, 99999.0);
+    apmidg_invalidatelims(1);
+    apmidg_getfreqlims(1, 0, &fmin, &fmax);
+    CHECK(fmin == 300.0 && fmax == 1600.0);
+
+    apmidg_finish();
+    return TEST_RESULT();
+}
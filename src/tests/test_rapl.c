@@ -0,0 +1,91 @@
+/*
+  The CPU RAPL zones over a fake powercap tree: the discovery order,
+  the subzone names, and the counter extension across wraparounds.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include "apmidg_fakesys.h"
+
+#define SPEC "sim:ndevs=1,nsubdevs=0"
+
+#define RAPL "devices/virtual/powercap/intel-rapl/"
+#define PKG0 RAPL "intel-rapl:0/"
+#define DRAM PKG0 "intel-rapl:0:0/"
+#define PKG1 RAPL "intel-rapl:1/"
+
+int main()
+{
+    char root[64];
+    uint64_t e, prev_e, ts;
+
+    if (fakesys_init(root) != 0) {
+	printf("Failed to create a fake sysfs\n");
+	return 1;
+    }
+    fakesys_write(root, PKG0 "name", "package-0\n");
+    fakesys_write(root, PKG0 "energy_uj", "1000\n");
+    fakesys_write(root, PKG0 "max_energy_range_uj", "262143328850\n");
+    fakesys_write(root, DRAM "name", "dram\n");
+    fakesys_write(root, DRAM "energy_uj", "500\n"); // no max_energy_range_uj
+    fakesys_write(root, PKG1 "name", "package-1\n");
+    fakesys_write(root, PKG1 "energy_uj", "9000\n");
+    fakesys_write(root, PKG1 "max_energy_range_uj", "10000\n");
+    // unreadable zones are skipped
+    fakesys_write(root, RAPL "intel-rapl:2/name", "package-2\n");
+
+    setenv("APMIDG_RAPL", "1", 1);
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	fakesys_remove(root);
+	return 1;
+    }
+    CHECK(apmidg_rapl_getnzones() == 3);
+    CHECK(strcmp(apmidg_rapl_getzonename(0), "package-0") == 0);
+    CHECK(strcmp(apmidg_rapl_getzonename(1), "package-0/dram") == 0);
+    CHECK(strcmp(apmidg_rapl_getzonename(2), "package-1") == 0);
+    CHECK(apmidg_rapl_getzonename(3) == NULL);
+    CHECK(apmidg_rapl_readenergy(3, &e, &ts) == -1);
+
+    CHECK(apmidg_rapl_readenergy(0, &prev_e, &ts) == 0);
+    fakesys_write(root, PKG0 "energy_uj", "5000\n");
+    CHECK(apmidg_rapl_readenergy(0, &e, &ts) == 0);
+    CHECK(e - prev_e == 4000);
+
+    // wraps at max_energy_range_uj
+    CHECK(apmidg_rapl_readenergy(2, &prev_e, &ts) == 0);
+    fakesys_write(root, PKG1 "energy_uj", "1000\n");
+    CHECK(apmidg_rapl_readenergy(2, &e, &ts) == 0);
+    CHECK(e - prev_e == 2000);
+
+    // without the range, a wrap counts from zero
+    CHECK(apmidg_rapl_readenergy(1, &prev_e, &ts) == 0);
+    fakesys_write(root, DRAM "energy_uj", "100\n");
+    CHECK(apmidg_rapl_readenergy(1, &e, &ts) == 0);
+    CHECK(e - prev_e == 100);
+
+    // the average since the previous call. the interval it used lies
+    // between the reads around the two calls, so the power is bounded
+    // whatever the scheduling delays
+    uint64_t tsb, ts0, ts1, ts2;
+    double watt;
+    apmidg_rapl_readenergy(0, &e, &tsb);
+    apmidg_rapl_readpoweravg(0);
+    apmidg_rapl_readenergy(0, &e, &ts0);
+    usleep(100000);
+    fakesys_write(root, PKG0 "energy_uj", "2005000\n");
+    apmidg_rapl_readenergy(0, &e, &ts1);
+    watt = apmidg_rapl_readpoweravg(0);
+    apmidg_rapl_readenergy(0, &e, &ts2);
+    CHECK(watt >= 2000000.0 / (ts2 - tsb) - 1e-9);
+    CHECK(watt <= 2000000.0 / (ts1 - ts0) + 1e-9);
+    apmidg_finish();
+
+    setenv("APMIDG_RAPL", "0", 1);
+    if (apmidg_init_backend(0, SPEC) == 0) {
+	CHECK(apmidg_rapl_getnzones() == 0);
+	apmidg_finish();
+    }
+
+    fakesys_remove(root);
+    return TEST_RESULT();
+}
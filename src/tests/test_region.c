@@ -0,0 +1,92 @@
+/*
+  Region totals of threads that exit. Each thread keeps its own
+  totals, which are folded into a shared total when it exits, so the
+  sums must not lose or double count any call.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+#define SPEC "sim:ndevs=2,nsubdevs=2,clock=virtual"
+
+#define NTHREADS (4)
+#define NWAVES   (50)
+#define NCALLS   (20)
+
+static void *worker(void *arg)
+{
+    for (int i = 0; i < NCALLS; i++) {
+	apmidg_region_begin("outer");
+	apmidg_region_begin("inner");
+	apmidg_region_end("inner");
+	apmidg_region_end("outer");
+    }
+    apmidg_region_end("outer"); // unmatched
+    return NULL;
+}
+
+static pthread_barrier_t barrier;
+
+// uses regions, then exits after the main thread re-initialized
+static void *lingerer(void *arg)
+{
+    apmidg_region_begin("outer");
+    apmidg_region_end("outer");
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    return NULL;
+}
+
+static void runwaves(int nwaves)
+{
+    pthread_t th[NTHREADS];
+
+    for (int w = 0; w < nwaves; w++) {
+	for (int i = 0; i < NTHREADS; i++) pthread_create(&th[i], NULL, worker, NULL);
+	for (int i = 0; i < NTHREADS; i++) pthread_join(th[i], NULL);
+    }
+}
+
+int main()
+{
+    uint64_t calls;
+    double time_s, energy_J, freq_MHz;
+
+    setenv("APMIDG_ACC_POLL_MS", "0", 1); // the reads are the clock
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+
+    worker(NULL); // the main thread stays alive
+    runwaves(NWAVES);
+
+    CHECK(apmidg_region_getstats("outer", &calls, &time_s, &energy_J, &freq_MHz) == 0);
+    CHECK(calls == (uint64_t)(NWAVES * NTHREADS + 1) * NCALLS);
+    CHECK(energy_J > 0.0);
+    CHECK(freq_MHz > 0.0);
+    CHECK(apmidg_region_getstats("inner", &calls, &time_s, &energy_J, &freq_MHz) == 0);
+    CHECK(calls == (uint64_t)(NWAVES * NTHREADS + 1) * NCALLS);
+    CHECK(apmidg_region_getstats("none", &calls, &time_s, &energy_J, &freq_MHz) == -1);
+
+    // a thread of an earlier init exits after the re-init
+    pthread_t th;
+    pthread_barrier_init(&barrier, NULL, 2);
+    pthread_create(&th, NULL, lingerer, NULL);
+    pthread_barrier_wait(&barrier);
+    apmidg_finish();
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    pthread_barrier_wait(&barrier);
+    pthread_join(th, NULL);
+    CHECK(apmidg_region_getstats("outer", &calls, &time_s, &energy_J, &freq_MHz) == -1);
+    runwaves(1);
+    CHECK(apmidg_region_getstats("outer", &calls, &time_s, &energy_J, &freq_MHz) == 0);
+    CHECK(calls == (uint64_t)NTHREADS * NCALLS);
+    apmidg_finish();
+
+    return TEST_RESULT();
+}
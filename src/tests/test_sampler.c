@@ -0,0 +1,46 @@
+/*
+  The background sampler over a device whose temperature reads fail
+  (the simulator's tempfail). A failed read publishes no sample, so
+  the ring carries real values only.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include <unistd.h>
+
+#define SPEC "sim:ndevs=2,nsubdevs=0,tempfail=0"
+
+#define NBUF (4096)
+
+int main()
+{
+    static apmidg_sample_t buf[NBUF];
+    apmidg_sample_t s;
+    uint64_t cursor = 0;
+    int n, ntemp[2] = {0, 0}, nfreq = 0, nbad = 0;
+
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    CHECK(apmidg_sampler_start(100.0, NBUF) == 0);
+    usleep(200000);
+    n = apmidg_sampler_read(&cursor, buf, NBUF);
+    CHECK(n > 0);
+    for (int i = 0; i < n; i++) {
+	if (buf[i].kind == APMIDG_SAMPLE_TEMP) ntemp[buf[i].devid]++;
+	if (buf[i].kind == APMIDG_SAMPLE_FREQ) nfreq++;
+	if (buf[i].kind != APMIDG_SAMPLE_POWER && buf[i].value < 0.0) nbad++;
+    }
+    CHECK(ntemp[0] == 0);
+    CHECK(ntemp[1] > 0);
+    CHECK(nfreq > 0);
+    CHECK(nbad == 0);
+
+    CHECK(apmidg_sampler_latest(0, APMIDG_SAMPLE_TEMP, 0, &s) == -1);
+    CHECK(apmidg_sampler_latest(1, APMIDG_SAMPLE_TEMP, 0, &s) == 0);
+    CHECK(s.value > 0.0);
+
+    apmidg_sampler_stop();
+    apmidg_finish();
+    return TEST_RESULT();
+}
@@ -0,0 +1,47 @@
+/*
+  Device and subdevice selection (apmidg_init_select()). A list that
+  names a device or a subdevice the driver lacks fails the init, and
+  a failed init leaves the library ready for the next one.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+
+#define SPEC_SUB   "sim:ndevs=2,nsubdevs=2"
+#define SPEC_NOSUB "sim:ndevs=2,nsubdevs=0"
+
+// init with devices, check the topology, and finish. ndevs < 0 for a
+// failure
+static void check(const char *spec, const char *devices, int ndevs, int npwrdoms)
+{
+    int rc = apmidg_init_select(0, spec, 0, devices);
+
+    if (ndevs < 0) {
+	CHECK(rc == -1);
+	return;
+    }
+    CHECK(rc == 0);
+    if (rc != 0) return;
+    CHECK(apmidg_getndevs() == ndevs);
+    CHECK(apmidg_getnpwrdoms(0) == npwrdoms);
+    apmidg_finish();
+}
+
+int main()
+{
+    // the device and one per subdevice
+    check(SPEC_SUB, "", 2, 3);
+    check(SPEC_SUB, "1", 1, 3);
+    check(SPEC_SUB, "0.1", 1, 1);
+    check(SPEC_SUB, "0.0,0.1", 1, 2);
+    check(SPEC_SUB, "0,0.1", 1, 3);
+    check(SPEC_SUB, "2", -1, 0);
+    check(SPEC_SUB, "0.5", -1, 0);
+    check(SPEC_SUB, "0.1,1.2", -1, 0);
+    check(SPEC_SUB, "0.x", -1, 0);
+
+    // a device without subdevices is its own subdevice 0
+    check(SPEC_NOSUB, "1.0", 1, 1);
+    check(SPEC_NOSUB, "1.1", -1, 0);
+
+    return TEST_RESULT();
+}
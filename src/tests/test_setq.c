@@ -0,0 +1,129 @@
+/*
+  The asynchronous limit changes. A callback holds the worker, so the
+  requests queued meanwhile coalesce deterministically. The hwmon
+  backend over a fake sysfs lets the test change a limit behind the
+  library's cache.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include "apmidg_fakesys.h"
+#include <pthread.h>
+
+#define SPEC "hwmon:sim:ndevs=2,nsubdevs=0"
+
+#define DEV0 "bus/pci/devices/0000:01:00.0/hwmon/hwmon0/"
+
+static int released;
+static int ncalls;
+static int nsuperseded;
+
+// hold the worker until released
+static void blockcb(const apmidg_set_result_t *res, void *arg)
+{
+    __atomic_add_fetch(&ncalls, 1, __ATOMIC_SEQ_CST);
+    apmidg_set_flush(); // would wait for itself
+    while (!__atomic_load_n(&released, __ATOMIC_SEQ_CST)) usleep(1000);
+}
+
+static void countcb(const apmidg_set_result_t *res, void *arg)
+{
+    __atomic_add_fetch(&ncalls, 1, __ATOMIC_SEQ_CST);
+    if (res->status == APMIDG_SET_SUPERSEDED) __atomic_add_fetch(&nsuperseded, 1, __ATOMIC_SEQ_CST);
+}
+
+// block the worker on device 1, which is not hwmon
+static void block()
+{
+    __atomic_store_n(&released, 0, __ATOMIC_SEQ_CST);
+    uint64_t r = apmidg_setpwrlim_async(1, 0, 500000, blockcb, NULL);
+    apmidg_set_wait(r, -1); // recorded before the callback
+}
+
+struct waitarg {
+    uint64_t reqid;
+    int status;
+};
+
+static void *waiter(void *arg)
+{
+    struct waitarg *w = (struct waitarg *)arg;
+    w->status = apmidg_set_wait(w->reqid, -1);
+    return NULL;
+}
+
+int main()
+{
+    char root[64], buf[64];
+    uint64_t r, r1, r2, r3;
+    int lim_mw;
+
+    if (fakesys_init(root) != 0) {
+	printf("Failed to create a fake sysfs\n");
+	return 1;
+    }
+    fakesys_write(root, DEV0 "name", "xe\n");
+    fakesys_write(root, DEV0 "power1_max", "250000000\n");
+
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	fakesys_remove(root);
+	return 1;
+    }
+    apmidg_setlimcachettl(60000);
+
+    // the limit changes behind the cache. the request is compared with
+    // the driver, so it is written
+    apmidg_getpwrlim(0, 0, &lim_mw);
+    CHECK(lim_mw == 250000);
+    fakesys_write(root, DEV0 "power1_max", "300000000\n");
+    r = apmidg_setpwrlim_async(0, 0, 250000, NULL, NULL);
+    CHECK(apmidg_set_wait(r, -1) == APMIDG_SET_DONE);
+    CHECK(fakesys_read(root, DEV0 "power1_max", buf, sizeof(buf)) == 0);
+    CHECK(strcmp(buf, "250000000\n") == 0);
+    r = apmidg_setpwrlim_async(0, 0, 250000, NULL, NULL);
+    CHECK(apmidg_set_wait(r, -1) == APMIDG_SET_SKIPPED);
+
+    // a frequency request leaves the cached power limit alone
+    fakesys_write(root, DEV0 "power1_max", "260000000\n");
+    r = apmidg_setfreqlims_async(0, 0, 300.0, 1200.0, NULL, NULL);
+    CHECK(apmidg_set_wait(r, -1) == APMIDG_SET_DONE);
+    apmidg_getpwrlim(0, 0, &lim_mw);
+    CHECK(lim_mw == 250000);
+    fakesys_write(root, DEV0 "power1_max", "250000000\n");
+
+    // the latest request of the domain is written, the others are
+    // superseded at once
+    block();
+    r1 = apmidg_setpwrlim_async(0, 0, 200000, countcb, NULL);
+    r2 = apmidg_setpwrlim_async(0, 0, 210000, countcb, NULL);
+    r3 = apmidg_setpwrlim_async(0, 0, 220000, countcb, NULL);
+    CHECK(apmidg_set_status(r1) == APMIDG_SET_SUPERSEDED);
+    CHECK(apmidg_set_status(r2) == APMIDG_SET_SUPERSEDED);
+    CHECK(apmidg_set_status(r3) == APMIDG_SET_QUEUED);
+    __atomic_store_n(&released, 1, __ATOMIC_SEQ_CST);
+    apmidg_set_flush();
+    CHECK(apmidg_set_status(r3) == APMIDG_SET_DONE);
+    CHECK(fakesys_read(root, DEV0 "power1_max", buf, sizeof(buf)) == 0);
+    CHECK(strcmp(buf, "220000000\n") == 0);
+    // every request is called back once
+    CHECK(ncalls == 4);
+    CHECK(nsuperseded == 2);
+
+    // apmidg_finish() completes a request that another thread waits for
+    pthread_t th;
+    struct waitarg w;
+    block();
+    w.reqid = r = apmidg_setpwrlim_async(0, 0, 230000, NULL, NULL);
+    w.status = APMIDG_SET_UNKNOWN;
+    pthread_create(&th, NULL, waiter, &w);
+    usleep(100000); // in apmidg_set_wait()
+    __atomic_store_n(&released, 1, __ATOMIC_SEQ_CST);
+    apmidg_finish();
+    pthread_join(th, NULL);
+    CHECK(w.status == APMIDG_SET_DONE);
+    CHECK(apmidg_set_status(r) == APMIDG_SET_UNKNOWN);
+    CHECK(apmidg_setpwrlim_async(0, 0, 240000, NULL, NULL) == 0);
+
+    fakesys_remove(root);
+    return TEST_RESULT();
+}
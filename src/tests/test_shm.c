@@ -0,0 +1,97 @@
+/*
+  The shared telemetry segment: publish and read, reclaim a segment
+  left by a dead publisher, refuse one owned by a live publisher, and
+  give it up in apmidg_finish().
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#define SPEC "sim:ndevs=2,nsubdevs=0"
+
+// run fn in a child and return its exit status
+static int inchild(int (*fn)(const char *), const char *name)
+{
+    pid_t pid = fork();
+    if (pid == 0) _exit(fn(name));
+    int st = 0;
+    waitpid(pid, &st, 0);
+    return WIFEXITED(st) ? WEXITSTATUS(st) : -1;
+}
+
+// die without apmidg_shm_destroy()
+static int createanddie(const char *name)
+{
+    if (apmidg_init_backend(0, SPEC) != 0) return 2;
+    return apmidg_shm_create(name, 1000) == 0 ? 0 : 1;
+}
+
+static int create(const char *name)
+{
+    return apmidg_shm_create(name, 1000) == 0 ? 0 : 1;
+}
+
+int main()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/apmidg_test_%d", (int)getpid());
+
+    CHECK(inchild(createanddie, name) == 0);
+
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    CHECK(apmidg_shm_create(name, 1000) == 0); // reclaimed
+    CHECK(apmidg_shm_publish() == 0);          // the power baseline
+    CHECK(inchild(create, name) == 1);         // we own it
+    usleep(10000);
+    CHECK(apmidg_shm_publish() == 0);
+
+    apmidg_shm_t *shm = apmidg_shm_attach(name);
+    CHECK(shm != NULL);
+    if (shm) {
+	int npwr, nfreq, ntemp;
+	CHECK(apmidg_shm_getndevs(shm) == 2);
+	CHECK(apmidg_shm_getsnapshotsize(shm, &npwr, &nfreq, &ntemp) == 0);
+	CHECK(npwr == 2 && nfreq == 2 && ntemp == 4);
+
+	int devid[2], id[2];
+	double power_W[2], temp_C[4];
+	apmidg_snapshot_t snap = {0};
+	snap.npwr = npwr;
+	snap.pwr_devid = devid;
+	snap.pwr_id = id;
+	snap.power_W = power_W;
+	snap.nfreq = nfreq;
+	snap.ntemp = ntemp;
+	snap.temp_C = temp_C;
+	uint64_t ts = 0;
+	CHECK(apmidg_shm_read(shm, &snap, &ts) == 0);
+	CHECK(ts > 0);
+	CHECK(devid[0] == 0 && devid[1] == 1);
+	CHECK_NEAR(power_W[0], 600.0, 5.0);
+	CHECK_NEAR(temp_C[1], 30.0 + 0.15 * 600.0, 1.0);
+	apmidg_shm_detach(shm);
+    }
+
+    apmidg_shm_destroy();
+    CHECK(apmidg_shm_attach(name) == NULL);
+
+    // the finish gives up the segment, so a re-init can take it again
+    CHECK(apmidg_shm_create(name, 1000) == 0);
+    apmidg_finish();
+    CHECK(apmidg_shm_attach(name) == NULL);
+    CHECK(inchild(createanddie, name) == 0);
+    CHECK(apmidg_init_backend(0, SPEC) == 0);
+    CHECK(apmidg_shm_create(name, 1000) == 0);
+    apmidg_finish();
+
+    strcat(name, ".lock"); // left by design
+    shm_unlink(name);
+    return TEST_RESULT();
+}
@@ -0,0 +1,65 @@
+/*
+  The call statistics. A public function that calls another counts
+  once, and a reset while other threads count leaves no stale counts
+  behind.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define SPEC "sim:ndevs=2,nsubdevs=0"
+
+#define NTHREADS (4)
+#define NCALLS   (200000)
+
+// the calls of the entry point, 0 if it is not listed
+static uint64_t apicalls(const char *name)
+{
+    apmidg_stats_t st[256];
+    int n = apmidg_stats_get(st, 256);
+
+    for (int i = 0; i < n && i < 256; i++)
+	if (st[i].kind == APMIDG_STATS_API && strcmp(st[i].name, name) == 0) return st[i].calls;
+    return 0;
+}
+
+static void *worker(void *arg)
+{
+    for (int i = 0; i < NCALLS; i++) apmidg_getndevs();
+    return NULL;
+}
+
+int main()
+{
+    pthread_t th[NTHREADS];
+
+    apmidg_stats_reset();
+    setenv("APMIDG_ACC_POLL_MS", "0", 1);
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    // apmidg_init_backend() calls apmidg_init_select()
+    CHECK(apicalls("apmidg_init_backend") == 1);
+    CHECK(apicalls("apmidg_init_select") == 0);
+
+    for (int i = 0; i < NTHREADS; i++) pthread_create(&th[i], NULL, worker, NULL);
+    for (int i = 0; i < 100; i++) apmidg_stats_reset();
+    for (int i = 0; i < NTHREADS; i++) pthread_join(th[i], NULL);
+    // the calls after the last reset, never an old count written back
+    CHECK(apicalls("apmidg_getndevs") <= (uint64_t)NTHREADS * NCALLS);
+
+    apmidg_stats_reset();
+    CHECK(apicalls("apmidg_getndevs") == 0);
+    for (int i = 0; i < 10; i++) apmidg_getndevs();
+    CHECK(apicalls("apmidg_getndevs") == 10);
+
+    // apmidg_finish() stops the engines through their public stop
+    apmidg_finish();
+    CHECK(apicalls("apmidg_finish") == 1);
+    CHECK(apicalls("apmidg_sampler_stop") == 0);
+
+    return TEST_RESULT();
+}
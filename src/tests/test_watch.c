@@ -0,0 +1,117 @@
+/*
+  The threshold watches on the simulator. The actual frequency follows
+  the requested range at once, so the polled watches see exactly the
+  values the test sets. A sensor runs at 30 + 0.15 * P C, and the
+  simulator raises its threshold events, so a temperature watch is
+  driven by them.
+ */
+#include "libapmidg.h"
+#include "apmidg_test.h"
+#include <unistd.h>
+
+#define SPEC "sim:ndevs=2,nsubdevs=0"
+
+struct counts {
+    int nabove;
+    int nbelow;
+    int unwatchrc;     // of the apmidg_unwatch() from the callback
+};
+
+static void countcb(const apmidg_watch_event_t *ev, void *arg)
+{
+    struct counts *c = (struct counts *)arg;
+    if (ev->above) __atomic_add_fetch(&c->nabove, 1, __ATOMIC_SEQ_CST);
+    else __atomic_add_fetch(&c->nbelow, 1, __ATOMIC_SEQ_CST);
+}
+
+static void unwatchcb(const apmidg_watch_event_t *ev, void *arg)
+{
+    struct counts *c = (struct counts *)arg;
+    c->unwatchrc = apmidg_unwatch(ev->watchid);
+    countcb(ev, arg);
+}
+
+// the callbacks run on a thread of the library. wait up to 2 sec
+static int waitfor(int *n, int want)
+{
+    for (int i = 0; i < 2000 && __atomic_load_n(n, __ATOMIC_SEQ_CST) < want; i++) usleep(1000);
+    return __atomic_load_n(n, __ATOMIC_SEQ_CST);
+}
+
+// set the max frequency of device 0 and read it, which feeds the
+// polled watches
+static void setfreq(double max_MHz)
+{
+    double actual;
+    apmidg_setfreqlims(0, 0, 300.0, max_MHz);
+    apmidg_readfreq(0, 0, &actual);
+}
+
+int main()
+{
+    struct counts c = {0, 0, 0}, u = {0, 0, 0}, d = {0, 0, 0}, t = {0, 0, 0};
+    int wid;
+
+    if (apmidg_init_backend(0, SPEC) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+
+    // hysteresis: above at 1200 MHz, below again only at 1000 MHz
+    setfreq(800.0);
+    wid = apmidg_watch(0, APMIDG_SAMPLE_FREQ, 0, 1200.0, 200.0, 0.0, countcb, &c);
+    CHECK(wid >= 0);
+    CHECK(apmidg_watch_ishw(wid) == 0);
+    setfreq(1300.0);
+    CHECK(waitfor(&c.nabove, 1) == 1);
+    setfreq(1100.0); // within the hysteresis
+    setfreq(1300.0);
+    usleep(100000);
+    CHECK(c.nabove == 1 && c.nbelow == 0);
+    setfreq(1000.0);
+    CHECK(waitfor(&c.nbelow, 1) == 1);
+    // re-armed
+    setfreq(1200.0);
+    CHECK(waitfor(&c.nabove, 2) == 2);
+    CHECK(apmidg_unwatch(wid) == 0);
+    CHECK(apmidg_unwatch(wid) == -1);
+
+    // debounce: a crossing that does not hold for 200 msec is dropped
+    setfreq(800.0);
+    wid = apmidg_watch(0, APMIDG_SAMPLE_FREQ, 0, 1200.0, 0.0, 200.0, countcb, &d);
+    setfreq(1300.0);
+    setfreq(800.0);
+    setfreq(1300.0);
+    usleep(250000);
+    CHECK(d.nabove == 0);
+    setfreq(1300.0); // still above after the debounce
+    CHECK(waitfor(&d.nabove, 1) == 1);
+    apmidg_unwatch(wid);
+
+    // a callback removes its own watch. no callback follows
+    setfreq(800.0);
+    wid = apmidg_watch(0, APMIDG_SAMPLE_FREQ, 0, 1200.0, 0.0, 0.0, unwatchcb, &u);
+    setfreq(1300.0);
+    CHECK(waitfor(&u.nabove, 1) == 1);
+    CHECK(u.unwatchrc == 0);
+    setfreq(800.0);
+    setfreq(1300.0);
+    usleep(100000);
+    CHECK(u.nabove == 1 && u.nbelow == 0);
+    CHECK(apmidg_watch_ishw(wid) == -1);
+    setfreq(1600.0);
+
+    // the sensor events of device 1: 120 C at 600 W, 75 C at 300 W
+    wid = apmidg_watch(1, APMIDG_SAMPLE_TEMP, 0, 100.0, 10.0, 0.0, countcb, &t);
+    CHECK(wid >= 0);
+    CHECK(apmidg_watch_ishw(wid) == 1);
+    CHECK(waitfor(&t.nabove, 1) == 1);
+    apmidg_setpwrlim(1, 0, 300000);
+    CHECK(waitfor(&t.nbelow, 1) == 1);
+    apmidg_setpwrlim(1, 0, 600000);
+    CHECK(waitfor(&t.nabove, 2) == 2);
+    CHECK(apmidg_unwatch(wid) == 0);
+
+    apmidg_finish();
+    return TEST_RESULT();
+}
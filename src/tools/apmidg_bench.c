@@ -0,0 +1,539 @@
+/*
+  apmidg_bench: measures the per-call latency distribution and the
+  throughput of the libapmidg C API entry points, single- and
+  multi-threaded, and compares apmidg_readenergy() against the raw
+  sysman path of c_examples/standalone_energy_reader.c. With -b sim,
+  it runs against the simulator backend, so no GPU is needed.
+
+  Developed by Kazutomo Yoshii <kazutomo@mcs.anl.gov>
+ */
+#include "libapmidg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+
+// the raw path from standalone_energy_reader.c
+extern int zerInit();
+extern int zerGetNDevs();
+extern void zerReadEnergy(int devid, uint64_t *ts_us, uint64_t *energy_uj);
+
+static int ndevs;
+static const char *backend = NULL;
+
+static inline uint64_t gettime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * benchmarked calls. each takes a device id and does one call
+ */
+
+static void b_readenergy(int di)
+{
+    uint64_t e, ts;
+    apmidg_readenergy(di, 0, &e, &ts);
+}
+
+static void b_readpoweravg(int di)
+{
+    apmidg_readpoweravg(di, 0);
+}
+
+static void b_readfreq(int di)
+{
+    double f;
+    apmidg_readfreq(di, 0, &f);
+}
+
+static void b_readtemp(int di)
+{
+    double t;
+    apmidg_readtemp(di, 0, &t);
+}
+
+static void b_getpwrprops(int di)
+{
+    int onsubdev, subdevid, canctrl, deflim_mw;
+    apmidg_getpwrprops(di, 0, &onsubdev, &subdevid, &canctrl, &deflim_mw, NULL, NULL);
+}
+
+static void b_getpwrlim(int di)
+{
+    int lim_mw;
+    apmidg_getpwrlim(di, 0, &lim_mw);
+}
+
+static void b_getfreqlims(int di)
+{
+    double fmin, fmax;
+    apmidg_getfreqlims(di, 0, &fmin, &fmax);
+}
+
+// a begin/end pair. it reads the counters of all devices since the
+// bench does not start the sampler
+static void b_region(int di)
+{
+    apmidg_region_begin("apmidg_bench");
+    apmidg_region_end("apmidg_bench");
+}
+
+// writes back the limits read at startup, so the state is unchanged
+static double *cur_fmin, *cur_fmax;
+
+static void b_setfreqlims(int di)
+{
+    apmidg_setfreqlims(di, 0, cur_fmin[di], cur_fmax[di]);
+}
+
+static void b_zerreadenergy(int di)
+{
+    uint64_t e, ts;
+    zerReadEnergy(di, &ts, &e);
+}
+
+typedef struct {
+    const char *name;
+    void (*func)(int);
+    int iswrite;
+} benchfunc_t;
+
+static benchfunc_t funcs[] = {
+    {"apmidg_readenergy", b_readenergy, 0},
+    {"zerReadEnergy(raw)", b_zerreadenergy, 0},
+    {"apmidg_readpoweravg", b_readpoweravg, 0},
+    {"apmidg_readfreq", b_readfreq, 0},
+    {"apmidg_readtemp", b_readtemp, 0},
+    {"apmidg_getpwrprops", b_getpwrprops, 0},
+    {"apmidg_getpwrlim", b_getpwrlim, 0},
+    {"apmidg_getfreqlims", b_getfreqlims, 0},
+    {"apmidg_region_pair", b_region, 0},
+    {"apmidg_setfreqlims", b_setfreqlims, 1},
+};
+
+/*
+ * measurement
+ */
+
+typedef struct {
+    void (*func)(int);
+    int tid;
+    int niters;
+    uint32_t *lat_ns;
+    pthread_barrier_t *barrier;
+} threadarg_t;
+
+static void *benchthread(void *p)
+{
+    threadarg_t *a = (threadarg_t *)p;
+    int di = ndevs > 0 ? a->tid % ndevs : 0;
+
+    for (int i = 0; i < a->niters / 10 + 1; i++) a->func(di); // warm up
+    pthread_barrier_wait(a->barrier);
+    for (int i = 0; i < a->niters; i++) {
+	uint64_t t0 = gettime_ns();
+	a->func(di);
+	uint64_t t1 = gettime_ns();
+	a->lat_ns[i] = (t1 - t0) > UINT32_MAX ? UINT32_MAX : (uint32_t)(t1 - t0);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : (x > y);
+}
+
+static void printheader()
+{
+    printf("%-22s %7s %9s %10s %10s %10s %12s\n",
+	   "function", "threads", "calls", "p50_us", "p99_us", "max_us", "calls/s");
+}
+
+static void report(const char *name, int nthreads, uint32_t *lat, size_t n, uint64_t wall_ns)
+{
+    qsort(lat, n, sizeof(uint32_t), cmp_u32);
+    printf("%-22s %7d %9zu %10.3f %10.3f %10.3f %12.0f\n", name, nthreads, n,
+	   lat[n / 2] * 1e-3, lat[(size_t)(n * 0.99)] * 1e-3, lat[n - 1] * 1e-3,
+	   wall_ns > 0 ? n / (wall_ns * 1e-9) : 0.0);
+}
+
+static void runbench(benchfunc_t *bf, int nthreads, int niters)
+{
+    pthread_t *th = calloc(nthreads, sizeof(pthread_t));
+    threadarg_t *args = calloc(nthreads, sizeof(threadarg_t));
+    uint32_t *lat = calloc((size_t)nthreads * niters, sizeof(uint32_t));
+    pthread_barrier_t barrier;
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++) {
+	args[i].func = bf->func;
+	args[i].tid = i;
+	args[i].niters = niters;
+	args[i].lat_ns = lat + (size_t)i * niters;
+	args[i].barrier = &barrier;
+	pthread_create(&th[i], NULL, benchthread, &args[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    uint64_t t0 = gettime_ns();
+    for (int i = 0; i < nthreads; i++) pthread_join(th[i], NULL);
+    uint64_t t1 = gettime_ns();
+    pthread_barrier_destroy(&barrier);
+
+    report(bf->name, nthreads, lat, (size_t)nthreads * niters, t1 - t0);
+
+    free(lat);
+    free(args);
+    free(th);
+}
+
+// tag is appended to the row names, e.g., "(N=64)"
+static void runinitbench(int niters, int verbose, const char *spec, const char *tag)
+{
+    uint32_t *lat_init = calloc(niters, sizeof(uint32_t));
+    uint32_t *lat_finish = calloc(niters, sizeof(uint32_t));
+    uint64_t wall_init = 0, wall_finish = 0;
+    char name[64];
+
+    for (int i = 0; i < niters; i++) {
+	uint64_t t0 = gettime_ns();
+	apmidg_init_backend(verbose, spec);
+	uint64_t t1 = gettime_ns();
+	apmidg_finish();
+	uint64_t t2 = gettime_ns();
+	lat_init[i] = (t1 - t0) > UINT32_MAX ? UINT32_MAX : (uint32_t)(t1 - t0);
+	lat_finish[i] = (t2 - t1) > UINT32_MAX ? UINT32_MAX : (uint32_t)(t2 - t1);
+	wall_init += t1 - t0;
+	wall_finish += t2 - t1;
+    }
+    snprintf(name, sizeof(name), "apmidg_init%s", tag);
+    report(name, 1, lat_init, niters, wall_init);
+    snprintf(name, sizeof(name), "apmidg_finish%s", tag);
+    report(name, 1, lat_finish, niters, wall_finish);
+
+    free(lat_init);
+    free(lat_finish);
+}
+
+/*
+ * init sweep: the init/finish time against the number of simulated
+ * devices. the other sim params (e.g., latency_us) come from -b
+ */
+static int runinitsweep(char *devlist, int niters, int verbose)
+{
+    const char *params = "";
+    char spec[1024], tag[32];
+
+    if (backend && strncmp(backend, "sim", 3) == 0 && backend[3] == ':')
+	params = backend + 4;
+    else if (backend && strcmp(backend, "sim") != 0) {
+	printf("-D needs the simulator backend (-b sim[:params])\n");
+	return 1;
+    }
+    if (niters < 1) niters = 1;
+
+    printf("[apmidg_bench] init sweep: sim:%s iters=%d\n\n", params, niters);
+    printheader();
+    for (char *tok = strtok(devlist, ","); tok; tok = strtok(NULL, ",")) {
+	int n = atoi(tok);
+	if (n < 1) continue;
+	// a later key overrides an earlier one
+	snprintf(spec, sizeof(spec), "sim:%s%sndevs=%d", params, params[0] ? "," : "", n);
+	snprintf(tag, sizeof(tag), "(N=%d)", n);
+	runinitbench(niters, verbose, spec, tag);
+    }
+    return 0;
+}
+
+/*
+ * stress mode: every thread calls random entry points on random
+ * devices while one thread also restarts the sampler, the windowed
+ * statistics and the history, which are freed under the readers. build with
+ * -DAPMIDG_TSAN=ON to run it under ThreadSanitizer
+ */
+
+typedef struct {
+    int tid;
+    int readonly;
+    int *stop;
+    uint64_t nops;
+    uint64_t nbad;
+} stressarg_t;
+
+static void *stressthread(void *p)
+{
+    stressarg_t *a = (stressarg_t *)p;
+    unsigned int seed = 12345 + a->tid;
+    int npwr, nfreq, ntemp;
+
+    apmidg_getsnapshotsize(&npwr, &nfreq, &ntemp);
+    int *ibuf = calloc(3 * (npwr + nfreq + ntemp) + 3, sizeof(int));
+    uint64_t *ubuf = calloc(2 * npwr + 2, sizeof(uint64_t));
+    double *dbuf = calloc(npwr + 3 * nfreq + ntemp + 5, sizeof(double));
+
+    while (!__atomic_load_n(a->stop, __ATOMIC_RELAXED)) {
+	int di = rand_r(&seed) % ndevs;
+	int pi = rand_r(&seed) % apmidg_getnpwrdoms(di);
+	int fi = rand_r(&seed) % apmidg_getnfreqdoms(di);
+	int ti = rand_r(&seed) % apmidg_getntempsensors(di);
+	int canctrl, deflim_mw, lim_mw;
+	double fmin, fmax, v;
+	uint64_t e, ts;
+	apmidg_sample_t s;
+
+	switch (rand_r(&seed) % 14) {
+	case 0:
+	    apmidg_readenergy(di, pi, &e, &ts);
+	    break;
+	case 1:
+	    // counters are monotonic, so the average can never be negative
+	    if (apmidg_readpoweravg(di, pi) < 0.0) a->nbad++;
+	    break;
+	case 2:
+	    apmidg_readfreq(di, fi, &v);
+	    break;
+	case 3:
+	    apmidg_readtemp(di, ti, &v);
+	    break;
+	case 4:
+	    apmidg_getpwrlim(di, 0, &lim_mw);
+	    break;
+	case 5:
+	    apmidg_getpwrprops(di, 0, NULL, NULL, &canctrl, &deflim_mw, NULL, NULL);
+	    if (!a->readonly && canctrl > 0 && deflim_mw > 0)
+		apmidg_setpwrlim(di, 0, deflim_mw / 2 + rand_r(&seed) % (deflim_mw / 2));
+	    break;
+	case 6:
+	    apmidg_getfreqlims(di, fi, &fmin, &fmax);
+	    if (fmin > fmax) a->nbad++;
+	    break;
+	case 7:
+	    apmidg_getfreqprops(di, fi, NULL, NULL, &canctrl, &fmin, &fmax);
+	    if (!a->readonly && canctrl > 0)
+		apmidg_setfreqlims(di, fi, fmin, fmin + (fmax - fmin) * (rand_r(&seed) % 100) / 100.0);
+	    break;
+	case 8: {
+	    apmidg_snapshot_t snap = {
+		npwr, ibuf, ibuf + npwr, ubuf, ubuf + npwr, dbuf,
+		nfreq, ibuf + 2 * npwr, ibuf + 2 * npwr + nfreq, dbuf + npwr, dbuf + npwr + nfreq, dbuf + npwr + 2 * nfreq,
+		ntemp, ibuf + 2 * (npwr + nfreq), ibuf + 2 * (npwr + nfreq) + ntemp, dbuf + npwr + 3 * nfreq,
+	    };
+	    if (apmidg_snapshot(&snap) != 0) a->nbad++;
+	    break;
+	}
+	case 9:
+	    apmidg_sampler_latest(di, APMIDG_SAMPLE_POWER, pi, &s);
+	    break;
+	case 10:
+	    if (rand_r(&seed) % 100 == 0) apmidg_invalidatelims(di);
+	    break;
+	case 11:
+	    // only thread 0 changes the sampler, and rarely
+	    if (a->tid == 0 && rand_r(&seed) % 1000 == 0) {
+		if (apmidg_sampler_isrunning()) apmidg_sampler_stop();
+		else apmidg_sampler_start(1000.0, 0);
+	    }
+	    break;
+	case 12: {
+	    apmidg_wstats_t st;
+	    if (a->tid == 0 && rand_r(&seed) % 1000 == 0) {
+		if (apmidg_wstats_getnwindows() > 0) apmidg_wstats_stop();
+		else apmidg_wstats_start(NULL, 0);
+	    }
+	    if (apmidg_wstats_get(di, APMIDG_SAMPLE_POWER, pi, 0, &st) == 0 && st.count > 0 && st.min > st.max) a->nbad++;
+	    break;
+	}
+	case 13: {
+	    apmidg_history_t h[4];
+	    if (a->tid == 0 && rand_r(&seed) % 1000 == 0) {
+		if (apmidg_history_query(di, APMIDG_SAMPLE_POWER, pi, 0, 0, UINT64_MAX, h, 0) >= 0) apmidg_history_stop();
+		else apmidg_history_start(NULL);
+	    }
+	    apmidg_history_query(di, APMIDG_SAMPLE_TEMP, ti, APMIDG_HISTORY_AUTO, 0, UINT64_MAX, h, 4);
+	    break;
+	}
+	}
+	a->nops++;
+    }
+
+    free(ibuf);
+    free(ubuf);
+    free(dbuf);
+    return NULL;
+}
+
+static int runstress(int nthreads, double sec, int readonly)
+{
+    pthread_t *th = calloc(nthreads, sizeof(pthread_t));
+    stressarg_t *args = calloc(nthreads, sizeof(stressarg_t));
+    int stop = 0;
+    uint64_t nops = 0, nbad = 0;
+
+    // save the limits to restore them afterwards
+    int *lims = calloc(ndevs, sizeof(int));
+    int nfreq = 0;
+    for (int di = 0; di < ndevs; di++) nfreq += apmidg_getnfreqdoms(di);
+    double *franges = calloc(2 * nfreq + 2, sizeof(double));
+    for (int di = 0, k = 0; di < ndevs; di++) {
+	apmidg_getpwrlim(di, 0, &lims[di]);
+	for (int fi = 0; fi < apmidg_getnfreqdoms(di); fi++, k += 2)
+	    apmidg_getfreqlims(di, fi, &franges[k], &franges[k + 1]);
+    }
+
+    printf("[apmidg_bench] stress: backend=%s ndevs=%d threads=%d sec=%.1f%s\n",
+	   apmidg_getbackend(), ndevs, nthreads, sec, readonly ? " read-only" : "");
+
+    uint64_t t0 = gettime_ns();
+    for (int i = 0; i < nthreads; i++) {
+	args[i].tid = i;
+	args[i].readonly = readonly;
+	args[i].stop = &stop;
+	pthread_create(&th[i], NULL, stressthread, &args[i]);
+    }
+    usleep((useconds_t)(sec * 1e6));
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < nthreads; i++) {
+	pthread_join(th[i], NULL);
+	nops += args[i].nops;
+	nbad += args[i].nbad;
+    }
+    uint64_t t1 = gettime_ns();
+    apmidg_sampler_stop();
+
+    for (int di = 0, k = 0; di < ndevs; di++) {
+	if (!readonly && lims[di] > 0) apmidg_setpwrlim(di, 0, lims[di]);
+	for (int fi = 0; fi < apmidg_getnfreqdoms(di); fi++, k += 2)
+	    if (!readonly) apmidg_setfreqlims(di, fi, franges[k], franges[k + 1]);
+    }
+
+    printf("ops=%lu (%.0f ops/s) anomalies=%lu\n", nops, nops / ((t1 - t0) * 1e-9), nbad);
+
+    free(franges);
+    free(lims);
+    free(args);
+    free(th);
+    return nbad > 0 ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("\n");
+    printf("-n iters    : iterations per thread. default: 10000\n");
+    printf("-t threads  : comma-separated thread counts. default: 1,4\n");
+    printf("-f substr   : only run the functions whose name contains substr\n");
+    printf("-i iters    : init/finish iterations (0 to skip). default: 3\n");
+    printf("-r          : read-only. skip apmidg_setfreqlims\n");
+    printf("-b backend  : l0 or sim[:params]. default: $APMIDG_BACKEND or l0\n");
+    printf("-s sec      : stress all devices for sec seconds with the largest -t count instead\n");
+    printf("-D ndevs    : comma-separated simulated device counts. only measure init/finish for each\n");
+    printf("-v level    : verbose level. default: 0\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int niters = 10000;
+    int ninit = 3;
+    int readonly = 0;
+    int verbose = 0;
+    const char *filter = NULL;
+    char threadlist[256] = "1,4";
+    double stress_sec = 0.0;
+    char *initdevs = NULL;
+    int opt;
+
+    while((opt=getopt(argc, argv, "hn:t:f:i:rb:s:D:v:")) != -1 ) {
+	switch(opt) {
+	case 'n':
+	    niters = atoi(optarg);
+	    break;
+	case 't':
+	    snprintf(threadlist, sizeof(threadlist), "%s", optarg);
+	    break;
+	case 'f':
+	    filter = optarg;
+	    break;
+	case 'i':
+	    ninit = atoi(optarg);
+	    break;
+	case 'r':
+	    readonly = 1;
+	    break;
+	case 'b':
+	    backend = optarg;
+	    break;
+	case 's':
+	    stress_sec = atof(optarg);
+	    break;
+	case 'D':
+	    initdevs = optarg;
+	    break;
+	case 'v':
+	    verbose = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+    if (niters < 1) niters = 1;
+
+    if (initdevs) return runinitsweep(initdevs, ninit, verbose);
+
+    if(apmidg_init_backend(verbose, backend) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    ndevs = apmidg_getndevs();
+
+    if (stress_sec > 0.0) {
+	int maxthreads = 1;
+	for (char *tok = strtok(threadlist, ","); tok; tok = strtok(NULL, ","))
+	    if (atoi(tok) > maxthreads) maxthreads = atoi(tok);
+	int ret = runstress(maxthreads, stress_sec, readonly);
+	apmidg_finish();
+	return ret;
+    }
+
+    // the raw path needs its own init. apmidg_init() has already set
+    // ZES_ENABLE_SYSMAN. there is no raw path on the simulator
+    int rawavail = 0;
+    if (strcmp(apmidg_getbackend(), "l0") == 0)
+	rawavail = (zerInit() == 0 && zerGetNDevs() > 0);
+
+    cur_fmin = calloc(ndevs + 1, sizeof(double));
+    cur_fmax = calloc(ndevs + 1, sizeof(double));
+    for (int di = 0; di < ndevs; di++) apmidg_getfreqlims(di, 0, &cur_fmin[di], &cur_fmax[di]);
+
+    printf("[apmidg_bench] backend=%s ndevs=%d iters=%d threads=%s\n\n",
+	   apmidg_getbackend(), ndevs, niters, threadlist);
+    printheader();
+
+    for (char *tok = strtok(threadlist, ","); tok; tok = strtok(NULL, ",")) {
+	int nthreads = atoi(tok);
+	if (nthreads < 1) continue;
+
+	for (size_t i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
+	    benchfunc_t *bf = &funcs[i];
+	    if (filter && !strstr(bf->name, filter)) continue;
+	    if (readonly && bf->iswrite) continue;
+	    if (bf->func == b_zerreadenergy && !rawavail) continue;
+	    runbench(bf, nthreads, niters);
+	}
+    }
+
+    apmidg_finish();
+
+    if (ninit > 0 && (!filter || strstr("apmidg_init apmidg_finish", filter)))
+	runinitbench(ninit, verbose, backend, "");
+
+    return 0;
+}
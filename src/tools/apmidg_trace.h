@@ -0,0 +1,68 @@
+/*
+  apmidg binary trace format (used by apmidgrec and apmidgrec2csv)
+
+  A trace file is
+    apmidg_trace_hdr
+    npwr  x apmidg_trace_dom   (power domain topology)
+    nfreq x apmidg_trace_dom   (frequency domain topology)
+    ntemp x apmidg_trace_dom   (temperature sensor topology)
+    npwr  x apmidg_trace_base  (accumulated energy baseline)
+    records of hdr.recsize bytes until EOF
+
+  Each record is fixed width and delta-encoded against the previous
+  record (the first one against the baseline):
+    uint32_t dt_us               host time since the previous record
+    npwr  x { uint32_t de_uj;    accumulated energy delta
+              uint32_t dts_us; } energy counter timestamp delta
+    nfreq x uint16_t actual_MHz
+    ntemp x int16_t  temp_cC     temperature in 1/100 C
+    zero padding to a multiple of 4 bytes
+
+  The energy is the one of apmidg_readenergy_acc(), not the raw
+  counter, so the counter wraps and resets are already corrected and
+  the deltas are never negative. All values are little-endian. A
+  uint32_t energy delta covers 4294 J per record, i.e., more than 4 kW
+  per domain at the maximum 1 s interval of apmidgrec; a larger one
+  (e.g., after a stall) is clamped and the rest is carried into the
+  next records, so the accumulated energy stays exact.
+ */
+
+#ifndef __APMIDG_TRACE_H_DEFINED__
+#define __APMIDG_TRACE_H_DEFINED__
+
+#include <stdint.h>
+
+#define APMIDG_TRACE_MAGIC   "APMIDGTR"
+#define APMIDG_TRACE_VERSION (1)
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t hdrsize;
+    uint32_t ndevs;
+    uint32_t npwr;
+    uint32_t nfreq;
+    uint32_t ntemp;
+    uint32_t recsize;
+    uint32_t period_us;
+    uint64_t start_mono_us;   // CLOCK_MONOTONIC at the baseline
+    uint64_t start_epoch_us;  // CLOCK_REALTIME at the baseline
+} apmidg_trace_hdr;
+
+typedef struct {
+    int16_t devid;
+    int16_t id;
+} apmidg_trace_dom;
+
+typedef struct {
+    uint64_t energy_uj;
+    uint64_t ts_us;
+} apmidg_trace_base;
+
+static inline uint32_t apmidg_trace_recsize(uint32_t npwr, uint32_t nfreq, uint32_t ntemp)
+{
+    uint32_t sz = 4 + npwr * 8 + nfreq * 2 + ntemp * 2;
+    return (sz + 3) & ~3u;
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+  apmidgconf: saves the power limits and the frequency ranges of all
+  devices into a file, and restores them. Only the limits that differ
+  are written, and the restore is rolled back if any of them fails.
+
+  apmidgconf save node.cfg
+  apmidgconf diff node.cfg    # exit 1 if the node differs
+  apmidgconf apply node.cfg   # exit 1 if a limit failed
+
+  Like diff(1), the exit status is 2 on an error (e.g., a corrupt
+  file), so a script can tell it from a node that differs. A device
+  of the file that is not found counts as a difference.
+
+  Developed by Kazutomo Yoshii <kazutomo@mcs.anl.gov>
+ */
+#include "libapmidg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options] save|diff|apply filename\n", prog);
+    printf("\n");
+    printf("save        : write the current limits to filename\n");
+    printf("diff        : print the limits that differ from filename\n");
+    printf("apply       : restore the limits in filename\n");
+    printf("\n");
+    printf("-k          : apply: keep the writes that succeeded if another fails\n");
+    printf("-q          : diff, apply: do not print the differences\n");
+    printf("-v level    : verbose level. default: 0\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int flags = APMIDG_CONFIG_VERBOSE;
+    int verbose = 0;
+    int opt;
+    int rc = 0;
+
+    while((opt=getopt(argc, argv, "hkqv:")) != -1 ) {
+	switch(opt) {
+	case 'k':
+	    flags |= APMIDG_CONFIG_NOROLLBACK;
+	    break;
+	case 'q':
+	    flags &= ~APMIDG_CONFIG_VERBOSE;
+	    break;
+	case 'v':
+	    verbose = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 2;
+	}
+    }
+    if (argc - optind != 2) {
+	usage(argv[0]);
+	return 2;
+    }
+    const char *cmd = argv[optind];
+    const char *fn = argv[optind + 1];
+
+    if (strcmp(cmd, "save") && strcmp(cmd, "diff") && strcmp(cmd, "apply")) {
+	usage(argv[0]);
+	return 2;
+    }
+
+    if(apmidg_init(verbose) != 0) {
+	printf("Failed to initialize\n");
+	return 2;
+    }
+
+    if (strcmp(cmd, "save") == 0) {
+	if (apmidg_config_save(fn) != 0) {
+	    printf("Failed to save %s\n", fn);
+	    rc = 2;
+	}
+    } else {
+	apmidg_config_report_t rep;
+
+	if (strcmp(cmd, "diff") == 0) flags = (flags & APMIDG_CONFIG_VERBOSE) | APMIDG_CONFIG_DRYRUN;
+	rc = apmidg_config_apply(fn, flags, &rep) == 0 ? 0 : 1;
+	if (rc && rep.ndiffs == 0 && rep.nmissing == 0) {
+	    // refused before anything was compared
+	    printf("Failed to %s %s\n", cmd, fn);
+	    rc = 2;
+	} else if (flags & APMIDG_CONFIG_DRYRUN) {
+	    printf("%d of %d limits differ, %d devices not found\n", rep.ndiffs, rep.nents, rep.nmissing);
+	} else {
+	    printf("%d of %d limits differed: %d written, %d failed%s, %d devices not found (%.3f msec)\n",
+		   rep.ndiffs, rep.nents, rep.nwritten, rep.nfailed,
+		   rep.rolledback ? ", rolled back" : "", rep.nmissing, rep.elapsed_us / 1000.0);
+	}
+    }
+
+    apmidg_finish();
+
+    return rc;
+}
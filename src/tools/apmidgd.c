@@ -0,0 +1,103 @@
+/*
+  apmidgd: publishes the GPU telemetry of this node into a shared
+  memory segment so that many processes (MPI ranks, python tools)
+  can read it without initializing Level Zero. See
+  c_examples/shmreader.c for the reader side.
+
+  Developed by Kazutomo Yoshii <kazutomo@mcs.anl.gov>
+ */
+#include "libapmidg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+
+static volatile sig_atomic_t stop = 0;
+
+static void sighandler(int sig)
+{
+    stop = 1;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("\n");
+    printf("-n name     : shared memory name. default: %s\n", "/apmidg");
+    printf("-i msec     : publish interval in millisecond. default: 100\n");
+    printf("-t sec      : exit after sec seconds. default: run until signaled\n");
+    printf("-v level    : verbose level. default: 0\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = NULL;
+    double interval_ms = 100.0;
+    double timeout_sec = 0.0;
+    int verbose = 0;
+    int opt;
+
+    while((opt=getopt(argc, argv, "hn:i:t:v:")) != -1 ) {
+	switch(opt) {
+	case 'n':
+	    name = optarg;
+	    break;
+	case 'i':
+	    interval_ms = atof(optarg);
+	    break;
+	case 't':
+	    timeout_sec = atof(optarg);
+	    break;
+	case 'v':
+	    verbose = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+    if (interval_ms <= 0.0) interval_ms = 100.0;
+
+    if(apmidg_init(verbose) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+    if (apmidg_shm_create(name, (int)(interval_ms * 1000)) != 0) {
+	printf("Failed to create the shared memory segment\n");
+	apmidg_finish();
+	return 1;
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    struct timespec start, next, now;
+    long period_ns = (long)(interval_ms * 1e6);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+
+    if (verbose >= 1) printf("apmidgd: publishing every %.1f msec\n", interval_ms);
+
+    while (!stop) {
+	apmidg_shm_publish();
+
+	next.tv_sec += period_ns / 1000000000L;
+	next.tv_nsec += period_ns % 1000000000L;
+	if (next.tv_nsec >= 1000000000L) {
+	    next.tv_nsec -= 1000000000L;
+	    next.tv_sec++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timeout_sec > 0.0 &&
+	    (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9 >= timeout_sec)
+	    break;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    apmidg_shm_destroy();
+    apmidg_finish();
+
+    return 0;
+}
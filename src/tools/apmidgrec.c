@@ -0,0 +1,239 @@
+/*
+  apmidgrec: records all power, frequency and temperature domains at
+  a high rate into a compact binary trace (see apmidg_trace.h). Use
+  apmidgrec2csv to convert a trace into CSV.
+
+  Developed by Kazutomo Yoshii <kazutomo@mcs.anl.gov>
+ */
+#include "libapmidg.h"
+#include "apmidg_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+
+static volatile sig_atomic_t stop = 0;
+
+static void sighandler(int sig)
+{
+    stop = 1;
+}
+
+static uint64_t gettime_us(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("\n");
+    printf("-o fn       : output filename. default: apmidg_trace.bin\n");
+    printf("-r hz       : sampling rate in Hz (1 or higher). default: 1000\n");
+    printf("-t sec      : stop after sec seconds. default: run until signaled\n");
+    printf("-b MB       : output buffer size in MB. default: 4\n");
+    printf("-v level    : verbose level. default: 0\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *fn = "apmidg_trace.bin";
+    double rate_hz = 1000.0;
+    double timeout_sec = 0.0;
+    int bufmb = 4;
+    int verbose = 0;
+    int opt;
+
+    while((opt=getopt(argc, argv, "ho:r:t:b:v:")) != -1 ) {
+	switch(opt) {
+	case 'o':
+	    fn = optarg;
+	    break;
+	case 'r':
+	    rate_hz = atof(optarg);
+	    break;
+	case 't':
+	    timeout_sec = atof(optarg);
+	    break;
+	case 'b':
+	    bufmb = atoi(optarg);
+	    break;
+	case 'v':
+	    verbose = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+    if (rate_hz < 1.0) rate_hz = 1.0; // keep the deltas within 32 bits
+    if (bufmb < 1) bufmb = 1;
+
+    if(apmidg_init(verbose) != 0) {
+	printf("Failed to initialize\n");
+	return 1;
+    }
+
+    // the energy is read with apmidg_readenergy_acc(), not with
+    // apmidg_snapshot(), which would move the apmidg_readpoweravg()
+    // baseline. The accumulated value is monotonic across counter
+    // wraps and resets, so a delta is never negative
+    int ndevs = apmidg_getndevs();
+    int npwr = 0, nfreq = 0, ntemp = 0;
+    apmidg_getsnapshotsize(&npwr, &nfreq, &ntemp);
+    apmidg_trace_dom *pwrdoms = calloc(npwr + 1, sizeof(apmidg_trace_dom));
+    apmidg_trace_dom *freqdoms = calloc(nfreq + 1, sizeof(apmidg_trace_dom));
+    apmidg_trace_dom *tempdoms = calloc(ntemp + 1, sizeof(apmidg_trace_dom));
+    uint64_t *prev_e = calloc(npwr + 1, sizeof(uint64_t));
+    uint64_t *prev_ts = calloc(npwr + 1, sizeof(uint64_t));
+    unsigned char *rec = NULL;
+    char *iobuf = NULL;
+    FILE *fp = NULL;
+    uint64_t nrecs = 0, nclamped = 0;
+    int rc = 0;
+
+    int ip = 0, ifq = 0, it = 0;
+    for (int dev = 0; dev < ndevs; dev++) {
+	for (int id = 0; id < apmidg_getnpwrdoms(dev) && ip < npwr; id++, ip++)
+	    pwrdoms[ip] = (apmidg_trace_dom){(int16_t)dev, (int16_t)id};
+	for (int id = 0; id < apmidg_getnfreqdoms(dev) && ifq < nfreq; id++, ifq++)
+	    freqdoms[ifq] = (apmidg_trace_dom){(int16_t)dev, (int16_t)id};
+	for (int id = 0; id < apmidg_getntempsensors(dev) && it < ntemp; id++, it++)
+	    tempdoms[it] = (apmidg_trace_dom){(int16_t)dev, (int16_t)id};
+    }
+    npwr = ip;
+    nfreq = ifq;
+    ntemp = it;
+
+    fp = fopen(fn, "wb");
+    if (!fp) {
+	perror(fn);
+	rc = 1;
+	goto out;
+    }
+    iobuf = malloc((size_t)bufmb << 20);
+    setvbuf(fp, iobuf, _IOFBF, (size_t)bufmb << 20);
+
+    // the baseline
+    for (int i = 0; i < npwr; i++) {
+	if (apmidg_readenergy_acc(pwrdoms[i].devid, pwrdoms[i].id, &prev_e[i], &prev_ts[i]) != 0) {
+	    printf("Failed to read the energy of device %d domain %d\n", pwrdoms[i].devid, pwrdoms[i].id);
+	    rc = 1;
+	    goto out;
+	}
+    }
+
+    apmidg_trace_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, APMIDG_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = APMIDG_TRACE_VERSION;
+    hdr.hdrsize = sizeof(hdr);
+    hdr.ndevs = ndevs;
+    hdr.npwr = npwr;
+    hdr.nfreq = nfreq;
+    hdr.ntemp = ntemp;
+    hdr.recsize = apmidg_trace_recsize(npwr, nfreq, ntemp);
+    hdr.period_us = (uint32_t)(1e6 / rate_hz);
+    hdr.start_mono_us = gettime_us(CLOCK_MONOTONIC);
+    hdr.start_epoch_us = gettime_us(CLOCK_REALTIME);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    fwrite(pwrdoms, sizeof(apmidg_trace_dom), npwr, fp);
+    fwrite(freqdoms, sizeof(apmidg_trace_dom), nfreq, fp);
+    fwrite(tempdoms, sizeof(apmidg_trace_dom), ntemp, fp);
+    for (int i = 0; i < npwr; i++) {
+	apmidg_trace_base b = {prev_e[i], prev_ts[i]};
+	fwrite(&b, sizeof(b), 1, fp);
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    rec = calloc(1, hdr.recsize);
+    uint64_t prev_host_us = hdr.start_mono_us;
+    long period_ns = (long)(1e9 / rate_hz);
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    if (verbose >= 1) printf("apmidgrec: recording to %s at %.1f Hz (%u bytes/record)\n", fn, rate_hz, hdr.recsize);
+
+    while (!stop) {
+	next.tv_sec += period_ns / 1000000000L;
+	next.tv_nsec += period_ns % 1000000000L;
+	if (next.tv_nsec >= 1000000000L) {
+	    next.tv_nsec -= 1000000000L;
+	    next.tv_sec++;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+	uint64_t host_us = gettime_us(CLOCK_MONOTONIC);
+	unsigned char *p = rec;
+	uint32_t u32 = (uint32_t)(host_us - prev_host_us);
+	memcpy(p, &u32, 4); p += 4;
+	prev_host_us = host_us;
+
+	for (int i = 0; i < npwr; i++) {
+	    uint64_t e, ts;
+	    // on a failed read, the last accumulated value is returned
+	    // and the record carries a zero delta
+	    apmidg_readenergy_acc(pwrdoms[i].devid, pwrdoms[i].id, &e, &ts);
+	    uint64_t de = (e > prev_e[i]) ? e - prev_e[i] : 0;
+	    uint64_t dts = (ts > prev_ts[i]) ? ts - prev_ts[i] : 0;
+	    // a stall longer than 32 bits can hold is clamped. the
+	    // baseline advances by what was written, so the remainder
+	    // goes into the next records and the accumulated energy of
+	    // the trace stays exact
+	    if (de > UINT32_MAX || dts > UINT32_MAX) {
+		if (de > UINT32_MAX) de = UINT32_MAX;
+		if (dts > UINT32_MAX) dts = UINT32_MAX;
+		nclamped++;
+	    }
+	    u32 = (uint32_t)de;
+	    memcpy(p, &u32, 4); p += 4;
+	    u32 = (uint32_t)dts;
+	    memcpy(p, &u32, 4); p += 4;
+	    prev_e[i] += de;
+	    prev_ts[i] += dts;
+	}
+	for (int i = 0; i < nfreq; i++) {
+	    double f;
+	    apmidg_readfreq(freqdoms[i].devid, freqdoms[i].id, &f);
+	    uint16_t u16 = (f < 0.0) ? 0 : (f > 65535.0 ? 65535 : (uint16_t)(f + 0.5));
+	    memcpy(p, &u16, 2); p += 2;
+	}
+	for (int i = 0; i < ntemp; i++) {
+	    double t;
+	    apmidg_readtemp(tempdoms[i].devid, tempdoms[i].id, &t);
+	    t *= 100.0;
+	    int16_t s16 = (t > 32767.0) ? 32767 : (t < -32768.0 ? -32768 : (int16_t)(t < 0 ? t - 0.5 : t + 0.5));
+	    memcpy(p, &s16, 2); p += 2;
+	}
+	fwrite(rec, hdr.recsize, 1, fp);
+	nrecs++;
+
+	if (timeout_sec > 0.0 && (host_us - hdr.start_mono_us) >= timeout_sec * 1e6) break;
+    }
+
+    if (verbose >= 1) printf("apmidgrec: %lu records\n", (unsigned long)nrecs);
+    if (nclamped > 0)
+	printf("Warning: %lu energy deltas exceeded 32 bits and were carried into the next records\n", (unsigned long)nclamped);
+
+out:
+    if (fp) fclose(fp);
+    free(iobuf);
+    free(rec);
+    free(pwrdoms);
+    free(freqdoms);
+    free(tempdoms);
+    free(prev_e);
+    free(prev_ts);
+
+    apmidg_finish();
+
+    return rc;
+}
@@ -0,0 +1,146 @@
+/*
+  apmidgrec2csv: converts a binary trace recorded by apmidgrec into CSV
+
+  Developed by Kazutomo Yoshii <kazutomo@mcs.anl.gov>
+ */
+#include "apmidg_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options] tracefile\n", prog);
+    printf("\n");
+    printf("-o fn       : output CSV filename. default: stdout\n");
+    printf("-e          : use the epoch time instead of the time since start\n");
+    printf("-i          : print the trace header and exit\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outfn = NULL;
+    int useepoch = 0;
+    int infoonly = 0;
+    int opt;
+
+    while((opt=getopt(argc, argv, "ho:ei")) != -1 ) {
+	switch(opt) {
+	case 'o':
+	    outfn = optarg;
+	    break;
+	case 'e':
+	    useepoch = 1;
+	    break;
+	case 'i':
+	    infoonly = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+    if (optind >= argc) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    FILE *fp = fopen(argv[optind], "rb");
+    if (!fp) {
+	perror(argv[optind]);
+	return 1;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+    apmidg_trace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	memcmp(hdr.magic, APMIDG_TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+	fprintf(stderr, "%s: not an apmidg trace\n", argv[optind]);
+	return 1;
+    }
+    if (hdr.version != APMIDG_TRACE_VERSION || hdr.hdrsize != sizeof(hdr) ||
+	hdr.recsize != apmidg_trace_recsize(hdr.npwr, hdr.nfreq, hdr.ntemp)) {
+	fprintf(stderr, "%s: unsupported trace version %u\n", argv[optind], hdr.version);
+	return 1;
+    }
+
+    uint32_t ndoms = hdr.npwr + hdr.nfreq + hdr.ntemp;
+    apmidg_trace_dom *doms = calloc(ndoms + 1, sizeof(apmidg_trace_dom));
+    apmidg_trace_base *base = calloc(hdr.npwr + 1, sizeof(apmidg_trace_base));
+    if (fread(doms, sizeof(apmidg_trace_dom), ndoms, fp) != ndoms ||
+	fread(base, sizeof(apmidg_trace_base), hdr.npwr, fp) != hdr.npwr) {
+	fprintf(stderr, "%s: truncated header\n", argv[optind]);
+	return 1;
+    }
+    apmidg_trace_dom *pdoms = doms;
+    apmidg_trace_dom *fdoms = doms + hdr.npwr;
+    apmidg_trace_dom *tdoms = doms + hdr.npwr + hdr.nfreq;
+
+    if (infoonly) {
+	printf("version=%u ndevs=%u npwr=%u nfreq=%u ntemp=%u recsize=%u period_us=%u start_epoch_us=%lu\n",
+	       hdr.version, hdr.ndevs, hdr.npwr, hdr.nfreq, hdr.ntemp, hdr.recsize, hdr.period_us,
+	       (unsigned long)hdr.start_epoch_us);
+	return 0;
+    }
+
+    FILE *out = stdout;
+    if (outfn) {
+	out = fopen(outfn, "w");
+	if (!out) {
+	    perror(outfn);
+	    return 1;
+	}
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    fprintf(out, "time_s");
+    for (uint32_t i = 0; i < hdr.npwr; i++)
+	fprintf(out, ",dev%d_pwr%d_W,dev%d_pwr%d_J", pdoms[i].devid, pdoms[i].id, pdoms[i].devid, pdoms[i].id);
+    for (uint32_t i = 0; i < hdr.nfreq; i++)
+	fprintf(out, ",dev%d_freq%d_MHz", fdoms[i].devid, fdoms[i].id);
+    for (uint32_t i = 0; i < hdr.ntemp; i++)
+	fprintf(out, ",dev%d_temp%d_C", tdoms[i].devid, tdoms[i].id);
+    fprintf(out, "\n");
+
+    unsigned char *rec = malloc(hdr.recsize);
+    uint64_t *acc_uj = calloc(hdr.npwr + 1, sizeof(uint64_t));
+    uint64_t t_us = 0;
+
+    while (fread(rec, hdr.recsize, 1, fp) == 1) {
+	const unsigned char *p = rec;
+	uint32_t u32;
+
+	memcpy(&u32, p, 4); p += 4;
+	t_us += u32;
+	if (useepoch)
+	    fprintf(out, "%.6f", (hdr.start_epoch_us + t_us) * 1e-6);
+	else
+	    fprintf(out, "%.6f", t_us * 1e-6);
+
+	for (uint32_t i = 0; i < hdr.npwr; i++) {
+	    uint32_t de, dts;
+	    memcpy(&de, p, 4); p += 4;
+	    memcpy(&dts, p, 4); p += 4;
+	    acc_uj[i] += de;
+	    fprintf(out, ",%.3f,%.6f", dts > 0 ? (double)de / dts : 0.0, acc_uj[i] * 1e-6);
+	}
+	for (uint32_t i = 0; i < hdr.nfreq; i++) {
+	    uint16_t u16;
+	    memcpy(&u16, p, 2); p += 2;
+	    fprintf(out, ",%u", u16);
+	}
+	for (uint32_t i = 0; i < hdr.ntemp; i++) {
+	    int16_t s16;
+	    memcpy(&s16, p, 2); p += 2;
+	    fprintf(out, ",%.2f", s16 / 100.0);
+	}
+	fprintf(out, "\n");
+    }
+
+    fclose(fp);
+    if (outfn) fclose(out);
+
+    return 0;
+}